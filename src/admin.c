@@ -0,0 +1,320 @@
+/* Copyright (c) 2017-2019 Foudil Brétel.  All rights reserved. */
+#include <inttypes.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include "log.h"
+#include "metrics.h"
+#include "net/socket.h"
+#include "server.h"
+#include "timers.h"
+#include "utils/cont.h"
+#include "utils/lookup.h"
+#include "admin.h"
+
+enum admin_cmd {
+    ADMIN_CMD_NONE,
+    ADMIN_CMD_METRICS,
+    ADMIN_CMD_DHT,
+    ADMIN_CMD_LOOP,
+};
+
+static const lookup_entry admin_cmd_names[] = {
+    { ADMIN_CMD_METRICS, "metrics" },
+    { ADMIN_CMD_DHT,     "dht" },
+    { ADMIN_CMD_LOOP,    "loop" },
+    { 0,                 NULL },
+};
+
+bool admin_init(struct admin_ctx *actx, const char path[])
+{
+    actx->sock = socket_init_unix(path);
+    if (actx->sock < 0)
+        return false;
+    list_init(&actx->clients);
+    actx->nclients = 0;
+    actx->started_ms = now_millis();
+    log_info("Admin endpoint listening on %s.", path);
+    return true;
+}
+
+static void admin_client_close(struct admin_ctx *actx, struct admin_client *c)
+{
+    sock_close(c->fd);
+    iobuf_reset(&c->rsp);
+    list_delete(&c->item);
+    free_safer(c);
+    actx->nclients--;
+}
+
+void admin_shutdown(struct admin_ctx *actx, const char path[])
+{
+    while (!list_is_empty(&actx->clients)) {
+        struct admin_client *c = cont(actx->clients.prev, struct admin_client, item);
+        admin_client_close(actx, c);
+    }
+    socket_shutdown(actx->sock);
+    if (unlink(path) == -1)
+        log_perror(LOG_WARNING, "Failed unlink: %s.", errno);
+}
+
+/**
+ * Appends the listening socket and clients' fds to @fds from position @nfds.
+ * POLLOUT is only requested while a response is pending. Returns the new
+ * count of fds.
+ */
+int admin_pollfds_update(struct admin_ctx *actx, struct pollfd fds[], int nfds)
+{
+    fds[nfds].fd = actx->sock;
+    fds[nfds].events = POLLIN;
+    fds[nfds].revents = 0;
+    nfds++;
+
+    struct list_item *it = &actx->clients;
+    list_for(it, &actx->clients) {
+        struct admin_client *c = cont(it, struct admin_client, item);
+        fds[nfds].fd = c->fd;
+        fds[nfds].events = c->rsp.pos > 0 ? POLLOUT : POLLIN;
+        fds[nfds].revents = 0;
+        nfds++;
+    }
+    return nfds;
+}
+
+struct admin_client *admin_client_find(struct admin_ctx *actx, const int fd)
+{
+    struct list_item *it = &actx->clients;
+    list_for(it, &actx->clients) {
+        struct admin_client *c = cont(it, struct admin_client, item);
+        if (c->fd == fd)
+            return c;
+    }
+    return NULL;
+}
+
+bool admin_conn_accept_all(struct admin_ctx *actx)
+{
+    while (true) {
+        int conn = accept(actx->sock, NULL, NULL);
+        if (conn < 0) {
+            if (errno != EWOULDBLOCK) {
+                log_perror(LOG_ERR, "Failed admin accept: %s.", errno);
+                return false;
+            }
+            break;
+        }
+
+        if (actx->nclients >= ADMIN_CLIENTS_MAX) {
+            log_warning("Too many admin clients. Closing fd=%d.", conn);
+            sock_close(conn);
+            continue;
+        }
+
+        /* Not inherited from the listening socket. */
+        if (sock_setnonblock(conn)) {
+            sock_close(conn);
+            continue;
+        }
+
+        struct admin_client *c = calloc(1, sizeof(struct admin_client));
+        if (!c) {
+            log_perror(LOG_ERR, "Failed malloc: %s.", errno);
+            sock_close(conn);
+            return false;
+        }
+        c->fd = conn;
+        c->deadline_ms = now_millis() + ADMIN_CLIENT_TIMEOUT_MS;
+        list_init(&c->item);
+        list_append(&actx->clients, &c->item);
+        actx->nclients++;
+        log_debug("Admin client registered (fd=%d).", conn);
+    }
+    return true;
+}
+
+static bool admin_render_dht(struct admin_ctx *actx, struct iobuf *out)
+{
+    const struct kad_dht *dht = actx->kctx->dht;
+    bool ok = true;
+    for (int i = KAD_GUID_SPACE_IN_BITS - 1; i >= 0; i--) {
+        const struct list_item *it = &dht->buckets[i];
+        list_for(it, &dht->buckets[i]) {
+            const struct kad_node *node = cont(it, struct kad_node, item);
+            char id[2*KAD_GUID_SPACE_IN_BYTES+1];
+            for (size_t j = 0; j < KAD_GUID_SPACE_IN_BYTES; j++)
+                sprintf(id + 2*j, "%02x", node->info.id.bytes[j]);
+            char addr[INET6_ADDRSTRLEN+8] = "-";
+            sockaddr_storage_ntop(addr, sizeof(addr), &node->info.addr);
+            ok &= iobuf_appendf(out, "%d %s %s %lld %d\n", i, id, addr,
+                                (long long)node->last_seen, node->stale);
+        }
+    }
+    return ok;
+}
+
+static bool admin_render_loop(struct admin_ctx *actx, struct iobuf *out)
+{
+    struct metrics snap;
+    metrics_snapshot(&snap);
+
+    bool ok = true;
+    ok &= iobuf_appendf(out, "uptime_ms %lld\n", now_millis() - actx->started_ms);
+    ok &= iobuf_appendf(out, "iterations %"PRIu64"\n", snap.cnt[METRICS_CNT_LOOP_ITER]);
+    ok &= iobuf_appendf(out, "event_queue_depth %"PRId64"\n",
+                        snap.gauge[METRICS_GAUGE_EVENT_QUEUE_DEPTH]);
+    ok &= iobuf_appendf(out, "peers %"PRId64"\n", snap.gauge[METRICS_GAUGE_PEERS]);
+    ok &= iobuf_appendf(out, "kad_queries_pending %d\n",
+                        list_count(&actx->kctx->queries));
+    ok &= iobuf_appendf(out, "admin_clients %zu\n", actx->nclients);
+
+    long long now = now_millis();
+    struct list_item *it = actx->timer_list;
+    list_for(it, actx->timer_list) {
+        struct timer *t = cont(it, struct timer, item);
+        ok &= iobuf_appendf(out, "timer %s %lld\n", t->name, t->expire - now);
+    }
+    return ok;
+}
+
+/**
+ * Renders the whole response into @c's buffer, so that it can be streamed
+ * later without touching server state.
+ */
+static bool admin_respond(struct admin_ctx *actx, struct admin_client *c)
+{
+    const char *req = c->req;
+    size_t req_len = strcspn(req, "\r\n");
+    bool http = false;
+    if (req_len > 4 && strncmp(req, "GET /", 5) == 0) {
+        http = true;
+        req += 5;
+        req_len = strcspn(req, " \r\n");
+    }
+
+    enum admin_cmd cmd = ADMIN_CMD_NONE;
+    for (const lookup_entry *e = admin_cmd_names; e->name; e++) {
+        if (strlen(e->name) == req_len && strncmp(e->name, req, req_len) == 0) {
+            cmd = e->id;
+            break;
+        }
+    }
+
+    struct iobuf body = {0};
+    bool ok = true;
+    switch (cmd) {
+    case ADMIN_CMD_METRICS: {
+        server_metrics_update(actx->kctx);
+        struct metrics snap;
+        metrics_snapshot(&snap);
+        ok = metrics_render_prometheus(&snap, &body);
+        break;
+    }
+    case ADMIN_CMD_DHT:
+        ok = admin_render_dht(actx, &body);
+        break;
+    case ADMIN_CMD_LOOP:
+        ok = admin_render_loop(actx, &body);
+        break;
+    default:
+        ok = iobuf_appendf(&body, "unknown command. Try: metrics, dht, loop.\n");
+        break;
+    }
+    if (!ok) {
+        iobuf_reset(&body);
+        return false;
+    }
+
+    if (http) {
+        ok = iobuf_appendf(&c->rsp, "HTTP/1.0 %s\r\n"
+                           "Content-Type: text/plain; version=0.0.4\r\n"
+                           "Content-Length: %zu\r\n\r\n",
+                           cmd ? "200 OK" : "404 Not Found", body.pos);
+    }
+    ok = ok && (body.pos == 0 || iobuf_append(&c->rsp, body.buf, body.pos));
+    iobuf_reset(&body);
+    return ok;
+}
+
+/**
+ * Writes as much of the pending response as the socket accepts. Returns
+ * false when the client should be closed: done or failed.
+ */
+static bool admin_flush(struct admin_client *c)
+{
+    while (c->rsp_off < c->rsp.pos) {
+        ssize_t slen = send(c->fd, c->rsp.buf + c->rsp_off,
+                            c->rsp.pos - c->rsp_off, MSG_NOSIGNAL);
+        if (slen < 0) {
+            if (errno == EWOULDBLOCK || errno == EAGAIN)
+                return true;
+            if (errno != EPIPE)
+                log_perror(LOG_ERR, "Failed admin send: %s.", errno);
+            return false;
+        }
+        c->rsp_off += slen;
+        c->deadline_ms = now_millis() + ADMIN_CLIENT_TIMEOUT_MS;
+    }
+    return false;
+}
+
+/**
+ * Returns false only on fatal errors. Clients are closed when done.
+ */
+bool admin_conn_handle(struct admin_ctx *actx, const int fd, const short revents)
+{
+    struct admin_client *c = admin_client_find(actx, fd);
+    if (!c) {
+        log_error("Unregistered admin fd=%d.", fd);
+        return true;
+    }
+
+    if (c->rsp.pos == 0 && (revents & (POLLIN|POLLHUP))) {
+        ssize_t slen = recv(fd, c->req + c->req_len,
+                            ADMIN_REQ_MAX - 1 - c->req_len, 0);
+        if (slen < 0) {
+            if (errno == EWOULDBLOCK || errno == EAGAIN)
+                return true;
+            log_perror(LOG_ERR, "Failed admin recv: %s.", errno);
+            admin_client_close(actx, c);
+            return true;
+        }
+        c->req_len += slen;
+        c->req[c->req_len] = '\0';
+
+        bool complete = slen == 0 || memchr(c->req, '\n', c->req_len) ||
+            c->req_len == ADMIN_REQ_MAX - 1;
+        if (!complete)
+            return true;
+        if (c->req_len == 0 || !admin_respond(actx, c)) {
+            admin_client_close(actx, c);
+            return true;
+        }
+    }
+    else if (revents & (POLLERR|POLLNVAL)) {
+        admin_client_close(actx, c);
+        return true;
+    }
+
+    if (!admin_flush(c))
+        admin_client_close(actx, c);
+
+    return true;
+}
+
+/**
+ * Closes clients past their deadline.
+ */
+bool admin_expire(struct admin_ctx *actx, const long long now)
+{
+    struct list_item *it = actx->clients.next;
+    while (it != &actx->clients) {
+        struct admin_client *c = cont(it, struct admin_client, item);
+        it = it->next;
+        if (now < c->deadline_ms)
+            continue;
+        log_info("Admin client timed out. Closing fd=%d.", c->fd);
+        admin_client_close(actx, c);
+        metrics_inc(METRICS_CNT_ADMIN_TIMEOUTS);
+    }
+    return true;
+}
@@ -0,0 +1,65 @@
+/* Copyright (c) 2017-2019 Foudil Brétel.  All rights reserved. */
+#ifndef ADMIN_H
+#define ADMIN_H
+
+/**
+ * Local admin endpoint on a unix stream socket.
+ *
+ * Clients send a single command line and get a text response, after which the
+ * connection is closed. Commands:
+ *
+ *   metrics   Prometheus text exposition of the metrics registry.
+ *   dht       Routing table: bucket, node id, address, last_seen, stale.
+ *   loop      Event-loop stats.
+ *
+ * A minimal HTTP request (`GET /metrics HTTP/1.1`) is also understood so that
+ * scrapers can go through a unix socket proxy.
+ *
+ * Responses are fully rendered into a per-client buffer when the request is
+ * complete, so that they are consistent snapshots. They are then streamed with
+ * non-blocking writes, the event loop watching POLLOUT until drained.
+ *
+ * Clients must complete their request within ADMIN_CLIENT_TIMEOUT_MS of
+ * connecting, and then keep reading the response, or they are closed, so that
+ * idle clients cannot hold the few slots.
+ */
+#include <poll.h>
+#include <stdbool.h>
+#include "net/iobuf.h"
+#include "net/kad/rpc.h"
+#include "utils/list.h"
+
+#define ADMIN_CLIENTS_MAX 4
+#define ADMIN_REQ_MAX     128
+#define ADMIN_CLIENT_TIMEOUT_MS 5000
+#define ADMIN_EXPIRE_TICK_MS    1000
+
+struct admin_client {
+    struct list_item item;
+    int              fd;
+    char             req[ADMIN_REQ_MAX];
+    size_t           req_len;
+    struct iobuf     rsp;
+    size_t           rsp_off; /* bytes of rsp already written */
+    long long        deadline_ms; /* pushed back by response progress */
+};
+
+struct admin_ctx {
+    int                  sock;
+    struct list_item     clients;   /* admin_client list */
+    size_t               nclients;
+    /* server state we report on */
+    struct kad_ctx      *kctx;
+    struct list_item    *timer_list;
+    long long            started_ms;
+};
+
+bool admin_init(struct admin_ctx *actx, const char path[]);
+void admin_shutdown(struct admin_ctx *actx, const char path[]);
+int admin_pollfds_update(struct admin_ctx *actx, struct pollfd fds[], int nfds);
+struct admin_client *admin_client_find(struct admin_ctx *actx, const int fd);
+bool admin_conn_accept_all(struct admin_ctx *actx);
+bool admin_conn_handle(struct admin_ctx *actx, const int fd, const short revents);
+bool admin_expire(struct admin_ctx *actx, const long long now);
+
+#endif /* ADMIN_H */
@@ -1,9 +1,15 @@
 /* Copyright (c) 2017-2019 Foudil Brétel.  All rights reserved. */
+#include <poll.h>
+#include "admin.h"
 #include "log.h"
+#include "metrics.h"
 #include "net/actions.h"
 #include "net/socket.h"
+#include "timers.h"
 #include "events.h"
 
+event_pool pool_events = {0};
+
 static bool event_node_data_cb(struct event_args args)
 {
     return node_handle_data(args.node_data.sock, args.node_data.kctx);
@@ -23,13 +29,22 @@ struct event event_peer_conn = {"peer-conn", .cb=event_peer_conn_cb, .args={{{0}
 
 bool event_peer_data_cb(struct event_args args)
 {
-    struct peer *p = peer_find_by_fd(args.peer_data.peer_list, args.peer_data.fd);
+    struct peer *p = peer_find_by_fd(args.peer_data.fd);
     if (!p) {
         log_fatal("Unregistered peer fd=%d.", args.peer_data.fd);
         return false;
     }
-    if (peer_conn_handle_data(p, args.peer_data.kctx) == CONN_CLOSED &&
-        !peer_conn_close(p)) {
+    short revents = args.peer_data.revents;
+    int ret = CONN_OK;
+    if (revents & POLLOUT)
+        ret = peer_conn_flush(p);
+    if (ret == CONN_OK && revents & (POLLIN|POLLPRI))
+        ret = peer_conn_handle_data(p, args.peer_data.kctx);
+    else if (ret == CONN_OK && revents & (POLLHUP|POLLERR|POLLNVAL)) {
+        log_info("Peer %s hung up.", p->addr_str);
+        ret = CONN_CLOSED;
+    }
+    if (ret == CONN_CLOSED && !peer_conn_close(p)) {
         log_fatal("Could not close connection of peer fd=%d.", args.peer_data.fd);
         return false;
     }
@@ -38,18 +53,85 @@ bool event_peer_data_cb(struct event_args args)
 
 static bool event_kad_refresh_cb(struct event_args args)
 {
-    (void)args;
-    return kad_refresh(NULL);
+    return kad_refresh(args.kad_refresh.kctx, args.kad_refresh.sock);
 }
 struct event event_kad_refresh = {"kad-refresh", .cb=event_kad_refresh_cb, .args={{{0}}}, .fatal=false,};
 
+static bool event_kad_expire_cb(struct event_args args)
+{
+    return kad_expire(args.kad_expire.kctx, args.kad_expire.sock);
+}
+struct event event_kad_expire = {"kad-expire", .cb=event_kad_expire_cb, .args={{{0}}}, .fatal=false,};
+
+static bool event_kad_checkpoint_cb(struct event_args args)
+{
+    return kad_rpc_checkpoint(args.kad_checkpoint.kctx);
+}
+struct event event_kad_checkpoint = {"kad-checkpoint", .cb=event_kad_checkpoint_cb, .args={{{0}}}, .fatal=false,};
+
 bool event_kad_bootstrap_cb(struct event_args args)
 {
     return kad_bootstrap(args.kad_bootstrap.timer_list, args.kad_bootstrap.conf,
                          args.kad_bootstrap.kctx, args.kad_bootstrap.sock);
 }
 
-bool event_node_ping_cb(struct event_args args)
+bool event_kad_bootstrap_pace_cb(struct event_args args)
+{
+    return kad_bootstrap_pace(args.kad_bootstrap.timer_list, args.kad_bootstrap.conf,
+                              args.kad_bootstrap.kctx, args.kad_bootstrap.sock);
+}
+
+bool event_kad_warm_start_cb(struct event_args args)
+{
+    return kad_warm_start(args.kad_bootstrap.timer_list, args.kad_bootstrap.conf,
+                          args.kad_bootstrap.kctx, args.kad_bootstrap.sock);
+}
+
+static bool event_admin_conn_cb(struct event_args args)
+{
+    return admin_conn_accept_all(args.admin_conn.actx);
+}
+struct event event_admin_conn = {"admin-conn", .cb=event_admin_conn_cb, .args={{{0}}}, .fatal=false,};
+
+static bool event_admin_expire_cb(struct event_args args)
+{
+    return admin_expire(args.admin_expire.actx, now_millis());
+}
+struct event event_admin_expire = {"admin-expire", .cb=event_admin_expire_cb, .args={{{0}}}, .fatal=false,};
+
+bool event_admin_data_cb(struct event_args args)
+{
+    return admin_conn_handle(args.admin_data.actx, args.admin_data.fd,
+                             args.admin_data.revents);
+}
+
+/**
+ * Stamps @ev with its enqueuing time, for queue-wait accounting.
+ *
+ * Fails only when the queue reached its maximum size. The caller keeps
+ * ownership of @ev then, and should apply backpressure: fd events are
+ * level-triggered so unread data will be signaled again by poll(2).
+ */
+bool event_enqueue(event_queue *evq, struct event *ev)
+{
+    if (!ev->metrics_id)
+        ev->metrics_id = lookup_by_name(metrics_event_names, ev->name,
+                                        EVENT_NAME_MAX);
+    ev->queued_us = now_micros();
+    if (!event_queue_put(evq, ev)) {
+        metrics_inc(METRICS_CNT_EVENT_QUEUE_DEFERRED);
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Releases pooled events still queued, and frees the queue itself.
+ */
+void event_queue_clear(event_queue *evq)
 {
-    return node_ping(args.node_ping.kctx, args.node_ping.sock, args.node_ping.node);
+    struct event *ev;
+    while ((ev = event_queue_get(evq)))
+        event_pool_put(&pool_events, ev->self);
+    event_queue_free(evq);
 }
@@ -10,10 +10,13 @@
  */
 #include <netinet/in.h>
 #include "net/kad/dht.h"
+#include "utils/pool.h"
 #include "utils/queue.h"
 
 #define EVENT_NAME_MAX 32
 
+struct admin_ctx;
+
 struct event_args {
     union {
         // TODO use struct server_ctx to simplify
@@ -30,28 +33,46 @@ struct event_args {
         } peer_conn;
 
         struct peer_data {
-            struct list_item *peer_list;
             struct kad_ctx   *kctx;
             int               fd;
+            short             revents;
         } peer_data;
 
         struct kad_refresh {
-            void *none;
+            struct kad_ctx *kctx;
+            int             sock;
         } kad_refresh;
 
+        struct kad_expire {
+            struct kad_ctx *kctx;
+            int             sock;
+        } kad_expire;
+
+        struct kad_checkpoint_args {
+            struct kad_ctx *kctx;
+        } kad_checkpoint;
+
         struct kad_bootstrap {
             struct list_item    *timer_list;
             const struct config *conf;
-            // for subsequent node_ping
+            // for subsequent pings
             struct kad_ctx      *kctx;
             int                  sock;
         } kad_bootstrap;
 
-        struct node_ping {
-            struct kad_ctx          *kctx;
-            int                      sock;
-            struct kad_node_info     node;
-        } node_ping;
+        struct admin_conn {
+            struct admin_ctx *actx;
+        } admin_conn;
+
+        struct admin_expire {
+            struct admin_ctx *actx;
+        } admin_expire;
+
+        struct admin_data {
+            struct admin_ctx *actx;
+            int               fd;
+            short             revents;
+        } admin_data;
     };
 };
 
@@ -63,19 +84,37 @@ struct event {
     /* Arguments must be captured at runtime. */
     struct event_args   args;
     bool                fatal;
-    /* Must be set for allocated events. Used to free allocated event. */
+    /* Must be set for events drawn from pool_events. Used to release them. */
     struct event       *self;
+    /* Set by event_enqueue(). */
+    int                 metrics_id;
+    long long           queued_us;
 };
 
+#define EVENT_POOL_SLAB_LEN 64
+POOL_GENERATE(event_pool, struct event, EVENT_POOL_SLAB_LEN)
+extern event_pool pool_events;
+
 struct event event_node_data;
 struct event event_peer_conn;
 struct event event_kad_refresh;
+struct event event_kad_expire;
+struct event event_kad_checkpoint;
+struct event event_admin_conn;
+struct event event_admin_expire;
 // event to be malloc'd
 bool event_peer_data_cb(struct event_args args);
+bool event_admin_data_cb(struct event_args args);
 bool event_kad_bootstrap_cb(struct event_args args);
-bool event_node_ping_cb(struct event_args args);
+bool event_kad_bootstrap_pace_cb(struct event_args args);
+bool event_kad_warm_start_cb(struct event_args args);
+
+#define EVENT_QUEUE_BIT_LEN     8
+#define EVENT_QUEUE_MAX_BIT_LEN 16
+QUEUE_GROW_GENERATE(event_queue, struct event, EVENT_QUEUE_BIT_LEN,
+                    EVENT_QUEUE_MAX_BIT_LEN)
 
-#define EVENT_QUEUE_BIT_LEN 8
-QUEUE_GENERATE(event_queue, struct event, EVENT_QUEUE_BIT_LEN)
+bool event_enqueue(event_queue *evq, struct event *ev);
+void event_queue_clear(event_queue *evq);
 
 #endif /* EVENTS_H */
@@ -1,5 +1,7 @@
 /* Copyright (c) 2017-2019 Foudil Brétel.  All rights reserved. */
 #include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
 #include <limits.h>
 #include <pwd.h>
 #include <stdio.h>
@@ -118,3 +120,109 @@ bool file_write(const char path[], char buf[], size_t buf_len)
     }
     return ret;
 }
+
+static bool file_write_all(int fd, const char buf[], size_t buf_len)
+{
+    while (buf_len > 0) {
+        ssize_t n = write(fd, buf, buf_len);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+        buf += n;
+        buf_len -= n;
+    }
+    return true;
+}
+
+static bool file_sync_dir(const char path[])
+{
+    char dir[PATH_MAX];
+    if (!strcpy_safer(dir, path, sizeof(dir)))
+        return false;
+    int fd = open(dirname(dir), O_RDONLY|O_DIRECTORY);
+    if (fd < 0) {
+        perror("Failed open");
+        return false;
+    }
+    bool ret = true;
+    if (fsync(fd) == -1) {
+        perror("Failed fsync");
+        ret = false;
+    }
+    close(fd);
+    return ret;
+}
+
+/**
+ * Replaces @path with @buf: writes a temporary file next to it, syncs it and
+ * renames it over @path. After a crash, @path holds either the old or the new
+ * content, never a mix.
+ */
+bool file_write_atomic(const char path[], const char buf[], size_t buf_len)
+{
+    char tmp[PATH_MAX];
+    int len = snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    if (len < 0 || (size_t)len >= sizeof(tmp)) {
+        fprintf(stderr, "Can't snprintf as destination buffer too small\n");
+        return false;
+    }
+
+    int fd = open(tmp, O_WRONLY|O_CREAT|O_TRUNC, 0600);
+    if (fd < 0) {
+        perror("Failed open");
+        return false;
+    }
+    if (!file_write_all(fd, buf, buf_len)) {
+        perror("Failed write");
+        goto fail;
+    }
+    if (fsync(fd) == -1) {
+        perror("Failed fsync");
+        goto fail;
+    }
+    if (close(fd) == -1) {
+        fd = -1;
+        perror("Failed close");
+        goto fail;
+    }
+    fd = -1;
+    if (rename(tmp, path) == -1) {
+        perror("Failed rename");
+        goto fail;
+    }
+    return file_sync_dir(path);
+
+  fail:
+    if (fd >= 0)
+        close(fd);
+    unlink(tmp);
+    return false;
+}
+
+/**
+ * Appends @buf to @path, which is created when missing, and syncs it.
+ */
+bool file_append(const char path[], const char buf[], size_t buf_len)
+{
+    int fd = open(path, O_WRONLY|O_CREAT|O_APPEND, 0600);
+    if (fd < 0) {
+        perror("Failed open");
+        return false;
+    }
+    bool ret = true;
+    if (!file_write_all(fd, buf, buf_len)) {
+        perror("Failed write");
+        ret = false;
+    }
+    else if (fdatasync(fd) == -1) {
+        perror("Failed fdatasync");
+        ret = false;
+    }
+    if (close(fd) == -1) {
+        perror("Failed close");
+        ret = false;
+    }
+    return ret;
+}
@@ -9,5 +9,7 @@ bool get_home_dir(char out[], const size_t out_len);
 bool resolve_path(const char path[], char out[], const size_t out_len);
 bool file_read(char buf[], size_t *buf_len, const char path[]);
 bool file_write(const char path[], char buf[], size_t buf_len);
+bool file_write_atomic(const char path[], const char buf[], size_t buf_len);
+bool file_append(const char path[], const char buf[], size_t buf_len);
 
 #endif /* FILE_H */
@@ -0,0 +1,251 @@
+/* Copyright (c) 2017-2019 Foudil Brétel.  All rights reserved. */
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include "log.h"
+#include "utils/cont.h"
+#include "metrics.h"
+
+#define METRICS_LABEL_MAX 48
+
+_Thread_local struct metrics metrics_local;
+
+static struct {
+    pthread_mutex_t  lock;
+    struct list_item shards;
+    /* Accumulates counts of unregistered threads so that totals never go
+       backward. */
+    struct metrics   retired;
+} metrics_registry = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .shards = LIST_ITEM_INIT(metrics_registry.shards),
+};
+
+static void metrics_hist_merge(struct metrics_histogram *d,
+                               const struct metrics_histogram *s)
+{
+    d->count += s->count;
+    d->sum += s->sum;
+    if (s->max > d->max)
+        d->max = s->max;
+    for (size_t j = 0; j < METRICS_HIST_BUCKETS; j++)
+        d->buckets[j] += s->buckets[j];
+}
+
+static void metrics_merge(struct metrics *dst, const struct metrics *src)
+{
+    for (size_t i = 0; i < METRICS_CNT_LEN; i++)
+        dst->cnt[i] += src->cnt[i];
+    for (size_t i = 0; i < METRICS_GAUGE_LEN; i++)
+        dst->gauge[i] += src->gauge[i];
+    for (size_t i = 0; i < METRICS_DHT_BUCKETS; i++)
+        dst->dht_fill[i] += src->dht_fill[i];
+    for (size_t i = 0; i < METRICS_POOL_LEN; i++) {
+        dst->pool_in_use[i] += src->pool_in_use[i];
+        dst->pool_capacity[i] += src->pool_capacity[i];
+    }
+    for (size_t i = 0; i < METRICS_HIST_LEN; i++)
+        metrics_hist_merge(&dst->hist[i], &src->hist[i]);
+    for (size_t i = 0; i < METRICS_EVENT_LEN; i++) {
+        metrics_hist_merge(&dst->ev_run[i], &src->ev_run[i]);
+        metrics_hist_merge(&dst->ev_wait[i], &src->ev_wait[i]);
+    }
+}
+
+static const char *metrics_event_name(const int e)
+{
+    const char *name = lookup_by_id(metrics_event_names, e);
+    return name ? name : "other";
+}
+
+/**
+ * Makes the calling thread's shard visible to snapshots. Must be balanced
+ * with metrics_thread_unregister() before the thread exits.
+ */
+bool metrics_thread_register(void)
+{
+    if (pthread_mutex_lock(&metrics_registry.lock)) {
+        log_error("Failed to lock metrics registry.");
+        return false;
+    }
+    list_init(&metrics_local.item);
+    list_append(&metrics_registry.shards, &metrics_local.item);
+    pthread_mutex_unlock(&metrics_registry.lock);
+    return true;
+}
+
+void metrics_thread_unregister(void)
+{
+    if (pthread_mutex_lock(&metrics_registry.lock)) {
+        log_error("Failed to lock metrics registry.");
+        return;
+    }
+    list_delete(&metrics_local.item);
+    /* Gauges are instantaneous values owned by the thread. */
+    memset(metrics_local.gauge, 0, sizeof(metrics_local.gauge));
+    memset(metrics_local.dht_fill, 0, sizeof(metrics_local.dht_fill));
+    memset(metrics_local.pool_in_use, 0, sizeof(metrics_local.pool_in_use));
+    memset(metrics_local.pool_capacity, 0, sizeof(metrics_local.pool_capacity));
+    metrics_merge(&metrics_registry.retired, &metrics_local);
+    pthread_mutex_unlock(&metrics_registry.lock);
+}
+
+void metrics_snapshot(struct metrics *snap)
+{
+    memset(snap, 0, sizeof(*snap));
+    list_init(&snap->item);
+    if (pthread_mutex_lock(&metrics_registry.lock)) {
+        log_error("Failed to lock metrics registry.");
+        return;
+    }
+    metrics_merge(snap, &metrics_registry.retired);
+    struct list_item *it = &metrics_registry.shards;
+    list_for(it, &metrics_registry.shards) {
+        struct metrics *shard = cont(it, struct metrics, item);
+        metrics_merge(snap, shard);
+    }
+    pthread_mutex_unlock(&metrics_registry.lock);
+}
+
+/**
+ * Returns the upper bound of the bucket holding the @pct percentile (0..1).
+ */
+uint64_t metrics_hist_percentile(const struct metrics_histogram *hist,
+                                 const double pct)
+{
+    if (hist->count == 0)
+        return 0;
+    uint64_t rank = (uint64_t)(pct * hist->count + 0.5);
+    if (rank == 0)
+        rank = 1;
+    uint64_t seen = 0;
+    for (unsigned i = 0; i < METRICS_HIST_BUCKETS - 1; i++) {
+        seen += hist->buckets[i];
+        if (seen >= rank) {
+            uint64_t high = metrics_hist_bucket_low(i + 1) - 1;
+            return high < hist->max ? high : hist->max;
+        }
+    }
+    return hist->max;
+}
+
+static void metrics_log_hist(const char *name, const char *label,
+                             const struct metrics_histogram *h)
+{
+    log_info("  %s%s count=%"PRIu64" avg=%"PRIu64" p50=%"PRIu64" p90=%"PRIu64
+             " p99=%"PRIu64" max=%"PRIu64, name, label,
+             h->count, h->count ? h->sum / h->count : 0,
+             metrics_hist_percentile(h, 0.5), metrics_hist_percentile(h, 0.9),
+             metrics_hist_percentile(h, 0.99), h->max);
+}
+
+void metrics_log(const struct metrics *snap)
+{
+    log_info("Metrics snapshot:");
+    for (int i = METRICS_CNT_NONE + 1; i < METRICS_CNT_LEN; i++)
+        log_info("  %s=%"PRIu64, lookup_by_id(metrics_cnt_names, i), snap->cnt[i]);
+    for (int i = METRICS_GAUGE_NONE + 1; i < METRICS_GAUGE_LEN; i++)
+        log_info("  %s=%"PRId64, lookup_by_id(metrics_gauge_names, i), snap->gauge[i]);
+    for (int i = 0; i < METRICS_DHT_BUCKETS; i++)
+        if (snap->dht_fill[i])
+            log_info("  dht_bucket[%d]=%"PRIu64, i, snap->dht_fill[i]);
+    for (int i = METRICS_POOL_NONE + 1; i < METRICS_POOL_LEN; i++)
+        log_info("  pool[%s] in_use=%"PRIu64" capacity=%"PRIu64,
+                 lookup_by_id(metrics_pool_names, i), snap->pool_in_use[i],
+                 snap->pool_capacity[i]);
+    for (int i = METRICS_HIST_NONE + 1; i < METRICS_HIST_LEN; i++)
+        metrics_log_hist(lookup_by_id(metrics_hist_names, i), "", &snap->hist[i]);
+    for (int i = 0; i < METRICS_EVENT_LEN; i++) {
+        if (snap->ev_run[i].count == 0)
+            continue;
+        char label[METRICS_LABEL_MAX];
+        snprintf(label, sizeof(label), "[%s]", metrics_event_name(i));
+        metrics_log_hist("event_wait_us", label, &snap->ev_wait[i]);
+        metrics_log_hist("event_run_us", label, &snap->ev_run[i]);
+    }
+}
+
+/**
+ * @labels, if not empty, must end with a comma.
+ */
+static bool metrics_render_prometheus_hist(struct iobuf *out, const char *name,
+                                           const char *labels,
+                                           const struct metrics_histogram *h)
+{
+    bool ok = true;
+    uint64_t cumul = 0;
+    unsigned b = 0;
+    for (unsigned exp = 0; exp <= METRICS_HIST_EXP_MAX; exp++) {
+        uint64_t le = (uint64_t)1 << exp;
+        while (b < METRICS_HIST_BUCKETS - 1 &&
+               metrics_hist_bucket_low(b + 1) - 1 <= le)
+            cumul += h->buckets[b++];
+        ok &= iobuf_appendf(out, METRICS_PREFIX"%s_bucket{%sle=\"%"PRIu64"\"} %"
+                            PRIu64"\n", name, labels, le, cumul);
+    }
+    size_t llen = strlen(labels);
+    ok &= iobuf_appendf(out, METRICS_PREFIX"%s_bucket{%sle=\"+Inf\"} %"PRIu64"\n"
+                        METRICS_PREFIX"%s_sum%s%.*s%s %"PRIu64"\n"
+                        METRICS_PREFIX"%s_count%s%.*s%s %"PRIu64"\n",
+                        name, labels, h->count,
+                        name, llen ? "{" : "", (int)(llen ? llen - 1 : 0), labels,
+                        llen ? "}" : "", h->sum,
+                        name, llen ? "{" : "", (int)(llen ? llen - 1 : 0), labels,
+                        llen ? "}" : "", h->count);
+    return ok;
+}
+
+/**
+ * Prometheus text exposition format. Histograms are exported with
+ * power-of-two `le` boundaries, sub-buckets being merged.
+ */
+bool metrics_render_prometheus(const struct metrics *snap, struct iobuf *out)
+{
+    bool ok = true;
+    for (int i = METRICS_CNT_NONE + 1; i < METRICS_CNT_LEN; i++) {
+        const char *name = lookup_by_id(metrics_cnt_names, i);
+        ok &= iobuf_appendf(out, "# TYPE "METRICS_PREFIX"%s_total counter\n"
+                            METRICS_PREFIX"%s_total %"PRIu64"\n",
+                            name, name, snap->cnt[i]);
+    }
+    for (int i = METRICS_GAUGE_NONE + 1; i < METRICS_GAUGE_LEN; i++) {
+        const char *name = lookup_by_id(metrics_gauge_names, i);
+        ok &= iobuf_appendf(out, "# TYPE "METRICS_PREFIX"%s gauge\n"
+                            METRICS_PREFIX"%s %"PRId64"\n",
+                            name, name, snap->gauge[i]);
+    }
+    ok &= iobuf_appendf(out, "# TYPE "METRICS_PREFIX"dht_bucket_nodes gauge\n");
+    for (int i = 0; i < METRICS_DHT_BUCKETS; i++)
+        if (snap->dht_fill[i])
+            ok &= iobuf_appendf(out, METRICS_PREFIX"dht_bucket_nodes{bucket=\"%d\"} %"
+                                PRIu64"\n", i, snap->dht_fill[i]);
+    const char *pool_fam[] = {"pool_in_use", "pool_capacity"};
+    const uint64_t *pool_val[] = {snap->pool_in_use, snap->pool_capacity};
+    for (size_t f = 0; f < 2; f++) {
+        ok &= iobuf_appendf(out, "# TYPE "METRICS_PREFIX"%s gauge\n", pool_fam[f]);
+        for (int i = METRICS_POOL_NONE + 1; i < METRICS_POOL_LEN; i++)
+            ok &= iobuf_appendf(out, METRICS_PREFIX"%s{pool=\"%s\"} %"PRIu64"\n",
+                                pool_fam[f], lookup_by_id(metrics_pool_names, i),
+                                pool_val[f][i]);
+    }
+    for (int i = METRICS_HIST_NONE + 1; i < METRICS_HIST_LEN; i++) {
+        const char *name = lookup_by_id(metrics_hist_names, i);
+        ok &= iobuf_appendf(out, "# TYPE "METRICS_PREFIX"%s histogram\n", name);
+        ok &= metrics_render_prometheus_hist(out, name, "", &snap->hist[i]);
+    }
+
+    const char *ev_fam[] = {"event_wait_us", "event_run_us"};
+    const struct metrics_histogram *ev_hist[] = {snap->ev_wait, snap->ev_run};
+    for (size_t f = 0; f < 2; f++) {
+        ok &= iobuf_appendf(out, "# TYPE "METRICS_PREFIX"%s histogram\n", ev_fam[f]);
+        for (int i = 0; i < METRICS_EVENT_LEN; i++) {
+            if (ev_hist[f][i].count == 0)
+                continue;
+            char label[METRICS_LABEL_MAX];
+            snprintf(label, sizeof(label), "event=\"%s\",", metrics_event_name(i));
+            ok &= metrics_render_prometheus_hist(out, ev_fam[f], label, &ev_hist[f][i]);
+        }
+    }
+    return ok;
+}
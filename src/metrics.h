@@ -0,0 +1,328 @@
+/* Copyright (c) 2017-2019 Foudil Brétel.  All rights reserved. */
+#ifndef METRICS_H
+#define METRICS_H
+
+/**
+ * Lightweight metrics: counters, gauges and latency histograms.
+ *
+ * Each thread records into its own thread-local shard, so recording is a
+ * plain memory increment: no lock, no atomic. Threads register their shard
+ * once with metrics_thread_register(). Snapshots sum all registered shards
+ * under the registry lock, which recording never takes. Readers may thus
+ * observe slightly stale values, which is fine for monitoring.
+ *
+ * Histograms are log-linear (HdrHistogram-like): values below
+ * 2^METRICS_HIST_SUB_BITS get their own bucket, then each power of two is
+ * split into 2^METRICS_HIST_SUB_BITS linear sub-buckets.
+ */
+#include <stdbool.h>
+#include <stdint.h>
+#include "kad_defs.h"
+#include "net/iobuf.h"
+#include "utils/list.h"
+#include "utils/lookup.h"
+#include "utils/pool.h"
+
+#define METRICS_HIST_SUB_BITS 3
+#define METRICS_HIST_SUB_LEN  (1 << METRICS_HIST_SUB_BITS)
+/* Values above 2^METRICS_HIST_EXP_MAX (~12 days in µs) land in the last
+   bucket. */
+#define METRICS_HIST_EXP_MAX  40
+#define METRICS_HIST_BUCKETS                                            \
+    ((METRICS_HIST_EXP_MAX - METRICS_HIST_SUB_BITS + 2) * METRICS_HIST_SUB_LEN)
+
+#define METRICS_DHT_BUCKETS KAD_GUID_SPACE_IN_BITS
+
+#define METRICS_PREFIX "ptp_"
+
+enum metrics_cnt {
+    METRICS_CNT_NONE,
+    METRICS_CNT_LOOP_ITER,
+    METRICS_CNT_LOOP_STALLS,
+    METRICS_CNT_EVENT_QUEUE_DEFERRED,
+    METRICS_CNT_UDP_PKT_IN,
+    METRICS_CNT_UDP_PKT_OUT,
+    METRICS_CNT_UDP_BYTES_IN,
+    METRICS_CNT_UDP_BYTES_OUT,
+    METRICS_CNT_TCP_RECV,
+    METRICS_CNT_TCP_SEND,
+    METRICS_CNT_TCP_SEND_QUEUED,
+    METRICS_CNT_TCP_MSG_CAPPED,
+    METRICS_CNT_TCP_BULK_BYTES_IN,
+    METRICS_CNT_TCP_BULK_BYTES_OUT,
+    METRICS_CNT_KAD_DECODE_FAIL,
+    METRICS_CNT_KAD_QUERY_PING,
+    METRICS_CNT_KAD_QUERY_FIND_NODE,
+    METRICS_CNT_KAD_RSP_MATCHED,
+    METRICS_CNT_KAD_RSP_UNMATCHED,
+    METRICS_CNT_KAD_QUERY_SENT,
+    METRICS_CNT_KAD_QUERY_TIMEOUT,
+    METRICS_CNT_KAD_QUERY_RETRIES,
+    METRICS_CNT_KAD_CHECKPOINTS,
+    METRICS_CNT_KAD_CHECKPOINT_FAIL,
+    METRICS_CNT_KAD_BOOTSTRAP_RETRIES,
+    METRICS_CNT_KAD_BOOTSTRAP_FAILED,
+    METRICS_CNT_KAD_WARM_DROPPED,
+    METRICS_CNT_KAD_REFRESH,
+    METRICS_CNT_KAD_REFRESH_QUERIES,
+    METRICS_CNT_KAD_EVICT_PROBES,
+    METRICS_CNT_KAD_EVICT_PROBES_DROPPED,
+    METRICS_CNT_KAD_EVICTIONS,
+    METRICS_CNT_KAD_RATE_LIMITED,
+    METRICS_CNT_KAD_RATE_LIMIT_EVICTIONS,
+    METRICS_CNT_KAD_ERR_THROTTLED,
+    METRICS_CNT_ADMIN_TIMEOUTS,
+    METRICS_CNT_LEN,
+};
+
+static const lookup_entry metrics_cnt_names[] = {
+    { METRICS_CNT_LOOP_ITER,           "loop_iterations" },
+    { METRICS_CNT_LOOP_STALLS,         "loop_stalls" },
+    { METRICS_CNT_EVENT_QUEUE_DEFERRED, "event_queue_deferred" },
+    { METRICS_CNT_UDP_PKT_IN,          "udp_packets_in" },
+    { METRICS_CNT_UDP_PKT_OUT,         "udp_packets_out" },
+    { METRICS_CNT_UDP_BYTES_IN,        "udp_bytes_in" },
+    { METRICS_CNT_UDP_BYTES_OUT,       "udp_bytes_out" },
+    { METRICS_CNT_TCP_RECV,            "tcp_recv" },
+    { METRICS_CNT_TCP_SEND,            "tcp_send" },
+    { METRICS_CNT_TCP_SEND_QUEUED,     "tcp_send_queued" },
+    { METRICS_CNT_TCP_MSG_CAPPED,      "tcp_msg_capped" },
+    { METRICS_CNT_TCP_BULK_BYTES_IN,   "tcp_bulk_bytes_in" },
+    { METRICS_CNT_TCP_BULK_BYTES_OUT,  "tcp_bulk_bytes_out" },
+    { METRICS_CNT_KAD_DECODE_FAIL,     "kad_decode_failures" },
+    { METRICS_CNT_KAD_QUERY_PING,      "kad_queries_ping" },
+    { METRICS_CNT_KAD_QUERY_FIND_NODE, "kad_queries_find_node" },
+    { METRICS_CNT_KAD_RSP_MATCHED,     "kad_responses_matched" },
+    { METRICS_CNT_KAD_RSP_UNMATCHED,   "kad_responses_unmatched" },
+    { METRICS_CNT_KAD_QUERY_SENT,      "kad_queries_sent" },
+    { METRICS_CNT_KAD_QUERY_TIMEOUT,   "kad_queries_timeout" },
+    { METRICS_CNT_KAD_QUERY_RETRIES,   "kad_queries_retransmitted" },
+    { METRICS_CNT_KAD_CHECKPOINTS,     "kad_checkpoints" },
+    { METRICS_CNT_KAD_CHECKPOINT_FAIL, "kad_checkpoint_failures" },
+    { METRICS_CNT_KAD_BOOTSTRAP_RETRIES, "kad_bootstrap_retries" },
+    { METRICS_CNT_KAD_BOOTSTRAP_FAILED, "kad_bootstrap_seeds_failed" },
+    { METRICS_CNT_KAD_WARM_DROPPED,    "kad_warm_start_dropped" },
+    { METRICS_CNT_KAD_REFRESH,         "kad_bucket_refreshes" },
+    { METRICS_CNT_KAD_REFRESH_QUERIES, "kad_refresh_queries" },
+    { METRICS_CNT_KAD_EVICT_PROBES,    "kad_evict_probes" },
+    { METRICS_CNT_KAD_EVICT_PROBES_DROPPED, "kad_evict_probes_dropped" },
+    { METRICS_CNT_KAD_EVICTIONS,       "kad_evictions" },
+    { METRICS_CNT_KAD_RATE_LIMITED,    "kad_rate_limited" },
+    { METRICS_CNT_KAD_RATE_LIMIT_EVICTIONS, "kad_rate_limit_evictions" },
+    { METRICS_CNT_KAD_ERR_THROTTLED,   "kad_error_replies_throttled" },
+    { METRICS_CNT_ADMIN_TIMEOUTS,      "admin_client_timeouts" },
+    { 0,                               NULL },
+};
+
+enum metrics_gauge {
+    METRICS_GAUGE_NONE,
+    METRICS_GAUGE_EVENT_QUEUE_DEPTH,
+    METRICS_GAUGE_EVENT_QUEUE_HIWAT,
+    METRICS_GAUGE_PEERS,
+    METRICS_GAUGE_PEER_OUTQ_BYTES,
+    METRICS_GAUGE_PEER_MSG_BUF_BYTES,
+    METRICS_GAUGE_KAD_QUERIES_PENDING,
+    METRICS_GAUGE_DHT_NODES,
+    METRICS_GAUGE_KAD_BOOTSTRAP_READY_MS,
+    METRICS_GAUGE_KAD_REFRESH_BACKLOG,
+    METRICS_GAUGE_LEN,
+};
+
+static const lookup_entry metrics_gauge_names[] = {
+    { METRICS_GAUGE_EVENT_QUEUE_DEPTH,   "event_queue_depth" },
+    { METRICS_GAUGE_EVENT_QUEUE_HIWAT,   "event_queue_high_water" },
+    { METRICS_GAUGE_PEERS,               "peers" },
+    { METRICS_GAUGE_PEER_OUTQ_BYTES,     "peer_outq_bytes" },
+    { METRICS_GAUGE_PEER_MSG_BUF_BYTES,  "peer_msg_buffered_bytes" },
+    { METRICS_GAUGE_KAD_QUERIES_PENDING, "kad_queries_pending" },
+    { METRICS_GAUGE_DHT_NODES,           "dht_nodes" },
+    { METRICS_GAUGE_KAD_BOOTSTRAP_READY_MS, "kad_bootstrap_ready_ms" },
+    { METRICS_GAUGE_KAD_REFRESH_BACKLOG, "kad_refresh_backlog" },
+    { 0,                                 NULL },
+};
+
+enum metrics_hist {
+    METRICS_HIST_NONE,
+    METRICS_HIST_UDP_HANDLE_US,
+    METRICS_HIST_TCP_HANDLE_US,
+    METRICS_HIST_KAD_RTT_US,
+    METRICS_HIST_POLL_WAIT_US,
+    METRICS_HIST_LOOP_BUSY_US,
+    METRICS_HIST_KAD_CHECKPOINT_US,
+    METRICS_HIST_LEN,
+};
+
+static const lookup_entry metrics_hist_names[] = {
+    { METRICS_HIST_UDP_HANDLE_US, "udp_handle_us" },
+    { METRICS_HIST_TCP_HANDLE_US, "tcp_handle_us" },
+    { METRICS_HIST_KAD_RTT_US,    "kad_rtt_us" },
+    { METRICS_HIST_POLL_WAIT_US,  "loop_poll_wait_us" },
+    { METRICS_HIST_LOOP_BUSY_US,  "loop_busy_us" },
+    { METRICS_HIST_KAD_CHECKPOINT_US, "kad_checkpoint_us" },
+    { 0,                          NULL },
+};
+
+/**
+ * Event-loop events, for per-event histograms. Names must match the events'
+ * names. Unknown events are accounted as METRICS_EVENT_NONE ("other").
+ */
+enum metrics_event {
+    METRICS_EVENT_NONE,
+    METRICS_EVENT_NODE_DATA,
+    METRICS_EVENT_PEER_CONN,
+    METRICS_EVENT_PEER_DATA,
+    METRICS_EVENT_KAD_REFRESH,
+    METRICS_EVENT_KAD_BOOTSTRAP,
+    METRICS_EVENT_ADMIN_CONN,
+    METRICS_EVENT_ADMIN_DATA,
+    METRICS_EVENT_KAD_CHECKPOINT,
+    METRICS_EVENT_KAD_WARM_START,
+    METRICS_EVENT_KAD_EXPIRE,
+    METRICS_EVENT_ADMIN_EXPIRE,
+    METRICS_EVENT_LEN,
+};
+
+static const lookup_entry metrics_event_names[] = {
+    { METRICS_EVENT_NODE_DATA,     "node-data" },
+    { METRICS_EVENT_PEER_CONN,     "peer-conn" },
+    { METRICS_EVENT_PEER_DATA,     "peer-data" },
+    { METRICS_EVENT_KAD_REFRESH,   "kad-refresh" },
+    { METRICS_EVENT_KAD_BOOTSTRAP, "kad-bootstrap" },
+    { METRICS_EVENT_ADMIN_CONN,    "admin-conn" },
+    { METRICS_EVENT_ADMIN_DATA,    "admin-data" },
+    { METRICS_EVENT_KAD_CHECKPOINT, "kad-checkpoint" },
+    { METRICS_EVENT_KAD_WARM_START, "kad-warm-start" },
+    { METRICS_EVENT_KAD_EXPIRE,    "kad-expire" },
+    { METRICS_EVENT_ADMIN_EXPIRE,  "admin-expire" },
+    { 0,                           NULL },
+};
+
+enum metrics_pool {
+    METRICS_POOL_NONE,
+    METRICS_POOL_EVENT,
+    METRICS_POOL_TIMER,
+    METRICS_POOL_PEER,
+    METRICS_POOL_KAD_QUERY,
+    METRICS_POOL_KAD_NODE,
+    METRICS_POOL_LEN,
+};
+
+static const lookup_entry metrics_pool_names[] = {
+    { METRICS_POOL_EVENT,     "event" },
+    { METRICS_POOL_TIMER,     "timer" },
+    { METRICS_POOL_PEER,      "peer" },
+    { METRICS_POOL_KAD_QUERY, "kad_query" },
+    { METRICS_POOL_KAD_NODE,  "kad_node" },
+    { 0,                      NULL },
+};
+
+struct metrics_histogram {
+    uint64_t count;
+    uint64_t sum;
+    uint64_t max;
+    uint64_t buckets[METRICS_HIST_BUCKETS];
+};
+
+/**
+ * A shard, or a snapshot when summed up.
+ */
+struct metrics {
+    struct list_item         item;
+    uint64_t                 cnt[METRICS_CNT_LEN];
+    int64_t                  gauge[METRICS_GAUGE_LEN];
+    /* Routing table fill, only refreshed right before snapshots. */
+    uint64_t                 dht_fill[METRICS_DHT_BUCKETS];
+    /* Object pools, only refreshed right before snapshots. */
+    uint64_t                 pool_in_use[METRICS_POOL_LEN];
+    uint64_t                 pool_capacity[METRICS_POOL_LEN];
+    struct metrics_histogram hist[METRICS_HIST_LEN];
+    /* Callback duration and time spent in the event queue. */
+    struct metrics_histogram ev_run[METRICS_EVENT_LEN];
+    struct metrics_histogram ev_wait[METRICS_EVENT_LEN];
+};
+
+extern _Thread_local struct metrics metrics_local;
+
+bool metrics_thread_register(void);
+void metrics_thread_unregister(void);
+void metrics_snapshot(struct metrics *snap);
+void metrics_log(const struct metrics *snap);
+bool metrics_render_prometheus(const struct metrics *snap, struct iobuf *out);
+
+uint64_t metrics_hist_percentile(const struct metrics_histogram *hist,
+                                 const double pct);
+
+static inline void metrics_inc(const enum metrics_cnt c)
+{
+    metrics_local.cnt[c]++;
+}
+
+static inline void metrics_add(const enum metrics_cnt c, const uint64_t n)
+{
+    metrics_local.cnt[c] += n;
+}
+
+static inline void metrics_gauge_set(const enum metrics_gauge g, const int64_t v)
+{
+    metrics_local.gauge[g] = v;
+}
+
+static inline void metrics_gauge_add(const enum metrics_gauge g, const int64_t v)
+{
+    metrics_local.gauge[g] += v;
+}
+
+static inline void metrics_pool_set(const enum metrics_pool p,
+                                    const struct pool_stats *stats)
+{
+    metrics_local.pool_in_use[p] = stats->in_use;
+    metrics_local.pool_capacity[p] = stats->capacity;
+}
+
+static inline unsigned metrics_hist_bucket(const uint64_t v)
+{
+    if (v < METRICS_HIST_SUB_LEN)
+        return (unsigned)v;
+    unsigned exp = 63 - __builtin_clzll(v);
+    if (exp > METRICS_HIST_EXP_MAX)
+        return METRICS_HIST_BUCKETS - 1;
+    unsigned sub = (v >> (exp - METRICS_HIST_SUB_BITS)) & (METRICS_HIST_SUB_LEN - 1);
+    return (exp - METRICS_HIST_SUB_BITS + 1) * METRICS_HIST_SUB_LEN + sub;
+}
+
+/**
+ * Smallest value that falls into bucket @idx.
+ */
+static inline uint64_t metrics_hist_bucket_low(const unsigned idx)
+{
+    if (idx < METRICS_HIST_SUB_LEN)
+        return idx;
+    unsigned exp = idx / METRICS_HIST_SUB_LEN + METRICS_HIST_SUB_BITS - 1;
+    uint64_t sub = idx % METRICS_HIST_SUB_LEN;
+    return (METRICS_HIST_SUB_LEN + sub) << (exp - METRICS_HIST_SUB_BITS);
+}
+
+static inline void metrics_histogram_record(struct metrics_histogram *hist,
+                                            const uint64_t v)
+{
+    hist->buckets[metrics_hist_bucket(v)]++;
+    hist->count++;
+    hist->sum += v;
+    if (v > hist->max)
+        hist->max = v;
+}
+
+static inline void metrics_hist_record(const enum metrics_hist h, const uint64_t v)
+{
+    metrics_histogram_record(&metrics_local.hist[h], v);
+}
+
+static inline void metrics_event_record(const enum metrics_event e,
+                                        const uint64_t wait_us,
+                                        const uint64_t run_us)
+{
+    metrics_histogram_record(&metrics_local.ev_wait[e], wait_us);
+    metrics_histogram_record(&metrics_local.ev_run[e], run_us);
+}
+
+#endif /* METRICS_H */
@@ -1,16 +1,26 @@
 /* Copyright (c) 2017-2019 Foudil Brétel.  All rights reserved. */
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/sendfile.h>
 #include <unistd.h>
 #include "utils/array.h"
 #include "config.h"
 #include "log.h"
+#include "metrics.h"
+#include "net/kad/bootstrap.h"
 #include "net/kad/rpc.h"
 #include "net/socket.h"
 #include "timers.h"
+#include "trace.h"
 #include "net/actions.h"
 
-#define BOOTSTRAP_NODES_LEN 64
-// FIXME: low for testing purpose.
-#define SERVER_TCP_BUFLEN 10
+peer_pool pool_peers = {0};
+struct proto_msg_budget peers_msg_budget = {0};
+
+/* Registered peers, indexed by fd. */
+static struct peer **peers_by_fd = NULL;
+static size_t peers_by_fd_len = 0;
+
 #define SERVER_UDP_BUFLEN 1400
 
 bool node_handle_data(int sock, struct kad_ctx *kctx)
@@ -31,49 +41,195 @@ bool node_handle_data(int sock, struct kad_ctx *kctx)
         return true;
     }
     log_debug("Received %d bytes.", slen);
+    long long handle_start = now_micros();
+    metrics_inc(METRICS_CNT_UDP_PKT_IN);
+    metrics_add(METRICS_CNT_UDP_BYTES_IN, slen);
+    trace_add(&(struct trace_record){
+        .ts_us=handle_start, .fd=sock, .bytes=slen, .kind=TRACE_KIND_UDP_RECV,
+        .result=1});
+
+    if (!kad_ratelimit_allow(&kctx->ratelimit, &node_addr, handle_start / 1000)) {
+        log_debug("Rate limited datagram dropped.");
+        metrics_inc(METRICS_CNT_KAD_RATE_LIMITED);
+        goto cleanup;
+    }
 
-    struct iobuf rsp = {0};
-    bool resp = kad_rpc_handle(kctx, &node_addr, buf, (size_t)slen, &rsp);
-    if (rsp.pos == 0) {
+    struct iochain *rsp = &kctx->sndbuf;
+    iochain_clear(rsp);
+    bool resp = kad_rpc_handle(kctx, &node_addr, buf, (size_t)slen, rsp);
+    if (rsp->len == 0) {
         log_info("Handling incoming message did not produce response. Not responding.");
         ret = resp; goto cleanup;
     }
-    if (rsp.pos > SERVER_UDP_BUFLEN) {
+    if (rsp->len > SERVER_UDP_BUFLEN) {
         log_error("Response too long.");
         ret = false; goto cleanup;
     }
 
-    slen = sendto(sock, rsp.buf, rsp.pos, 0,
-                  (struct sockaddr *)&node_addr, node_addr_len);
+    slen = iochain_sendmsg(sock, rsp, 0, &node_addr, node_addr_len);
+    trace_add(&(struct trace_record){
+        .ts_us=now_micros(), .fd=sock, .bytes=rsp->len, .kind=TRACE_KIND_UDP_SEND,
+        .result=slen >= 0});
     if (slen < 0) {
         if (errno != EWOULDBLOCK) {
-            log_perror(LOG_ERR, "Failed sendto: %s", errno);
+            log_perror(LOG_ERR, "Failed sendmsg: %s", errno);
             ret = false; goto cleanup;
         }
         goto cleanup;
     }
     log_debug("Sent %d bytes.", slen);
+    metrics_inc(METRICS_CNT_UDP_PKT_OUT);
+    metrics_add(METRICS_CNT_UDP_BYTES_OUT, slen);
 
   cleanup:
-    iobuf_reset(&rsp);
+    kad_probes_send(kctx, sock);
+    arena_reset(&kctx->arena);
+    metrics_hist_record(METRICS_HIST_UDP_HANDLE_US, now_micros() - handle_start);
     return ret;
 }
 
+static bool peer_bulk_sink_open(struct peer *peer)
+{
+    struct peer_bulk_sink *sink = &peer->sink;
+    if (!sink->dir) {
+        log_warning("No sink for bulk content from peer %s.", peer->addr_str);
+        return false;
+    }
+    char path[PATH_MAX];
+    int len = snprintf(path, sizeof(path), "%s/"PEER_BULK_SINK_PREFIX"%.*s",
+                       sink->dir, (int)strcspn(peer->addr_str, ":"), peer->addr_str);
+    if (len < 0 || (size_t)len >= sizeof(path)) {
+        log_error("Bulk sink path too long.");
+        return false;
+    }
+    sink->fd = open(path, O_WRONLY | O_CREAT | O_CLOEXEC, 0600);
+    if (sink->fd == -1) {
+        log_perror(LOG_ERR, "Failed open: %s.", errno);
+        return false;
+    }
+    log_info("Receiving bulk content from peer %s into %s.", peer->addr_str, path);
+    return true;
+}
+
+/**
+ * Writes @len bytes of the data field of a BULK message, from @pos within
+ * it, to the peer's sink. The leading offset field is accumulated first.
+ */
+static bool peer_bulk_recv(struct peer *peer, const char buf[], size_t len,
+                           size_t pos)
+{
+    struct peer_bulk_sink *sink = &peer->sink;
+    if (pos < PROTO_MSG_BULK_OFFSET_LEN) {
+        size_t n = PROTO_MSG_BULK_OFFSET_LEN - pos;
+        if (n > len)
+            n = len;
+        memcpy(sink->off.db + pos, buf, n);
+        buf += n;
+        len -= n;
+        pos += n;
+    }
+    if (len == 0)
+        return true;
+    if (sink->fd < 0 && !peer_bulk_sink_open(peer))
+        return false;
+
+    off_t off = u64_ntoh(sink->off).dd + (pos - PROTO_MSG_BULK_OFFSET_LEN);
+    while (len > 0) {
+        ssize_t n = pwrite(sink->fd, buf, len, off);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            log_perror(LOG_ERR, "Failed pwrite: %s.", errno);
+            return false;
+        }
+        metrics_add(METRICS_CNT_TCP_BULK_BYTES_IN, n);
+        buf += n;
+        len -= n;
+        off += n;
+    }
+    return true;
+}
+
+static bool peer_msg_handle(struct proto_msg_parser *parser, void *data)
+{
+    struct peer *peer = data;
+    log_info("Got msg %s (%"PRIu32" bytes) from peer %s.",
+             lookup_by_id(proto_msg_type_names, parser->msg_type),
+             parser->msg_len.dd, peer->addr_str);
+    if (parser->msg_type == PROTO_MSG_TYPE_BULK) {
+        if (parser->msg_len.dd < PROTO_MSG_BULK_OFFSET_LEN) {
+            log_warning("Malformed bulk msg from peer %s.", peer->addr_str);
+            return false;
+        }
+        return parser->streaming ||
+            peer_bulk_recv(peer, parser->msg_data.buf, parser->msg_data.pos, 0);
+    }
+    // TODO: call tcp handlers here.
+    return true;
+}
+
+/**
+ * Only bulk content is streamed, straight to the sink. Other messages too
+ * long to be buffered are rejected.
+ */
+static bool peer_msg_chunk(struct proto_msg_parser *parser,
+                           const char buf[], size_t len, void *data)
+{
+    if (parser->msg_type != PROTO_MSG_TYPE_BULK) {
+        parser->capped = true;
+        return false;
+    }
+    return peer_bulk_recv(data, buf, len, parser->msg_recv);
+}
+
+static bool peer_index_set(const int fd, struct peer *peer)
+{
+    if ((size_t)fd >= peers_by_fd_len) {
+        size_t len = peers_by_fd_len ? peers_by_fd_len : PEER_INDEX_LEN_INITIAL;
+        while (len <= (size_t)fd)
+            len *= 2;
+        struct peer **idx = realloc(peers_by_fd, len * sizeof(struct peer *));
+        if (!idx) {
+            log_perror(LOG_ERR, "Failed realloc: %s.", errno);
+            return false;
+        }
+        memset(idx + peers_by_fd_len, 0,
+               (len - peers_by_fd_len) * sizeof(struct peer *));
+        peers_by_fd = idx;
+        peers_by_fd_len = len;
+    }
+    peers_by_fd[fd] = peer;
+    return true;
+}
+
 static struct peer*
-peer_register(struct list_item *peers, int conn, struct sockaddr_storage *addr)
+peer_register(struct list_item *peers, int conn, struct sockaddr_storage *addr,
+              const struct config *conf)
 {
-    struct peer *peer = calloc(1, sizeof(struct peer));
+    struct peer *peer = peer_pool_get(&pool_peers);
     if (!peer) {
         log_perror(LOG_ERR, "Failed malloc: %s.", errno);
         return NULL;
     }
 
+    if (!peer_index_set(conn, peer)) {
+        peer_pool_put(&pool_peers, peer);
+        return NULL;
+    }
     peer->fd = conn;
     peer->addr = *addr;
     sockaddr_storage_fmt(peer->addr_str, &peer->addr);
+    iobuf_init_inline(&peer->rcvbuf, peer->rcvbuf_inline, PEER_RCVBUF_MIN);
     proto_msg_parser_init(&peer->parser);
+    peer->parser.buf_max = conf->msg_buf_max;
+    peer->parser.budget = &peers_msg_budget;
+    peer->parser.on_msg = peer_msg_handle;
+    peer->parser.on_chunk = peer_msg_chunk;
+    peer->parser.on_msg_data = peer;
+    peer->sink = (struct peer_bulk_sink){.dir=conf->conf_dir, .fd=-1};
     list_init(&(peer->item));
     list_append(peers, &(peer->item));
+    metrics_gauge_add(METRICS_GAUGE_PEERS, 1);
     log_debug("Peer %s registered (fd=%d).", peer->addr_str, conn);
 
     return peer;
@@ -103,6 +259,13 @@ int peer_conn_accept_all(const int listenfd, struct list_item *peers,
         }
         log_debug("Incoming connection...");
 
+        /* Not inherited from the listening socket. */
+        if (sock_setnonblock(conn)) {
+            sock_close(conn);
+            skipped++;
+            continue;
+        }
+
         /* Close the connection nicely when max_peers reached. Another approach
            would be to close the listening socket and reopen it when we're
            ready, which would result in ECONNREFUSED on the client side. */
@@ -116,7 +279,7 @@ int peer_conn_accept_all(const int listenfd, struct list_item *peers,
             continue;
         }
 
-        struct peer *p = peer_register(peers, conn, &peer_addr);
+        struct peer *p = peer_register(peers, conn, &peer_addr, conf);
         if (!p) {
             log_error("Failed to register peer fd=%d."
                       " Trying to close connection gracefully.", conn);
@@ -141,69 +304,219 @@ int peer_conn_accept_all(const int listenfd, struct list_item *peers,
         return 0;
 }
 
-struct peer*
-peer_find_by_fd(struct list_item *peers, const int fd)
+struct peer* peer_find_by_fd(const int fd)
 {
-    struct peer *p;
-    struct list_item * it = peers;
-    list_for(it, peers) {
-        p = cont(it, struct peer, item);
-        if (!p) {
-            log_error("Undefined container in list.");
-            return NULL;
-        }
-        if (p->fd == fd)
-            break;
-    }
-
-    if (it == peers) {
+    if (fd < 0 || (size_t)fd >= peers_by_fd_len || !peers_by_fd[fd]) {
         log_warning("Peer not found fd=%d.", fd);
         return NULL;
     }
-
-    return p;
+    return peers_by_fd[fd];
 }
 
 static void peer_unregister(struct peer *peer)
 {
     log_debug("Unregistering peer %s.", peer->addr_str);
     proto_msg_parser_terminate(&peer->parser);
+    iobuf_reset(&peer->rcvbuf);
+    metrics_gauge_add(METRICS_GAUGE_PEER_OUTQ_BYTES, -(int64_t)peer_outq_len(peer));
+    iobuf_reset(&peer->outq);
+    if (peer->bulk.left > 0)
+        close(peer->bulk.fd);
+    if (peer->sink.fd >= 0)
+        close(peer->sink.fd);
+    peers_by_fd[peer->fd] = NULL;
     list_delete(&peer->item);
-    free_safer(peer);
+    peer_pool_put(&pool_peers, peer);
+    metrics_gauge_add(METRICS_GAUGE_PEERS, -1);
+}
+
+/**
+ * Queues @ch, unsent, at the end of @peer's outbound queue.
+ */
+static bool peer_outq_push(struct peer *peer, const struct iochain *ch)
+{
+    /* Reclaim the sent part once it dominates. */
+    if (peer->outq_off > peer->outq.pos / 2) {
+        memmove(peer->outq.buf, peer->outq.buf + peer->outq_off,
+                peer_outq_len(peer));
+        peer->outq.pos -= peer->outq_off;
+        if (peer->bulk.left > 0)
+            peer->bulk.at -= peer->outq_off;
+        peer->outq_off = 0;
+    }
+    if (!iochain_flatten(ch, &peer->outq))
+        return false;
+    metrics_inc(METRICS_CNT_TCP_SEND_QUEUED);
+    metrics_gauge_add(METRICS_GAUGE_PEER_OUTQ_BYTES, ch->len);
+    return true;
 }
 
-static bool peer_msg_send(const struct peer *peer, enum proto_msg_type typ,
-                          const char *msg, union u32 msg_len)
+/**
+ * Sends right away when nothing is pending, and queues what the socket does
+ * not accept. Queued data is flushed by peer_conn_flush() on POLLOUT.
+ */
+bool peer_msg_send(struct peer *peer, enum proto_msg_type typ,
+                   const char *msg, union u32 msg_len)
 {
-    size_t buf_len = msg_len.dd + PROTO_MSG_FIELD_TYPE_LEN + PROTO_MSG_FIELD_LENGTH_LEN;
-    char buf[buf_len];
-    char *bufp = buf;
-    memcpy(bufp, lookup_by_id(proto_msg_type_names, typ), PROTO_MSG_FIELD_LENGTH_LEN);
-    bufp += PROTO_MSG_FIELD_TYPE_LEN;
-    memcpy(bufp, u32_hton(msg_len).db, PROTO_MSG_FIELD_LENGTH_LEN);
-    bufp += PROTO_MSG_FIELD_LENGTH_LEN;
-    memcpy(bufp, msg, (size_t)msg_len.dd);
-
-    int resp = send(peer->fd, buf, buf_len, MSG_NOSIGNAL);
-    if (resp < 0) {
-        if (errno == EPIPE)
-            log_info("Peer fd=%u disconnected while sending.");
-        else
-            log_perror(LOG_ERR, "Failed send: %s.", errno);
+    struct iochain ch;
+    iochain_clear(&ch);
+    union u32 len_n = u32_hton(msg_len);
+    if (!iochain_copy(&ch, lookup_by_id(proto_msg_type_names, typ), PROTO_MSG_FIELD_TYPE_LEN) ||
+        !iochain_copy(&ch, len_n.db, PROTO_MSG_FIELD_LENGTH_LEN) ||
+        !iochain_ref(&ch, msg, (size_t)msg_len.dd))
         return false;
+    metrics_inc(METRICS_CNT_TCP_SEND);
+
+    if (peer_outq_len(peer) > 0 || peer->bulk.left > 0)
+        return peer_outq_push(peer, &ch);
+
+    ssize_t slen = iochain_sendmsg(peer->fd, &ch, MSG_NOSIGNAL, NULL, 0);
+    if (slen < 0) {
+        if (errno == EWOULDBLOCK || errno == EAGAIN)
+            slen = 0;
+        else {
+            if (errno == EPIPE)
+                log_info("Peer fd=%u disconnected while sending.", peer->fd);
+            else
+                log_perror(LOG_ERR, "Failed send: %s.", errno);
+            return false;
+        }
     }
+    if ((size_t)slen == ch.len)
+        return true;
+
+    log_debug("Short write to peer %s (%zd/%zu).", peer->addr_str, slen, ch.len);
+    iochain_consume(&ch, slen);
+    iobuf_clear(&peer->outq);
+    peer->outq_off = 0;
+    return peer_outq_push(peer, &ch);
+}
 
+/**
+ * Sends @len bytes of @fd from @off, as a BULK message queued after pending
+ * messages. The content is written with sendfile(2) by peer_conn_flush(). On
+ * success, @fd belongs to the peer and is closed once sent. One transfer at a
+ * time per peer.
+ */
+bool peer_bulk_send(struct peer *peer, const int fd, const off_t off,
+                    const size_t len)
+{
+    if (peer->bulk.left > 0) {
+        log_error("Bulk transfer to peer %s already in progress.", peer->addr_str);
+        return false;
+    }
+    if (len > PROTO_MSG_BULK_MAX) {
+        log_error("Bulk segment too long (%zu bytes).", len);
+        return false;
+    }
+
+    struct iochain ch;
+    iochain_clear(&ch);
+    union u32 len_n = u32_hton((union u32){PROTO_MSG_BULK_OFFSET_LEN + len});
+    union u64 off_n = u64_hton((union u64){(uint64_t)off});
+    if (!iochain_copy(&ch, lookup_by_id(proto_msg_type_names, PROTO_MSG_TYPE_BULK),
+                      PROTO_MSG_FIELD_TYPE_LEN) ||
+        !iochain_copy(&ch, len_n.db, PROTO_MSG_FIELD_LENGTH_LEN) ||
+        !iochain_copy(&ch, off_n.db, PROTO_MSG_BULK_OFFSET_LEN) ||
+        !peer_outq_push(peer, &ch))
+        return false;
+    metrics_inc(METRICS_CNT_TCP_SEND);
+
+    if (len == 0)
+        close(fd);
+    else
+        peer->bulk = (struct peer_bulk){
+            .fd=fd, .off=off, .left=len, .at=peer->outq.pos};
     return true;
 }
 
+/**
+ * Writes as much of the outbound queue, and of the bulk content within it, as
+ * the socket accepts.
+ */
+int peer_conn_flush(struct peer *peer)
+{
+    size_t burst = 0;
+    while (peer->outq_off < peer->outq.pos || peer->bulk.left > 0) {
+        struct peer_bulk *bulk = &peer->bulk;
+        size_t end = bulk->left > 0 ? bulk->at : peer->outq.pos;
+        ssize_t slen;
+        if (peer->outq_off < end) {
+            slen = send(peer->fd, peer->outq.buf + peer->outq_off,
+                        end - peer->outq_off, MSG_NOSIGNAL);
+            if (slen >= 0) {
+                peer->outq_off += slen;
+                metrics_gauge_add(METRICS_GAUGE_PEER_OUTQ_BYTES, -slen);
+            }
+        }
+        else {
+            if (burst >= PEER_BULK_BURST)
+                return CONN_OK;
+            size_t n = bulk->left < PEER_BULK_BURST ? bulk->left : PEER_BULK_BURST;
+            slen = sendfile(peer->fd, bulk->fd, &bulk->off, n);
+            if (slen == 0) {
+                log_error("Bulk content for peer %s ended early.", peer->addr_str);
+                return CONN_CLOSED;
+            }
+            if (slen > 0) {
+                bulk->left -= slen;
+                burst += slen;
+                metrics_add(METRICS_CNT_TCP_BULK_BYTES_OUT, slen);
+                if (bulk->left == 0)
+                    close(bulk->fd);
+            }
+        }
+
+        if (slen < 0) {
+            if (errno == EWOULDBLOCK || errno == EAGAIN)
+                return CONN_OK;
+            if (errno == EPIPE)
+                log_info("Peer %s disconnected while sending.", peer->addr_str);
+            else
+                log_perror(LOG_ERR, "Failed send: %s.", errno);
+            return CONN_CLOSED;
+        }
+    }
+    iobuf_clear(&peer->outq);
+    peer->outq_off = 0;
+    return CONN_OK;
+}
+
+/**
+ * Sizes the receive buffer after the last read of @slen bytes. Its content is
+ * not kept: the parser consumes whole chunks.
+ */
+static bool peer_rcvbuf_adapt(struct peer *peer, const size_t slen)
+{
+    size_t capa = peer->rcvbuf.capa;
+    if (slen == capa && capa < PEER_RCVBUF_MAX) {
+        capa *= 2;
+        peer->rcvbuf_underused = 0;
+    }
+    else if (slen < capa / 4 && capa > PEER_RCVBUF_MIN) {
+        if (++peer->rcvbuf_underused >= PEER_RCVBUF_SHRINK_AFTER) {
+            capa /= 2;
+            peer->rcvbuf_underused = 0;
+        }
+    }
+    else
+        peer->rcvbuf_underused = 0;
+
+    if (capa == peer->rcvbuf.capa)
+        return true;
+    log_debug("Peer %s receive buffer: %u -> %zu bytes.", peer->addr_str,
+              peer->rcvbuf.capa, capa);
+    iobuf_reset(&peer->rcvbuf);
+    return iobuf_reserve(&peer->rcvbuf, capa);
+}
+
 int peer_conn_handle_data(struct peer *peer, struct kad_ctx *kctx)
 {
     (void)kctx; // FIXME:
     enum conn_ret ret = CONN_OK;
 
-    char buf[SERVER_TCP_BUFLEN];
-    memset(buf, 0, SERVER_TCP_BUFLEN);
-    ssize_t slen = recv(peer->fd, buf, SERVER_TCP_BUFLEN, 0);
+    char *buf = peer->rcvbuf.buf;
+    ssize_t slen = recv(peer->fd, buf, peer->rcvbuf.capa, 0);
     if (slen < 0) {
         if (errno != EWOULDBLOCK) {
             log_perror(LOG_ERR, "Failed recv: %s", errno);
@@ -218,15 +531,23 @@ int peer_conn_handle_data(struct peer *peer, struct kad_ctx *kctx)
         goto end;
     }
     log_debug("Received %d bytes.", slen);
+    long long handle_start = now_micros();
+    metrics_inc(METRICS_CNT_TCP_RECV);
 
     if (peer->parser.stage == PROTO_MSG_STAGE_ERROR) {
         char *bufx = log_fmt_hex(LOG_ERR, (unsigned char*)buf, slen);
         log_error("Parsing error. buf=%s", bufx);
         free_safer(bufx);
-        goto end;
+        goto adapt;
     }
 
     if (!proto_msg_parse(&peer->parser, buf, slen)) {
+        if (peer->parser.capped) {
+            log_warning("Peer %s exceeded message buffering cap.", peer->addr_str);
+            metrics_inc(METRICS_CNT_TCP_MSG_CAPPED);
+            ret = CONN_CLOSED;
+            goto end;
+        }
         log_debug("Failed parsing of chunk.");
         /* TODO: how do we get out of the error state ? We could send a
            PROTO_MSG_TYPE_ERROR, then watch for a special PROTO_MSG_TYPE_RESET
@@ -240,17 +561,14 @@ int peer_conn_handle_data(struct peer *peer, struct kad_ctx *kctx)
             log_warning("Failed to notify peer %s of error state.", peer->addr_str);
             ret = CONN_CLOSED;
         }
-        goto end;
+        goto adapt;
     }
     log_debug("Successful parsing of chunk.");
+    metrics_hist_record(METRICS_HIST_TCP_HANDLE_US, now_micros() - handle_start);
 
-    if (peer->parser.stage == PROTO_MSG_STAGE_NONE) {
-        log_info("Got msg %s from peer %s.",
-                 lookup_by_id(proto_msg_type_names, peer->parser.msg_type),
-                 peer->addr_str);
-        // TODO: call tcp handlers here.
-    }
-
+  adapt:
+    if (ret == CONN_OK && !peer_rcvbuf_adapt(peer, slen))
+        ret = CONN_CLOSED;
   end:
     return ret;
 }
@@ -275,13 +593,110 @@ int peer_conn_close_all(struct list_item *peers)
         if (!peer_conn_close(p))
             fail++;
     }
+    free(peers_by_fd);
+    peers_by_fd = NULL;
+    peers_by_fd_len = 0;
     return fail;
 }
 
-bool kad_refresh(void *data)
+/**
+ * Refreshes the buckets due: a find_node query for a random id of the bucket
+ * is sent to the closest known nodes.
+ */
+bool kad_refresh(struct kad_ctx *kctx, const int sock)
+{
+    time_t now = time(NULL);
+    int bkt_idx;
+    while ((bkt_idx = kad_refresh_sched_next(&kctx->refresh, kctx->dht, now)) >= 0) {
+        kad_guid target;
+        dht_bucket_random_id(kctx->dht, bkt_idx, &target);
+        struct kad_node_info nodes[KAD_K_CONST];
+        size_t nodes_len = dht_find_closest(kctx->dht, &target, nodes, NULL);
+        for (size_t i = 0; i < nodes_len && i < KAD_REFRESH_ALPHA; i++) {
+            if (node_find(kctx, sock, nodes[i], &target))
+                metrics_inc(METRICS_CNT_KAD_REFRESH_QUERIES);
+        }
+        metrics_inc(METRICS_CNT_KAD_REFRESH);
+    }
+    metrics_gauge_set(METRICS_GAUGE_KAD_REFRESH_BACKLOG, kctx->refresh.backlog);
+    return true;
+}
+
+/* Sends the encoded query to its node. */
+static bool node_query_transmit(struct kad_ctx *kctx, const int sock,
+                                const struct kad_rpc_query *query)
 {
-    (void)data;
-    log_info("FIXME refresh cb");
+    struct iochain *qbuf = &kctx->sndbuf;
+    socklen_t addr_len = sizeof(struct sockaddr_storage);
+    ssize_t slen = iochain_sendmsg(sock, qbuf, 0, &query->node.addr, addr_len);
+    if (slen < 0) {
+        if (errno != EWOULDBLOCK) {
+            log_perror(LOG_ERR, "Failed sendmsg: %s", errno);
+        }
+        return false;
+    }
+    log_debug("Sent %d bytes.", slen);
+    metrics_inc(METRICS_CNT_UDP_PKT_OUT);
+    metrics_add(METRICS_CNT_UDP_BYTES_OUT, slen);
+    return true;
+}
+
+/* Sends the encoded query, which then awaits its response. */
+static bool node_query_send(struct kad_ctx *kctx, const int sock,
+                            struct kad_rpc_query *query)
+{
+    if (!node_query_transmit(kctx, sock, query))
+        return false;
+    metrics_inc(METRICS_CNT_KAD_QUERY_SENT);
+
+    kad_rpc_query_add(kctx, query);
+    metrics_gauge_add(METRICS_GAUGE_KAD_QUERIES_PENDING, 1);
+    char *id = log_fmt_hex(LOG_DEBUG, query->msg.tx_id.bytes, KAD_RPC_MSG_TX_ID_LEN);
+    log_debug("Query (tx_id=%s) saved.", id);
+    free_safer(id);
+
+    return true;
+}
+
+/**
+ * Pings the eviction candidates not pinged yet. Unsent pings are retried on
+ * the next call.
+ */
+void kad_probes_send(struct kad_ctx *kctx, const int sock)
+{
+    size_t i = 0;
+    while (i < kctx->probes_len) {
+        struct kad_rpc_probe *probe = &kctx->probes[i];
+        if (!probe->sent) {
+            if (node_ping(kctx, sock, probe->node)) {
+                probe->sent = true;
+                metrics_inc(METRICS_CNT_KAD_EVICT_PROBES);
+            }
+            else if (kad_rpc_probe_unsent(kctx, probe))
+                continue; // the last probe moved in its place
+        }
+        i++;
+    }
+}
+
+/**
+ * Retransmits the queries not responded to in time, and expires those out of
+ * retries, which may evict nodes. Unsent retransmissions just time out again.
+ */
+bool kad_expire(struct kad_ctx *kctx, const int sock)
+{
+    long long now = now_millis();
+    size_t expired = kad_rpc_expire(kctx, now);
+    if (expired > 0)
+        log_debug("%zu queries expired.", expired);
+
+    struct kad_rpc_query *query;
+    while ((query = kad_rpc_query_resend_next(kctx, &kctx->sndbuf, now))) {
+        log_debug("Kad retransmitting to %s", query->node.addr_str);
+        if (node_query_transmit(kctx, sock, query))
+            metrics_inc(METRICS_CNT_KAD_QUERY_RETRIES);
+    }
+    kad_probes_send(kctx, sock);
     return true;
 }
 
@@ -308,10 +723,15 @@ bool kad_bootstrap(struct list_item *timer_list, const struct config *conf,
         return true;
     }
 
-    struct sockaddr_storage nodes[BOOTSTRAP_NODES_LEN];
-    int nnodes = kad_read_bootstrap_nodes(nodes, ARRAY_LEN(nodes), bootstrap_nodes_path);
+    struct sockaddr_storage *nodes = malloc(conf->bootstrap_max * sizeof(*nodes));
+    if (!nodes) {
+        log_perror(LOG_ERR, "Failed malloc: %s.", errno);
+        return false;
+    }
+    int nnodes = kad_read_bootstrap_nodes(nodes, conf->bootstrap_max, bootstrap_nodes_path);
     if (nnodes < 0) {
         log_error("Failed to read bootstrap nodes.");
+        free(nodes);
         return false;
     }
     log_info("%d bootstrap nodes read.", nnodes);
@@ -319,92 +739,157 @@ bool kad_bootstrap(struct list_item *timer_list, const struct config *conf,
         log_warning("No bootstrap nodes read.");
     }
 
+    bool ok = kad_bootstrap_sched_init(&kctx->boot, nodes, nnodes,
+                                       conf->bootstrap_rate,
+                                       conf->bootstrap_inflight, false,
+                                       now_millis());
+    free(nodes);
+    if (!ok)
+        return false;
+    return kad_bootstrap_pace(timer_list, conf, kctx, sock);
+}
 
-    struct list_item timer_list_tmp;
-    list_init(&timer_list_tmp);
-    struct event *event_node_ping[nnodes];
-    int i=0;
-    for (; i<nnodes; i++) {
-        event_node_ping[i] = malloc(sizeof(struct event));
-        if (!event_node_ping[i]) {
-            log_perror(LOG_ERR, "Failed malloc: %s.", errno);
-            goto cleanup;
-        }
-        *event_node_ping[i] = (struct event){
-            "node-ping", .cb=event_node_ping_cb,
-            .args.node_ping={
-                .kctx=kctx, .sock=sock,
-                .node={.id={{0},0}, .addr=nodes[i], .addr_str={0}}
-            },
-            .fatal=false, .self=event_node_ping[i]
-        };
-        sockaddr_storage_fmt(event_node_ping[i]->args.node_ping.node.addr_str,
-                             &event_node_ping[i]->args.node_ping.node.addr);
-
-        struct timer *timer_node_ping = malloc(sizeof(struct timer));
-        if (!timer_node_ping) {
-            log_perror(LOG_ERR, "Failed malloc: %s.", errno);
-            goto cleanup;
-        }
-        *timer_node_ping = (struct timer){
-            .name="node-ping", .ms=0, .expire=now_millis(),
-            .event=event_node_ping[i], .once=true, .self=timer_node_ping
-        };
-        list_append(&timer_list_tmp, &timer_node_ping->item);
+/**
+ * Validates the nodes of a table loaded from disk: they are marked stale and
+ * pinged like bootstrap seeds. Queries are answered from the table meanwhile.
+ */
+bool kad_warm_start(struct list_item *timer_list, const struct config *conf,
+                    struct kad_ctx *kctx, const int sock)
+{
+    struct kad_dht_encoded *snap = malloc(sizeof(struct kad_dht_encoded));
+    if (!snap) {
+        log_perror(LOG_ERR, "Failed malloc: %s.", errno);
+        return false;
     }
+    snap->nodes_len = 0;
+    dht_snapshot(kctx->dht, snap);
 
-    list_concat(timer_list, &timer_list_tmp);
-    return true;
+    bool ok = false;
+    struct sockaddr_storage *addrs = malloc(snap->nodes_len * sizeof(*addrs));
+    if (!addrs) {
+        log_perror(LOG_ERR, "Failed malloc: %s.", errno);
+        goto cleanup;
+    }
+    for (size_t i = 0; i < snap->nodes_len; i++)
+        addrs[i] = snap->nodes[i].addr;
+    ok = kad_bootstrap_sched_init(&kctx->boot, addrs, snap->nodes_len,
+                                  conf->bootstrap_rate,
+                                  conf->bootstrap_inflight, true, now_millis());
+    free(addrs);
+    if (!ok)
+        goto cleanup;
+
+    dht_mark_stale(kctx->dht);
+    log_info("Validating %zu loaded nodes.", snap->nodes_len);
+    ok = kad_bootstrap_pace(timer_list, conf, kctx, sock);
 
   cleanup:
-    for (int j=0; j<i; j++) {
-        free(event_node_ping[j]);
+    free(snap);
+    return ok;
+}
+
+/* Drops the loaded nodes not heard from, and bootstraps if too few are left. */
+static bool kad_warm_start_end(struct list_item *timer_list,
+                               const struct config *conf,
+                               struct kad_ctx *kctx, const int sock)
+{
+    size_t dropped = dht_purge_stale(kctx->dht);
+    metrics_add(METRICS_CNT_KAD_WARM_DROPPED, dropped);
+    uint64_t fill[KAD_GUID_SPACE_IN_BITS];
+    size_t alive = dht_bucket_fill(kctx->dht, fill);
+    log_info("Warm start done: %zu nodes alive, %zu dropped.", alive, dropped);
+    if (alive >= KAD_BOOTSTRAP_WARM_MIN)
+        return true;
+
+    log_info("Too few nodes alive. Bootstrapping.");
+    return kad_bootstrap(timer_list, conf, kctx, sock);
+}
+
+/**
+ * Pings the bootstrap seeds due, then schedules itself again until
+ * bootstrapping is over.
+ */
+bool kad_bootstrap_pace(struct list_item *timer_list, const struct config *conf,
+                        struct kad_ctx *kctx, const int sock)
+{
+    long long now = now_millis();
+    uint64_t fill[KAD_GUID_SPACE_IN_BITS];
+    if (!kad_bootstrap_sched_update(&kctx->boot, dht_bucket_fill(kctx->dht, fill), now)) {
+        bool warm = kctx->boot.warm;
+        kad_bootstrap_sched_terminate(&kctx->boot);
+        return warm ? kad_warm_start_end(timer_list, conf, kctx, sock) : true;
     }
-    struct list_item *timer_it = &timer_list_tmp;
-    list_for(timer_it, &timer_list_tmp) {
-        struct timer *p = cont(timer_it, struct timer, item);
-        if (p)
-            free(p->self);
+
+    const struct sockaddr_storage *addr;
+    while ((addr = kad_bootstrap_sched_next(&kctx->boot, now))) {
+        struct kad_node_info node = {.addr=*addr};
+        sockaddr_storage_fmt(node.addr_str, &node.addr);
+        /* Unsent pings time out and are retried like unanswered ones. */
+        node_ping(kctx, sock, node);
     }
-    return false;
+
+    struct event *event_pace = event_pool_get(&pool_events);
+    if (!event_pace) {
+        log_perror(LOG_ERR, "Failed malloc: %s.", errno);
+        return false;
+    }
+    *event_pace = (struct event){
+        "kad-bootstrap", .cb=event_kad_bootstrap_pace_cb,
+        .args.kad_bootstrap={.timer_list=timer_list, .conf=conf, .kctx=kctx, .sock=sock},
+        .fatal=false, .self=event_pace
+    };
+    struct timer *timer_pace = timer_pool_get(&pool_timers);
+    if (!timer_pace) {
+        log_perror(LOG_ERR, "Failed malloc: %s.", errno);
+        event_pool_put(&pool_events, event_pace);
+        return false;
+    }
+    *timer_pace = (struct timer){
+        .name="kad-bootstrap", .ms=KAD_BOOTSTRAP_TICK_MS,
+        .expire=now + KAD_BOOTSTRAP_TICK_MS, .event=event_pace, .once=true,
+        .self=timer_pace
+    };
+    list_append(timer_list, &timer_pace->item);
+    return true;
 }
 
 bool node_ping(struct kad_ctx *kctx, const int sock, const struct kad_node_info node)
 {
     log_info("Kad pinging %s", node.addr_str);
 
-    struct kad_rpc_query *query = calloc(1, sizeof(struct kad_rpc_query));
+    struct kad_rpc_query *query = kad_rpc_query_pool_get(&pool_kad_queries);
     if (!query) {
         log_perror(LOG_ERR, "Failed malloc: %s.", errno);
         return false;
     }
     query->node = node;
 
-    struct iobuf qbuf = {0};
-    if (!kad_rpc_query_ping(kctx, &qbuf, query)) {
-        goto failed;
+    iochain_clear(&kctx->sndbuf);
+    if (!kad_rpc_query_ping(kctx, &kctx->sndbuf, query) ||
+        !node_query_send(kctx, sock, query)) {
+        kad_rpc_query_pool_put(&pool_kad_queries, query);
+        return false;
     }
+    return true;
+}
 
-    socklen_t addr_len = sizeof(struct sockaddr_storage);
-    ssize_t slen = sendto(sock, qbuf.buf, qbuf.pos, 0, (struct sockaddr *)&node.addr, addr_len);
-    if (slen < 0) {
-        if (errno != EWOULDBLOCK) {
-            log_perror(LOG_ERR, "Failed sendto: %s", errno);
-        }
-        goto failed;
-    }
-    log_debug("Sent %d bytes.", slen);
-    iobuf_reset(&qbuf);
+bool node_find(struct kad_ctx *kctx, const int sock,
+               const struct kad_node_info node, const kad_guid *target)
+{
+    log_debug("Kad find_node to %s", node.addr_str);
 
-    list_append(&kctx->queries, &query->item);
-    char *id = log_fmt_hex(LOG_DEBUG, query->msg.tx_id.bytes, KAD_RPC_MSG_TX_ID_LEN);
-    log_debug("Query (tx_id=%s) saved.", id);
-    free_safer(id);
+    struct kad_rpc_query *query = kad_rpc_query_pool_get(&pool_kad_queries);
+    if (!query) {
+        log_perror(LOG_ERR, "Failed malloc: %s.", errno);
+        return false;
+    }
+    query->node = node;
 
+    iochain_clear(&kctx->sndbuf);
+    if (!kad_rpc_query_find_node(kctx, &kctx->sndbuf, query, target) ||
+        !node_query_send(kctx, sock, query)) {
+        kad_rpc_query_pool_put(&pool_kad_queries, query);
+        return false;
+    }
     return true;
-
-  failed:
-    iobuf_reset(&qbuf);
-    free_safer(query);
-    return false;
 }
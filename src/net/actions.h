@@ -11,9 +11,48 @@
 #include "net/msg.h"
 #include "options.h"
 #include "utils/list.h"
+#include "utils/pool.h"
 
 enum conn_ret {CONN_OK, CONN_CLOSED};
 
+/* Pending outbound bytes above which a peer is not read from anymore, until
+   it drains its replies. */
+#define PEER_OUTQ_HIWAT (256 * 1024)
+/* Receive buffer bounds. It doubles when a recv(2) fills it, and halves after
+   PEER_RCVBUF_SHRINK_AFTER reads that used less than a quarter of it. */
+#define PEER_RCVBUF_MIN          (4 * 1024)
+#define PEER_RCVBUF_MAX          (256 * 1024)
+#define PEER_RCVBUF_SHRINK_AFTER 16
+/* Bulk content written per flush, so that other peers get their turn. */
+#define PEER_BULK_BURST          (1024 * 1024)
+/* Initial length of the fd index, doubled as needed. */
+#define PEER_INDEX_LEN_INITIAL   64
+
+/**
+ * Content sent with sendfile(2), once the outbound queue is flushed up to
+ * @at. Transfer in progress while @left > 0.
+ */
+struct peer_bulk {
+    int    fd;
+    off_t  off;
+    size_t left;
+    size_t at;
+};
+
+/**
+ * Inbound BULK content is written at its carried offset into a file of @dir,
+ * named after the peer's address, so that a transfer resumed over a new
+ * connection lands in the same file. @fd is opened on the first content.
+ */
+#define PEER_BULK_SINK_PREFIX "bulk-"
+
+struct peer_bulk_sink {
+    const char *dir;
+    int         fd;
+    /* Offset field of the current message, in network order. */
+    union u64   off;
+};
+
 /**
  * A "peer" is a client/server listening on a TCP port that implements some
  * specific protocol (msg). A "node" is a client/server listening on a UDP port
@@ -26,18 +65,49 @@ struct peer {
     // used for logging = addr:port in hex
     char                    addr_str[32+1+4+1];
     struct proto_msg_parser parser;
+    struct iobuf            rcvbuf;
+    unsigned                rcvbuf_underused;
+    /* Initial storage of rcvbuf, which only goes to the heap when grown. */
+    char                    rcvbuf_inline[PEER_RCVBUF_MIN];
+    /* Outbound data not yet accepted by the socket, from outq_off. */
+    struct iobuf            outq;
+    size_t                  outq_off;
+    struct peer_bulk        bulk;
+    struct peer_bulk_sink   sink;
 };
 
+static inline size_t peer_outq_len(const struct peer *peer)
+{
+    return peer->outq.pos - peer->outq_off;
+}
+
+#define PEER_POOL_SLAB_LEN 16
+POOL_GENERATE(peer_pool, struct peer, PEER_POOL_SLAB_LEN)
+extern peer_pool pool_peers;
+/* Message data buffered by all peers. */
+extern struct proto_msg_budget peers_msg_budget;
+
 bool node_handle_data(int sock, struct kad_ctx *kctx);
-struct peer* peer_find_by_fd(struct list_item *peers, const int fd);
+struct peer* peer_find_by_fd(const int fd);
 int peer_conn_accept_all(const int listenfd, struct list_item *peers,
                          const int nfds, const struct config *conf);
 int peer_conn_handle_data(struct peer *peer, struct kad_ctx *kctx);
+int peer_conn_flush(struct peer *peer);
+bool peer_msg_send(struct peer *peer, enum proto_msg_type typ,
+                   const char *msg, union u32 msg_len);
+bool peer_bulk_send(struct peer *peer, const int fd, const off_t off,
+                    const size_t len);
 bool peer_conn_close(struct peer *peer);
 int peer_conn_close_all(struct list_item *peers);
 
-bool kad_refresh(void *data);
+bool kad_refresh(struct kad_ctx *kctx, const int sock);
+bool kad_expire(struct kad_ctx *kctx, const int sock);
+void kad_probes_send(struct kad_ctx *kctx, const int sock);
 bool kad_bootstrap(struct list_item *timer_list, const struct config *conf, struct kad_ctx *kctx, const int sock);
+bool kad_bootstrap_pace(struct list_item *timer_list, const struct config *conf, struct kad_ctx *kctx, const int sock);
+bool kad_warm_start(struct list_item *timer_list, const struct config *conf, struct kad_ctx *kctx, const int sock);
 bool node_ping(struct kad_ctx *kctx, const int sock, const struct kad_node_info node);
+bool node_find(struct kad_ctx *kctx, const int sock,
+               const struct kad_node_info node, const kad_guid *target);
 
 #endif /* ACTIONS_H */
@@ -1,4 +1,6 @@
 /* Copyright (c) 2017-2019 Foudil Brétel.  All rights reserved. */
+#include <stdarg.h>
+#include <stdio.h>
 #include <string.h>
 #include "log.h"
 #include "net/iobuf.h"
@@ -23,7 +25,14 @@ static bool iobuf_grow(struct iobuf *buf, const size_t len)
     while (capa < needed)
         capa *= IOBUF_SIZE_FACTOR;
 
-    void *realloced = realloc(buf->buf, capa);
+    void *realloced = NULL;
+    if (buf->buf && buf->buf == buf->inl) {
+        realloced = malloc(capa);
+        if (realloced)
+            memcpy(realloced, buf->buf, buf->pos);
+    }
+    else
+        realloced = realloc(buf->buf, capa);
     if (!realloced) {
         log_perror(LOG_ERR, "Failed realloc: %s.", errno);
         return false;
@@ -34,27 +43,194 @@ static bool iobuf_grow(struct iobuf *buf, const size_t len)
     return true;
 }
 
+void iobuf_init_inline(struct iobuf *buf, char *storage, const size_t len)
+{
+    *buf = (struct iobuf){
+        .buf=storage, .pos=0, .capa=len, .inl=storage, .inl_capa=len
+    };
+}
+
+/**
+ * Empties @buf and releases its storage, back to the inline storage if any.
+ * Use iobuf_clear() to keep the storage.
+ */
 void iobuf_reset(struct iobuf *buf)
 {
-    free_safer(buf->buf);
+    if (buf->buf != buf->inl)
+        free_safer(buf->buf);
+    buf->buf  = buf->inl;
     buf->pos  = 0;
-    buf->capa = 0;
+    buf->capa = buf->inl_capa;
+}
+
+/**
+ * Capacity hint: makes room for @len more bytes.
+ */
+bool iobuf_reserve(struct iobuf *buf, const size_t len)
+{
+    return buf->pos + len <= buf->capa || iobuf_grow(buf, len);
 }
 
 bool iobuf_append(struct iobuf *buf, const char *data, const size_t len)
 {
-    // log_debug("  buf_pos=%zu, len=%zu, capa=%zu", buf->pos, len, buf->capa);
     if ((buf->pos + len > buf->capa) && !iobuf_grow(buf, len))
         return false;
-    // log_debug("  buf_pos=%zu, len=%zu, capa=%zu", buf->pos, len, buf->capa);
 
     memcpy(buf->buf + buf->pos, data, len);
     buf->pos += len;
 
-    char *bufx = log_fmt_hex(LOG_DEBUG, (unsigned char*)buf->buf, buf->pos);
-    // log_debug("iobuf=%s", bufx);
-    free_safer(bufx);
+    return true;
+}
+
+/**
+ * printf(3)-like append. Mainly for text output.
+ */
+bool iobuf_appendf(struct iobuf *buf, const char *fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    int len = vsnprintf(NULL, 0, fmt, ap);
+    va_end(ap);
+    if (len < 0) {
+        log_error("Failed to format iobuf content.");
+        return false;
+    }
+
+    if ((buf->pos + len + 1 > buf->capa) && !iobuf_grow(buf, len + 1))
+        return false;
+
+    va_start(ap, fmt);
+    vsnprintf(buf->buf + buf->pos, len + 1, fmt, ap);
+    va_end(ap);
+    buf->pos += len;
+
+    return true;
+}
 
+bool iochain_ref(struct iochain *ch, const void *data, const size_t len)
+{
+    if (len == 0)
+        return true;
+    if (ch->iovcnt >= IOCHAIN_IOV_MAX) {
+        log_error("Too many fragments in iochain.");
+        return false;
+    }
+    ch->iov[ch->iovcnt++] = (struct iovec){.iov_base=(void *)data, .iov_len=len};
+    ch->len += len;
     return true;
+}
 
+/**
+ * Reserves @len bytes in the scratch area, extending the last fragment when
+ * it ends there.
+ */
+static char *iochain_scratch_take(struct iochain *ch, const size_t len)
+{
+    if (ch->scratch_pos + len > IOCHAIN_SCRATCH_LEN) {
+        log_error("Iochain scratch area full.");
+        return NULL;
+    }
+    char *p = ch->scratch + ch->scratch_pos;
+    struct iovec *last = ch->iovcnt > 0 ? &ch->iov[ch->iovcnt - 1] : NULL;
+    if (last && (char *)last->iov_base + last->iov_len == p)
+        last->iov_len += len;
+    else {
+        if (ch->iovcnt >= IOCHAIN_IOV_MAX) {
+            log_error("Too many fragments in iochain.");
+            return NULL;
+        }
+        ch->iov[ch->iovcnt++] = (struct iovec){.iov_base=p, .iov_len=len};
+    }
+    ch->scratch_pos += len;
+    ch->len += len;
+    return p;
+}
+
+bool iochain_copy(struct iochain *ch, const void *data, const size_t len)
+{
+    if (len == 0)
+        return true;
+    char *p = iochain_scratch_take(ch, len);
+    if (!p)
+        return false;
+    memcpy(p, data, len);
+    return true;
+}
+
+/**
+ * Copies small fragments, references the others.
+ */
+bool iochain_append(struct iochain *ch, const void *data, const size_t len)
+{
+    if (len < IOCHAIN_COALESCE_MAX &&
+        ch->scratch_pos + len <= IOCHAIN_SCRATCH_LEN)
+        return iochain_copy(ch, data, len);
+    return iochain_ref(ch, data, len);
+}
+
+/**
+ * printf(3)-like append, formatted into the scratch area.
+ */
+bool iochain_appendf(struct iochain *ch, const char *fmt, ...)
+{
+    size_t avail = IOCHAIN_SCRATCH_LEN - ch->scratch_pos;
+    va_list ap;
+    va_start(ap, fmt);
+    /* Room for vsnprintf()'s terminating NUL, which is not part of the
+       fragment. */
+    int len = vsnprintf(ch->scratch + ch->scratch_pos, avail, fmt, ap);
+    va_end(ap);
+    if (len < 0 || (size_t)len >= avail) {
+        log_error("Failed to format iochain content.");
+        return false;
+    }
+    return iochain_scratch_take(ch, len) != NULL;
+}
+
+/**
+ * Drops the first @len bytes of @ch, typically after a short write.
+ */
+void iochain_consume(struct iochain *ch, size_t len)
+{
+    if (len > ch->len)
+        len = ch->len;
+    ch->len -= len;
+    int i = 0;
+    while (i < ch->iovcnt && len >= ch->iov[i].iov_len)
+        len -= ch->iov[i++].iov_len;
+    if (i < ch->iovcnt) {
+        ch->iov[i].iov_base = (char *)ch->iov[i].iov_base + len;
+        ch->iov[i].iov_len -= len;
+    }
+    memmove(ch->iov, ch->iov + i, (ch->iovcnt - i) * sizeof(struct iovec));
+    ch->iovcnt -= i;
+}
+
+/**
+ * Appends the content of @ch to @out. Mainly for tests and contiguous
+ * outputs.
+ */
+bool iochain_flatten(const struct iochain *ch, struct iobuf *out)
+{
+    if (!iobuf_reserve(out, ch->len))
+        return false;
+    for (int i = 0; i < ch->iovcnt; i++)
+        if (!iobuf_append(out, ch->iov[i].iov_base, ch->iov[i].iov_len))
+            return false;
+    return true;
+}
+
+ssize_t iochain_writev(int fd, const struct iochain *ch)
+{
+    return writev(fd, ch->iov, ch->iovcnt);
+}
+
+ssize_t iochain_sendmsg(int fd, const struct iochain *ch, int flags,
+                        const struct sockaddr_storage *addr, socklen_t addr_len)
+{
+    struct msghdr msg = {
+        .msg_name=(void *)addr, .msg_namelen=addr ? addr_len : 0,
+        .msg_iov=(struct iovec *)ch->iov, .msg_iovlen=ch->iovcnt,
+    };
+    return sendmsg(fd, &msg, flags);
 }
@@ -4,17 +4,75 @@
 
 #include <stdbool.h>
 #include <stdlib.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
 
 #define IOBUF_SIZE_INITIAL 512
 #define IOBUF_SIZE_FACTOR  2
 
+/**
+ * When @inl is set, it is used as initial storage, and the buffer only
+ * spills to the heap when outgrowing it. See iobuf_init_inline().
+ */
 struct iobuf {
-    char     *buf;
-    size_t    pos;
-    unsigned  capa;
+    char         *buf;
+    size_t        pos;
+    unsigned      capa;
+    char         *inl;
+    unsigned      inl_capa;
 };
 
+void iobuf_init_inline(struct iobuf *buf, char *storage, const size_t len);
 void iobuf_reset(struct iobuf *buf);
+bool iobuf_reserve(struct iobuf *buf, const size_t len);
 bool iobuf_append(struct iobuf *buf, const char *data, const size_t len);
+bool iobuf_appendf(struct iobuf *buf, const char *fmt, ...);
+
+/**
+ * Empties @buf, keeping its storage for reuse.
+ */
+static inline void iobuf_clear(struct iobuf *buf)
+{
+    buf->pos = 0;
+}
+
+/**
+ * Scatter-gather output: a chain of fragments handed as is to writev(2) or
+ * sendmsg(2).
+ *
+ * Fragments either reference external memory, which must stay valid until
+ * the chain is sent, or are copied into the chain's scratch area. Small
+ * fragments are copied, and contiguous copies are coalesced into a single
+ * fragment. As fragments may point into the chain itself, a chain must not
+ * be moved.
+ */
+#define IOCHAIN_IOV_MAX      64
+#define IOCHAIN_SCRATCH_LEN  1024
+#define IOCHAIN_COALESCE_MAX 16  /* fragments shorter than this are copied */
+
+struct iochain {
+    struct iovec iov[IOCHAIN_IOV_MAX];
+    int          iovcnt;
+    size_t       len;          /* total bytes */
+    char         scratch[IOCHAIN_SCRATCH_LEN];
+    size_t       scratch_pos;
+};
+
+bool iochain_ref(struct iochain *ch, const void *data, const size_t len);
+bool iochain_copy(struct iochain *ch, const void *data, const size_t len);
+bool iochain_append(struct iochain *ch, const void *data, const size_t len);
+bool iochain_appendf(struct iochain *ch, const char *fmt, ...);
+void iochain_consume(struct iochain *ch, size_t len);
+bool iochain_flatten(const struct iochain *ch, struct iobuf *out);
+ssize_t iochain_writev(int fd, const struct iochain *ch);
+ssize_t iochain_sendmsg(int fd, const struct iochain *ch, int flags,
+                        const struct sockaddr_storage *addr, socklen_t addr_len);
+
+static inline void iochain_clear(struct iochain *ch)
+{
+    ch->iovcnt = 0;
+    ch->len = 0;
+    ch->scratch_pos = 0;
+}
 
 #endif /* IOBUF_H */
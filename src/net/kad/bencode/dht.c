@@ -76,6 +76,11 @@ bool benc_encode_dht(struct iobuf *buf, const struct kad_dht_encoded *dht)
     char tmps[2048];
     size_t tmps_len = 0;
 
+    /* Capacity hint: a compact node info is at most "38:" followed by
+       KAD_GUID_SPACE_IN_BYTES + 18 bytes. */
+    if (!iobuf_reserve(buf, 64 + dht->nodes_len * (3 + KAD_GUID_SPACE_IN_BYTES + 18)))
+        return false;
+
     iobuf_append(buf, "d", 1);
 
     // id
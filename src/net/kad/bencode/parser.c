@@ -1,5 +1,6 @@
 /* Copyright (c) 2017-2019 Foudil Brétel.  All rights reserved. */
 #include <ctype.h>
+#include <errno.h>
 #include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -12,6 +13,14 @@
 #define BENC_NODES_MAX 4096
 
 /* https://github.com/willemt/heapless-bencode/blob/master/bencode.c */
+static bool benc_truncated(struct benc_parser *p)
+{
+    sprintf(p->err_msg, "Truncated bencode at %zu.",
+            (size_t)POINTER_OFFSET(p->beg, p->cur));
+    p->err = true;
+    return false;
+}
+
 static bool benc_extract_int(struct benc_parser *p, struct benc_literal *lit)
 {
     lit->t = BENC_LITERAL_TYPE_INT;
@@ -19,12 +28,14 @@ static bool benc_extract_int(struct benc_parser *p, struct benc_literal *lit)
     int sign = 1;
 
     p->cur++;  // eat up 'i'
-    if (*p->cur == '-') {
+    if (p->cur < p->end && *p->cur == '-') {
         sign = -1;
         p->cur++;
     }
 
     do {
+        if (p->cur == p->end)
+            return benc_truncated(p);
         if (!isdigit(*p->cur)) {
             sprintf(p->err_msg, "Invalid character in bencode at %zu.",
                     (size_t)POINTER_OFFSET(p->beg, p->cur));
@@ -46,7 +57,9 @@ static bool benc_extract_int(struct benc_parser *p, struct benc_literal *lit)
 
         lit->i = val_tmp;
         p->cur++;
-    } while (*p->cur != 'e');
+    } while (p->cur < p->end && *p->cur != 'e');
+    if (p->cur == p->end)
+        return benc_truncated(p);
     p->cur++;  // eat up 'e'
 
     lit->i *= sign;
@@ -59,6 +72,8 @@ static bool benc_extract_str(struct benc_parser *p, struct benc_literal *lit)
     lit->t = BENC_LITERAL_TYPE_STR;
     lit->s.len = 0;
     do {
+        if (p->cur == p->end)
+            return benc_truncated(p);
         if (!isdigit(*p->cur)) {
             sprintf(p->err_msg, "Invalid character in bencode at %zu.",
                     (size_t)POINTER_OFFSET(p->beg, p->cur));
@@ -68,17 +83,20 @@ static bool benc_extract_str(struct benc_parser *p, struct benc_literal *lit)
 
         lit->s.len *= 10;
         lit->s.len += *p->cur - '0';
+        if (lit->s.len > BENC_PARSER_STR_LEN_MAX) {
+            sprintf(p->err_msg, "String too long at %zu.",
+                    (size_t)POINTER_OFFSET(p->beg, p->cur));
+            p->err = true;
+            return false;
+        }
         p->cur++;
-    } while (*p->cur != ':');
-
-    if (lit->s.len > BENC_PARSER_STR_LEN_MAX) {
-        sprintf(p->err_msg, "String too long at %zu.",
-                (size_t)POINTER_OFFSET(p->beg, p->cur));
-        p->err = true;
-        return false;
-    }
+    } while (p->cur < p->end && *p->cur != ':');
+    if (p->cur == p->end)
+        return benc_truncated(p);
 
     p->cur++;
+    if (lit->s.len > (size_t)(p->end - p->cur))
+        return benc_truncated(p);
     memcpy(lit->s.p, p->cur, lit->s.len);
     p->cur += lit->s.len;
 
@@ -197,6 +215,28 @@ void log_debug_literal(const struct benc_literal *lit)
 }
 */
 
+/**
+ * Allocates and zeroes @repr's storage from @arena, like BENC_REPR_DECL_INIT
+ * does on the stack.
+ */
+bool benc_repr_arena_init(struct benc_repr *repr, struct arena *arena,
+                          const size_t max_literals, const size_t max_nodes)
+{
+    repr->lit = arena_alloc(arena, max_literals * sizeof(struct benc_literal));
+    repr->n = arena_alloc(arena, max_nodes * sizeof(struct benc_node));
+    if (!repr->lit || !repr->n) {
+        log_perror(LOG_ERR, "Failed malloc: %s.", errno);
+        return false;
+    }
+    memset(repr->lit, 0, max_literals * sizeof(struct benc_literal));
+    memset(repr->n, 0, max_nodes * sizeof(struct benc_node));
+    repr->lit_len = max_literals;
+    repr->lit_off = 0;
+    repr->n_len = max_nodes;
+    repr->n_off = 0;
+    return true;
+}
+
 struct benc_node*
 benc_node_find_key(const struct benc_node *dict,
                    const char key[], const size_t key_len)
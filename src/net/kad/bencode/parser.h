@@ -4,6 +4,7 @@
 
 #include <stddef.h>
 #include <stdbool.h>
+#include "utils/arena.h"
 
 #define BENC_PARSER_STACK_MAX   32
 #define BENC_PARSER_STR_LEN_MAX 256
@@ -105,6 +106,8 @@ struct benc_parser {
     size_t            stack_off;
 };
 
+bool benc_repr_arena_init(struct benc_repr *repr, struct arena *arena,
+                          const size_t max_literals, const size_t max_nodes);
 struct benc_node* benc_node_find_key(const struct benc_node *dict,
                                      const char key[], const size_t key_len);
 
@@ -112,7 +115,7 @@ struct benc_node* benc_node_find_key(const struct benc_node *dict,
  * Creates a tree-like representation of a bencode object from @buf.
  *
  * @param repr will hold the resulting bencode object. Use BENC_REPR_DECL_INIT
- *             to declare and initialize.
+ *             to declare and initialize, or benc_repr_arena_init().
  */
 bool benc_parse(struct benc_repr *repr, const char buf[], const size_t slen);
 
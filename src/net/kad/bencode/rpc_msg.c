@@ -93,9 +93,17 @@ benc_read_guid_from_key(kad_guid *guid,
  * "Compact node info" is a 26-byte string (20-byte node-id + 6-byte "Compact
  * IP-address/port info" (4-byte IP (16-byte for ip6) + 2-byte port all in
  * network byte order))".
+ *
+ * The bencode representation is allocated from @arena, which the caller
+ * resets.
  */
-bool benc_decode_rpc_msg(struct kad_rpc_msg *msg, const char buf[], const size_t slen) {
-    BENC_REPR_DECL_INIT(repr, KAD_RPC_MSG_LITERAL_MAX, KAD_RPC_MSG_NODES_MAX);
+bool benc_decode_rpc_msg(struct kad_rpc_msg *msg, const char buf[], const size_t slen,
+                         struct arena *arena) {
+    struct benc_repr repr;
+    if (!benc_repr_arena_init(&repr, arena, KAD_RPC_MSG_LITERAL_MAX,
+                              KAD_RPC_MSG_NODES_MAX)) {
+        return false;
+    }
 
     if (!benc_parse(&repr, buf, slen)) {
         return false;
@@ -222,50 +230,43 @@ bool benc_decode_rpc_msg(struct kad_rpc_msg *msg, const char buf[], const size_t
 
 /**
  * Straight-forward serialization. NO VALIDATION is performed.
+ *
+ * Ids are referenced, not copied: @msg must outlive @ch.
  */
 // FIXME dict entries supposed to be sorted when serialized. Basically we just
 // need to reverse the current order.
-bool benc_encode_rpc_msg(struct iobuf *buf, const struct kad_rpc_msg *msg)
+bool benc_encode_rpc_msg(struct iochain *ch, const struct kad_rpc_msg *msg)
 {
-    char tmps[2048];
-    size_t tmps_len = 0;
+    bool ok = true;
 
     /* we avoid the burden of looking up into kad_rpc_msg_key_names just for single chars. */
-    sprintf(tmps, "d1:t%d:", KAD_RPC_MSG_TX_ID_LEN);
-    tmps_len += strlen(tmps);
-    memcpy(tmps + tmps_len, msg->tx_id.bytes, KAD_RPC_MSG_TX_ID_LEN);
-    tmps_len += KAD_RPC_MSG_TX_ID_LEN;
-    iobuf_append(buf, tmps, tmps_len); // tx
-    iobuf_append(buf, "1:y1:", 5); // type
-    iobuf_append(buf, lookup_by_id(kad_rpc_type_names, msg->type), 1);
+    ok &= iochain_appendf(ch, "d1:t%d:", KAD_RPC_MSG_TX_ID_LEN);
+    ok &= iochain_append(ch, msg->tx_id.bytes, KAD_RPC_MSG_TX_ID_LEN); // tx
+    ok &= iochain_copy(ch, "1:y1:", 5); // type
+    ok &= iochain_copy(ch, lookup_by_id(kad_rpc_type_names, msg->type), 1);
 
     if (msg->type == KAD_RPC_TYPE_ERROR) {
-        sprintf(tmps, "1:eli%llue%zu:%se", msg->err_code,
-                strlen(msg->err_msg), msg->err_msg);
-        iobuf_append(buf, tmps, strlen(tmps));
+        ok &= iochain_appendf(ch, "1:eli%llue%zu:", msg->err_code,
+                              strlen(msg->err_msg));
+        ok &= iochain_append(ch, msg->err_msg, strlen(msg->err_msg));
+        ok &= iochain_copy(ch, "e", 1);
     }
     else {
 
         if (msg->type == KAD_RPC_TYPE_QUERY) {
             const char * meth_name = lookup_by_id(kad_rpc_meth_names, msg->meth);
-            sprintf(tmps, "1:q%zu:%s", strlen(meth_name), meth_name);
-            iobuf_append(buf, tmps, strlen(tmps));
+            ok &= iochain_appendf(ch, "1:q%zu:%s", strlen(meth_name), meth_name);
 
             if (msg->meth == KAD_RPC_METH_PING) {
-                iobuf_append(buf, "1:ad2:id", 8);
+                ok &= iochain_copy(ch, "1:ad2:id", 8);
             }
             else if (msg->meth == KAD_RPC_METH_FIND_NODE) {
                 const char *field_target = lookup_by_id(
                     kad_rpc_msg_key_names, KAD_RPC_MSG_KEY_TARGET);
-                sprintf(tmps, "1:ad%zu:%s%d:", strlen(field_target),
-                        field_target, KAD_GUID_SPACE_IN_BYTES);
-                tmps_len = strlen(tmps);
-                memcpy(tmps + tmps_len, (char*)msg->target.bytes,
-                       KAD_GUID_SPACE_IN_BYTES);
-                tmps_len += KAD_GUID_SPACE_IN_BYTES;
-                memcpy(tmps + tmps_len, "2:id", 4);
-                tmps_len += 4;
-                iobuf_append(buf, tmps, tmps_len); // target
+                ok &= iochain_appendf(ch, "1:ad%zu:%s%d:", strlen(field_target),
+                                      field_target, KAD_GUID_SPACE_IN_BYTES);
+                ok &= iochain_ref(ch, msg->target.bytes, KAD_GUID_SPACE_IN_BYTES); // target
+                ok &= iochain_copy(ch, "2:id", 4);
             }
             else {
                 log_error("Unsupported msg method while encoding.");
@@ -276,17 +277,16 @@ bool benc_encode_rpc_msg(struct iobuf *buf, const struct kad_rpc_msg *msg)
         else if (msg->type == KAD_RPC_TYPE_RESPONSE) {
 
             if (msg->meth == KAD_RPC_METH_PING) {
-                iobuf_append(buf, "1:rd2:id", 8);
+                ok &= iochain_copy(ch, "1:rd2:id", 8);
             }
             else if (msg->meth == KAD_RPC_METH_FIND_NODE) {
                 const char *field_nodes = lookup_by_id(
                     kad_rpc_msg_key_names, KAD_RPC_MSG_KEY_NODES);
-                sprintf(tmps, "1:rd%zu:%sl", strlen(field_nodes), field_nodes);
-                iobuf_append(buf, tmps, strlen(tmps));
-                if (!benc_write_nodes(buf, msg->nodes, msg->nodes_len)) {
+                ok &= iochain_appendf(ch, "1:rd%zu:%sl", strlen(field_nodes), field_nodes);
+                if (!benc_chain_nodes(ch, msg->nodes, msg->nodes_len)) {
                     return false;
                 }
-                iobuf_append(buf, "e2:id", 5);
+                ok &= iochain_copy(ch, "e2:id", 5);
             }
             else {
                 log_error("Unsupported msg method while encoding.");
@@ -299,16 +299,12 @@ bool benc_encode_rpc_msg(struct iobuf *buf, const struct kad_rpc_msg *msg)
             return false;
         }
 
-        sprintf(tmps, "%d:", KAD_GUID_SPACE_IN_BYTES);
-        tmps_len = strlen(tmps);
-        memcpy(tmps + tmps_len, (char*)msg->node_id.bytes,
-               KAD_GUID_SPACE_IN_BYTES);
-        tmps_len += KAD_GUID_SPACE_IN_BYTES;
-        iobuf_append(buf, tmps, tmps_len); // node_id
+        ok &= iochain_appendf(ch, "%d:", KAD_GUID_SPACE_IN_BYTES);
+        ok &= iochain_ref(ch, msg->node_id.bytes, KAD_GUID_SPACE_IN_BYTES); // node_id
 
-        iobuf_append(buf, "e", 1);
+        ok &= iochain_copy(ch, "e", 1);
     }
 
-    iobuf_append(buf, "e", 1);
-    return true;
+    ok &= iochain_copy(ch, "e", 1);
+    return ok;
 }
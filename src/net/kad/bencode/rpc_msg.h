@@ -8,7 +8,8 @@
 #include "net/iobuf.h"
 #include "net/kad/rpc.h"
 
-bool benc_decode_rpc_msg(struct kad_rpc_msg *msg, const char buf[], const size_t slen);
-bool benc_encode_rpc_msg(struct iobuf *buf, const struct kad_rpc_msg *msg);
+bool benc_decode_rpc_msg(struct kad_rpc_msg *msg, const char buf[], const size_t slen,
+                         struct arena *arena);
+bool benc_encode_rpc_msg(struct iochain *ch, const struct kad_rpc_msg *msg);
 
 #endif /* BENCODE_RPC_MSG_H */
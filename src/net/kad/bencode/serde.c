@@ -176,29 +176,37 @@ int benc_read_nodes_from_key(struct kad_node_info nodes[], const size_t nodes_le
     return nnodes;
 }
 
+/**
+ * Writes the "Compact IP-address/port info" of @ss into @compact. Returns its
+ * length, 0 for unsupported address families.
+ */
+unsigned
+benc_compact_addr(unsigned char compact[], const struct sockaddr_storage *ss)
+{
+    if (ss->ss_family == AF_INET) {
+        const struct sockaddr_in *sa = (struct sockaddr_in *)ss;
+        memcpy(compact, (unsigned char*)&sa->sin_addr, BENC_IP4_ADDR_LEN_IN_BYTES);
+        memcpy(compact + BENC_IP4_ADDR_LEN_IN_BYTES, (unsigned char*)&sa->sin_port, 2);
+        return BENC_IP4_ADDR_LEN_IN_BYTES + 2;
+    }
+    else if (ss->ss_family == AF_INET6) {
+        const struct sockaddr_in6 *sa = (struct sockaddr_in6 *)ss;
+        memcpy(compact, (unsigned char*)&sa->sin6_addr, BENC_IP6_ADDR_LEN_IN_BYTES);
+        memcpy(compact + BENC_IP6_ADDR_LEN_IN_BYTES, (unsigned char*)&sa->sin6_port, 2);
+        return BENC_IP6_ADDR_LEN_IN_BYTES + 2;
+    }
+    log_error("Unsupported socket address family (%d).", ss->ss_family);
+    return 0;
+}
+
 bool benc_write_nodes(struct iobuf *buf, const struct kad_node_info nodes[], size_t nodes_len)
 {
     char tmps[64];
     for (size_t i = 0; i < nodes_len; i++) {
-        unsigned compact_len = 0;
-        unsigned char compact[21] = {0};
-        const struct sockaddr_storage *ss = &nodes[i].addr;
-        if (ss->ss_family == AF_INET) {
-            compact_len = 6;
-            const struct sockaddr_in *sa = (struct sockaddr_in *)ss;
-            memcpy(compact, (unsigned char*)&sa->sin_addr, 4);
-            memcpy(compact + 4, (unsigned char*)&sa->sin_port, 2);
-        }
-        else if (ss->ss_family == AF_INET6) {
-            compact_len = 18;
-            const struct sockaddr_in6 *sa = (struct sockaddr_in6 *)ss;
-            memcpy(compact, (unsigned char*)&sa->sin6_addr, 16);
-            memcpy(compact + 16, (unsigned char*)&sa->sin6_port, 2);
-        }
-        else {
-            log_error("Unsupported socket address family (%d).", ss->ss_family);
+        unsigned char compact[BENC_IP6_ADDR_LEN_IN_BYTES + 2] = {0};
+        unsigned compact_len = benc_compact_addr(compact, &nodes[i].addr);
+        if (!compact_len)
             return false;
-        }
 
         sprintf(tmps, "%u:", KAD_GUID_SPACE_IN_BYTES + compact_len);
         size_t tmps_len = strlen(tmps);
@@ -210,3 +218,24 @@ bool benc_write_nodes(struct iobuf *buf, const struct kad_node_info nodes[], siz
 
     return true;
 }
+
+/**
+ * Like benc_write_nodes(), but node ids are referenced, not copied: @nodes
+ * must outlive @ch.
+ */
+bool benc_chain_nodes(struct iochain *ch, const struct kad_node_info nodes[], size_t nodes_len)
+{
+    for (size_t i = 0; i < nodes_len; i++) {
+        unsigned char compact[BENC_IP6_ADDR_LEN_IN_BYTES + 2] = {0};
+        unsigned compact_len = benc_compact_addr(compact, &nodes[i].addr);
+        if (!compact_len)
+            return false;
+
+        if (!iochain_appendf(ch, "%u:", KAD_GUID_SPACE_IN_BYTES + compact_len) ||
+            !iochain_ref(ch, nodes[i].id.bytes, KAD_GUID_SPACE_IN_BYTES) ||
+            !iochain_copy(ch, compact, compact_len))
+            return false;
+    }
+
+    return true;
+}
@@ -30,6 +30,9 @@ int benc_read_nodes_from_key(struct kad_node_info nodes[], const size_t nodes_le
                              const lookup_entry k_names[],
                              const int k1, const int k2);
 bool benc_read_guid(kad_guid *id, const struct benc_literal *lit);
+bool benc_read_single_addr(struct sockaddr_storage *addr, char *p, size_t len);
+unsigned benc_compact_addr(unsigned char compact[], const struct sockaddr_storage *ss);
 bool benc_write_nodes(struct iobuf *buf, const struct kad_node_info nodes[], size_t nodes_len);
+bool benc_chain_nodes(struct iochain *ch, const struct kad_node_info nodes[], size_t nodes_len);
 
 #endif /* BENCODE_KAD_H */
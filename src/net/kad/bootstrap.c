@@ -0,0 +1,542 @@
+/* Copyright (c) 2017-2019 Foudil Brétel.  All rights reserved. */
+#include <arpa/inet.h>
+#include <ctype.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include "log.h"
+#include "metrics.h"
+#include "net/socket.h"
+#include "net/kad/bencode/parser.h"
+#include "net/kad/bencode/serde.h"
+#include "net/kad/bootstrap.h"
+
+/* Longest bencode string length accepted, entries are much shorter. */
+#define KAD_BOOTSTRAP_STR_LEN_MAX (1 << 20)
+
+/**
+ * FNV-1a over the address and port, seeded, with the splitmix64 finalizer
+ * for an even spread of the keys.
+ */
+static uint64_t kad_bootstrap_key(const struct sockaddr_storage *ss,
+                                  const uint64_t seed)
+{
+    unsigned char bytes[1 + 16 + 2];
+    size_t len = 0;
+    bytes[len++] = (unsigned char)ss->ss_family;
+    if (ss->ss_family == AF_INET) {
+        const struct sockaddr_in *sa = (const struct sockaddr_in *)ss;
+        memcpy(bytes + len, &sa->sin_addr, 4);
+        len += 4;
+        memcpy(bytes + len, &sa->sin_port, 2);
+        len += 2;
+    }
+    else {
+        const struct sockaddr_in6 *sa = (const struct sockaddr_in6 *)ss;
+        memcpy(bytes + len, &sa->sin6_addr, 16);
+        len += 16;
+        memcpy(bytes + len, &sa->sin6_port, 2);
+        len += 2;
+    }
+
+    uint64_t h = 0xcbf29ce484222325ULL ^ seed;
+    for (size_t i = 0; i < len; i++) {
+        h ^= bytes[i];
+        h *= 0x100000001b3ULL;
+    }
+    h ^= h >> 30;
+    h *= 0xbf58476d1ce4e5b9ULL;
+    h ^= h >> 27;
+    h *= 0x94d049bb133111ebULL;
+    h ^= h >> 31;
+    return h;
+}
+
+static bool kad_bootstrap_addr_eq(const struct sockaddr_storage *a,
+                                  const struct sockaddr_storage *b)
+{
+    if (a->ss_family != b->ss_family)
+        return false;
+    return a->ss_family == AF_INET ?
+        sockaddr_storage_cmp4(a, b) : sockaddr_storage_cmp6(a, b);
+}
+
+/**
+ * Offers @ss to the sample: kept if its key is among the smallest.
+ */
+static void kad_bootstrap_offer(struct kad_bootstrap_sample *sample,
+                                const struct sockaddr_storage *ss)
+{
+    sample->read++;
+    uint64_t key = kad_bootstrap_key(ss, sample->seed);
+    if (sample->len == sample->max && key > sample->keys[sample->len - 1])
+        return;
+
+    size_t lo = 0, hi = sample->len;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (sample->keys[mid] < key)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    for (size_t i = lo; i < sample->len && sample->keys[i] == key; i++) {
+        if (kad_bootstrap_addr_eq(&sample->addrs[i], ss)) {
+            sample->dups++;
+            return;
+        }
+    }
+    if (lo == sample->max)
+        return;
+
+    if (sample->len == sample->max)
+        sample->len--;
+    memmove(&sample->keys[lo + 1], &sample->keys[lo],
+            (sample->len - lo) * sizeof(*sample->keys));
+    memmove(&sample->addrs[lo + 1], &sample->addrs[lo],
+            (sample->len - lo) * sizeof(*sample->addrs));
+    sample->keys[lo] = key;
+    sample->addrs[lo] = *ss;
+    sample->len++;
+}
+
+static bool kad_bootstrap_parse_port(in_port_t *port, const char str[])
+{
+    char *end = NULL;
+    errno = 0;
+    long val = strtol(str, &end, 10);
+    if (errno != 0 || end == str || *end != '\0' || val < 1 || val > 65535)
+        return false;
+    *port = htons((uint16_t)val);
+    return true;
+}
+
+/**
+ * Parses a text line, trimmed. @ss's family is left unspecified for blank
+ * lines and comments.
+ */
+static bool kad_bootstrap_parse_line(struct sockaddr_storage *ss, char line[])
+{
+    memset(ss, 0, sizeof(*ss));
+    char *host = line;
+    while (isspace((unsigned char)*host))
+        host++;
+    char *end = host + strlen(host);
+    while (end > host && isspace((unsigned char)end[-1]))
+        *--end = '\0';
+    if (*host == '\0' || *host == '#')
+        return true;
+
+    char *port = NULL;
+    if (*host == '[') {
+        host++;
+        char *close = strchr(host, ']');
+        if (!close)
+            return false;
+        *close = '\0';
+        port = close + 1;
+        if (*port == ':')
+            port++;
+    }
+    else if ((port = strpbrk(host, " \t"))) {
+        *port++ = '\0';
+    }
+    else if ((port = strchr(host, ':')) && !strchr(port + 1, ':')) {
+        *port++ = '\0';
+    }
+    else
+        return false;
+    while (isspace((unsigned char)*port))
+        port++;
+
+    struct sockaddr_in *sa = (struct sockaddr_in *)ss;
+    struct sockaddr_in6 *sa6 = (struct sockaddr_in6 *)ss;
+    if (inet_pton(AF_INET, host, &sa->sin_addr) == 1) {
+        sa->sin_family = AF_INET;
+        return kad_bootstrap_parse_port(&sa->sin_port, port);
+    }
+    if (inet_pton(AF_INET6, host, &sa6->sin6_addr) == 1) {
+        sa6->sin6_family = AF_INET6;
+        return kad_bootstrap_parse_port(&sa6->sin6_port, port);
+    }
+    return false;
+}
+
+static void kad_bootstrap_line(struct kad_bootstrap_reader *reader)
+{
+    reader->buf[reader->buf_len] = '\0';
+    reader->buf_len = 0;
+    struct sockaddr_storage ss;
+    if (!kad_bootstrap_parse_line(&ss, reader->buf))
+        reader->sample.invalid++;
+    else if (ss.ss_family != AF_UNSPEC)
+        kad_bootstrap_offer(&reader->sample, &ss);
+}
+
+static void kad_bootstrap_str(struct kad_bootstrap_reader *reader)
+{
+    struct sockaddr_storage ss = {0};
+    if (reader->str_len != BENC_IP4_ADDR_LEN_IN_BYTES + 2 &&
+        reader->str_len != BENC_IP6_ADDR_LEN_IN_BYTES + 2)
+        reader->sample.invalid++;
+    else if (benc_read_single_addr(&ss, reader->buf, reader->str_len))
+        kad_bootstrap_offer(&reader->sample, &ss);
+    reader->str_len = 0;
+    reader->buf_len = 0;
+}
+
+/**
+ * Initializes @reader to sample up to @addrs_len addresses into @addrs.
+ */
+bool kad_bootstrap_reader_init(struct kad_bootstrap_reader *reader,
+                               struct sockaddr_storage addrs[],
+                               const size_t addrs_len, const uint64_t seed)
+{
+    memset(reader, 0, sizeof(*reader));
+    if (addrs_len == 0) {
+        log_error("Empty bootstrap sample.");
+        return false;
+    }
+    reader->sample.keys = malloc(addrs_len * sizeof(*reader->sample.keys));
+    if (!reader->sample.keys) {
+        log_perror(LOG_ERR, "Failed malloc: %s.", errno);
+        return false;
+    }
+    reader->sample.addrs = addrs;
+    reader->sample.max = addrs_len;
+    reader->sample.seed = seed;
+    return true;
+}
+
+void kad_bootstrap_reader_terminate(struct kad_bootstrap_reader *reader)
+{
+    free(reader->sample.keys);
+    reader->sample.keys = NULL;
+}
+
+/**
+ * Feeds a chunk of the list to @reader. The format is guessed from the first
+ * non-blank character: 'l' for bencode, text otherwise.
+ */
+bool kad_bootstrap_read(struct kad_bootstrap_reader *reader,
+                        const char buf[], const size_t len)
+{
+    for (size_t i = 0; i < len; i++) {
+        const char c = buf[i];
+        switch (reader->stage) {
+        case KAD_BOOTSTRAP_STAGE_NONE:
+            if (isspace((unsigned char)c))
+                break;
+            if (c == 'l') {
+                reader->fmt = KAD_BOOTSTRAP_FMT_BENC;
+                reader->stage = KAD_BOOTSTRAP_STAGE_LEN;
+                break;
+            }
+            reader->fmt = KAD_BOOTSTRAP_FMT_TEXT;
+            reader->stage = KAD_BOOTSTRAP_STAGE_LINE;
+            /* fall through */
+        case KAD_BOOTSTRAP_STAGE_LINE:
+            if (c == '\n')
+                kad_bootstrap_line(reader);
+            else if (reader->buf_len < KAD_BOOTSTRAP_LINE_MAX - 1)
+                reader->buf[reader->buf_len++] = c;
+            else {
+                reader->sample.invalid++;
+                reader->buf_len = 0;
+                reader->stage = KAD_BOOTSTRAP_STAGE_SKIP;
+            }
+            break;
+
+        case KAD_BOOTSTRAP_STAGE_SKIP:
+            if (c == '\n')
+                reader->stage = KAD_BOOTSTRAP_STAGE_LINE;
+            break;
+
+        case KAD_BOOTSTRAP_STAGE_LEN:
+            if (c >= '0' && c <= '9') {
+                reader->str_len = reader->str_len * 10 + (c - '0');
+                reader->buf_len++;
+                if (reader->str_len > KAD_BOOTSTRAP_STR_LEN_MAX)
+                    goto invalid;
+            }
+            else if (c == ':' && reader->buf_len > 0) {
+                reader->buf_len = 0;
+                reader->stage = KAD_BOOTSTRAP_STAGE_STR;
+                if (reader->str_len == 0) {
+                    kad_bootstrap_str(reader);
+                    reader->stage = KAD_BOOTSTRAP_STAGE_LEN;
+                }
+            }
+            else if (c == 'e' && reader->buf_len == 0)
+                reader->stage = KAD_BOOTSTRAP_STAGE_END;
+            else
+                goto invalid;
+            break;
+
+        case KAD_BOOTSTRAP_STAGE_STR:
+            if (reader->buf_len < KAD_BOOTSTRAP_LINE_MAX)
+                reader->buf[reader->buf_len] = c;
+            reader->buf_len++;
+            if (reader->buf_len == reader->str_len) {
+                kad_bootstrap_str(reader);
+                reader->stage = KAD_BOOTSTRAP_STAGE_LEN;
+            }
+            break;
+
+        case KAD_BOOTSTRAP_STAGE_END:
+            if (!isspace((unsigned char)c))
+                goto invalid;
+            break;
+
+        default:
+            return false;
+        }
+    }
+    return true;
+
+  invalid:
+    log_error("Invalid bencoded bootstrap list.");
+    reader->stage = KAD_BOOTSTRAP_STAGE_ERROR;
+    return false;
+}
+
+/**
+ * Signals the end of the list to @reader.
+ */
+bool kad_bootstrap_read_end(struct kad_bootstrap_reader *reader)
+{
+    switch (reader->stage) {
+    case KAD_BOOTSTRAP_STAGE_NONE:
+    case KAD_BOOTSTRAP_STAGE_END:
+    case KAD_BOOTSTRAP_STAGE_SKIP:
+        return true;
+    case KAD_BOOTSTRAP_STAGE_LINE:
+        if (reader->buf_len > 0)
+            kad_bootstrap_line(reader);
+        return true;
+    case KAD_BOOTSTRAP_STAGE_LEN:
+    case KAD_BOOTSTRAP_STAGE_STR:
+        log_error("Truncated bencoded bootstrap list.");
+        return false;
+    default:
+        return false;
+    }
+}
+
+/**
+ * Reads the bootstrap list at @path, sampling up to @nodes_len distinct
+ * addresses into @nodes.
+ *
+ * Returns the number of nodes sampled, or -1 on failure.
+ */
+int kad_read_bootstrap_nodes(struct sockaddr_storage nodes[], size_t nodes_len,
+                             const char path[])
+{
+    FILE *fp = fopen(path, "rb");
+    if (!fp) {
+        log_perror(LOG_ERR, "Failed fopen: %s.", errno);
+        return -1;
+    }
+    log_debug("Reading bootstrap nodes from file '%s'.", path);
+
+    int nnodes = -1;
+    struct kad_bootstrap_reader reader;
+    uint64_t seed = ((uint64_t)random() << 32) ^ (uint64_t)random();
+    if (!kad_bootstrap_reader_init(&reader, nodes, nodes_len, seed))
+        goto cleanup;
+
+    char chunk[KAD_BOOTSTRAP_CHUNK_LEN];
+    size_t len;
+    while ((len = fread(chunk, 1, sizeof(chunk), fp)) > 0) {
+        if (!kad_bootstrap_read(&reader, chunk, len))
+            goto terminate;
+    }
+    if (ferror(fp)) {
+        log_perror(LOG_ERR, "Failed fread: %s.", errno);
+        goto terminate;
+    }
+    if (!kad_bootstrap_read_end(&reader))
+        goto terminate;
+
+    nnodes = reader.sample.len;
+    log_debug("Bootstrap nodes: %zu read, %zu duplicates, %zu invalid.",
+              reader.sample.read, reader.sample.dups, reader.sample.invalid);
+    if (reader.sample.invalid > 0)
+        log_warning("Ignored %zu invalid bootstrap entries.",
+                    reader.sample.invalid);
+
+  terminate:
+    kad_bootstrap_reader_terminate(&reader);
+  cleanup:
+    fclose(fp);
+    if (nnodes < 0)
+        log_error("Decoding of bootstrap nodes file (%s) failed.", path);
+    return nnodes;
+}
+
+/**
+ * Sets the seeds of the scheduler, pinged at @rate per second with at most
+ * @inflight_max pings in flight. With @warm, the seeds are the nodes of a
+ * loaded table, which are all validated regardless of the table's fill.
+ */
+bool kad_bootstrap_sched_init(struct kad_bootstrap_sched *sched,
+                              const struct sockaddr_storage addrs[],
+                              const size_t addrs_len, const unsigned rate,
+                              const size_t inflight_max, const bool warm,
+                              const long long now)
+{
+    memset(sched, 0, sizeof(*sched));
+    sched->ready_ms = -1;
+    sched->warm = warm;
+    if (addrs_len == 0)
+        return true;
+
+    sched->seeds = calloc(addrs_len, sizeof(*sched->seeds));
+    if (!sched->seeds) {
+        log_perror(LOG_ERR, "Failed calloc: %s.", errno);
+        return false;
+    }
+    for (size_t i = 0; i < addrs_len; i++) {
+        sched->seeds[i].addr = addrs[i];
+        sched->seeds[i].due_ms = now;
+    }
+    sched->seeds_len = addrs_len;
+    sched->pending = addrs_len;
+    sched->inflight_max = inflight_max;
+    sched->target = KAD_BOOTSTRAP_TARGET;
+    sched->rate = rate;
+    sched->credit = 1000;
+    sched->credit_ms = now;
+    sched->start_ms = now;
+    sched->active = true;
+    return true;
+}
+
+void kad_bootstrap_sched_terminate(struct kad_bootstrap_sched *sched)
+{
+    free(sched->seeds);
+    sched->seeds = NULL;
+    sched->seeds_len = 0;
+    sched->active = false;
+}
+
+static void kad_bootstrap_sched_ready(struct kad_bootstrap_sched *sched,
+                                      const size_t nodes, const long long now)
+{
+    if (sched->warm || sched->ready_ms >= 0 || nodes < KAD_K_CONST)
+        return;
+    sched->ready_ms = now - sched->start_ms;
+    metrics_gauge_set(METRICS_GAUGE_KAD_BOOTSTRAP_READY_MS, sched->ready_ms);
+    log_info("DHT ready after %lld ms (%zu nodes).", sched->ready_ms, nodes);
+}
+
+/* Seeds in flight for too long are retried later, or given up. */
+static void kad_bootstrap_sched_expire(struct kad_bootstrap_sched *sched,
+                                       const long long now)
+{
+    for (size_t i = 0; i < sched->seeds_len && sched->inflight > 0; i++) {
+        struct kad_bootstrap_seed *seed = &sched->seeds[i];
+        if (seed->state != KAD_BOOTSTRAP_SEED_INFLIGHT || seed->due_ms > now)
+            continue;
+        sched->inflight--;
+        if (seed->tries >= KAD_BOOTSTRAP_TRIES) {
+            seed->state = KAD_BOOTSTRAP_SEED_FAILED;
+            sched->pending--;
+            metrics_inc(METRICS_CNT_KAD_BOOTSTRAP_FAILED);
+            continue;
+        }
+        seed->state = KAD_BOOTSTRAP_SEED_NONE;
+        seed->due_ms = now + (KAD_BOOTSTRAP_BACKOFF_MS << (seed->tries - 1));
+        metrics_inc(METRICS_CNT_KAD_BOOTSTRAP_RETRIES);
+    }
+}
+
+/**
+ * Expires pings in flight, and tells if bootstrapping goes on given the
+ * number of @nodes in the routing table.
+ */
+bool kad_bootstrap_sched_update(struct kad_bootstrap_sched *sched,
+                                const size_t nodes, const long long now)
+{
+    if (!sched->active)
+        return false;
+
+    kad_bootstrap_sched_expire(sched, now);
+    kad_bootstrap_sched_ready(sched, nodes, now);
+    if (sched->warm) {
+        sched->active = sched->pending > 0;
+    }
+    else if (nodes >= sched->target) {
+        log_info("Bootstrap done (%zu nodes).", nodes);
+        sched->active = false;
+    }
+    else if (sched->pending == 0) {
+        if (sched->ready_ms < 0)
+            log_warning("Bootstrap seeds exhausted before DHT ready (%zu nodes).",
+                        nodes);
+        else
+            log_info("Bootstrap seeds exhausted (%zu nodes).", nodes);
+        sched->active = false;
+    }
+    return sched->active;
+}
+
+/**
+ * Returns the address of the next seed to ping at @now, which is then deemed
+ * in flight, or NULL when pacing or the cap on pings in flight hold it back.
+ */
+const struct sockaddr_storage *
+kad_bootstrap_sched_next(struct kad_bootstrap_sched *sched, const long long now)
+{
+    if (!sched->active)
+        return NULL;
+
+    sched->credit += (now - sched->credit_ms) * sched->rate;
+    sched->credit_ms = now;
+    long long credit_max = 1000 + sched->rate * KAD_BOOTSTRAP_TICK_MS;
+    if (sched->credit > credit_max)
+        sched->credit = credit_max;
+    if (sched->credit < 1000 || sched->inflight >= sched->inflight_max)
+        return NULL;
+
+    for (size_t n = 0; n < sched->seeds_len; n++) {
+        struct kad_bootstrap_seed *seed = &sched->seeds[sched->cursor];
+        sched->cursor = (sched->cursor + 1) % sched->seeds_len;
+        if (seed->state != KAD_BOOTSTRAP_SEED_NONE || seed->due_ms > now)
+            continue;
+        seed->state = KAD_BOOTSTRAP_SEED_INFLIGHT;
+        seed->tries++;
+        seed->due_ms = now + KAD_BOOTSTRAP_TIMEOUT_MS;
+        sched->inflight++;
+        sched->credit -= 1000;
+        return &seed->addr;
+    }
+    return NULL;
+}
+
+/**
+ * Marks the seed at @addr as answered. A late answer, after a timeout,
+ * counts as well.
+ */
+void kad_bootstrap_sched_answered(struct kad_bootstrap_sched *sched,
+                                  const struct sockaddr_storage *addr,
+                                  const size_t nodes, const long long now)
+{
+    if (!sched->active)
+        return;
+
+    for (size_t i = 0; i < sched->seeds_len; i++) {
+        struct kad_bootstrap_seed *seed = &sched->seeds[i];
+        if (seed->tries == 0 || !kad_bootstrap_addr_eq(&seed->addr, addr))
+            continue;
+        if (seed->state == KAD_BOOTSTRAP_SEED_INFLIGHT)
+            sched->inflight--;
+        if (seed->state == KAD_BOOTSTRAP_SEED_INFLIGHT ||
+            seed->state == KAD_BOOTSTRAP_SEED_NONE) {
+            seed->state = KAD_BOOTSTRAP_SEED_ANSWERED;
+            sched->pending--;
+        }
+        break;
+    }
+    kad_bootstrap_sched_ready(sched, nodes, now);
+}
@@ -0,0 +1,144 @@
+/* Copyright (c) 2017-2019 Foudil Brétel.  All rights reserved. */
+#ifndef KAD_BOOTSTRAP_H
+#define KAD_BOOTSTRAP_H
+
+/**
+ * Loader of the bootstrap node list.
+ *
+ * The list is read in chunks, so that its size is not capped. It is either a
+ * bencoded list of compact addresses, or text with one address per line, like
+ * `192.0.2.1 22000`, `192.0.2.1:22000`, `[2001:db8::1]:22000` or
+ * `2001:db8::1 22000`. Blank lines and lines starting with '#' are skipped.
+ *
+ * Addresses are sampled with a bottom-k sketch: each address gets a hash keyed
+ * with a random seed, and the addresses with the smallest hashes are kept.
+ * This is a uniform sample of the distinct addresses, in memory bounded by the
+ * sample size. Duplicates share a hash, so they are dropped on the way.
+ *
+ * The sampled seeds are then pinged by a scheduler, at a given rate and with
+ * a cap on pings in flight. Unanswered seeds are retried with exponential
+ * backoff, up to KAD_BOOTSTRAP_TRIES times. The scheduler does no I/O: the
+ * caller asks it for the seeds due, and reports answers and the fill of the
+ * routing table. Bootstrapping ends when the table holds the target number
+ * of nodes, or when all seeds answered or were given up. The table is deemed
+ * ready once it holds KAD_K_CONST nodes.
+ *
+ * The same scheduler validates a table loaded from disk (warm start): the
+ * loaded nodes are pinged as seeds, while the table already answers queries.
+ * Validation ends once all of them answered or were given up. Nodes not heard
+ * from are then dropped, and bootstrapping from the node list follows if
+ * fewer than KAD_BOOTSTRAP_WARM_MIN are left.
+ */
+#include <netinet/in.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include "net/kad/dht.h"
+
+#define KAD_BOOTSTRAP_CHUNK_LEN 4096
+#define KAD_BOOTSTRAP_LINE_MAX  128
+#define KAD_BOOTSTRAP_TRIES     3
+#define KAD_BOOTSTRAP_TIMEOUT_MS 2000
+/* Backoff before the n-th retry: KAD_BOOTSTRAP_BACKOFF_MS * 2^(n-1). */
+#define KAD_BOOTSTRAP_BACKOFF_MS 1000
+#define KAD_BOOTSTRAP_TARGET    (4 * KAD_K_CONST)
+/* Period of the scheduler while bootstrapping. */
+#define KAD_BOOTSTRAP_TICK_MS   50
+#define KAD_BOOTSTRAP_WARM_MIN  KAD_K_CONST
+
+enum kad_bootstrap_fmt {
+    KAD_BOOTSTRAP_FMT_NONE,
+    KAD_BOOTSTRAP_FMT_BENC,
+    KAD_BOOTSTRAP_FMT_TEXT,
+};
+
+enum kad_bootstrap_stage {
+    KAD_BOOTSTRAP_STAGE_NONE,
+    KAD_BOOTSTRAP_STAGE_LEN,    /* bencode string length, or list end */
+    KAD_BOOTSTRAP_STAGE_STR,    /* bencode string */
+    KAD_BOOTSTRAP_STAGE_LINE,   /* text line */
+    KAD_BOOTSTRAP_STAGE_SKIP,   /* rest of an overlong text line */
+    KAD_BOOTSTRAP_STAGE_END,
+    KAD_BOOTSTRAP_STAGE_ERROR,
+};
+
+struct kad_bootstrap_sample {
+    /* Sorted by ascending key. */
+    struct sockaddr_storage *addrs;
+    uint64_t                *keys;
+    size_t                   len;
+    size_t                   max;
+    uint64_t                 seed;
+    size_t                   read;
+    size_t                   dups;
+    size_t                   invalid;
+};
+
+struct kad_bootstrap_reader {
+    enum kad_bootstrap_fmt      fmt;
+    enum kad_bootstrap_stage    stage;
+    size_t                      str_len;
+    char                        buf[KAD_BOOTSTRAP_LINE_MAX];
+    size_t                      buf_len;
+    struct kad_bootstrap_sample sample;
+};
+
+enum kad_bootstrap_seed_state {
+    KAD_BOOTSTRAP_SEED_NONE,
+    KAD_BOOTSTRAP_SEED_INFLIGHT,
+    KAD_BOOTSTRAP_SEED_ANSWERED,
+    KAD_BOOTSTRAP_SEED_FAILED,
+};
+
+struct kad_bootstrap_seed {
+    struct sockaddr_storage       addr;
+    enum kad_bootstrap_seed_state state;
+    unsigned                      tries;
+    /* Next ping, or timeout when in flight. */
+    long long                     due_ms;
+};
+
+struct kad_bootstrap_sched {
+    struct kad_bootstrap_seed *seeds;
+    size_t                     seeds_len;
+    size_t                     inflight;
+    size_t                     inflight_max;
+    size_t                     pending;  /* neither answered nor failed */
+    size_t                     target;
+    size_t                     cursor;
+    /* Pacing credit, in thousandths of a ping. */
+    long long                  rate;
+    long long                  credit;
+    long long                  credit_ms;
+    long long                  start_ms;
+    long long                  ready_ms; /* -1 until ready */
+    bool                       active;
+    bool                       warm;     /* validating a loaded table */
+};
+
+bool kad_bootstrap_reader_init(struct kad_bootstrap_reader *reader,
+                               struct sockaddr_storage addrs[],
+                               const size_t addrs_len, const uint64_t seed);
+void kad_bootstrap_reader_terminate(struct kad_bootstrap_reader *reader);
+bool kad_bootstrap_read(struct kad_bootstrap_reader *reader,
+                        const char buf[], const size_t len);
+bool kad_bootstrap_read_end(struct kad_bootstrap_reader *reader);
+
+bool kad_bootstrap_sched_init(struct kad_bootstrap_sched *sched,
+                              const struct sockaddr_storage addrs[],
+                              const size_t addrs_len, const unsigned rate,
+                              const size_t inflight_max, const bool warm,
+                              const long long now);
+void kad_bootstrap_sched_terminate(struct kad_bootstrap_sched *sched);
+bool kad_bootstrap_sched_update(struct kad_bootstrap_sched *sched,
+                                const size_t nodes, const long long now);
+const struct sockaddr_storage *
+kad_bootstrap_sched_next(struct kad_bootstrap_sched *sched, const long long now);
+void kad_bootstrap_sched_answered(struct kad_bootstrap_sched *sched,
+                                  const struct sockaddr_storage *addr,
+                                  const size_t nodes, const long long now);
+
+int kad_read_bootstrap_nodes(struct sockaddr_storage nodes[], size_t nodes_len,
+                             const char path[]);
+
+#endif /* KAD_BOOTSTRAP_H */
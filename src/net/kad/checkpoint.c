@@ -0,0 +1,241 @@
+/* Copyright (c) 2017-2019 Foudil Brétel.  All rights reserved. */
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "file.h"
+#include "log.h"
+#include "metrics.h"
+#include "timers.h"
+#include "net/socket.h"
+#include "net/kad/bencode/parser.h"
+#include "net/kad/bencode/serde.h"
+#include "net/kad/checkpoint.h"
+
+static void kad_checkpoint_write(struct kad_checkpoint *ckpt,
+                                 const struct kad_dht_encoded *snap)
+{
+    long long start = now_micros();
+    if (!dht_write_encoded(snap, ckpt->state_path)) {
+        metrics_inc(METRICS_CNT_KAD_CHECKPOINT_FAIL);
+        return;
+    }
+    /* Now included in the state file. */
+    if (unlink(ckpt->journal_path) == -1 && errno != ENOENT)
+        log_perror(LOG_ERR, "Failed unlink: %s.", errno);
+    metrics_inc(METRICS_CNT_KAD_CHECKPOINTS);
+    metrics_hist_record(METRICS_HIST_KAD_CHECKPOINT_US, now_micros() - start);
+    log_debug("DHT checkpoint written (%zu nodes).", snap->nodes_len);
+}
+
+static void *kad_checkpoint_run(void *data)
+{
+    struct kad_checkpoint *ckpt = data;
+    if (!metrics_thread_register())
+        return NULL;
+
+    struct iobuf journal = {0};
+    pthread_mutex_lock(&ckpt->lock);
+    while (true) {
+        while (!ckpt->stop && !ckpt->snap && !ckpt->journal.pos)
+            pthread_cond_wait(&ckpt->cond, &ckpt->lock);
+        /* Pending work is done before stopping. */
+        if (!ckpt->snap && !ckpt->journal.pos)
+            break;
+
+        struct kad_dht_encoded *snap = ckpt->snap;
+        ckpt->snap = NULL;
+        struct iobuf tmp = journal;
+        journal = ckpt->journal;
+        ckpt->journal = tmp;
+        pthread_mutex_unlock(&ckpt->lock);
+
+        if (snap) {
+            kad_checkpoint_write(ckpt, snap);
+            free(snap);
+        }
+        if (journal.pos > 0) {
+            if (!file_append(ckpt->journal_path, journal.buf, journal.pos))
+                log_error("Failed to append to DHT journal (%s).",
+                          ckpt->journal_path);
+            iobuf_clear(&journal);
+        }
+
+        pthread_mutex_lock(&ckpt->lock);
+    }
+    pthread_mutex_unlock(&ckpt->lock);
+
+    iobuf_reset(&journal);
+    metrics_thread_unregister();
+    return NULL;
+}
+
+/**
+ * Starts the writer thread. @journal_path is removed by checkpoints even when
+ * the journal is disabled, so that a stale journal is not replayed.
+ */
+bool kad_checkpoint_start(struct kad_checkpoint *ckpt, const char state_path[],
+                          const char journal_path[], const bool journal)
+{
+    memset(ckpt, 0, sizeof(*ckpt));
+    if (!strcpy_safer(ckpt->state_path, state_path, sizeof(ckpt->state_path)) ||
+        !strcpy_safer(ckpt->journal_path, journal_path, sizeof(ckpt->journal_path))) {
+        log_error("DHT checkpoint paths too long.");
+        return false;
+    }
+    ckpt->journal_on = journal;
+
+    if (pthread_mutex_init(&ckpt->lock, NULL) != 0) {
+        log_error("Failed to initialize checkpoint lock.");
+        return false;
+    }
+    if (pthread_cond_init(&ckpt->cond, NULL) != 0) {
+        log_error("Failed to initialize checkpoint condition.");
+        pthread_mutex_destroy(&ckpt->lock);
+        return false;
+    }
+
+    /* Leave signals to the loop thread. */
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    int rv = pthread_create(&ckpt->th, NULL, kad_checkpoint_run, ckpt);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (rv != 0) {
+        log_error("Failed to create checkpoint thread (%d).", rv);
+        pthread_mutex_destroy(&ckpt->lock);
+        pthread_cond_destroy(&ckpt->cond);
+        return false;
+    }
+
+    log_info("DHT checkpoints started (journal %s).",
+             ckpt->journal_on ? "enabled" : "disabled");
+    return true;
+}
+
+/**
+ * Writes pending work, then stops the writer thread.
+ */
+void kad_checkpoint_stop(struct kad_checkpoint *ckpt)
+{
+    pthread_mutex_lock(&ckpt->lock);
+    ckpt->stop = true;
+    pthread_cond_signal(&ckpt->cond);
+    pthread_mutex_unlock(&ckpt->lock);
+    pthread_join(ckpt->th, NULL);
+    pthread_mutex_destroy(&ckpt->lock);
+    pthread_cond_destroy(&ckpt->cond);
+    iobuf_reset(&ckpt->journal);
+}
+
+/**
+ * Hands a snapshot of @dht over to the writer thread. A snapshot still
+ * pending is replaced.
+ */
+bool kad_checkpoint_submit(struct kad_checkpoint *ckpt, const struct kad_dht *dht)
+{
+    struct kad_dht_encoded *snap = malloc(sizeof(struct kad_dht_encoded));
+    if (!snap) {
+        log_perror(LOG_ERR, "Failed malloc: %s.", errno);
+        return false;
+    }
+    snap->nodes_len = 0;
+    dht_snapshot(dht, snap);
+
+    pthread_mutex_lock(&ckpt->lock);
+    struct kad_dht_encoded *prev = ckpt->snap;
+    ckpt->snap = snap;
+    pthread_cond_signal(&ckpt->cond);
+    pthread_mutex_unlock(&ckpt->lock);
+
+    if (prev) {
+        log_debug("Replacing pending DHT checkpoint.");
+        free(prev);
+    }
+    return true;
+}
+
+/**
+ * Journals a change of the buckets. Matches dht_journal_fn, with @data the
+ * kad_checkpoint.
+ */
+void kad_checkpoint_journal(enum dht_journal_op op,
+                            const struct kad_node_info *info, void *data)
+{
+    struct kad_checkpoint *ckpt = data;
+    if (!ckpt->journal_on)
+        return;
+
+    char rec[KAD_JOURNAL_REC_MAX];
+    unsigned compact_len = benc_compact_addr(
+        (unsigned char *)rec + 2 + KAD_GUID_SPACE_IN_BYTES, &info->addr);
+    if (!compact_len)
+        return;
+    rec[0] = op == DHT_JOURNAL_INSERT ? KAD_JOURNAL_OP_INSERT : KAD_JOURNAL_OP_DELETE;
+    rec[1] = (char)compact_len;
+    memcpy(rec + 2, info->id.bytes, KAD_GUID_SPACE_IN_BYTES);
+    size_t rec_len = 2 + KAD_GUID_SPACE_IN_BYTES + compact_len;
+
+    pthread_mutex_lock(&ckpt->lock);
+    if (ckpt->journal.pos + rec_len > KAD_JOURNAL_PENDING_MAX)
+        log_warning("DHT journal lagging behind. Dropping record.");
+    else if (iobuf_append(&ckpt->journal, rec, rec_len))
+        pthread_cond_signal(&ckpt->cond);
+    pthread_mutex_unlock(&ckpt->lock);
+}
+
+/**
+ * Applies the records of @journal_path to @dht. A truncated last record, as
+ * left by a crash, is ignored.
+ *
+ * Returns the number of records replayed, or -1 on failure.
+ */
+int kad_journal_replay(struct kad_dht *dht, const char journal_path[])
+{
+    FILE *fp = fopen(journal_path, "rb");
+    if (!fp) {
+        if (errno == ENOENT)
+            return 0;
+        log_perror(LOG_ERR, "Failed fopen: %s.", errno);
+        return -1;
+    }
+
+    int nrecs = 0;
+    unsigned char hdr[2];
+    char rec[KAD_GUID_SPACE_IN_BYTES + 16 + 2];
+    while (fread(hdr, sizeof(hdr), 1, fp) == 1) {
+        size_t len = KAD_GUID_SPACE_IN_BYTES + hdr[1];
+        if (len > sizeof(rec) ||
+            (hdr[0] != KAD_JOURNAL_OP_INSERT && hdr[0] != KAD_JOURNAL_OP_DELETE)) {
+            log_error("Invalid DHT journal record #%d.", nrecs);
+            nrecs = -1;
+            break;
+        }
+        if (fread(rec, len, 1, fp) != 1)
+            break;
+        nrecs++;
+
+        struct kad_node_info info = {0};
+        kad_guid_set(&info.id, (unsigned char *)rec);
+        if (!benc_read_single_addr(&info.addr, rec + KAD_GUID_SPACE_IN_BYTES,
+                                   hdr[1]))
+            continue;
+        sockaddr_storage_fmt(info.addr_str, &info.addr);
+
+        bool known = dht_find(dht, &info.id) != NULL;
+        if (hdr[0] == KAD_JOURNAL_OP_INSERT && !known)
+            dht_insert(dht, &info);
+        else if (hdr[0] == KAD_JOURNAL_OP_DELETE && known)
+            dht_delete(dht, &info.id);
+    }
+    if (ferror(fp)) {
+        log_perror(LOG_ERR, "Failed fread: %s.", errno);
+        nrecs = -1;
+    }
+    fclose(fp);
+
+    if (nrecs >= 0)
+        log_info("Replayed %d DHT journal records.", nrecs);
+    return nrecs;
+}
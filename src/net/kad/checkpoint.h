@@ -0,0 +1,54 @@
+/* Copyright (c) 2017-2019 Foudil Brétel.  All rights reserved. */
+#ifndef KAD_CHECKPOINT_H
+#define KAD_CHECKPOINT_H
+
+/**
+ * Background persistence of the routing table.
+ *
+ * The event loop takes a snapshot of the table with dht_snapshot() and hands
+ * it over to a writer thread, which encodes it and atomically replaces the
+ * state file. Only the latest snapshot is kept when the writer lags behind.
+ *
+ * With a journal, changes of the buckets are also handed over, and appended
+ * to a journal file. Each checkpoint removes the journal, and the journal is
+ * replayed after loading the state file. Replaying is idempotent, so records
+ * older than the checkpoint are harmless.
+ *
+ * A journal record is: op (1 byte), compact address length (1 byte), node id,
+ * compact address.
+ */
+#include <limits.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include "net/iobuf.h"
+#include "net/kad/dht.h"
+
+#define KAD_JOURNAL_OP_INSERT 'I'
+#define KAD_JOURNAL_OP_DELETE 'D'
+#define KAD_JOURNAL_REC_MAX   (2 + KAD_GUID_SPACE_IN_BYTES + 16 + 2)
+/* Pending journal bytes above which records are dropped, until the writer
+   catches up. */
+#define KAD_JOURNAL_PENDING_MAX (256 * 1024)
+
+struct kad_checkpoint {
+    pthread_t               th;
+    pthread_mutex_t         lock;
+    pthread_cond_t          cond;
+    bool                    stop;
+    char                    state_path[PATH_MAX];
+    char                    journal_path[PATH_MAX];
+    bool                    journal_on;
+    /* Pending work, protected by lock. */
+    struct kad_dht_encoded *snap;
+    struct iobuf            journal;
+};
+
+bool kad_checkpoint_start(struct kad_checkpoint *ckpt, const char state_path[],
+                          const char journal_path[], const bool journal);
+void kad_checkpoint_stop(struct kad_checkpoint *ckpt);
+bool kad_checkpoint_submit(struct kad_checkpoint *ckpt, const struct kad_dht *dht);
+void kad_checkpoint_journal(enum dht_journal_op op,
+                            const struct kad_node_info *info, void *data);
+int kad_journal_replay(struct kad_dht *dht, const char journal_path[]);
+
+#endif /* KAD_CHECKPOINT_H */
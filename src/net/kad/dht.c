@@ -7,19 +7,49 @@
  * 0x0100 ^ 0x0110 = 0x0010, common prefix "00". It thus really represents a
  * distance in the tree.
  */
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <time.h>
 #include <unistd.h>
 #include "log.h"
 #include "file.h"
 #include "utils/bitfield.h"
 #include "utils/bits.h"
+#include "utils/crc32.h"
+#include "net/socket.h"
 #include "net/kad/bencode/dht.h"
 #include "net/kad/dht.h"
 
-#define DHT_STATE_LEN_IN_BYTES 4096
-#define NODES_FILE_LEN_IN_BYTES 512
+kad_node_pool pool_kad_nodes = {0};
+
+/**
+ * Binary state file, integers network-ordered:
+ *
+ *   header: magic (8) | version (2) | record length (2) | nodes count (4) |
+ *           crc32 (4) | self id
+ *   record: node id | family (1) | unused (1) | port (2) | address (16)
+ *
+ * The crc32 covers the self id and the records. Records have a fixed size, so
+ * that the mapped file is walked in place. An IPv4 address takes the first 4
+ * bytes of the address field.
+ */
+#define DHT_STATE_MAGIC       "ptp-dht\n"
+#define DHT_STATE_MAGIC_LEN   8
+#define DHT_STATE_VERSION     1
+#define DHT_STATE_OFF_VERSION 8
+#define DHT_STATE_OFF_REC_LEN 10
+#define DHT_STATE_OFF_NODES   12
+#define DHT_STATE_OFF_CRC     16
+#define DHT_STATE_OFF_SELF_ID 20
+#define DHT_STATE_HDR_LEN     (DHT_STATE_OFF_SELF_ID + KAD_GUID_SPACE_IN_BYTES)
+#define DHT_STATE_REC_LEN     (KAD_GUID_SPACE_IN_BYTES + 4 + 16)
+/* Nodes decoded at once from the mapped file before a bulk insert. */
+#define DHT_STATE_LOAD_BATCH  64
 
 static void kad_generate_id(kad_guid *uid)
 {
@@ -32,18 +62,20 @@ static void kad_generate_id(kad_guid *uid)
 static void dht_init(struct kad_dht *dht)
 {
     memset(&dht->self_id, 0, sizeof(kad_guid));
-    for (size_t i = 0; i < KAD_GUID_SPACE_IN_BITS; i++)
+    for (size_t i = 0; i < KAD_GUID_SPACE_IN_BITS; i++) {
         list_init(&dht->buckets[i]);
+        dht->bucket_active[i] = 0;
+    }
     list_init(&dht->replacement);
+    dht->journal = NULL;
+    dht->journal_data = NULL;
 }
 
+/**
+ * The caller seeds random(3) beforehand, see kad_rpc_init().
+ */
 struct kad_dht *dht_create()
 {
-    struct timespec time;
-    if (clock_gettime(CLOCK_REALTIME, &time) < 0)
-        log_perror(LOG_ERR, "Failed clock_gettime(): %s", errno);
-    srandom(time.tv_sec * time.tv_nsec * getpid());
-
     struct kad_dht *dht = malloc(sizeof(struct kad_dht));
     if (!dht) {
         log_perror(LOG_ERR, "Failed malloc: %s.", errno);
@@ -65,10 +97,11 @@ void dht_destroy(struct kad_dht *dht)
 {
     for (int i = 0; i < KAD_GUID_SPACE_IN_BITS; i++) {
         struct list_item *bucket = &dht->buckets[i];
-        list_free_all(bucket, struct kad_node, item);
+        list_pool_put_all(bucket, struct kad_node, item, kad_node_pool,
+                          &pool_kad_nodes);
     }
     struct list_item *repl = &dht->replacement;
-    list_free_all(repl, struct kad_node, item);
+    list_pool_put_all(repl, struct kad_node, item, kad_node_pool, &pool_kad_nodes);
     free_safer(dht);
 }
 
@@ -103,22 +136,44 @@ static inline size_t kad_bucket_hash(const kad_guid *self_id,
     return bucket_idx;
 }
 
+/* Unknown round-trip times rank last. */
+static inline int kad_node_rtt_rank(const struct kad_node *node)
+{
+    return node->srtt_ms8 > 0 ? node->srtt_ms8 : INT_MAX;
+}
+
+/**
+ * Appends the nodes of @bucket to @nodes, up to KAD_K_CONST in total.
+ *
+ * Nodes of a bucket are equally distant at the bucket's granularity, so
+ * lower round-trip times come first (proximity neighbor selection), then the
+ * bucket's order.
+ */
 static inline size_t
 kad_bucket_get_nodes(const struct list_item *bucket,
                      struct kad_node_info nodes[], size_t nodes_pos,
                      const kad_guid *caller) {
+    const struct kad_node *cands[KAD_K_CONST];
+    size_t cands_len = 0;
     const struct list_item *it = bucket;
-    struct kad_node *node;
-    size_t bucket_pos = 0;
     list_for(it, bucket) {
-        if (bucket_pos >= KAD_K_CONST)
+        if (cands_len >= KAD_K_CONST)
             break;
-        node = cont(it, struct kad_node, item);
+        const struct kad_node *node = cont(it, struct kad_node, item);
         if (caller && kad_guid_eq(&node->info.id, caller)) {
             log_debug("%s: ignoring known caller", __func__);
             continue;
         }
-        kad_node_info_copy(&nodes[nodes_pos+bucket_pos], &node->info);
+        int rank = kad_node_rtt_rank(node);
+        size_t i = cands_len++;
+        for (; i > 0 && kad_node_rtt_rank(cands[i-1]) > rank; i--)
+            cands[i] = cands[i-1];
+        cands[i] = node;
+    }
+
+    size_t bucket_pos = 0;
+    while (bucket_pos < cands_len && nodes_pos + bucket_pos < KAD_K_CONST) {
+        kad_node_info_copy(&nodes[nodes_pos+bucket_pos], &cands[bucket_pos]->info);
         bucket_pos += 1;
     }
     return bucket_pos;
@@ -198,6 +253,47 @@ dht_get_from_list(const struct list_item *list, const kad_guid *node_id)
     return NULL;
 }
 
+/**
+ * « Good nodes are nodes that have responded to one of our queries within the
+ * last 15 minutes. [...] After 15 minutes of inactivity, a node becomes
+ * questionable. Nodes become bad when they fail to respond to multiple
+ * queries in a row. » (BEP 5)
+ *
+ * Any message from a node counts as activity, and `stale` counts the queries
+ * it failed to respond to since.
+ */
+enum kad_node_state kad_node_state(const struct kad_node *node, const time_t now)
+{
+    if (node->stale >= KAD_NODE_BAD_TIMEOUTS)
+        return KAD_NODE_STATE_BAD;
+    if (node->stale > 0 || now - node->last_seen >= KAD_NODE_GOOD_S)
+        return KAD_NODE_STATE_QUESTIONABLE;
+    return KAD_NODE_STATE_GOOD;
+}
+
+/* Returns the bad node of @bucket with the highest round-trip time, if any. */
+static struct kad_node *
+dht_bucket_find_bad(const struct list_item *bucket, const time_t now)
+{
+    struct kad_node *bad = NULL;
+    const struct list_item *it = bucket;
+    list_for(it, bucket) {
+        struct kad_node *node = cont(it, struct kad_node, item);
+        if (kad_node_state(node, now) == KAD_NODE_STATE_BAD &&
+            (!bad || kad_node_rtt_rank(node) > kad_node_rtt_rank(bad)))
+            bad = node;
+    }
+    return bad;
+}
+
+static void dht_node_remove(struct kad_dht *dht, struct kad_node *node)
+{
+    if (dht->journal)
+        dht->journal(DHT_JOURNAL_DELETE, &node->info, dht->journal_data);
+    list_delete(&node->item);
+    kad_node_pool_put(&pool_kad_nodes, node);
+}
+
 /**
  * Try to update node's data and move it to the end of the bucket, or the the
  * beginning of the replacement cache.
@@ -226,29 +322,34 @@ int dht_update(struct kad_dht *dht, const struct kad_node_info *info)
 
     node->last_seen = time.tv_sec;
     node->stale = 0;
+    bool in_bucket = dht_get_from_list(&dht->buckets[bkt_idx], &info->id) != NULL;
     list_delete(&node->item);
-    list_append(&dht->buckets[bkt_idx], &node->item);
+    if (in_bucket || kad_bucket_count(&dht->buckets[bkt_idx]) < KAD_K_CONST) {
+        list_append(&dht->buckets[bkt_idx], &node->item);
+        dht->bucket_active[bkt_idx] = time.tv_sec;
+        if (!in_bucket && dht->journal)
+            dht->journal(DHT_JOURNAL_INSERT, &node->info, dht->journal_data);
+    }
+    else
+        list_prepend(&dht->replacement, &node->item);
 
     return 0;
 }
 
-static struct kad_node *dht_node_new(const struct kad_node_info *info)
+static struct kad_node *dht_node_new(const struct kad_node_info *info,
+                                     const time_t now)
 {
-    struct timespec time;
-    if (clock_gettime(CLOCK_REALTIME, &time) < 0) {
-        log_perror(LOG_ERR, "Failed clock_gettime(): %s", errno);
-        return NULL;
-    }
-
-    struct kad_node *node = malloc(sizeof(struct kad_node));
+    struct kad_node *node = kad_node_pool_get(&pool_kad_nodes);
     if (!node) {
         log_perror(LOG_ERR, "Failed malloc: %s.", errno);
         return NULL;
     }
 
     kad_node_info_copy(&node->info, info);
-    node->last_seen = time.tv_sec;
+    node->last_seen = now;
     node->stale = 0;
+    node->srtt_ms8 = 0;
+    node->rttvar_ms4 = 0;
     list_init(&(node->item));
 
     return node;
@@ -266,16 +367,32 @@ bool dht_insert(struct kad_dht *dht, const struct kad_node_info *info)
         return false;
     }
 
-    struct kad_node *node = dht_node_new(info);
+    struct timespec time;
+    if (clock_gettime(CLOCK_REALTIME, &time) < 0) {
+        log_perror(LOG_ERR, "Failed clock_gettime(): %s", errno);
+        return false;
+    }
+
+    struct kad_node *node = dht_node_new(info, time.tv_sec);
     if (!node)
         return false;
 
     size_t bkt_idx = kad_bucket_hash(&dht->self_id, &node->info.id);
     struct list_item *bucket = &dht->buckets[bkt_idx];
     size_t count = kad_bucket_count(bucket);
+    struct kad_node *bad = count < KAD_K_CONST ? NULL :
+        dht_bucket_find_bad(bucket, time.tv_sec);
+    if (bad) {
+        log_debug("DHT replacing bad node in bucket %zu.", bkt_idx);
+        dht_node_remove(dht, bad);
+        count--;
+    }
     if (count < KAD_K_CONST) {
         list_append(&dht->buckets[bkt_idx], &node->item);
+        dht->bucket_active[bkt_idx] = time.tv_sec;
         log_debug("DHT insert into bucket %zu.", bkt_idx);
+        if (dht->journal)
+            dht->journal(DHT_JOURNAL_INSERT, &node->info, dht->journal_data);
     }
     else {
         list_prepend(&dht->replacement, &node->item);
@@ -285,6 +402,50 @@ bool dht_insert(struct kad_dht *dht, const struct kad_node_info *info)
     return true;
 }
 
+/**
+ * Inserts unknown nodes in bulk, as when loading the state file: the time is
+ * read once, and the fill of buckets is tracked rather than counted for each
+ * node. Changes are not journaled.
+ *
+ * Returns the number of nodes inserted, or -1 on failure.
+ */
+int dht_insert_bulk(struct kad_dht *dht, const struct kad_node_info infos[],
+                    const size_t infos_len)
+{
+    struct timespec time;
+    if (clock_gettime(CLOCK_REALTIME, &time) < 0) {
+        log_perror(LOG_ERR, "Failed clock_gettime(): %s", errno);
+        return -1;
+    }
+
+    uint64_t fill[KAD_GUID_SPACE_IN_BITS];
+    dht_bucket_fill(dht, fill);
+
+    int inserted = 0;
+    for (size_t i = 0; i < infos_len; i++) {
+        if (kad_guid_eq(&dht->self_id, &infos[i].id)) {
+            log_error("Ignoring DHT insert of node with same id as me.");
+            continue;
+        }
+
+        struct kad_node *node = dht_node_new(&infos[i], time.tv_sec);
+        if (!node)
+            return -1;
+
+        size_t bkt_idx = kad_bucket_hash(&dht->self_id, &node->info.id);
+        if (fill[bkt_idx] < KAD_K_CONST) {
+            list_append(&dht->buckets[bkt_idx], &node->item);
+            dht->bucket_active[bkt_idx] = time.tv_sec;
+            fill[bkt_idx]++;
+        }
+        else
+            list_prepend(&dht->replacement, &node->item);
+        inserted++;
+    }
+
+    return inserted;
+}
+
 bool dht_delete(struct kad_dht *dht, const kad_guid *node_id)
 {
     size_t bkt_idx = kad_bucket_hash(&dht->self_id, node_id);
@@ -296,8 +457,104 @@ bool dht_delete(struct kad_dht *dht, const kad_guid *node_id)
         return false;
     }
 
-    list_delete(&node->item);
-    free_safer(node);
+    dht_node_remove(dht, node);
+    return true;
+}
+
+/**
+ * Returns the least-recently seen node of the bucket of @node_id, when that
+ * bucket is full, @node_id waits in the replacement cache, and that node is
+ * questionable: it should be pinged, and evicted if it does not respond.
+ */
+const struct kad_node *
+dht_evict_candidate(const struct kad_dht *dht, const kad_guid *node_id,
+                    const time_t now)
+{
+    size_t bkt_idx = kad_bucket_hash(&dht->self_id, node_id);
+    const struct list_item *bucket = &dht->buckets[bkt_idx];
+    if (kad_bucket_count(bucket) < KAD_K_CONST ||
+        dht_get_from_list(bucket, node_id) ||
+        !dht_get_from_list(&dht->replacement, node_id))
+        return NULL;
+
+    const struct kad_node *lrs = cont(bucket->next, struct kad_node, item);
+    if (kad_node_state(lrs, now) == KAD_NODE_STATE_GOOD)
+        return NULL;
+    return lrs;
+}
+
+/**
+ * Counts a query @node_id failed to respond to. Returns false if the node is
+ * unknown.
+ */
+bool dht_timeout(struct kad_dht *dht, const kad_guid *node_id)
+{
+    size_t bkt_idx = kad_bucket_hash(&dht->self_id, node_id);
+    struct kad_node *node = dht_get_from_list(&dht->buckets[bkt_idx], node_id);
+    if (!node)
+        node = dht_get_from_list(&dht->replacement, node_id);
+    if (!node)
+        return false;
+    node->stale++;
+    return true;
+}
+
+/**
+ * Records a round-trip time sample of @node_id into its smoothed round-trip
+ * time and mean deviation, as per Jacobson/Karels (RFC 6298). Returns false if
+ * the node is unknown.
+ */
+bool dht_rtt_sample(struct kad_dht *dht, const kad_guid *node_id,
+                    const long long rtt_ms)
+{
+    size_t bkt_idx = kad_bucket_hash(&dht->self_id, node_id);
+    struct kad_node *node = dht_get_from_list(&dht->buckets[bkt_idx], node_id);
+    if (!node)
+        node = dht_get_from_list(&dht->replacement, node_id);
+    if (!node)
+        return false;
+
+    // clamped so that 0 still means unknown
+    int rtt = rtt_ms < 1 ? 1 : rtt_ms > INT_MAX / 64 ? INT_MAX / 64 : rtt_ms;
+    if (node->srtt_ms8 == 0) {
+        node->srtt_ms8 = rtt << 3;
+        node->rttvar_ms4 = rtt << 1;
+    }
+    else {
+        /* srtt += (rtt - srtt) / 8, and rttvar += (|rtt - srtt| - rttvar) / 4,
+           on scaled values, so without truncation of the errors. */
+        int delta = rtt - (node->srtt_ms8 >> 3);
+        node->srtt_ms8 += delta;
+        if (delta < 0)
+            delta = -delta;
+        node->rttvar_ms4 += delta - (node->rttvar_ms4 >> 2);
+    }
+    return true;
+}
+
+/**
+ * Evicts @node_id from its bucket, in favor of the most recently seen node of
+ * the replacement cache for that bucket, if any.
+ */
+bool dht_evict(struct kad_dht *dht, const kad_guid *node_id)
+{
+    size_t bkt_idx = kad_bucket_hash(&dht->self_id, node_id);
+    struct kad_node *node = dht_get_from_list(&dht->buckets[bkt_idx], node_id);
+    if (!node)
+        return false;
+    dht_node_remove(dht, node);
+
+    struct list_item *it = &dht->replacement;
+    list_for(it, &dht->replacement) {
+        struct kad_node *repl = cont(it, struct kad_node, item);
+        if (kad_bucket_hash(&dht->self_id, &repl->info.id) != bkt_idx)
+            continue;
+        list_delete(&repl->item);
+        list_append(&dht->buckets[bkt_idx], &repl->item);
+        if (dht->journal)
+            dht->journal(DHT_JOURNAL_INSERT, &repl->info, dht->journal_data);
+        break;
+    }
     return true;
 }
 
@@ -312,70 +569,311 @@ dht_find(const struct kad_dht *dht, const kad_guid *node_id)
     return NULL;
 }
 
-int dht_read(struct kad_dht **dht, const char state_path[])
+/**
+ * Fills @fill with the number of nodes of each bucket. Returns the total.
+ */
+size_t dht_bucket_fill(const struct kad_dht *dht, uint64_t fill[])
 {
-    char buf[DHT_STATE_LEN_IN_BYTES];
-    size_t buf_len = 0;
-    if (!file_read(buf, &buf_len, state_path)) {
-        log_error("Failed to read DHT state file (%s).", state_path);
-        goto fail;
+    size_t total = 0;
+    for (size_t i = 0; i < KAD_GUID_SPACE_IN_BITS; i++) {
+        fill[i] = kad_bucket_count(&dht->buckets[i]);
+        total += fill[i];
     }
+    return total;
+}
 
-    struct kad_dht_encoded encoded;
-    if (!benc_decode_dht(&encoded, buf, buf_len)) {
-        log_error("Decoding of DHT state file (%s) failed.", state_path);
-        goto fail;
-    }
+void dht_bucket_touch(struct kad_dht *dht, const size_t bkt_idx,
+                      const time_t now)
+{
+    dht->bucket_active[bkt_idx] = now;
+}
 
-    *dht = malloc(sizeof(struct kad_dht));
-    if (!*dht) {
-        log_perror(LOG_ERR, "Failed malloc: %s.", errno);
-        goto fail;
-    }
-    dht_init(*dht);
+/**
+ * Draws a random id falling into bucket @bkt_idx: it shares the bits of our
+ * id above the bucket's bit, differs on it, and is random below.
+ */
+void dht_bucket_random_id(const struct kad_dht *dht, const size_t bkt_idx,
+                          kad_guid *id)
+{
+    *id = dht->self_id;
+    size_t pos = KAD_GUID_SPACE_IN_BITS - 1 - bkt_idx;
+    id->bytes[pos / 8] ^= 0x80 >> (pos % 8);
+    for (size_t i = pos + 1; i < KAD_GUID_SPACE_IN_BYTES * 8; i++)
+        if (random() & 1)
+            id->bytes[i / 8] ^= 0x80 >> (i % 8);
+}
 
-    (*dht)->self_id = encoded.self_id;
-    char *id = log_fmt_hex(LOG_DEBUG, (*dht)->self_id.bytes, KAD_GUID_SPACE_IN_BYTES);
-    log_debug("self_id=%s", id);
-    free_safer(id);
+/**
+ * Marks all nodes of the buckets as stale, until heard from again. Returns the
+ * number of nodes marked.
+ */
+size_t dht_mark_stale(struct kad_dht *dht)
+{
+    size_t marked = 0;
+    for (size_t i = 0; i < KAD_GUID_SPACE_IN_BITS; i++) {
+        struct list_item *it = &dht->buckets[i];
+        list_for(it, &dht->buckets[i]) {
+            cont(it, struct kad_node, item)->stale++;
+            marked++;
+        }
+    }
+    return marked;
+}
 
-    for (size_t i = 0; i < encoded.nodes_len; i++) {
-        if (!dht_insert(*dht, &encoded.nodes[i])) {
-            log_error("DHT node insert from encoded [%d] failed.", i);
-            goto fail;
+/**
+ * Deletes the stale nodes of the buckets. Returns the number of nodes deleted.
+ */
+size_t dht_purge_stale(struct kad_dht *dht)
+{
+    size_t purged = 0;
+    for (size_t i = 0; i < KAD_GUID_SPACE_IN_BITS; i++) {
+        struct list_item *it = dht->buckets[i].next;
+        while (it != &dht->buckets[i]) {
+            struct kad_node *node = cont(it, struct kad_node, item);
+            it = it->next;
+            if (node->stale == 0)
+                continue;
+            dht_node_remove(dht, node);
+            purged++;
         }
     }
+    return purged;
+}
 
-    return encoded.nodes_len;
+static inline void dht_state_put16(unsigned char *p, const uint16_t v)
+{
+    uint16_t n = htons(v);
+    memcpy(p, &n, sizeof(n));
+}
 
-  fail:
-    *dht = NULL;
-    return -1;
+static inline void dht_state_put32(unsigned char *p, const uint32_t v)
+{
+    uint32_t n = htonl(v);
+    memcpy(p, &n, sizeof(n));
+}
+
+static inline uint16_t dht_state_get16(const unsigned char *p)
+{
+    uint16_t n;
+    memcpy(&n, p, sizeof(n));
+    return ntohs(n);
+}
+
+static inline uint32_t dht_state_get32(const unsigned char *p)
+{
+    uint32_t n;
+    memcpy(&n, p, sizeof(n));
+    return ntohl(n);
+}
+
+static bool dht_state_rec_write(unsigned char rec[],
+                                const struct kad_node_info *info)
+{
+    memset(rec, 0, DHT_STATE_REC_LEN);
+    memcpy(rec, info->id.bytes, KAD_GUID_SPACE_IN_BYTES);
+    unsigned char *p = rec + KAD_GUID_SPACE_IN_BYTES;
+    if (info->addr.ss_family == AF_INET) {
+        const struct sockaddr_in *sa = (const struct sockaddr_in *)&info->addr;
+        p[0] = 4;
+        memcpy(p + 2, &sa->sin_port, 2);
+        memcpy(p + 4, &sa->sin_addr, 4);
+    }
+    else if (info->addr.ss_family == AF_INET6) {
+        const struct sockaddr_in6 *sa = (const struct sockaddr_in6 *)&info->addr;
+        p[0] = 6;
+        memcpy(p + 2, &sa->sin6_port, 2);
+        memcpy(p + 4, &sa->sin6_addr, 16);
+    }
+    else
+        return false;
+    return true;
+}
+
+static bool dht_state_rec_read(struct kad_node_info *info,
+                               const unsigned char rec[])
+{
+    memset(info, 0, sizeof(*info));
+    kad_guid_set(&info->id, rec);
+    const unsigned char *p = rec + KAD_GUID_SPACE_IN_BYTES;
+    if (p[0] == 4) {
+        struct sockaddr_in *sa = (struct sockaddr_in *)&info->addr;
+        sa->sin_family = AF_INET;
+        memcpy(&sa->sin_port, p + 2, 2);
+        memcpy(&sa->sin_addr, p + 4, 4);
+    }
+    else if (p[0] == 6) {
+        struct sockaddr_in6 *sa = (struct sockaddr_in6 *)&info->addr;
+        sa->sin6_family = AF_INET6;
+        memcpy(&sa->sin6_port, p + 2, 2);
+        memcpy(&sa->sin6_addr, p + 4, 16);
+    }
+    else
+        return false;
+    return sockaddr_storage_fmt(info->addr_str, &info->addr);
 }
 
-int kad_read_bootstrap_nodes(struct sockaddr_storage nodes[], size_t nodes_len,
-                             const char state_path[])
+/**
+ * Loads the binary state file mapped at @buf into @dht.
+ */
+static int dht_state_load(struct kad_dht *dht, const unsigned char buf[],
+                          const size_t len)
 {
-    char buf[NODES_FILE_LEN_IN_BYTES];
-    size_t buf_len = 0;
-    if (!file_read(buf, &buf_len, state_path)) {
-        log_error("Failed to read bootsrap nodes file '%s'.", state_path);
+    if (len < DHT_STATE_HDR_LEN) {
+        log_error("Truncated DHT state header.");
+        return -1;
+    }
+    uint16_t version = dht_state_get16(buf + DHT_STATE_OFF_VERSION);
+    if (version != DHT_STATE_VERSION) {
+        log_error("Unsupported DHT state version %u.", version);
+        return -1;
+    }
+    uint16_t rec_len = dht_state_get16(buf + DHT_STATE_OFF_REC_LEN);
+    if (rec_len != DHT_STATE_REC_LEN) {
+        log_error("Unexpected DHT state record length %u (expected %u).",
+                  rec_len, DHT_STATE_REC_LEN);
+        return -1;
+    }
+    size_t nodes_len = dht_state_get32(buf + DHT_STATE_OFF_NODES);
+    if ((len - DHT_STATE_HDR_LEN) / DHT_STATE_REC_LEN != nodes_len ||
+        (len - DHT_STATE_HDR_LEN) % DHT_STATE_REC_LEN != 0) {
+        log_error("Truncated DHT state records.");
         return -1;
     }
-    log_debug("Reading bootstrap nodes from file '%s'.", state_path);
+    uint32_t crc = crc32(0, buf + DHT_STATE_OFF_SELF_ID,
+                         len - DHT_STATE_OFF_SELF_ID);
+    if (crc != dht_state_get32(buf + DHT_STATE_OFF_CRC)) {
+        log_error("DHT state checksum mismatch.");
+        return -1;
+    }
+
+    kad_guid_set(&dht->self_id, buf + DHT_STATE_OFF_SELF_ID);
+
+    struct kad_node_info batch[DHT_STATE_LOAD_BATCH];
+    size_t batch_len = 0;
+    int inserted = 0;
+    const unsigned char *rec = buf + DHT_STATE_HDR_LEN;
+    for (size_t i = 0; i < nodes_len; i++, rec += DHT_STATE_REC_LEN) {
+        if (!dht_state_rec_read(&batch[batch_len], rec)) {
+            log_warning("Ignoring DHT state record #%zu.", i);
+            continue;
+        }
+        batch_len++;
+        if (batch_len == DHT_STATE_LOAD_BATCH) {
+            int n = dht_insert_bulk(dht, batch, batch_len);
+            if (n < 0)
+                return -1;
+            inserted += n;
+            batch_len = 0;
+        }
+    }
+    if (batch_len > 0) {
+        int n = dht_insert_bulk(dht, batch, batch_len);
+        if (n < 0)
+            return -1;
+        inserted += n;
+    }
+
+    return inserted;
+}
 
-    // FIXME would it not be easier to have a simple text file ?
-    int nnodes = benc_decode_bootstrap_nodes(nodes, nodes_len, buf, buf_len);
-    if (nnodes < 0) {
-        log_error("Decoding of bootsrap nodes file (%s) failed.", state_path);
+/**
+ * Loads a bencoded state file, as written by previous versions.
+ */
+static int dht_state_load_benc(struct kad_dht *dht, const char buf[],
+                               const size_t len)
+{
+    struct kad_dht_encoded *encoded = malloc(sizeof(struct kad_dht_encoded));
+    if (!encoded) {
+        log_perror(LOG_ERR, "Failed malloc: %s.", errno);
         return -1;
     }
 
-    return nnodes;
+    int inserted = -1;
+    if (!benc_decode_dht(encoded, buf, len)) {
+        log_error("Decoding of bencoded DHT state failed.");
+        goto cleanup;
+    }
+    log_info("Migrating DHT state from bencode.");
+
+    dht->self_id = encoded->self_id;
+    inserted = dht_insert_bulk(dht, encoded->nodes, encoded->nodes_len);
+
+  cleanup:
+    free(encoded);
+    return inserted;
+}
+
+/**
+ * Loads the state file at @state_path into a new @dht. The file is mapped,
+ * and may be in the binary format or, for migration, in bencode.
+ *
+ * Returns the number of nodes loaded, or -1 on failure.
+ */
+int dht_read(struct kad_dht **dht, const char state_path[])
+{
+    int nread = -1;
+    *dht = NULL;
+
+    int fd = open(state_path, O_RDONLY);
+    if (fd == -1) {
+        log_perror(LOG_ERR, "Failed open: %s.", errno);
+        goto fail;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        log_perror(LOG_ERR, "Failed fstat: %s.", errno);
+        goto cleanup;
+    }
+    size_t len = st.st_size;
+    if (len == 0) {
+        log_error("Empty DHT state file.");
+        goto cleanup;
+    }
+    void *map = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED) {
+        log_perror(LOG_ERR, "Failed mmap: %s.", errno);
+        goto cleanup;
+    }
+
+    *dht = malloc(sizeof(struct kad_dht));
+    if (!*dht) {
+        log_perror(LOG_ERR, "Failed malloc: %s.", errno);
+        goto unmap;
+    }
+    dht_init(*dht);
+
+    if (len >= DHT_STATE_MAGIC_LEN &&
+        memcmp(map, DHT_STATE_MAGIC, DHT_STATE_MAGIC_LEN) == 0)
+        nread = dht_state_load(*dht, map, len);
+    else
+        nread = dht_state_load_benc(*dht, map, len);
+
+    if (nread >= 0) {
+        char *id = log_fmt_hex(LOG_DEBUG, (*dht)->self_id.bytes, KAD_GUID_SPACE_IN_BYTES);
+        log_debug("self_id=%s", id);
+        free_safer(id);
+    }
+    else
+        dht_destroy(*dht);
+
+  unmap:
+    if (munmap(map, len) == -1)
+        log_perror(LOG_ERR, "Failed munmap: %s.", errno);
+  cleanup:
+    close(fd);
+  fail:
+    if (nread < 0) {
+        log_error("Failed to read DHT state file (%s).", state_path);
+        *dht = NULL;
+    }
+    return nread;
 }
 
-static size_t
-dht_encode(const struct kad_dht *dht, struct kad_dht_encoded *encoded)
+/**
+ * Copies the nodes of the buckets into @encoded: a cheap, self-contained
+ * snapshot that can be encoded and written away from the event loop.
+ */
+size_t dht_snapshot(const struct kad_dht *dht, struct kad_dht_encoded *encoded)
 {
     encoded->self_id = dht->self_id;
     size_t start = encoded->nodes_len;
@@ -385,24 +883,45 @@ dht_encode(const struct kad_dht *dht, struct kad_dht_encoded *encoded)
     return encoded->nodes_len - start;
 }
 
-bool dht_write(const struct kad_dht *dht, const char state_path[]) {
-    bool res = true;
-
-    struct kad_dht_encoded encoded = {0};
-    dht_encode(dht, &encoded);
-
-    struct iobuf buf = {0};
-    if (!benc_encode_dht(&buf, &encoded)) {
-        log_error("Encoding of DHT state file (%s) failed.", state_path);
-        res = false; goto cleanup;
+bool dht_write_encoded(const struct kad_dht_encoded *encoded,
+                       const char state_path[])
+{
+    size_t len = DHT_STATE_HDR_LEN + encoded->nodes_len * DHT_STATE_REC_LEN;
+    unsigned char *buf = malloc(len);
+    if (!buf) {
+        log_perror(LOG_ERR, "Failed malloc: %s.", errno);
+        return false;
     }
 
-    if (!file_write(state_path, buf.buf, buf.pos)) {
-        log_error("Failed to write DHT state file (%s).", state_path);
-        res = false; goto cleanup;
+    memcpy(buf, DHT_STATE_MAGIC, DHT_STATE_MAGIC_LEN);
+    dht_state_put16(buf + DHT_STATE_OFF_VERSION, DHT_STATE_VERSION);
+    dht_state_put16(buf + DHT_STATE_OFF_REC_LEN, DHT_STATE_REC_LEN);
+    memcpy(buf + DHT_STATE_OFF_SELF_ID, encoded->self_id.bytes,
+           KAD_GUID_SPACE_IN_BYTES);
+    size_t nodes_len = 0;
+    for (size_t i = 0; i < encoded->nodes_len; i++) {
+        unsigned char *rec = buf + DHT_STATE_HDR_LEN + nodes_len * DHT_STATE_REC_LEN;
+        if (dht_state_rec_write(rec, &encoded->nodes[i]))
+            nodes_len++;
+        else
+            log_warning("Ignoring node of unknown address family.");
     }
-
-  cleanup:
-    iobuf_reset(&buf);
+    len = DHT_STATE_HDR_LEN + nodes_len * DHT_STATE_REC_LEN;
+    dht_state_put32(buf + DHT_STATE_OFF_NODES, nodes_len);
+    dht_state_put32(buf + DHT_STATE_OFF_CRC,
+                    crc32(0, buf + DHT_STATE_OFF_SELF_ID,
+                          len - DHT_STATE_OFF_SELF_ID));
+
+    bool res = file_write_atomic(state_path, (char *)buf, len);
+    if (!res)
+        log_error("Failed to write DHT state file (%s).", state_path);
+    free(buf);
     return res;
 }
+
+bool dht_write(const struct kad_dht *dht, const char state_path[])
+{
+    struct kad_dht_encoded encoded = {0};
+    dht_snapshot(dht, &encoded);
+    return dht_write_encoded(&encoded, state_path);
+}
@@ -8,6 +8,7 @@
  */
 
 #include <netdb.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <string.h>
 #include <sys/socket.h>
@@ -16,6 +17,7 @@
 #include "utils/cont.h"
 #include "utils/byte_array.h"
 #include "utils/list.h"
+#include "utils/pool.h"
 #include "utils/safer.h"
 
 #define ADDR_STR_MAX 32+1+4+1
@@ -27,6 +29,14 @@
         free_safer(node);                                               \
     }
 
+/** Same as list_free_all() for pool-allocated items. */
+#define list_pool_put_all(itemp, type, field, pname, pool)              \
+    while (!list_is_empty(itemp)) {                                     \
+        type *node = cont(itemp->prev, type, field);                    \
+        list_delete(itemp->prev);                                       \
+        pname##_put(pool, node);                                        \
+    }
+
 /* Byte arrays are not affected by endian issues.
    http://stackoverflow.com/a/4523537/421846 */
 BYTE_ARRAY_GENERATE(kad_guid, KAD_GUID_SPACE_IN_BYTES)
@@ -43,9 +53,37 @@ struct kad_node {
     struct list_item     item;
     struct kad_node_info info;
     time_t               last_seen;
-    int                  stale;
+    int                  stale; // queries not responded to since last_seen
+    /* Smoothed round-trip time and its mean deviation, 0 when unknown.
+       Scaled by 8 and 4, in ms, so that small errors still count. */
+    int                  srtt_ms8;
+    int                  rttvar_ms4;
+};
+
+#define KAD_NODE_GOOD_S        (15 * 60)
+#define KAD_NODE_BAD_TIMEOUTS  2
+
+enum kad_node_state {
+    KAD_NODE_STATE_NONE,
+    KAD_NODE_STATE_GOOD,
+    KAD_NODE_STATE_QUESTIONABLE,
+    KAD_NODE_STATE_BAD,
 };
 
+#define KAD_NODE_POOL_SLAB_LEN 64
+POOL_GENERATE(kad_node_pool, struct kad_node, KAD_NODE_POOL_SLAB_LEN)
+extern kad_node_pool pool_kad_nodes;
+
+enum dht_journal_op {
+    DHT_JOURNAL_NONE,
+    DHT_JOURNAL_INSERT,
+    DHT_JOURNAL_DELETE,
+};
+
+/** Called for each change of the buckets, for journaling. */
+typedef void (*dht_journal_fn)(enum dht_journal_op op,
+                               const struct kad_node_info *info, void *data);
+
 struct kad_dht {
     kad_guid         self_id;
     /* The routing table is implemented as hash table: an array of lists
@@ -66,6 +104,10 @@ struct kad_dht {
        recently seen entry having the highest priority as a replacement
        candidate. » */
     struct list_item replacement; // kad_node list
+    /* Last change of each bucket, or lookup into it, for refreshing. */
+    time_t           bucket_active[KAD_GUID_SPACE_IN_BITS];
+    dht_journal_fn   journal;
+    void            *journal_data;
 };
 
 /**
@@ -92,11 +134,11 @@ static inline void kad_node_info_copy(struct kad_node_info *dst,
 
 int dht_read(struct kad_dht **dht, const char state_path[]);
 bool dht_write(const struct kad_dht *dht, const char state_path[]);
+size_t dht_snapshot(const struct kad_dht *dht, struct kad_dht_encoded *encoded);
+bool dht_write_encoded(const struct kad_dht_encoded *encoded, const char state_path[]);
 struct kad_dht *dht_create();
 void dht_destroy(struct kad_dht * dht);
 
-int kad_read_bootstrap_nodes(struct sockaddr_storage nodes[], size_t nodes_len, const char state_path[]);
-
 /**
  * « When a Kademlia node receives any message (re- quest or reply) from
  * another node, it updates the appropriate k-bucket for the sender’s node ID.
@@ -112,9 +154,32 @@ int kad_read_bootstrap_nodes(struct sockaddr_storage nodes[], size_t nodes_len,
  */
 int dht_update(struct kad_dht *dht, const struct kad_node_info *info);
 bool dht_insert(struct kad_dht *dht, const struct kad_node_info *info);
+int dht_insert_bulk(struct kad_dht *dht, const struct kad_node_info infos[],
+                    const size_t infos_len);
 bool dht_delete(struct kad_dht *dht, const kad_guid *node_id);
 size_t dht_find_closest(struct kad_dht *dht, const kad_guid *target,
                         struct kad_node_info nodes[], const kad_guid *caller);
 const struct kad_node *dht_find(const struct kad_dht *dht, const kad_guid *node_id);
+size_t dht_bucket_fill(const struct kad_dht *dht, uint64_t fill[]);
+void dht_bucket_touch(struct kad_dht *dht, const size_t bkt_idx,
+                      const time_t now);
+void dht_bucket_random_id(const struct kad_dht *dht, const size_t bkt_idx,
+                          kad_guid *id);
+enum kad_node_state kad_node_state(const struct kad_node *node, const time_t now);
+
+/* Retransmission timeout of @node, srtt + 4 * rttvar, or 0 when unknown. */
+static inline long long kad_node_rto_ms(const struct kad_node *node)
+{
+    return node->srtt_ms8 ? (node->srtt_ms8 >> 3) + node->rttvar_ms4 : 0;
+}
+const struct kad_node *
+dht_evict_candidate(const struct kad_dht *dht, const kad_guid *node_id,
+                    const time_t now);
+bool dht_timeout(struct kad_dht *dht, const kad_guid *node_id);
+bool dht_rtt_sample(struct kad_dht *dht, const kad_guid *node_id,
+                    const long long rtt_ms);
+bool dht_evict(struct kad_dht *dht, const kad_guid *node_id);
+size_t dht_mark_stale(struct kad_dht *dht);
+size_t dht_purge_stale(struct kad_dht *dht);
 
 #endif /* DHT_H */
@@ -0,0 +1,133 @@
+/* Copyright (c) 2017-2019 Foudil Brétel.  All rights reserved. */
+#include <netinet/in.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/random.h>
+#include "metrics.h"
+#include "net/kad/ratelimit.h"
+
+/* Keyed, so that colliding sources cannot be picked in advance. */
+static uint32_t kad_ratelimit_seed = 0;
+
+/* FNV-1a. */
+static inline uint32_t kad_ratelimit_entry_hash(const struct kad_ratelimit_key key)
+{
+    uint32_t hash = 2166136261u ^ kad_ratelimit_seed;
+    for (size_t i = 0; i < sizeof(key.bytes); i++) {
+        hash ^= key.bytes[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static inline int kad_ratelimit_entry_compare(const struct kad_ratelimit_key keyA,
+                                              const struct kad_ratelimit_key keyB)
+{
+    return memcmp(keyA.bytes, keyB.bytes, sizeof(keyA.bytes));
+}
+
+#define HASH_KEY_TYPE struct kad_ratelimit_key
+#include "utils/hash.h"
+HASH_GENERATE(kad_ratelimit_entry, item, key)
+
+void kad_ratelimit_init(struct kad_ratelimit *rl, const long long now)
+{
+    if (kad_ratelimit_seed == 0 &&
+        getrandom(&kad_ratelimit_seed, sizeof(kad_ratelimit_seed), 0) !=
+        sizeof(kad_ratelimit_seed))
+        kad_ratelimit_seed = random();
+    rl->entries_len = 0;
+    hash_init(rl->hash, KAD_RATELIMIT_HASH_LEN);
+    list_init(&rl->lru);
+    rl->err_tokens = KAD_RATELIMIT_ERR_BURST * 1000LL;
+    rl->err_ts_ms = now;
+}
+
+static bool kad_ratelimit_key_set(struct kad_ratelimit_key *key,
+                                  const struct sockaddr_storage *addr)
+{
+    memset(key->bytes, 0, sizeof(key->bytes));
+    if (addr->ss_family == AF_INET) {
+        const struct sockaddr_in *sa = (const struct sockaddr_in *)addr;
+        memcpy(key->bytes, &sa->sin_addr, sizeof(sa->sin_addr));
+        key->bytes[15] = 4;
+        return true;
+    }
+    else if (addr->ss_family == AF_INET6) {
+        const struct sockaddr_in6 *sa = (const struct sockaddr_in6 *)addr;
+        if (IN6_IS_ADDR_V4MAPPED(&sa->sin6_addr)) {
+            memcpy(key->bytes, &sa->sin6_addr.s6_addr[12], 4);
+            key->bytes[15] = 4;
+        }
+        else {
+            memcpy(key->bytes, sa->sin6_addr.s6_addr, 8); // /64
+            key->bytes[15] = 6;
+        }
+        return true;
+    }
+    return false;
+}
+
+/* Refills @tokens, in thousandths, at @rate per second up to @burst. */
+static inline bool kad_ratelimit_take(long long *tokens, long long *ts_ms,
+                                      const unsigned rate, const unsigned burst,
+                                      const long long now)
+{
+    if (now > *ts_ms) {
+        *tokens += (now - *ts_ms) * rate;
+        if (*tokens > burst * 1000LL)
+            *tokens = burst * 1000LL;
+        *ts_ms = now;
+    }
+    if (*tokens < 1000)
+        return false;
+    *tokens -= 1000;
+    return true;
+}
+
+/**
+ * Takes a token from the bucket of the source of @addr. Returns false when the
+ * datagram should be dropped.
+ */
+bool kad_ratelimit_allow(struct kad_ratelimit *rl,
+                         const struct sockaddr_storage *addr, const long long now)
+{
+    struct kad_ratelimit_key key;
+    if (!kad_ratelimit_key_set(&key, addr))
+        return false;
+
+    struct kad_ratelimit_entry *entry =
+        kad_ratelimit_entry_get(rl->hash, KAD_RATELIMIT_HASH_LEN, key);
+    if (entry) {
+        list_delete(&entry->lru);
+    }
+    else {
+        if (rl->entries_len < KAD_RATELIMIT_LEN) {
+            entry = &rl->entries[rl->entries_len++];
+        }
+        else {
+            entry = cont(rl->lru.prev, struct kad_ratelimit_entry, lru);
+            list_delete(&entry->lru);
+            hash_delete(&entry->item);
+            metrics_inc(METRICS_CNT_KAD_RATE_LIMIT_EVICTIONS);
+        }
+        entry->key = key;
+        entry->tokens = KAD_RATELIMIT_BURST * 1000LL;
+        entry->ts_ms = now;
+        kad_ratelimit_entry_insert(rl->hash, KAD_RATELIMIT_HASH_LEN, key, &entry->item);
+    }
+    list_prepend(&rl->lru, &entry->lru);
+
+    return kad_ratelimit_take(&entry->tokens, &entry->ts_ms, KAD_RATELIMIT_RATE,
+                              KAD_RATELIMIT_BURST, now);
+}
+
+/**
+ * Takes a token from the budget of error replies. Returns false when the error
+ * reply should not be sent.
+ */
+bool kad_ratelimit_error_allow(struct kad_ratelimit *rl, const long long now)
+{
+    return kad_ratelimit_take(&rl->err_tokens, &rl->err_ts_ms,
+                              KAD_RATELIMIT_ERR_RATE, KAD_RATELIMIT_ERR_BURST, now);
+}
@@ -0,0 +1,59 @@
+/* Copyright (c) 2017-2019 Foudil Brétel.  All rights reserved. */
+#ifndef KAD_RATELIMIT_H
+#define KAD_RATELIMIT_H
+
+/**
+ * Per-source rate limiter of inbound KRPC datagrams.
+ *
+ * Each source gets a token bucket, checked before decoding. Sources are IPv4
+ * addresses, or IPv6 /64 prefixes, which are what a single host usually
+ * controls. Buckets live in a fixed table: when it is full, the least recently
+ * seen source is forgotten, and thus starts afresh with a full bucket when
+ * seen again.
+ *
+ * Error replies draw from a separate budget shared by all sources, so that
+ * garbage, spoofed or not, cannot be amplified into a flood of replies.
+ */
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include "utils/list.h"
+
+#define KAD_RATELIMIT_LEN      1024 // sources tracked
+#define KAD_RATELIMIT_HASH_LEN 256
+/* Datagrams per second, and burst, of each source. */
+#define KAD_RATELIMIT_RATE     20
+#define KAD_RATELIMIT_BURST    40
+/* Error replies per second, and burst, for all sources. */
+#define KAD_RATELIMIT_ERR_RATE  10
+#define KAD_RATELIMIT_ERR_BURST 10
+
+struct kad_ratelimit_key {
+    unsigned char bytes[16];
+};
+
+struct kad_ratelimit_entry {
+    struct list_item         item; // in a hash slot
+    struct list_item         lru;
+    struct kad_ratelimit_key key;
+    /* In thousandths of a datagram. */
+    long long                tokens;
+    long long                ts_ms;
+};
+
+struct kad_ratelimit {
+    struct kad_ratelimit_entry entries[KAD_RATELIMIT_LEN];
+    size_t                     entries_len;
+    struct list_item           hash[KAD_RATELIMIT_HASH_LEN];
+    struct list_item           lru; // most recently seen first
+    long long                  err_tokens;
+    long long                  err_ts_ms;
+};
+
+void kad_ratelimit_init(struct kad_ratelimit *rl, const long long now);
+bool kad_ratelimit_allow(struct kad_ratelimit *rl,
+                         const struct sockaddr_storage *addr, const long long now);
+bool kad_ratelimit_error_allow(struct kad_ratelimit *rl, const long long now);
+
+#endif /* KAD_RATELIMIT_H */
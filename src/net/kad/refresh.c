@@ -0,0 +1,65 @@
+/* Copyright (c) 2017-2019 Foudil Brétel.  All rights reserved. */
+#include <stdlib.h>
+#include "log.h"
+#include "net/kad/refresh.h"
+
+static inline time_t kad_refresh_jitter()
+{
+    return random() % (KAD_REFRESH_JITTER_S + 1);
+}
+
+void kad_refresh_sched_init(struct kad_refresh_sched *sched,
+                            const unsigned rate, const time_t now)
+{
+    for (size_t i = 0; i < KAD_GUID_SPACE_IN_BITS; i++)
+        sched->jitter[i] = kad_refresh_jitter();
+    sched->rate = rate;
+    sched->credit = 60;
+    sched->credit_s = now;
+    sched->backlog = 0;
+}
+
+/**
+ * Returns the index of the next bucket to refresh at @now, which is then
+ * deemed refreshed, or -1 when none is due or pacing holds them back.
+ */
+int kad_refresh_sched_next(struct kad_refresh_sched *sched,
+                           struct kad_dht *dht, const time_t now)
+{
+    if (now > sched->credit_s) {
+        sched->credit += (now - sched->credit_s) * sched->rate;
+        if (sched->credit > 60)
+            sched->credit = 60;
+    }
+    sched->credit_s = now;
+
+    uint64_t fill[KAD_GUID_SPACE_IN_BITS];
+    dht_bucket_fill(dht, fill);
+    int next = -1;
+    time_t next_due = 0;
+    size_t due = 0;
+    for (size_t i = 0; i < KAD_GUID_SPACE_IN_BITS; i++) {
+        if (fill[i] == 0)
+            continue;
+        time_t bkt_due = dht->bucket_active[i] + KAD_REFRESH_INTERVAL_S +
+            sched->jitter[i];
+        if (bkt_due > now)
+            continue;
+        due++;
+        if (next < 0 || bkt_due < next_due) {
+            next = i;
+            next_due = bkt_due;
+        }
+    }
+
+    if (next < 0 || sched->credit < 60) {
+        sched->backlog = due;
+        return -1;
+    }
+    sched->credit -= 60;
+    sched->backlog = due - 1;
+    sched->jitter[next] = kad_refresh_jitter();
+    dht_bucket_touch(dht, next, now);
+    log_debug("Refreshing bucket %d.", next);
+    return next;
+}
@@ -0,0 +1,44 @@
+/* Copyright (c) 2017-2019 Foudil Brétel.  All rights reserved. */
+#ifndef KAD_REFRESH_H
+#define KAD_REFRESH_H
+
+/**
+ * Scheduler of bucket refreshes.
+ *
+ * « Buckets that have not been changed in 15 minutes should be "refreshed."
+ * This is done by picking a random ID in the range of the bucket and
+ * performing a find_nodes search on it. » (BEP 5)
+ *
+ * A bucket is due once idle for KAD_REFRESH_INTERVAL_S, plus a jitter drawn
+ * anew for each bucket after each refresh, so that buckets filled together do
+ * not fall due together. Due buckets are handed out at a capped rate, longest
+ * idle first, and the ones held back are counted as the backlog. Empty buckets
+ * have no node to ask, and are not refreshed. The scheduler does no I/O.
+ */
+#include <stddef.h>
+#include <time.h>
+#include "net/kad/dht.h"
+
+#define KAD_REFRESH_INTERVAL_S 900
+#define KAD_REFRESH_JITTER_S   180
+#define KAD_REFRESH_TICK_MS    1000
+/* Bucket refreshes per minute. */
+#define KAD_REFRESH_RATE       6
+/* Nodes asked for each refresh. */
+#define KAD_REFRESH_ALPHA      3
+
+struct kad_refresh_sched {
+    time_t   jitter[KAD_GUID_SPACE_IN_BITS];
+    unsigned rate;
+    /* Pacing credit, in sixtieths of a refresh. */
+    long     credit;
+    time_t   credit_s;
+    size_t   backlog;
+};
+
+void kad_refresh_sched_init(struct kad_refresh_sched *sched,
+                            const unsigned rate, const time_t now);
+int kad_refresh_sched_next(struct kad_refresh_sched *sched,
+                           struct kad_dht *dht, const time_t now);
+
+#endif /* KAD_REFRESH_H */
@@ -1,14 +1,38 @@
 /* Copyright (c) 2017-2019 Foudil Brétel.  All rights reserved. */
+#include <errno.h>
 #include <limits.h>
+#include <sys/random.h>
+#include <time.h>
 #include <unistd.h>
 #include "log.h"
+#include "metrics.h"
 #include "utils/safer.h"
 #include "net/kad/bencode/rpc_msg.h"
 #include "net/socket.h"
 #include "timers.h"
+#include "trace.h"
 #include "net/kad/rpc.h"
 
 #define DHT_STATE_FILENAME "dht.dat"
+#define DHT_JOURNAL_FILENAME "dht.journal"
+
+kad_rpc_query_pool pool_kad_queries = {0};
+
+/**
+ * Seeds random(3), which draws node ids, bootstrap samples and refresh
+ * jitter, on every start whether the DHT is created or read.
+ */
+static void kad_rpc_seed(void)
+{
+    unsigned seed;
+    if (getrandom(&seed, sizeof(seed), 0) != sizeof(seed)) {
+        log_perror(LOG_WARNING, "Failed getrandom: %s.", errno);
+        struct timespec ts = {0};
+        clock_gettime(CLOCK_REALTIME, &ts);
+        seed = ts.tv_sec ^ ts.tv_nsec ^ getpid();
+    }
+    srandom(seed);
+}
 
 /**
  * Creates a DHT.
@@ -21,6 +45,7 @@
 int kad_rpc_init(struct kad_ctx *ctx, const char conf_dir[])
 {
     int nodes_len = 0;
+    kad_rpc_seed();
 
     if (conf_dir) {
         char dht_state_path[PATH_MAX];
@@ -32,6 +57,14 @@ int kad_rpc_init(struct kad_ctx *ctx, const char conf_dir[])
             log_info("DHT state file not readable and writable. Generating new DHT.");
             ctx->dht = dht_create();
         }
+
+        char journal_path[PATH_MAX];
+        snprintf(journal_path, PATH_MAX-1, "%s/"DHT_JOURNAL_FILENAME, conf_dir);
+        journal_path[PATH_MAX-1] = '\0';
+        if (ctx->dht && kad_journal_replay(ctx->dht, journal_path) > 0) {
+            uint64_t fill[KAD_GUID_SPACE_IN_BITS];
+            nodes_len = dht_bucket_fill(ctx->dht, fill);
+        }
     }
     else {
         ctx->dht = dht_create();
@@ -42,28 +75,233 @@ int kad_rpc_init(struct kad_ctx *ctx, const char conf_dir[])
         return -1;
     }
     list_init(&ctx->queries);
+    for (size_t i = 0; i < KAD_RPC_WHEEL_LEN; i++)
+        list_init(&ctx->wheel[i]);
+    ctx->wheel_ms = now_millis();
+    list_init(&ctx->resend);
+    ctx->query_retries = KAD_RPC_QUERY_RETRIES;
+    kad_ratelimit_init(&ctx->ratelimit, now_millis());
+    ctx->arena = (struct arena)ARENA_INIT(KAD_RPC_ARENA_LEN);
+    iochain_clear(&ctx->sndbuf);
+    ctx->ckpt_on = false;
+    ctx->probes_len = 0;
+    kad_bootstrap_sched_init(&ctx->boot, NULL, 0, 0, 0, false, 0);
+    kad_refresh_sched_init(&ctx->refresh, KAD_REFRESH_RATE, time(NULL));
 
     log_debug("DHT initialized.");
     return nodes_len;
 }
 
+/**
+ * Starts background checkpoints of the DHT into @conf_dir. With @journal,
+ * changes between checkpoints are also journaled.
+ */
+bool kad_rpc_checkpoint_start(struct kad_ctx *ctx, const char conf_dir[],
+                              const bool journal)
+{
+    char dht_state_path[PATH_MAX];
+    snprintf(dht_state_path, PATH_MAX-1, "%s/"DHT_STATE_FILENAME, conf_dir);
+    dht_state_path[PATH_MAX-1] = '\0';
+    char journal_path[PATH_MAX];
+    snprintf(journal_path, PATH_MAX-1, "%s/"DHT_JOURNAL_FILENAME, conf_dir);
+    journal_path[PATH_MAX-1] = '\0';
+
+    if (!kad_checkpoint_start(&ctx->ckpt, dht_state_path, journal_path, journal))
+        return false;
+    ctx->ckpt_on = true;
+    ctx->dht->journal = kad_checkpoint_journal;
+    ctx->dht->journal_data = &ctx->ckpt;
+    return true;
+}
+
+/**
+ * Hands a snapshot of the DHT over to the checkpoint thread.
+ */
+bool kad_rpc_checkpoint(struct kad_ctx *ctx)
+{
+    if (!ctx->ckpt_on)
+        return true;
+    return kad_checkpoint_submit(&ctx->ckpt, ctx->dht);
+}
+
 void kad_rpc_terminate(struct kad_ctx *ctx, const char conf_dir[])
 {
-    if (conf_dir) {
+    if (ctx->ckpt_on) {
+        ctx->dht->journal = NULL;
+        if (!kad_checkpoint_submit(&ctx->ckpt, ctx->dht))
+            log_error("Saving DHT failed.");
+        kad_checkpoint_stop(&ctx->ckpt);
+        ctx->ckpt_on = false;
+    }
+    else if (conf_dir) {
         char dht_state_path[PATH_MAX];
         snprintf(dht_state_path, PATH_MAX-1, "%s/"DHT_STATE_FILENAME, conf_dir);
         dht_state_path[PATH_MAX-1] = '\0';
         if (!dht_write(ctx->dht, dht_state_path)) {
             log_error("Saving DHT failed.");
         }
+        else {
+            char journal_path[PATH_MAX];
+            snprintf(journal_path, PATH_MAX-1, "%s/"DHT_JOURNAL_FILENAME, conf_dir);
+            journal_path[PATH_MAX-1] = '\0';
+            if (unlink(journal_path) == -1 && errno != ENOENT)
+                log_perror(LOG_ERR, "Failed unlink: %s.", errno);
+        }
     }
 
+    kad_bootstrap_sched_terminate(&ctx->boot);
     dht_destroy(ctx->dht);
     struct list_item *query = &ctx->queries;
-    list_free_all(query, struct kad_rpc_query, item);
+    list_pool_put_all(query, struct kad_rpc_query, item, kad_rpc_query_pool,
+                      &pool_kad_queries);
+    arena_destroy(&ctx->arena);
     log_debug("DHT terminated.");
 }
 
+/**
+ * Refreshes metrics that are derived from the routing table and pools, rather
+ * than recorded on the fly. Call right before taking a snapshot.
+ */
+void kad_rpc_metrics_update(const struct kad_ctx *ctx)
+{
+    metrics_gauge_set(METRICS_GAUGE_DHT_NODES,
+                      dht_bucket_fill(ctx->dht, metrics_local.dht_fill));
+    metrics_pool_set(METRICS_POOL_KAD_QUERY, &pool_kad_queries.stats);
+    metrics_pool_set(METRICS_POOL_KAD_NODE, &pool_kad_nodes.stats);
+}
+
+static struct kad_rpc_probe *
+kad_rpc_probe_find(struct kad_ctx *ctx, const kad_guid *node_id)
+{
+    for (size_t i = 0; i < ctx->probes_len; i++)
+        if (kad_guid_eq(&ctx->probes[i].node.id, node_id))
+            return &ctx->probes[i];
+    return NULL;
+}
+
+static void kad_rpc_probe_remove(struct kad_ctx *ctx, struct kad_rpc_probe *probe)
+{
+    *probe = ctx->probes[--ctx->probes_len];
+}
+
+/**
+ * Counts a failed attempt at sending @probe. After KAD_RPC_PROBE_TRIES, the
+ * probe is dropped and its candidate kept, so that unsendable probes do not
+ * hold the probe slots. Returns true when dropped.
+ */
+bool kad_rpc_probe_unsent(struct kad_ctx *ctx, struct kad_rpc_probe *probe)
+{
+    if (++probe->tries < KAD_RPC_PROBE_TRIES)
+        return false;
+    log_debug("Giving up probing %s.", probe->node.addr_str);
+    metrics_inc(METRICS_CNT_KAD_EVICT_PROBES_DROPPED);
+    kad_rpc_probe_remove(ctx, probe);
+    return true;
+}
+
+static void kad_rpc_query_arm(struct kad_ctx *ctx, struct kad_rpc_query *query)
+{
+    long long at = query->deadline_ms > ctx->wheel_ms ? query->deadline_ms : ctx->wheel_ms;
+    list_append(&ctx->wheel[(at / KAD_RPC_EXPIRE_TICK_MS) % KAD_RPC_WHEEL_LEN],
+                &query->timer);
+}
+
+/**
+ * Registers a query just sent, to be matched with its response, or timed out.
+ */
+void kad_rpc_query_add(struct kad_ctx *ctx, struct kad_rpc_query *query)
+{
+    list_append(&ctx->queries, &query->item);
+    query->deadline_ms = query->ts_ms + query->timeout_ms;
+    kad_rpc_query_arm(ctx, query);
+}
+
+/* The node of @query failed to respond: eviction candidates are evicted. */
+static void kad_rpc_query_fail(struct kad_ctx *ctx, struct kad_rpc_query *query)
+{
+    if (query->node.id.is_set) {
+        dht_timeout(ctx->dht, &query->node.id);
+        struct kad_rpc_probe *probe = kad_rpc_probe_find(ctx, &query->node.id);
+        if (probe && probe->sent) {
+            if (dht_evict(ctx->dht, &query->node.id)) {
+                log_debug("Evicted unresponsive node %s.", query->node.addr_str);
+                metrics_inc(METRICS_CNT_KAD_EVICTIONS);
+            }
+            kad_rpc_probe_remove(ctx, probe);
+        }
+    }
+
+    list_delete(&query->timer);
+    list_delete(&query->item);
+    kad_rpc_query_pool_put(&pool_kad_queries, query);
+    metrics_gauge_add(METRICS_GAUGE_KAD_QUERIES_PENDING, -1);
+    metrics_inc(METRICS_CNT_KAD_QUERY_TIMEOUT);
+}
+
+/**
+ * Turns the timeout wheel up to @now. Queries timed out are queued for
+ * retransmission with a doubled timeout, or expired when out of retries.
+ *
+ * Returns the number of queries expired.
+ */
+size_t kad_rpc_expire(struct kad_ctx *ctx, const long long now)
+{
+    /* Queries are armed no earlier than the wheel's time, which thus does
+       not go backwards. */
+    long long tick = ctx->wheel_ms / KAD_RPC_EXPIRE_TICK_MS;
+    if (now > ctx->wheel_ms)
+        ctx->wheel_ms = now;
+    long long tick_end = ctx->wheel_ms / KAD_RPC_EXPIRE_TICK_MS;
+    if (tick_end - tick >= KAD_RPC_WHEEL_LEN)
+        tick = tick_end - KAD_RPC_WHEEL_LEN + 1;
+
+    size_t expired = 0;
+    for (; tick <= tick_end; tick++) {
+        struct list_item *slot = &ctx->wheel[tick % KAD_RPC_WHEEL_LEN];
+        struct list_item *it = slot->next;
+        while (it != slot) {
+            struct kad_rpc_query *query = cont(it, struct kad_rpc_query, timer);
+            it = it->next;
+            if (query->deadline_ms > now)
+                continue;
+
+            if (query->retries > 0) {
+                query->retries--;
+                query->resent = true;
+                query->timeout_ms *= 2;
+                if (query->timeout_ms > KAD_RPC_QUERY_BACKOFF_MAX_MS)
+                    query->timeout_ms = KAD_RPC_QUERY_BACKOFF_MAX_MS;
+                list_delete(&query->timer);
+                list_append(&ctx->resend, &query->timer);
+                continue;
+            }
+            kad_rpc_query_fail(ctx, query);
+            expired++;
+        }
+    }
+    return expired;
+}
+
+/**
+ * Encodes into @ch the next query due for retransmission, with its original
+ * tx_id, and re-arms its timeout from @now. Returns NULL when none is due.
+ */
+struct kad_rpc_query *kad_rpc_query_resend_next(struct kad_ctx *ctx, struct iochain *ch,
+                                                const long long now)
+{
+    while (!list_is_empty(&ctx->resend)) {
+        struct kad_rpc_query *query = cont(ctx->resend.next, struct kad_rpc_query, timer);
+        list_delete(&query->timer);
+        query->deadline_ms = now + query->timeout_ms;
+        kad_rpc_query_arm(ctx, query);
+        iochain_clear(ch);
+        if (benc_encode_rpc_msg(ch, &query->msg))
+            return query;
+        log_error("Error while encoding query for retransmission.");
+    }
+    return NULL;
+}
+
 static struct kad_rpc_query *
 kad_rpc_query_find(struct kad_ctx *ctx, const kad_rpc_msg_tx_id *tx_id)
 {
@@ -89,6 +327,22 @@ kad_rpc_query_find(struct kad_ctx *ctx, const kad_rpc_msg_tx_id *tx_id)
     return query;
 }
 
+/* Queues a ping of the node @node_id would replace, if needed. */
+static void kad_rpc_probe_add(struct kad_ctx *ctx, const kad_guid *node_id)
+{
+    const struct kad_node *lrs = dht_evict_candidate(ctx->dht, node_id, time(NULL));
+    if (!lrs || kad_rpc_probe_find(ctx, &lrs->info.id))
+        return;
+    if (ctx->probes_len >= KAD_RPC_PROBES_MAX) {
+        log_debug("Too many eviction probes. Skipping %s.", lrs->info.addr_str);
+        return;
+    }
+    kad_node_info_copy(&ctx->probes[ctx->probes_len].node, &lrs->info);
+    ctx->probes[ctx->probes_len].sent = false;
+    ctx->probes[ctx->probes_len].tries = 0;
+    ctx->probes_len++;
+}
+
 static void
 kad_rpc_update_dht(struct kad_ctx *ctx, const struct sockaddr_storage *addr,
                    const kad_guid *node_id)
@@ -108,6 +362,18 @@ kad_rpc_update_dht(struct kad_ctx *ctx, const struct sockaddr_storage *addr,
     else
         log_warning("Failed to update kad_node (id=%s)", id);
     free_safer(id);
+    kad_rpc_probe_add(ctx, node_id);
+}
+
+static struct kad_rpc_msg *kad_rpc_msg_alloc(struct kad_ctx *ctx)
+{
+    struct kad_rpc_msg *msg = arena_alloc(&ctx->arena, sizeof(*msg));
+    if (!msg) {
+        log_perror(LOG_ERR, "Failed malloc: %s.", errno);
+        return NULL;
+    }
+    memset(msg, 0, sizeof(*msg));
+    return msg;
 }
 
 static bool kad_rpc_handle_error(const struct kad_rpc_msg *msg)
@@ -121,7 +387,7 @@ static bool kad_rpc_handle_error(const struct kad_rpc_msg *msg)
 
 static bool
 kad_rpc_handle_query(struct kad_ctx *ctx, const struct kad_rpc_msg *msg,
-                     struct iobuf *rsp)
+                     struct iochain *rsp)
 {
     switch (msg->meth) {
     case KAD_RPC_METH_NONE: {
@@ -130,12 +396,14 @@ kad_rpc_handle_query(struct kad_ctx *ctx, const struct kad_rpc_msg *msg,
     }
 
     case KAD_RPC_METH_PING: {
-        struct kad_rpc_msg resp = {0};
-        resp.tx_id = msg->tx_id;
-        resp.node_id = ctx->dht->self_id;
-        resp.type = KAD_RPC_TYPE_RESPONSE;
-        resp.meth = KAD_RPC_METH_PING;
-        if (!benc_encode_rpc_msg(rsp, &resp)) {
+        struct kad_rpc_msg *resp = kad_rpc_msg_alloc(ctx);
+        if (!resp)
+            return false;
+        resp->tx_id = msg->tx_id;
+        resp->node_id = ctx->dht->self_id;
+        resp->type = KAD_RPC_TYPE_RESPONSE;
+        resp->meth = KAD_RPC_METH_PING;
+        if (!benc_encode_rpc_msg(rsp, resp)) {
             log_error("Error while encoding ping response.");
             return false;
         }
@@ -143,14 +411,16 @@ kad_rpc_handle_query(struct kad_ctx *ctx, const struct kad_rpc_msg *msg,
     }
 
     case KAD_RPC_METH_FIND_NODE: {
-        struct kad_rpc_msg resp = {0};
-        resp.tx_id = msg->tx_id;
-        resp.node_id = ctx->dht->self_id;
-        resp.type = KAD_RPC_TYPE_RESPONSE;
-        resp.meth = KAD_RPC_METH_FIND_NODE;
-        resp.nodes_len = dht_find_closest(ctx->dht, &msg->target, resp.nodes,
-                                          &msg->node_id);
-        if (!benc_encode_rpc_msg(rsp, &resp)) {
+        struct kad_rpc_msg *resp = kad_rpc_msg_alloc(ctx);
+        if (!resp)
+            return false;
+        resp->tx_id = msg->tx_id;
+        resp->node_id = ctx->dht->self_id;
+        resp->type = KAD_RPC_TYPE_RESPONSE;
+        resp->meth = KAD_RPC_METH_FIND_NODE;
+        resp->nodes_len = dht_find_closest(ctx->dht, &msg->target, resp->nodes,
+                                           &msg->node_id);
+        if (!benc_encode_rpc_msg(rsp, resp)) {
             log_error("Error while encoding find node response.");
             return false;
         }
@@ -171,8 +441,25 @@ kad_rpc_handle_response(struct kad_ctx *ctx, const struct kad_rpc_msg *msg)
         char *id = log_fmt_hex(LOG_DEBUG, msg->tx_id.bytes, KAD_RPC_MSG_TX_ID_LEN);
         log_error("Query for response id(%s) not found.", id);
         free_safer(id);
+        metrics_inc(METRICS_CNT_KAD_RSP_UNMATCHED);
         return false;
     }
+    metrics_inc(METRICS_CNT_KAD_RSP_MATCHED);
+    long long now_us = now_micros();
+    long long now = now_us / 1000;
+    /* Responses to retransmitted queries are ambiguous samples (Karn). */
+    if (now_us >= query->ts_us && !query->resent) {
+        metrics_hist_record(METRICS_HIST_KAD_RTT_US, now_us - query->ts_us);
+        /* Only to the node queried: responders may claim any id. */
+        if (query->node.id.is_set && msg->node_id.is_set &&
+            kad_guid_eq(&query->node.id, &msg->node_id))
+            dht_rtt_sample(ctx->dht, &query->node.id, (now_us - query->ts_us) / 1000);
+    }
+
+    /* Eviction candidate alive: the newcomer stays in the replacement cache. */
+    struct kad_rpc_probe *probe = kad_rpc_probe_find(ctx, &query->node.id);
+    if (probe && probe->sent)
+        kad_rpc_probe_remove(ctx, probe);
 
     switch (query->msg.meth) {
     case KAD_RPC_METH_NONE: {
@@ -182,7 +469,12 @@ kad_rpc_handle_response(struct kad_ctx *ctx, const struct kad_rpc_msg *msg)
 
     case KAD_RPC_METH_PING: {
         log_debug("Handling ping response.");
-        // Nothing left to do as dht already updated in kad_rpc_handle
+        // dht already updated in kad_rpc_handle
+        if (ctx->boot.active) {
+            uint64_t fill[KAD_GUID_SPACE_IN_BITS];
+            kad_bootstrap_sched_answered(&ctx->boot, &query->node.addr,
+                                         dht_bucket_fill(ctx->dht, fill), now);
+        }
         break;
     }
 
@@ -195,8 +487,10 @@ kad_rpc_handle_response(struct kad_ctx *ctx, const struct kad_rpc_msg *msg)
         break;
     }
 
+    list_delete(&query->timer);
     list_delete(&query->item);
-    free_safer(query);
+    kad_rpc_query_pool_put(&pool_kad_queries, query);
+    metrics_gauge_add(METRICS_GAUGE_KAD_QUERIES_PENDING, -1);
     return true;
 }
 
@@ -225,49 +519,77 @@ kad_rpc_error(struct kad_rpc_msg *out, const enum kad_rpc_err err,
 /**
  * Processes the incoming message in `buf` and places the response, if any,
  * into the provided `rsp` buffer.
+ *
+ * Temporaries are allocated from ctx->arena, which the caller resets once
+ * done with the message: `rsp` may reference them.
  */
 bool kad_rpc_handle(struct kad_ctx *ctx, const struct sockaddr_storage *addr,
-                    const char buf[], const size_t slen, struct iobuf *rsp)
+                    const char buf[], const size_t slen, struct iochain *rsp)
 {
-    struct kad_rpc_msg msg = {0};
+    struct kad_rpc_msg *msg = kad_rpc_msg_alloc(ctx);
+    if (!msg)
+        return false;
+    bool ret = false;
 
-    if (!benc_decode_rpc_msg(&msg, buf, slen)) {
+    if (!benc_decode_rpc_msg(msg, buf, slen, &ctx->arena)) {
         log_error("Invalid message received.");
-        struct kad_rpc_msg rspmsg = {0};
-        kad_rpc_error(&rspmsg, KAD_RPC_ERR_PROTOCOL, &msg, &ctx->dht->self_id);
-        if (!benc_encode_rpc_msg(rsp, &rspmsg))
+        metrics_inc(METRICS_CNT_KAD_DECODE_FAIL);
+        if (!kad_ratelimit_error_allow(&ctx->ratelimit, now_millis())) {
+            log_debug("Error reply throttled.");
+            metrics_inc(METRICS_CNT_KAD_ERR_THROTTLED);
+            goto end;
+        }
+        struct kad_rpc_msg *rspmsg = kad_rpc_msg_alloc(ctx);
+        if (!rspmsg)
+            goto end;
+        kad_rpc_error(rspmsg, KAD_RPC_ERR_PROTOCOL, msg, &ctx->dht->self_id);
+        if (!benc_encode_rpc_msg(rsp, rspmsg))
             log_error("Error while encoding error response.");
-        return false;
+        goto end;
     }
-    kad_rpc_msg_log(&msg); // TESTING
+    kad_rpc_msg_log(msg); // TESTING
 
-    if (msg.node_id.is_set)
-        kad_rpc_update_dht(ctx, addr, &msg.node_id);
+    if (msg->node_id.is_set)
+        kad_rpc_update_dht(ctx, addr, &msg->node_id);
     else
         log_warning("Node id not set, DHT not updated.");
 
-    switch (msg.type) {
+    switch (msg->type) {
     case KAD_RPC_TYPE_NONE: {
         log_error("Got msg of type none.");
-        return false;
+        break;
     }
 
     case KAD_RPC_TYPE_ERROR: {
-        return kad_rpc_handle_error(&msg);
+        ret = kad_rpc_handle_error(msg);
+        break;
     }
 
     case KAD_RPC_TYPE_QUERY: {  /* We'll respond immediately */
-        return kad_rpc_handle_query(ctx, &msg, rsp);
+        if (msg->meth == KAD_RPC_METH_PING)
+            metrics_inc(METRICS_CNT_KAD_QUERY_PING);
+        else if (msg->meth == KAD_RPC_METH_FIND_NODE)
+            metrics_inc(METRICS_CNT_KAD_QUERY_FIND_NODE);
+        ret = kad_rpc_handle_query(ctx, msg, rsp);
+        break;
     }
 
     case KAD_RPC_TYPE_RESPONSE: {
-        return kad_rpc_handle_response(ctx, &msg);
+        ret = kad_rpc_handle_response(ctx, msg);
+        break;
     }
 
     default:
         log_error("Unknown msg type.");
-        return false;
+        break;
     }
+
+  end:
+    trace_add(&(struct trace_record){
+        .ts_us=now_micros(), .fd=-1, .bytes=slen, .kind=TRACE_KIND_RPC,
+        .tx_id=msg->tx_id.bytes[0] << 8 | msg->tx_id.bytes[1],
+        .rpc_type=msg->type, .rpc_meth=msg->meth, .result=ret});
+    return ret;
 }
 
 /**
@@ -300,18 +622,66 @@ void kad_rpc_msg_log(const struct kad_rpc_msg *msg)
     log_debug("}");
 }
 
-bool kad_rpc_query_ping(const struct kad_ctx *ctx, struct iobuf *buf, struct kad_rpc_query *query)
+/* Timeout of a query to @node, from its round-trip time estimate. */
+static long long
+kad_rpc_query_timeout(const struct kad_ctx *ctx, const struct kad_node_info *node)
+{
+    const struct kad_node *known = node->id.is_set ? dht_find(ctx->dht, &node->id) : NULL;
+    long long rto = known ? kad_node_rto_ms(known) : 0;
+    if (rto == 0)
+        return KAD_RPC_QUERY_TIMEOUT_MS;
+    if (rto < KAD_RPC_QUERY_TIMEOUT_MIN_MS)
+        return KAD_RPC_QUERY_TIMEOUT_MIN_MS;
+    if (rto > KAD_RPC_QUERY_TIMEOUT_MS)
+        return KAD_RPC_QUERY_TIMEOUT_MS;
+    return rto;
+}
+
+/* Seeds are not retransmitted to: bootstrapping retries them on its own. */
+static void
+kad_rpc_query_retries_set(const struct kad_ctx *ctx, struct kad_rpc_query *query)
+{
+    query->retries = query->node.id.is_set ? ctx->query_retries : 0;
+    query->resent = false;
+    list_init(&query->timer);
+}
+
+bool kad_rpc_query_ping(const struct kad_ctx *ctx, struct iochain *ch, struct kad_rpc_query *query)
 {
     list_init(&query->item);
-    query->ts_ms = now_millis();
+    query->ts_us = now_micros();
+    query->ts_ms = query->ts_us / 1000;
+    query->timeout_ms = kad_rpc_query_timeout(ctx, &query->node);
+    kad_rpc_query_retries_set(ctx, query);
     kad_rpc_generate_tx_id(&query->msg.tx_id);
     query->msg.node_id = ctx->dht->self_id;
     query->msg.type = KAD_RPC_TYPE_QUERY;
     query->msg.meth = KAD_RPC_METH_PING;
 
-    if (!benc_encode_rpc_msg(buf, &query->msg)) {
+    if (!benc_encode_rpc_msg(ch, &query->msg)) {
         log_error("Error while encoding ping query.");
         return false;
     }
     return true;
 }
+
+bool kad_rpc_query_find_node(const struct kad_ctx *ctx, struct iochain *ch,
+                             struct kad_rpc_query *query, const kad_guid *target)
+{
+    list_init(&query->item);
+    query->ts_us = now_micros();
+    query->ts_ms = query->ts_us / 1000;
+    query->timeout_ms = kad_rpc_query_timeout(ctx, &query->node);
+    kad_rpc_query_retries_set(ctx, query);
+    kad_rpc_generate_tx_id(&query->msg.tx_id);
+    query->msg.node_id = ctx->dht->self_id;
+    query->msg.type = KAD_RPC_TYPE_QUERY;
+    query->msg.meth = KAD_RPC_METH_FIND_NODE;
+    query->msg.target = *target;
+
+    if (!benc_encode_rpc_msg(ch, &query->msg)) {
+        log_error("Error while encoding find_node query.");
+        return false;
+    }
+    return true;
+}
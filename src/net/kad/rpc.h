@@ -8,10 +8,15 @@
 
 #include <stdbool.h>
 #include "net/iobuf.h"
+#include "net/kad/bootstrap.h"
+#include "net/kad/checkpoint.h"
 #include "net/kad/dht.h"
+#include "net/kad/ratelimit.h"
+#include "net/kad/refresh.h"
 #include "utils/byte_array.h"
 #include "utils/list.h"
 #include "utils/lookup.h"
+#include "utils/pool.h"
 #include "net/kad/bencode/parser.h"
 
 #define KAD_RPC_MSG_TX_ID_LEN 2
@@ -80,29 +85,96 @@ struct kad_rpc_msg {
 
 struct kad_rpc_query {
     struct list_item     item;
-    long long            ts_ms; // for expiring of queries
+    struct list_item     timer; // in the timeout wheel, or the resend list
+    long long            ts_ms; // of the first transmission
+    long long            ts_us; // same, for round-trip times
+    long long            timeout_ms; // of the last transmission
+    long long            deadline_ms;
+    unsigned             retries; // retransmissions left
+    bool                 resent;
     struct kad_rpc_msg   msg;
     struct kad_node_info node;
 };
 
+/* Queries not responded to within their timeout are retransmitted, with the
+   same tx_id, and expired when out of retries. The timeout is the
+   retransmission timeout of the node (RFC 6298) when its round-trip time is
+   known, within bounds, and the maximum otherwise. It doubles with each
+   retransmission. */
+#define KAD_RPC_QUERY_TIMEOUT_MS     2000
+#define KAD_RPC_QUERY_TIMEOUT_MIN_MS 250
+#define KAD_RPC_QUERY_BACKOFF_MAX_MS 8000
+#define KAD_RPC_QUERY_RETRIES        2
+#define KAD_RPC_EXPIRE_TICK_MS       100
+/* Timeout wheel: slots of KAD_RPC_EXPIRE_TICK_MS, spanning more than the
+   longest timeout. */
+#define KAD_RPC_WHEEL_LEN            128
+
+/**
+ * Ping-before-evict: when a newcomer finds its bucket full, the bucket's
+ * least-recently seen node is pinged if questionable, and evicted in favor
+ * of the replacement cache only if the ping times out.
+ */
+#define KAD_RPC_PROBES_MAX 8
+/* Probes that could not be sent are given up after that many attempts. */
+#define KAD_RPC_PROBE_TRIES 3
+
+struct kad_rpc_probe {
+    struct kad_node_info node; // eviction candidate
+    bool                 sent;
+    unsigned             tries; // failed sending attempts
+};
+
+#define KAD_RPC_QUERY_POOL_SLAB_LEN 32
+POOL_GENERATE(kad_rpc_query_pool, struct kad_rpc_query, KAD_RPC_QUERY_POOL_SLAB_LEN)
+extern kad_rpc_query_pool pool_kad_queries;
+
 struct kad_rpc_node_pair {
     struct list_item     item;
     struct kad_node_info old;
     struct kad_node_info new;
 };
 
+/* Per-datagram scratch memory: fits a decoded message and its response. */
+#define KAD_RPC_ARENA_LEN (128 * 1024)
+
 struct kad_ctx {
     struct kad_dht   *dht;
     struct list_item  queries; // kad_rcp_query list
+    struct list_item  wheel[KAD_RPC_WHEEL_LEN]; // kad_rpc_query list, by timer
+    long long         wheel_ms; // time the wheel was last turned to
+    struct list_item  resend; // kad_rpc_query list, by timer
+    unsigned          query_retries;
+    struct arena      arena;
+    /* UDP send buffer, reused across datagrams. */
+    struct iochain    sndbuf;
+    struct kad_checkpoint ckpt;
+    bool              ckpt_on;
+    struct kad_bootstrap_sched boot;
+    struct kad_refresh_sched refresh;
+    struct kad_rpc_probe probes[KAD_RPC_PROBES_MAX];
+    size_t            probes_len;
+    struct kad_ratelimit ratelimit;
 };
 
 int kad_rpc_init(struct kad_ctx *ctx, const char conf_dir[]);
 void kad_rpc_terminate(struct kad_ctx *ctx, const char conf_dir[]);
+bool kad_rpc_checkpoint_start(struct kad_ctx *ctx, const char conf_dir[],
+                              const bool journal);
+bool kad_rpc_checkpoint(struct kad_ctx *ctx);
+void kad_rpc_metrics_update(const struct kad_ctx *ctx);
+size_t kad_rpc_expire(struct kad_ctx *ctx, const long long now);
+bool kad_rpc_probe_unsent(struct kad_ctx *ctx, struct kad_rpc_probe *probe);
+void kad_rpc_query_add(struct kad_ctx *ctx, struct kad_rpc_query *query);
+struct kad_rpc_query *kad_rpc_query_resend_next(struct kad_ctx *ctx, struct iochain *ch,
+                                                const long long now);
 
 bool kad_rpc_handle(struct kad_ctx *ctx, const struct sockaddr_storage *addr,
-                    const char buf[], const size_t slen, struct iobuf *rsp);
+                    const char buf[], const size_t slen, struct iochain *rsp);
 void kad_rpc_msg_log(const struct kad_rpc_msg *msg);
 
-bool kad_rpc_query_ping(const struct kad_ctx *ctx, struct iobuf *buf, struct kad_rpc_query *query);
+bool kad_rpc_query_ping(const struct kad_ctx *ctx, struct iochain *ch, struct kad_rpc_query *query);
+bool kad_rpc_query_find_node(const struct kad_ctx *ctx, struct iochain *ch,
+                             struct kad_rpc_query *query, const kad_guid *target);
 
 #endif /* KAD_RPC_H */
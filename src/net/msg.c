@@ -14,10 +14,19 @@ void proto_msg_parser_init(struct proto_msg_parser *parser)
     parser->send     = false;
     parser->stage    = PROTO_MSG_STAGE_NONE;
     parser->msg_type = PROTO_MSG_TYPE_NONE;
+    parser->buf_max  = PROTO_MSG_BUF_MAX_DEFAULT;
+}
+
+static void proto_msg_budget_release(struct proto_msg_parser *parser)
+{
+    if (parser->budget)
+        parser->budget->used -= parser->budget_held;
+    parser->budget_held = 0;
 }
 
 void proto_msg_parser_terminate(struct proto_msg_parser *parser)
 {
+    proto_msg_budget_release(parser);
     iobuf_reset(&parser->msg_data);
 }
 
@@ -27,6 +36,65 @@ static void proto_msg_len_parse(const char buf[], size_t pos, union u32 *len)
     *len = u32_ntoh(*len);
 }
 
+/**
+ * Completes the header with @buf, up to @want bytes. Returns the number of
+ * bytes consumed.
+ */
+static size_t proto_msg_hdr_fill(struct proto_msg_parser *parser,
+                                 const char buf[], const size_t len,
+                                 const size_t want)
+{
+    size_t n = want - parser->hdr_len;
+    if (n > len)
+        n = len;
+    memcpy(parser->hdr + parser->hdr_len, buf, n);
+    parser->hdr_len += n;
+    return n;
+}
+
+/**
+ * Decides whether the data of the current message is buffered or streamed,
+ * and reserves its buffering space.
+ */
+static bool proto_msg_data_admit(struct proto_msg_parser *parser)
+{
+    size_t len = parser->msg_len.dd;
+    struct proto_msg_budget *budget = parser->budget;
+    bool fits = len <= parser->buf_max &&
+        (!budget || len <= budget->max - budget->used);
+
+    parser->streaming = !fits;
+    if (fits) {
+        if (budget) {
+            budget->used += len;
+            parser->budget_held = len;
+        }
+        return true;
+    }
+    if (parser->on_chunk)
+        return true;
+
+    log_warning("Message too long to be buffered (%zu bytes).", len);
+    parser->capped = true;
+    return false;
+}
+
+static bool proto_msg_complete(struct proto_msg_parser *parser)
+{
+    log_debug("  msg complete: type=%u, len=%"PRIu32, parser->msg_type,
+              parser->msg_len.dd);
+    parser->stage = PROTO_MSG_STAGE_NONE;
+    bool ok = !parser->on_msg || parser->on_msg(parser, parser->on_msg_data);
+    proto_msg_budget_release(parser);
+    return ok;
+}
+
+/**
+ * Parses a chunk of the input stream. Fields may span chunks, and a chunk may
+ * hold several messages: parser->on_msg is called for each complete one.
+ * Data is buffered within parser->buf_max and parser->budget, and otherwise
+ * streamed to parser->on_chunk.
+ */
 bool proto_msg_parse(struct proto_msg_parser *parser,
                      const char buf[], const size_t len)
 {
@@ -36,6 +104,12 @@ bool proto_msg_parse(struct proto_msg_parser *parser,
     while (offset < len) {
         switch (parser->stage) {
         case PROTO_MSG_STAGE_NONE: {
+            parser->hdr_len = 0;
+            parser->msg_recv = 0;
+            if (parser->msg_data.capa > PROTO_MSG_DATA_KEEP_LEN)
+                iobuf_reset(&parser->msg_data);
+            else
+                iobuf_clear(&parser->msg_data);
             parser->stage = PROTO_MSG_STAGE_TYPE;
             break;
         }
@@ -48,13 +122,12 @@ bool proto_msg_parse(struct proto_msg_parser *parser,
         }
 
         case PROTO_MSG_STAGE_TYPE: {
-            if (len < PROTO_MSG_FIELD_TYPE_LEN) {
-                log_error("Message too short.");
-                parser->stage = PROTO_MSG_STAGE_ERROR;
+            offset += proto_msg_hdr_fill(parser, buf + offset, len - offset,
+                                         PROTO_MSG_FIELD_TYPE_LEN);
+            if (parser->hdr_len < PROTO_MSG_FIELD_TYPE_LEN)
                 break;
-            }
 
-            parser->msg_type = lookup_by_name(proto_msg_type_names, buf,
+            parser->msg_type = lookup_by_name(proto_msg_type_names, parser->hdr,
                                               PROTO_MSG_FIELD_TYPE_LEN);
             if (!parser->msg_type) {
                 log_warning("Ignoring further input.");
@@ -63,49 +136,57 @@ bool proto_msg_parse(struct proto_msg_parser *parser,
             }
 
             log_debug("  msg_type=%u", parser->msg_type);
-            offset += PROTO_MSG_FIELD_TYPE_LEN;
             parser->stage = PROTO_MSG_STAGE_LEN;
             break;
         }
 
         case PROTO_MSG_STAGE_LEN: {
-            if (len - offset < PROTO_MSG_FIELD_LENGTH_LEN) {
-                log_error("Message too short.");
-                parser->stage = PROTO_MSG_STAGE_ERROR;
+            offset += proto_msg_hdr_fill(parser, buf + offset, len - offset,
+                                         PROTO_MSG_HEADER_LEN);
+            if (parser->hdr_len < PROTO_MSG_HEADER_LEN)
                 break;
-            }
 
             parser->msg_len.dd = 0;
-            proto_msg_len_parse(buf, offset, &parser->msg_len);
+            proto_msg_len_parse(parser->hdr, PROTO_MSG_FIELD_TYPE_LEN,
+                                &parser->msg_len);
             log_debug("  msg_len=%"PRIu32, parser->msg_len.dd);
-            offset += PROTO_MSG_FIELD_LENGTH_LEN;
+            if (!proto_msg_data_admit(parser)) {
+                parser->stage = PROTO_MSG_STAGE_ERROR;
+                break;
+            }
             parser->stage = PROTO_MSG_STAGE_DATA;
+            if (parser->msg_len.dd == 0 && !proto_msg_complete(parser))
+                return false;
             break;
         }
 
         case PROTO_MSG_STAGE_DATA: {
-            if (!iobuf_append(&parser->msg_data, buf + offset, len - offset)) {
+            size_t n = parser->msg_len.dd - parser->msg_recv;
+            if (n > len - offset)
+                n = len - offset;
+            if (parser->streaming) {
+                if (!parser->on_chunk(parser, buf + offset, n,
+                                      parser->on_msg_data))
+                    return false;
+            }
+            else if (!iobuf_append(&parser->msg_data, buf + offset, n)) {
                 proto_msg_parser_terminate(parser);
                 return false;
             }
+            offset += n;
+            parser->msg_recv += n;
 
-            /* We check for the length of actually received data after having
-               copied it for fear of losing some. */
-            if (parser->msg_data.pos > parser->msg_len.dd) {
-                log_warning("Received more data than expected.");
-                parser->stage = PROTO_MSG_STAGE_ERROR;
-            }
-            if (parser->msg_data.pos == parser->msg_len.dd)
-                parser->stage = PROTO_MSG_STAGE_NONE;
-
-            goto while_end; // we've got all we need from this chunk
+            if (parser->msg_recv == parser->msg_len.dd &&
+                !proto_msg_complete(parser))
+                return false;
+            break;
         }
 
         default:
             log_error("Parser in unknown state.");
             return false;
         }
-    } while_end:
+    }
 
-    return true;
+    return parser->stage != PROTO_MSG_STAGE_ERROR;
 }
@@ -8,6 +8,10 @@
  * The Length field contains the data length in uint32_t (~4GB).
  * The Data field contains raw bytes.
  *
+ * BULK messages carry a segment of some content: their Data field is the
+ * uint64_t offset of the segment within the content, followed by the
+ * segment, so that interrupted transfers can be resumed.
+ *
  * Inspired from http://cs.berry.edu/~nhamid/p2p/framework-python.html
  */
 
@@ -19,6 +23,13 @@
 
 #define PROTO_MSG_FIELD_TYPE_LEN    4
 #define PROTO_MSG_FIELD_LENGTH_LEN  4
+#define PROTO_MSG_HEADER_LEN        (PROTO_MSG_FIELD_TYPE_LEN + PROTO_MSG_FIELD_LENGTH_LEN)
+/* Data buffers grown beyond this are released between messages. */
+#define PROTO_MSG_DATA_KEEP_LEN     (64 * 1024)
+#define PROTO_MSG_BULK_OFFSET_LEN   8
+#define PROTO_MSG_BULK_MAX          (UINT32_MAX - PROTO_MSG_BULK_OFFSET_LEN)
+/* Default cap on the data buffered by a parser. */
+#define PROTO_MSG_BUF_MAX_DEFAULT   (1024 * 1024)
 
 enum proto_msg_stage {
     PROTO_MSG_STAGE_NONE,
@@ -33,15 +44,42 @@ enum proto_msg_type {
     PROTO_MSG_TYPE_ERROR,
     PROTO_MSG_TYPE_NAME,
     PROTO_MSG_TYPE_QUERY,
+    PROTO_MSG_TYPE_BULK,
 };
 
 static const lookup_entry proto_msg_type_names[] = {
     { PROTO_MSG_TYPE_ERROR,  "ERRO" },
     { PROTO_MSG_TYPE_NAME,   "NAME" },
     { PROTO_MSG_TYPE_QUERY,  "QERY" },
+    { PROTO_MSG_TYPE_BULK,   "BULK" },
     { 0, NULL }
 };
 
+struct proto_msg_parser;
+
+/**
+ * Called for each complete message, with msg_type and msg_data set. msg_data
+ * is empty when the message was streamed. Returning false aborts parsing.
+ */
+typedef bool (*proto_msg_handler)(struct proto_msg_parser *parser, void *data);
+
+/**
+ * Called with each piece of the data field of a streamed message, as it
+ * arrives. Returning false aborts parsing.
+ */
+typedef bool (*proto_msg_chunk_handler)(struct proto_msg_parser *parser,
+                                        const char buf[], size_t len,
+                                        void *data);
+
+/**
+ * Data bytes buffered by a set of parsers, against a shared cap. Space for a
+ * whole message is reserved when its length is known.
+ */
+struct proto_msg_budget {
+    size_t used;
+    size_t max;
+};
+
 struct proto_msg_parser {
     bool                 recv;
     bool                 send;
@@ -49,6 +87,23 @@ struct proto_msg_parser {
     enum proto_msg_type  msg_type;
     union u32            msg_len;
     struct iobuf         msg_data; /* holds only the data field */
+    /* Header bytes, accumulated across chunks. */
+    char                 hdr[PROTO_MSG_HEADER_LEN];
+    size_t               hdr_len;
+    /* Data bytes received for the current message. */
+    size_t               msg_recv;
+    /* Messages longer than buf_max, or not fitting into the budget, are
+       passed to on_chunk instead of being buffered into msg_data. They are
+       rejected when on_chunk is not set. */
+    size_t               buf_max;
+    struct proto_msg_budget *budget;
+    size_t               budget_held;
+    bool                 streaming;
+    /* Set when parsing failed because of a cap. */
+    bool                 capped;
+    proto_msg_handler    on_msg;
+    proto_msg_chunk_handler on_chunk;
+    void                *on_msg_data;
 };
 
 
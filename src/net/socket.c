@@ -4,9 +4,13 @@
 #include <netinet/in.h>
 #include <string.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/un.h>
+#include <arpa/inet.h>
 #include <unistd.h>
 #include "log.h"
+#include "utils/safer.h"
 
 static int sock_geterr(int fd) {
    int err = 1;
@@ -40,7 +44,7 @@ bool sock_close(int fd) {      // *not* the Windows closesocket()
    return true;
 }
 
-static int sock_setnonblock(int sock) {
+int sock_setnonblock(int sock) {
     int flags = fcntl(sock, F_GETFL, 0);
     if (flags == -1) {
         log_perror(LOG_ERR, "Failed get fcntl: %s.", errno);
@@ -132,6 +136,56 @@ int socket_init(const int socktype, const char bind_addr[], const char bind_port
     return sockfd;
 }
 
+/**
+ * Returns a non-blocking listening unix stream socket bound to @path, or -1 if
+ * failure. A stale socket file at @path is removed. Only the owner may connect.
+ */
+int socket_init_unix(const char path[])
+{
+    struct sockaddr_un addr = {0};
+    addr.sun_family = AF_UNIX;
+    if (!strcpy_safer(addr.sun_path, path, sizeof(addr.sun_path))) {
+        log_error("Unix socket path too long (%s).", path);
+        return -1;
+    }
+
+    int sockfd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sockfd == -1) {
+        log_perror(LOG_ERR, "Failed socket: %s.", errno);
+        return -1;
+    }
+
+    if (sock_setnonblock(sockfd))
+        goto fail;
+
+    if (unlink(path) == -1 && errno != ENOENT) {
+        log_perror(LOG_ERR, "Failed unlink: %s.", errno);
+        goto fail;
+    }
+
+    if (bind(sockfd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+        log_perror(LOG_ERR, "Failed bind: %s.", errno);
+        goto fail;
+    }
+
+    /* Connections are refused until listen(2): no window for others. */
+    if (chmod(path, S_IRUSR | S_IWUSR) == -1) {
+        log_perror(LOG_ERR, "Failed chmod: %s.", errno);
+        goto fail;
+    }
+
+    if (listen(sockfd, 4)) {
+        log_perror(LOG_ERR, "Failed listen: %s.", errno);
+        goto fail;
+    }
+
+    return sockfd;
+
+  fail:
+    sock_close(sockfd);
+    return -1;
+}
+
 bool socket_shutdown(int sock)
 {
     if (!sock_close(sock))
@@ -140,29 +194,57 @@ bool socket_shutdown(int sock)
     return true;
 }
 
+static char *hex_fmt(char *p, const unsigned char bytes[], const size_t len)
+{
+    static const char digits[] = "0123456789abcdef";
+    for (size_t i = 0; i < len; i++) {
+        *p++ = digits[bytes[i] >> 4];
+        *p++ = digits[bytes[i] & 0xf];
+    }
+    return p;
+}
+
 // https://beej.us/guide/bgnet/html/multi/sockaddr_inman.html
 bool sockaddr_storage_fmt(char str[], const struct sockaddr_storage *ss)
 {
     char *p = str;
     if (ss->ss_family == AF_INET) {
         const struct sockaddr_in *sa = (struct sockaddr_in *)ss;
-        for (int i=0; i<4; i++) {
-            snprintf(p, 3, "%02x",((unsigned char*)(&sa->sin_addr))[i]);
-            p += 2;
-        }
-        snprintf(p, 6, ":%02x%02x",
-                 ((unsigned char*)(&sa->sin_port))[0],
-                 ((unsigned char*)(&sa->sin_port))[1]);
+        p = hex_fmt(p, (unsigned char*)(&sa->sin_addr), 4);
+        *p++ = ':';
+        p = hex_fmt(p, (unsigned char*)(&sa->sin_port), 2);
+    }
+    else if (ss->ss_family == AF_INET6) {
+        const struct sockaddr_in6 *sa = (struct sockaddr_in6 *)ss;
+        p = hex_fmt(p, (unsigned char*)(&sa->sin6_addr), 16);
+        *p++ = ':';
+        p = hex_fmt(p, (unsigned char*)(&sa->sin6_port), 2);
+    }
+    else {
+        return false;
+    }
+    *p = '\0';
+    return true;
+}
+
+/**
+ * Human-readable form of @ss, like `[::1]:22000` or `127.0.0.1:22000`.
+ */
+bool sockaddr_storage_ntop(char str[], const size_t len,
+                           const struct sockaddr_storage *ss)
+{
+    char host[INET6_ADDRSTRLEN];
+    if (ss->ss_family == AF_INET) {
+        const struct sockaddr_in *sa = (struct sockaddr_in *)ss;
+        if (!inet_ntop(AF_INET, &sa->sin_addr, host, sizeof(host)))
+            return false;
+        snprintf(str, len, "%s:%u", host, ntohs(sa->sin_port));
     }
     else if (ss->ss_family == AF_INET6) {
         const struct sockaddr_in6 *sa = (struct sockaddr_in6 *)ss;
-        for (int i=0; i<16; i++) {
-            snprintf(p, 3, "%02x",((unsigned char*)(&sa->sin6_addr))[i]);
-            p += 2;
-        }
-        snprintf(p, 6, ":%02x%02x",
-                 ((unsigned char*)(&sa->sin6_port))[0],
-                 ((unsigned char*)(&sa->sin6_port))[1]);
+        if (!inet_ntop(AF_INET6, &sa->sin6_addr, host, sizeof(host)))
+            return false;
+        snprintf(str, len, "[%s]:%u", host, ntohs(sa->sin6_port));
     }
     else {
         return false;
@@ -6,10 +6,13 @@
 #include <stdbool.h>
 
 bool sock_close(int fd);
+int sock_setnonblock(int sock);
 int socket_init(const int socktype, const char bind_addr[], const char bind_port[]);
+int socket_init_unix(const char path[]);
 bool socket_shutdown(int sock);
 
 bool sockaddr_storage_fmt(char str[], const struct sockaddr_storage *ss);
+bool sockaddr_storage_ntop(char str[], const size_t len, const struct sockaddr_storage *ss);
 bool sockaddr_storage_cmp4(const struct sockaddr_storage *a, const struct sockaddr_storage *b);
 bool sockaddr_storage_cmp6(const struct sockaddr_storage *a, const struct sockaddr_storage *b);
 
@@ -20,6 +20,16 @@ const struct config CONFIG_DEFAULT = {
     .log_type  = LOG_TYPE_STDOUT,
     .log_level = LOG_UPTO(LOG_INFO),
     .max_peers = 256,
+    .admin_path = "",
+    .watchdog_ms = 0,
+    .msg_buf_max = 1024 * 1024,
+    .msg_buf_total = 64 * 1024 * 1024,
+    .checkpoint_s = 300,
+    .journal = false,
+    .bootstrap_max = 64,
+    .bootstrap_rate = 20,
+    .bootstrap_inflight = 16,
+    .query_retries = 2,
 };
 
 static void usage(void)
@@ -27,12 +37,26 @@ static void usage(void)
     printf("Usage: %s [parameters]\n", PACKAGE_NAME);
     printf("\nParameters:\n"
            " -a, --addr=[addr]       Set bind address (ip4 or ip6)\n"
+           " -A, --admin=[path]      Enable admin endpoint on unix socket path\n"
+           " -b, --msg-buf=[bytes]   Set maximum message data buffered per peer\n"
+           " -B, --msg-buf-total=[bytes]\n"
+           "                         Set maximum message data buffered for all peers\n"
            " -c, --config=[path]     Set the config directory path\n"
+           " -i, --bootstrap-inflight=[n]\n"
+           "                         Set maximum bootstrap pings in flight\n"
+           " -j, --journal           Journal DHT changes between checkpoints\n"
+           " -k, --checkpoint=[s]    Set DHT checkpoint period (0 disables)\n"
            " -l, --log=[level]       Set log level (debug..critical)\n"
            " -m, --max-peers=[max]   Set maximum number of peers\n"
+           " -n, --bootstrap-nodes=[max]\n"
+           "                         Set maximum number of bootstrap nodes sampled\n"
            " -o, --output=[file]     Set log output file\n"
            " -p, --port=[port]       Set bind port\n"
+           " -q, --query-retries=[n] Set retransmissions of unanswered queries\n"
+           " -r, --bootstrap-rate=[n]\n"
+           "                         Set bootstrap pings per second\n"
            " -s, --syslog            Use syslog\n"
+           " -w, --watchdog=[ms]     Report event-loop stalls longer than ms\n"
            " -h, --help              Print help and usage\n"
            " -v, --version           Print version of the server\n");
 }
@@ -85,18 +109,28 @@ int options_parse(struct config *conf, const int argc, char *const argv[])
         int option_index = 0;
         static struct option long_options[] = {
             {"addr",       required_argument, 0, 'a'},
+            {"admin",      required_argument, 0, 'A'},
+            {"msg-buf",    required_argument, 0, 'b'},
+            {"msg-buf-total", required_argument, 0, 'B'},
             {"config",     required_argument, 0, 'c'},
+            {"bootstrap-inflight", required_argument, 0, 'i'},
+            {"journal",    no_argument,       0, 'j'},
+            {"checkpoint", required_argument, 0, 'k'},
             {"log",        required_argument, 0, 'l'},
             {"max-peers",  required_argument, 0, 'm'},
+            {"bootstrap-nodes", required_argument, 0, 'n'},
             {"output",     required_argument, 0, 'o'},
             {"port",       required_argument, 0, 'p'},
+            {"query-retries", required_argument, 0, 'q'},
+            {"bootstrap-rate", required_argument, 0, 'r'},
             {"syslog",     no_argument,       0, 's'},
+            {"watchdog",   required_argument, 0, 'w'},
             {"help",       no_argument,       0, 'h'},
             {"version",    no_argument,       0, 'v'},
             {0}
         };
 
-        int c = getopt_long(argc, argv, "a:c:l:m:o:p:shv",
+        int c = getopt_long(argc, argv, "a:A:b:B:c:i:jk:l:m:n:o:p:q:r:sw:hv",
                         long_options, &option_index);
         if (c == -1)
             break;
@@ -109,6 +143,31 @@ int options_parse(struct config *conf, const int argc, char *const argv[])
             }
             break;
 
+        case 'A':
+            if (!strcpy_safer(conf->admin_path, optarg, sizeof(conf->admin_path))) {
+                fprintf(stderr, "Wrong value for --admin.\n");
+                return 1;
+            }
+            break;
+
+        case 'b':
+        case 'B': {
+            errno = 0;
+            long long val = strtoll(optarg, NULL, 10);
+            if ((errno == ERANGE && (val == LLONG_MAX || val == LLONG_MIN))
+                || (errno != 0 && val == 0)
+                || (val < 0 || (c == 'b' && val > OPTIONS_MSG_BUF_MAX))) {
+                fprintf(stderr, "Wrong value for --%s.\n",
+                        c == 'b' ? "msg-buf" : "msg-buf-total");
+                return 1;
+            }
+            if (c == 'b')
+                conf->msg_buf_max = (size_t)val;
+            else
+                conf->msg_buf_total = (size_t)val;
+            break;
+        }
+
         case 'c':
             if (!strcpy_safer(conf->conf_dir, optarg, sizeof(conf->conf_dir))) {
                 fprintf(stderr, "Wrong value for --config.\n");
@@ -116,6 +175,38 @@ int options_parse(struct config *conf, const int argc, char *const argv[])
             }
             break;
 
+        case 'i': {
+            errno = 0;
+            long val = strtol(optarg, NULL, 10);
+            if ((errno == ERANGE && (val == LONG_MAX || val == LONG_MIN))
+                || (errno != 0 && val == 0)
+                || (val < 1 || val > OPTIONS_BOOTSTRAP_MAX)) {
+                fprintf(stderr, "Wrong value for --bootstrap-inflight."
+                        " Should be in [1, %d].\n", OPTIONS_BOOTSTRAP_MAX);
+                return 1;
+            }
+            conf->bootstrap_inflight = (size_t)val;
+            break;
+        }
+
+        case 'j':
+            conf->journal = true;
+            break;
+
+        case 'k': {
+            errno = 0;
+            long val = strtol(optarg, NULL, 10);
+            if ((errno == ERANGE && (val == LONG_MAX || val == LONG_MIN))
+                || (errno != 0 && val == 0)
+                || (val < 0 || val > OPTIONS_CHECKPOINT_MAX_S)) {
+                fprintf(stderr, "Wrong value for --checkpoint."
+                        " Should be in [0, %d].\n", OPTIONS_CHECKPOINT_MAX_S);
+                return 1;
+            }
+            conf->checkpoint_s = val;
+            break;
+        }
+
         case 'l': {
             int sevmask = 0;
             for (int i = 0; log_severities[i].id; i++) {
@@ -152,6 +243,20 @@ int options_parse(struct config *conf, const int argc, char *const argv[])
             break;
         }
 
+        case 'n': {
+            errno = 0;
+            long val = strtol(optarg, NULL, 10);
+            if ((errno == ERANGE && (val == LONG_MAX || val == LONG_MIN))
+                || (errno != 0 && val == 0)
+                || (val < 1 || val > OPTIONS_BOOTSTRAP_MAX)) {
+                fprintf(stderr, "Wrong value for --bootstrap-nodes."
+                        " Should be in [1, %d].\n", OPTIONS_BOOTSTRAP_MAX);
+                return 1;
+            }
+            conf->bootstrap_max = (size_t)val;
+            break;
+        }
+
         case 'o':
             // TODO:
             break;
@@ -163,10 +268,52 @@ int options_parse(struct config *conf, const int argc, char *const argv[])
             }
             break;
 
+        case 'q': {
+            errno = 0;
+            long val = strtol(optarg, NULL, 10);
+            if ((errno == ERANGE && (val == LONG_MAX || val == LONG_MIN))
+                || (errno != 0 && val == 0)
+                || (val < 0 || val > OPTIONS_QUERY_RETRIES_MAX)) {
+                fprintf(stderr, "Wrong value for --query-retries."
+                        " Should be in [0, %d].\n", OPTIONS_QUERY_RETRIES_MAX);
+                return 1;
+            }
+            conf->query_retries = (unsigned)val;
+            break;
+        }
+
+        case 'r': {
+            errno = 0;
+            long val = strtol(optarg, NULL, 10);
+            if ((errno == ERANGE && (val == LONG_MAX || val == LONG_MIN))
+                || (errno != 0 && val == 0)
+                || (val < 1 || val > OPTIONS_BOOTSTRAP_RATE_MAX)) {
+                fprintf(stderr, "Wrong value for --bootstrap-rate."
+                        " Should be in [1, %d].\n", OPTIONS_BOOTSTRAP_RATE_MAX);
+                return 1;
+            }
+            conf->bootstrap_rate = (unsigned)val;
+            break;
+        }
+
         case 's':
             conf->log_type = LOG_TYPE_SYSLOG;
             break;
 
+        case 'w': {
+            errno = 0;
+            long val = strtol(optarg, NULL, 10);
+            if ((errno == ERANGE && (val == LONG_MAX || val == LONG_MIN))
+                || (errno != 0 && val == 0)
+                || (val < 0 || val > OPTIONS_WATCHDOG_MAX_MS)) {
+                fprintf(stderr, "Wrong value for --watchdog."
+                        " Should be in [0, %d].\n", OPTIONS_WATCHDOG_MAX_MS);
+                return 1;
+            }
+            conf->watchdog_ms = val;
+            break;
+        }
+
         case 'h':
             usage();
             return 0;
@@ -3,9 +3,18 @@
 #define OPTIONS_H
 
 #include <limits.h>
+#include <stdint.h>
 #include <netdb.h>
+#include <sys/un.h>
 #include "log.h"
 
+#define OPTIONS_WATCHDOG_MAX_MS 3600000
+#define OPTIONS_MSG_BUF_MAX     UINT32_MAX
+#define OPTIONS_CHECKPOINT_MAX_S 86400
+#define OPTIONS_BOOTSTRAP_MAX   4096
+#define OPTIONS_BOOTSTRAP_RATE_MAX 10000
+#define OPTIONS_QUERY_RETRIES_MAX  5
+
 struct config {
     char       conf_dir[PATH_MAX];
     char       bind_addr[NI_MAXHOST];
@@ -13,6 +22,22 @@ struct config {
     log_type_t log_type;
     int        log_level;
     size_t     max_peers;
+    /* Admin endpoint disabled when empty. */
+    char       admin_path[sizeof(((struct sockaddr_un*)0)->sun_path)];
+    /* Event-loop stall threshold. Watchdog disabled when 0. */
+    long long  watchdog_ms;
+    /* Caps on peer message data buffered, per peer and for all peers. */
+    size_t     msg_buf_max;
+    size_t     msg_buf_total;
+    /* DHT checkpoint period. Checkpoints disabled when 0. */
+    long long  checkpoint_s;
+    bool       journal;
+    /* Bootstrap nodes sampled from nodes.dat, and their pinging. */
+    size_t     bootstrap_max;
+    unsigned   bootstrap_rate;
+    size_t     bootstrap_inflight;
+    /* Retransmissions of unanswered kad queries. */
+    unsigned   query_retries;
 };
 
 extern const struct config CONFIG_DEFAULT;
@@ -1,14 +1,19 @@
 /* Copyright (c) 2017-2019 Foudil Brétel.  All rights reserved. */
+#include <limits.h>
 #include <poll.h>
+#include "admin.h"
 #include "events.h"
 #include "log.h"
+#include "metrics.h"
 #include "net/actions.h"
 #include "net/kad/rpc.h"
 #include "net/socket.h"
 #include "signals.h"
 #include "timers.h"
+#include "trace.h"
 #include "utils/bits.h"
 #include "utils/cont.h"
+#include "watchdog.h"
 #include "server.h"
 
 #define POLL_EVENTS POLLIN|POLLPRI
@@ -25,15 +30,36 @@ static int pollfds_update(struct pollfd fds[], const int nlisten,
             return npeer;
         }
 
+        /* Stop reading from peers that don't drain their replies. */
+        size_t pending = peer_outq_len(p);
         fds[npeer].fd = p->fd;
-        /* TODO: we will have to add POLLOUT when all data haven't been written
-           in one loop, and probably have 1 inbuf and 1 outbuf. */
-        fds[npeer].events = POLL_EVENTS;
+        fds[npeer].events = (pending < PEER_OUTQ_HIWAT ? POLL_EVENTS : 0) |
+            (pending > 0 || p->bulk.left > 0 ? POLLOUT : 0);
         npeer++;
     }
     return npeer;
 }
 
+/**
+ * Refreshes metrics derived from server state, rather than recorded.
+ */
+void server_metrics_update(const struct kad_ctx *kctx)
+{
+    metrics_pool_set(METRICS_POOL_EVENT, &pool_events.stats);
+    metrics_pool_set(METRICS_POOL_TIMER, &pool_timers.stats);
+    metrics_pool_set(METRICS_POOL_PEER, &pool_peers.stats);
+    metrics_gauge_set(METRICS_GAUGE_PEER_MSG_BUF_BYTES, peers_msg_budget.used);
+    kad_rpc_metrics_update(kctx);
+}
+
+static void server_metrics_dump(const struct kad_ctx *kctx)
+{
+    server_metrics_update(kctx);
+    struct metrics snap;
+    metrics_snapshot(&snap);
+    metrics_log(&snap);
+}
+
 /**
  * Main event loop
  *
@@ -71,66 +97,133 @@ bool server_run(const struct config *conf)
              conf->bind_addr, conf->bind_port);
 
     event_queue evq = {0};
+    peers_msg_budget.max = conf->msg_buf_total;
 
     struct list_item timer_list = LIST_ITEM_INIT(timer_list);
     struct timer timer_kad_refresh = {
-        .name="kad-refresh", .ms=300000, .event=&event_kad_refresh,
+        .name="kad-refresh", .ms=KAD_REFRESH_TICK_MS, .event=&event_kad_refresh,
         .item=LIST_ITEM_INIT(timer_kad_refresh.item)
     };
     list_append(&timer_list, &timer_kad_refresh.item);
+    struct timer timer_kad_expire = {
+        .name="kad-expire", .ms=KAD_RPC_EXPIRE_TICK_MS, .event=&event_kad_expire,
+        .item=LIST_ITEM_INIT(timer_kad_expire.item)
+    };
+    list_append(&timer_list, &timer_kad_expire.item);
 
     struct kad_ctx kctx = {0};
+    event_kad_refresh.args.kad_refresh.kctx = &kctx;
+    event_kad_refresh.args.kad_refresh.sock = sock_udp;
+    event_kad_expire.args.kad_expire.kctx = &kctx;
+    event_kad_expire.args.kad_expire.sock = sock_udp;
     int nodes_len = kad_rpc_init(&kctx, conf->conf_dir);
     if (nodes_len == -1) {
         log_fatal("Failed to initialize DHT. Aborting.");
         return false;
     }
-    else if (nodes_len == 0) {
-        struct event *event_kad_bootstrap = malloc(sizeof(struct event));
-        if (!event_kad_bootstrap) {
+    else {
+        kctx.query_retries = conf->query_retries;
+
+        /* Bootstrap from the node list, or validate the loaded table. */
+        struct event *event_kad_start = event_pool_get(&pool_events);
+        if (!event_kad_start) {
             log_perror(LOG_ERR, "Failed malloc: %s.", errno);
             return false;
         }
-        *event_kad_bootstrap = (struct event){
+        *event_kad_start = (struct event){
             "kad-bootstrap", .cb=event_kad_bootstrap_cb,
             .args.kad_bootstrap={.timer_list=&timer_list, .conf=conf, .kctx=&kctx, .sock=sock_udp},
-            .fatal=false, .self=event_kad_bootstrap
+            .fatal=false, .self=event_kad_start
         };
+        if (nodes_len > 0) {
+            strcpy(event_kad_start->name, "kad-warm-start");
+            event_kad_start->cb = event_kad_warm_start_cb;
+        }
 
         // Need to schedule event instead of adding to event queue, otherwise
         // applied after poll returns.
-        struct timer *timer_kad_bootstrap = malloc(sizeof(struct timer));
-        if (!timer_kad_bootstrap) {
+        struct timer *timer_kad_start = timer_pool_get(&pool_timers);
+        if (!timer_kad_start) {
             log_perror(LOG_ERR, "Failed malloc: %s.", errno);
-            free(event_kad_bootstrap);
+            event_pool_put(&pool_events, event_kad_start);
             return false;
         }
-        *timer_kad_bootstrap = (struct timer){
-            .name="kad-bootstrap", .ms=0, .event=event_kad_bootstrap,
-            .once=true, .self=timer_kad_bootstrap
+        *timer_kad_start = (struct timer){
+            .ms=0, .event=event_kad_start, .once=true, .self=timer_kad_start
         };
-        list_append(&timer_list, &timer_kad_bootstrap->item);
+        strcpy(timer_kad_start->name, event_kad_start->name);
+        list_append(&timer_list, &timer_kad_start->item);
+        if (nodes_len > 0)
+            log_info("Loaded %d nodes.", nodes_len);
     }
-    else {
-        log_debug("Loaded %d nodes from config.");
+
+    struct timer timer_kad_checkpoint = {
+        .name="kad-checkpoint", .ms=conf->checkpoint_s * 1000,
+        .event=&event_kad_checkpoint,
+        .item=LIST_ITEM_INIT(timer_kad_checkpoint.item)
+    };
+    if (conf->checkpoint_s > 0) {
+        if (!kad_rpc_checkpoint_start(&kctx, conf->conf_dir, conf->journal)) {
+            log_fatal("Failed to start DHT checkpoints. Aborting.");
+            return false;
+        }
+        event_kad_checkpoint.args.kad_checkpoint.kctx = &kctx;
+        list_append(&timer_list, &timer_kad_checkpoint.item);
+    }
+
+    struct admin_ctx actx = {.sock=-1};
+    struct timer timer_admin_expire = {
+        .name="admin-expire", .ms=ADMIN_EXPIRE_TICK_MS, .event=&event_admin_expire,
+        .item=LIST_ITEM_INIT(timer_admin_expire.item)
+    };
+    if (conf->admin_path[0]) {
+        if (!admin_init(&actx, conf->admin_path)) {
+            log_fatal("Failed to start admin endpoint. Aborting.");
+            return false;
+        }
+        actx.kctx = &kctx;
+        actx.timer_list = &timer_list;
+        event_admin_expire.args.admin_expire.actx = &actx;
+        list_append(&timer_list, &timer_admin_expire.item);
     }
 
+    /* Admin fds go last: the listening socket, then clients. */
     int nlisten = 2;
-    int nfds = nlisten + conf->max_peers;
-    struct pollfd fds[nfds];
+    struct pollfd fds[nlisten + conf->max_peers + 1 + ADMIN_CLIENTS_MAX];
     memset(fds, 0, sizeof(fds));
     fds[0].fd = sock_udp;
     fds[0].events = POLL_EVENTS;
     fds[1].fd = sock_tcp;
     fds[1].events = POLL_EVENTS;
     struct list_item peer_list = LIST_ITEM_INIT(peer_list);
+    int npeers = nlisten;
+    int nfds = npeers;
+    if (actx.sock >= 0)
+        nfds = admin_pollfds_update(&actx, fds, nfds);
 
     if (!timers_init(&timer_list)) {
         log_fatal("Timers' initialization failed. Aborting.");
         return false;
     }
 
+    if (!metrics_thread_register()) {
+        log_fatal("Metrics' initialization failed. Aborting.");
+        return false;
+    }
+
+    if (!trace_init(conf->conf_dir)) {
+        log_fatal("Trace initialization failed. Aborting.");
+        return false;
+    }
+
+    struct watchdog wd = {0};
+    if (conf->watchdog_ms > 0 && !watchdog_start(&wd, conf->watchdog_ms)) {
+        log_fatal("Watchdog initialization failed. Aborting.");
+        return false;
+    }
+
     while (true) {
+        metrics_inc(METRICS_CNT_LOOP_ITER);
 
         if (BITS_CHK(sig_events, EV_SIGINT)) {
             BITS_CLR(sig_events, EV_SIGINT);
@@ -138,6 +231,12 @@ bool server_run(const struct config *conf)
             break;
         }
 
+        if (BITS_CHK(sig_events, EV_SIGUSR1)) {
+            BITS_CLR(sig_events, EV_SIGUSR1);
+            server_metrics_dump(&kctx);
+            trace_dump();
+        }
+
         int timeout = timers_get_soonest(&timer_list);
         if (timeout < -1) {
             log_fatal("Timeout calculation failed. Aborting.");
@@ -145,7 +244,12 @@ bool server_run(const struct config *conf)
             break;
         }
         log_debug("Waiting to poll (timeout=%li)...", timeout);
-        if (poll(fds, nfds, timeout) < 0) {  // event_wait
+        long long poll_us = now_micros();
+        watchdog_poll(&wd, timeout < 0 ? LLONG_MAX : poll_us / 1000 + timeout);
+        int nready = poll(fds, nfds, timeout);  // event_wait
+        long long awake_us = now_micros();
+        metrics_hist_record(METRICS_HIST_POLL_WAIT_US, awake_us - poll_us);
+        if (nready < 0) {
             if (errno == EINTR)
                 continue;
             else {
@@ -160,35 +264,38 @@ bool server_run(const struct config *conf)
             if (fds[i].revents == 0)
                 continue;
 
-            if (!BITS_CHK(fds[i].revents, POLL_EVENTS)) {
-                log_error("Unexpected revents: %#x", fds[i].revents);
-                ret = false;
-                goto server_end;
-            }
-
-            if (fds[i].fd == sock_udp) {
-                event_node_data.args.node_data.sock = sock_udp;
-                event_node_data.args.node_data.kctx = &kctx;
-                if (!event_queue_put(&evq, &event_node_data)) {
-                    log_error("Enqueue event '%s' failed.", event_node_data.name);
+            if (i >= npeers) {
+                if (fds[i].fd == actx.sock) {
+                    event_admin_conn.args.admin_conn.actx = &actx;
+                    if (!event_enqueue(&evq, &event_admin_conn)) {
+                        log_warning("Event queue full. Deferring '%s'.", event_admin_conn.name);
+                    }
+                    continue;
                 }
-                continue;
-            }
 
-            if (fds[i].fd == sock_tcp) {
-                event_peer_conn.args.peer_conn.sock = sock_tcp;
-                event_peer_conn.args.peer_conn.peer_list = &peer_list;
-                event_peer_conn.args.peer_conn.nfds = nfds;
-                event_peer_conn.args.peer_conn.conf = conf;
-                if (!event_queue_put(&evq, &event_peer_conn)) {
-                    log_error("Enqueue event '%s' failed.", event_peer_conn.name);
+                struct event *event_admin_data = event_pool_get(&pool_events);
+                if (!event_admin_data) {
+                    log_perror(LOG_ERR, "Failed malloc: %s.", errno);
+                    ret = false;
+                    goto server_end;
+                }
+                *event_admin_data = (struct event){
+                    "admin-data", .cb=event_admin_data_cb, .args={{{0}}}, .fatal=false,
+                    .self=event_admin_data
+                };
+                event_admin_data->args.admin_data.actx = &actx;
+                event_admin_data->args.admin_data.fd = fds[i].fd;
+                event_admin_data->args.admin_data.revents = fds[i].revents;
+                if (!event_enqueue(&evq, event_admin_data)) {
+                    log_warning("Event queue full. Deferring '%s'.", event_admin_data->name);
+                    event_pool_put(&pool_events, event_admin_data);
                 }
                 continue;
             }
 
-            {
-                log_debug("Data available on fd %d.", fds[i].fd);
-                struct event *event_peer_data = malloc(sizeof(struct event));
+            if (i >= nlisten) {
+                log_debug("Peer fd %d ready (revents=%#x).", fds[i].fd, fds[i].revents);
+                struct event *event_peer_data = event_pool_get(&pool_events);
                 if (!event_peer_data) {
                     log_perror(LOG_ERR, "Failed malloc: %s.", errno);
                     ret = false;
@@ -198,14 +305,40 @@ bool server_run(const struct config *conf)
                     "peer-data", .cb=event_peer_data_cb, .args={{{0}}}, .fatal=true,
                     .self=event_peer_data
                 };
-                event_peer_data->args.peer_data.peer_list = &peer_list;
                 event_peer_data->args.peer_data.kctx = &kctx;
                 event_peer_data->args.peer_data.fd = fds[i].fd;
-                if (!event_queue_put(&evq, event_peer_data)) {
-                    log_error("Enqueue event '%s' failed.", event_peer_data->name);
+                event_peer_data->args.peer_data.revents = fds[i].revents;
+                if (!event_enqueue(&evq, event_peer_data)) {
+                    log_warning("Event queue full. Deferring '%s'.", event_peer_data->name);
+                    event_pool_put(&pool_events, event_peer_data);
+                }
+                continue;
+            }
+
+            if (!BITS_CHK(fds[i].revents, POLL_EVENTS)) {
+                log_error("Unexpected revents: %#x", fds[i].revents);
+                ret = false;
+                goto server_end;
+            }
+
+            if (fds[i].fd == sock_udp) {
+                event_node_data.args.node_data.sock = sock_udp;
+                event_node_data.args.node_data.kctx = &kctx;
+                if (!event_enqueue(&evq, &event_node_data)) {
+                    log_warning("Event queue full. Deferring '%s'.", event_node_data.name);
                 }
+                continue;
             }
 
+            if (fds[i].fd == sock_tcp) {
+                event_peer_conn.args.peer_conn.sock = sock_tcp;
+                event_peer_conn.args.peer_conn.peer_list = &peer_list;
+                event_peer_conn.args.peer_conn.nfds = npeers;
+                event_peer_conn.args.peer_conn.conf = conf;
+                if (!event_enqueue(&evq, &event_peer_conn)) {
+                    log_warning("Event queue full. Deferring '%s'.", event_peer_conn.name);
+                }
+            }
         } /* End loop poll fds */
 
         if (!timers_apply(&timer_list, &evq)) {
@@ -215,6 +348,8 @@ bool server_run(const struct config *conf)
         }
 
         // event_dispatch
+        metrics_gauge_set(METRICS_GAUGE_EVENT_QUEUE_DEPTH, event_queue_len(&evq));
+        metrics_gauge_set(METRICS_GAUGE_EVENT_QUEUE_HIWAT, evq.hiwat);
         while (event_queue_status(&evq) != QUEUE_STATE_EMPTY) {
             struct event *ev = event_queue_get(&evq);
             if (!ev) {
@@ -222,28 +357,55 @@ bool server_run(const struct config *conf)
                 continue;
             }
             log_debug("Triggering event '%s'.", ev->name);
-            if (!ev->cb(ev->args) && ev->fatal) {
+            watchdog_event(&wd, ev->metrics_id);
+            long long start_us = now_micros();
+            bool ok = ev->cb(ev->args);
+            watchdog_event(&wd, 0);
+            if (!ok && ev->fatal) {
                 ret = false;
             };
-            if (ev->self) {
-                free(ev->self);
-            }
+            long long end_us = now_micros();
+            metrics_event_record(ev->metrics_id, start_us - ev->queued_us,
+                                 end_us - start_us);
+            trace_add(&(struct trace_record){
+                .ts_us=start_us, .fd=-1, .dur_us=end_us - start_us,
+                .kind=TRACE_KIND_EVENT, .event=ev->metrics_id, .result=ok});
+            event_pool_put(&pool_events, ev->self);
             if (!ret) {
                 goto server_end;
             }
         }
 
-        nfds = pollfds_update(fds, nlisten, &peer_list);
+        npeers = pollfds_update(fds, nlisten, &peer_list);
+        nfds = npeers;
+        if (actx.sock >= 0)
+            nfds = admin_pollfds_update(&actx, fds, nfds);
+
+        metrics_hist_record(METRICS_HIST_LOOP_BUSY_US, now_micros() - awake_us);
 
     } /* End event loop */
 
   server_end:
+    if (!ret)
+        trace_dump();
+    event_queue_clear(&evq);
     peer_conn_close_all(&peer_list);
 
     kad_rpc_terminate(&kctx, conf->conf_dir);
+    if (conf->watchdog_ms > 0)
+        watchdog_stop(&wd);
+    metrics_thread_unregister();
 
+    if (actx.sock >= 0)
+        admin_shutdown(&actx, conf->admin_path);
     socket_shutdown(sock_tcp);
     socket_shutdown(sock_udp);
+
+    event_pool_destroy(&pool_events);
+    timer_pool_destroy(&pool_timers);
+    peer_pool_destroy(&pool_peers);
+    kad_rpc_query_pool_destroy(&pool_kad_queries);
+    kad_node_pool_destroy(&pool_kad_nodes);
     log_info("Server stopped.");
     return ret;
 }
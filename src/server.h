@@ -2,8 +2,10 @@
 #ifndef SERVER_H
 #define SERVER_H
 
+#include "net/kad/rpc.h"
 #include "options.h"
 
+void server_metrics_update(const struct kad_ctx *kctx);
 bool server_run(const struct config *conf);
 
 #endif /* SERVER_H */
@@ -53,5 +53,13 @@ bool sig_install()
         }
     }
 
+    /* sendfile(2) has no MSG_NOSIGNAL: get EPIPE instead. */
+    sa.sa_handler = SIG_IGN;
+    sa.sa_flags = 0;
+    if (sigaction(SIGPIPE, &sa, NULL) != 0) {
+        log_perror(LOG_ERR, "Failed sigaction: %s", errno);
+        return false;
+    }
+
     return true;
 }
@@ -6,6 +6,8 @@
 
 static clockid_t clockid = CLOCK_MONOTONIC;
 
+timer_pool pool_timers = {0};
+
 static inline long long millis_from_timespec(struct timespec t) {
     return (t).tv_sec * 1000LL + (t).tv_nsec / 1e6;
 }
@@ -34,6 +36,17 @@ long long now_millis()
     return millis_from_timespec(tspec);
 }
 
+/** For measuring latencies. */
+long long now_micros()
+{
+    struct timespec tspec = {0};
+    if (clock_gettime(clockid, &tspec) < 0) {
+        log_perror(LOG_ERR, "Failed clock_gettime: %s", errno);
+        return -1;
+    }
+    return tspec.tv_sec * 1000000LL + tspec.tv_nsec / 1000;
+}
+
 bool timers_init(struct list_item *timers)
 {
     long long tick_init = now_millis();
@@ -86,7 +99,6 @@ bool timers_apply(struct list_item *timers, event_queue *evq)
         return false;
     log_debug("tack=%lld", tack);
 
-    unsigned int errors = 0;
     struct list_item * it = timers;
     list_for(it, timers) {
         struct timer *t = cont(it, struct timer, item);
@@ -98,9 +110,10 @@ bool timers_apply(struct list_item *timers, event_queue *evq)
         int missed = 0;
         while (t->expire <= tack) {
             log_debug("timer '%s' triggered (missed=%ux)", t->name, missed);
-            if (!event_queue_put(evq, t->event)) {
-                log_error("Enqueue event '%s' failed.", t->event->name);
-                errors++;
+            if (!event_enqueue(evq, t->event)) {
+                /* Left expired: retried on next loop iteration. */
+                log_warning("Event queue full. Deferring timer '%s'.", t->name);
+                break;
             }
             /* FIXME handle `catch_up` flag: defaults to false, tells if we
                need to fire the timer handler as many times as we missed,
@@ -108,9 +121,7 @@ bool timers_apply(struct list_item *timers, event_queue *evq)
             if (t->once) {
                 it = it->prev; // deleting inside for_list
                 list_delete(&t->item);
-                if (t->self) {
-                    free(t->self);
-                }
+                timer_pool_put(&pool_timers, t->self);
                 break;
             }
             else {
@@ -121,5 +132,5 @@ bool timers_apply(struct list_item *timers, event_queue *evq)
 
     } // End for_list
 
-    return !errors;
+    return true;
 }
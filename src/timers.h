@@ -21,6 +21,7 @@
 #include "log.h"
 #include "options.h"
 #include "utils/list.h"
+#include "utils/pool.h"
 
 #define TIMER_NAME_MAX 64
 
@@ -31,8 +32,8 @@ struct timer {
     long long          expire;
     bool               catch_up;
     bool               once;
-    /* Address to self when allocated. `once` timers are expected to be
-       allocated. Used in timers_apply to free. The variable holding the
+    /* Address to self when drawn from pool_timers. `once` timers are expected
+       to be pooled. Used in timers_apply to release. The variable holding the
        pointer to the allocated memory might be gone out of scope when we free,
        so we have no reliable way to null it ourselves. It's thus best to stick
        to the convention not to hold any pointer to the allocated memory
@@ -41,8 +42,13 @@ struct timer {
     struct event      *event;
 };
 
+#define TIMER_POOL_SLAB_LEN 64
+POOL_GENERATE(timer_pool, struct timer, TIMER_POOL_SLAB_LEN)
+extern timer_pool pool_timers;
+
 bool timers_clock_res_is_millis();
 long long now_millis();
+long long now_micros();
 /** Before the event loop. */
 bool timers_init(struct list_item *timers);
 /** Right before poll() to calculate its `timeout` parameter. */
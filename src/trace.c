@@ -0,0 +1,124 @@
+/* Copyright (c) 2017-2019 Foudil Brétel.  All rights reserved. */
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "log.h"
+#include "trace.h"
+
+struct trace_ring trace_ring = {0};
+
+static char trace_path[PATH_MAX] = "";
+
+static const int trace_crash_signals[] = {SIGSEGV, SIGBUS, SIGFPE, SIGILL, SIGABRT};
+
+/** Only async-signal-safe calls. */
+static bool trace_write_all(int fd, const void *data, size_t len)
+{
+    const char *p = data;
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+        p += n;
+        len -= n;
+    }
+    return true;
+}
+
+/** Only async-signal-safe calls. */
+static bool trace_dump_fd(int fd)
+{
+    uint64_t head = trace_ring.head;
+    size_t count = head < TRACE_RING_LEN ? head : TRACE_RING_LEN;
+    size_t first = (head - count) & (TRACE_RING_LEN - 1);
+    size_t n1 = count < TRACE_RING_LEN - first ? count : TRACE_RING_LEN - first;
+
+    struct trace_file_header hdr = {
+        .version = TRACE_VERSION, .record_len = sizeof(struct trace_record),
+        .count = count, .event_names_len = METRICS_EVENT_LEN,
+    };
+    memcpy(hdr.magic, TRACE_MAGIC, sizeof(hdr.magic));
+    struct timespec ts;
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) == 0)
+        hdr.mono_us = ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+    if (clock_gettime(CLOCK_REALTIME, &ts) == 0)
+        hdr.real_us = ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+    if (!trace_write_all(fd, &hdr, sizeof(hdr)))
+        return false;
+
+    char names[METRICS_EVENT_LEN][TRACE_NAME_LEN] = {{0}};
+    for (const lookup_entry *e = metrics_event_names; e->name; e++) {
+        size_t i = 0;
+        for (; e->name[i] && i < TRACE_NAME_LEN - 1; i++)
+            names[e->id][i] = e->name[i];
+    }
+    if (!trace_write_all(fd, names, sizeof(names)))
+        return false;
+
+    return trace_write_all(fd, &trace_ring.rec[first],
+                           n1 * sizeof(struct trace_record)) &&
+        trace_write_all(fd, &trace_ring.rec[0],
+                        (count - n1) * sizeof(struct trace_record));
+}
+
+static void trace_crash_handler(int signo)
+{
+    int fd = open(trace_path, O_WRONLY|O_CREAT|O_TRUNC, 0600);
+    if (fd >= 0) {
+        trace_dump_fd(fd);
+        close(fd);
+    }
+    /* SA_RESETHAND restored the default action. */
+    raise(signo);
+}
+
+/**
+ * Sets the dump path and installs crash handlers.
+ */
+bool trace_init(const char conf_dir[])
+{
+    int len = snprintf(trace_path, sizeof(trace_path), "%s/"TRACE_FILENAME, conf_dir);
+    if (len < 0 || (size_t)len >= sizeof(trace_path)) {
+        log_error("Trace file path too long.");
+        return false;
+    }
+
+    struct sigaction sa = {0};
+    sa.sa_handler = trace_crash_handler;
+    sa.sa_flags = SA_RESETHAND;
+    sigemptyset(&sa.sa_mask);
+    for (size_t i = 0; i < sizeof(trace_crash_signals)/sizeof(int); i++) {
+        if (sigaction(trace_crash_signals[i], &sa, NULL) != 0) {
+            log_perror(LOG_ERR, "Failed sigaction: %s", errno);
+            return false;
+        }
+    }
+    return true;
+}
+
+bool trace_dump(void)
+{
+    int fd = open(trace_path, O_WRONLY|O_CREAT|O_TRUNC, 0600);
+    if (fd < 0) {
+        log_perror(LOG_ERR, "Failed open: %s.", errno);
+        return false;
+    }
+    bool ok = trace_dump_fd(fd);
+    if (!ok)
+        log_perror(LOG_ERR, "Failed write: %s.", errno);
+    if (close(fd) == -1) {
+        log_perror(LOG_ERR, "Failed close: %s.", errno);
+        ok = false;
+    }
+    if (ok)
+        log_info("Trace written to %s.", trace_path);
+    return ok;
+}
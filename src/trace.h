@@ -0,0 +1,81 @@
+/* Copyright (c) 2017-2019 Foudil Brétel.  All rights reserved. */
+#ifndef TRACE_H
+#define TRACE_H
+
+/**
+ * Flight recorder: a fixed-size ring of the most recent loop events, packets
+ * and RPC messages, for post-mortems.
+ *
+ * Recording is a fixed-size store into a static ring, without allocation nor
+ * lock: the ring is only written from the event-loop thread. It is dumped to
+ * a binary file on SIGUSR1, on fatal exit and on crashing signals, the latter
+ * being done with async-signal-safe calls only. Use tools/trace-decode to
+ * read dumps.
+ *
+ * Dump format, little-endian host order:
+ *   struct trace_file_header
+ *   char event_names[METRICS_EVENT_LEN][TRACE_NAME_LEN]
+ *   struct trace_record records[count], oldest first
+ */
+#include <stdbool.h>
+#include <stdint.h>
+#include "metrics.h"
+
+#define TRACE_RING_BIT_LEN 12
+#define TRACE_RING_LEN     (1 << TRACE_RING_BIT_LEN)
+#define TRACE_FILENAME     "trace.bin"
+#define TRACE_MAGIC        "PTPTRACE"
+#define TRACE_VERSION      1
+#define TRACE_NAME_LEN     16
+
+enum trace_kind {
+    TRACE_KIND_NONE,
+    TRACE_KIND_EVENT,     /* event dispatched: event, dur_us, result */
+    TRACE_KIND_UDP_RECV,  /* fd, bytes */
+    TRACE_KIND_UDP_SEND,  /* fd, bytes, result */
+    TRACE_KIND_RPC,       /* rpc_type, rpc_meth, tx_id, result */
+};
+
+struct trace_record {
+    int64_t  ts_us;       /* monotonic clock */
+    int32_t  fd;
+    uint32_t bytes;
+    uint32_t dur_us;
+    uint16_t kind;
+    uint16_t event;
+    uint16_t tx_id;
+    uint8_t  rpc_type;
+    uint8_t  rpc_meth;
+    int8_t   result;      /* 1 success, 0 failure, -1 unknown */
+    uint8_t  pad[3];
+};
+
+_Static_assert(sizeof(struct trace_record) == 32, "trace_record layout changed");
+
+struct trace_file_header {
+    char     magic[8];
+    uint32_t version;
+    uint32_t record_len;
+    uint32_t count;
+    uint32_t event_names_len;
+    /* Clocks at dump time, to convert ts_us to wall-clock time. */
+    int64_t  mono_us;
+    int64_t  real_us;
+};
+
+struct trace_ring {
+    uint64_t            head;
+    struct trace_record rec[TRACE_RING_LEN];
+};
+
+extern struct trace_ring trace_ring;
+
+bool trace_init(const char conf_dir[]);
+bool trace_dump(void);
+
+static inline void trace_add(const struct trace_record *rec)
+{
+    trace_ring.rec[trace_ring.head++ & (TRACE_RING_LEN - 1)] = *rec;
+}
+
+#endif /* TRACE_H */
@@ -0,0 +1,143 @@
+/* Copyright (c) 2017-2019 Foudil Brétel.  All rights reserved. */
+#ifndef ARENA_H
+#define ARENA_H
+
+/**
+ * A bump allocator for request-scoped memory.
+ *
+ * Allocations are carved out of chunks, and all released at once with
+ * arena_reset(). When a chunk is exhausted, a new one is chained; on reset,
+ * chained chunks are merged into a single chunk big enough for the whole
+ * working set, so that an arena which reached its steady state neither
+ * allocates nor frees anymore. Memory is handed out uninitialized, aligned
+ * for any type.
+ *
+ * Not thread-safe: use one arena per worker.
+ */
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define ARENA_ALIGN _Alignof(max_align_t)
+
+struct arena_chunk {
+    struct arena_chunk *next;
+    size_t              len;
+    _Alignas(max_align_t) char data[];
+};
+
+struct arena_stats {
+    size_t   chunks;
+    size_t   capacity;  /* bytes in all chunks */
+    size_t   used;
+    size_t   hiwat;     /* used high-water mark */
+    uint64_t resets;
+};
+
+struct arena {
+    struct arena_chunk *chunk;  /* current chunk, head of the list */
+    size_t              off;    /* in current chunk */
+    void               *last;   /* last allocation, for arena_realloc() */
+    size_t              chunk_len;
+    struct arena_stats  stats;
+};
+
+#define ARENA_INIT(len) { .chunk_len = (len) }
+
+static inline size_t arena_align(const size_t len)
+{
+    return (len + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+}
+
+static inline bool arena_grow(struct arena *a, const size_t len)
+{
+    size_t chunk_len = a->chunk_len > len ? a->chunk_len : len;
+    struct arena_chunk *c = malloc(sizeof(struct arena_chunk) + chunk_len);
+    if (!c)
+        return false;
+    c->len = chunk_len;
+    c->next = a->chunk;
+    a->chunk = c;
+    a->off = 0;
+    a->stats.chunks++;
+    a->stats.capacity += chunk_len;
+    return true;
+}
+
+static inline void *arena_alloc(struct arena *a, const size_t len)
+{
+    size_t alen = arena_align(len);
+    if ((!a->chunk || a->chunk->len - a->off < alen) && !arena_grow(a, alen))
+        return NULL;
+    void *p = a->chunk->data + a->off;
+    a->off += alen;
+    a->last = p;
+    if ((a->stats.used += alen) > a->stats.hiwat)
+        a->stats.hiwat = a->stats.used;
+    return p;
+}
+
+/**
+ * Grows @p, which must come from @a, to @len. The last allocation is
+ * extended in place when its chunk allows.
+ */
+static inline void *
+arena_realloc(struct arena *a, void *p, const size_t old_len, const size_t len)
+{
+    if (p && p == a->last) {
+        size_t start = (char *)p - a->chunk->data;
+        size_t alen = arena_align(len);
+        if (a->chunk->len - start >= alen) {
+            size_t prev = a->off - start;
+            a->off = start + alen;
+            a->stats.used += alen - prev;
+            if (a->stats.used > a->stats.hiwat)
+                a->stats.hiwat = a->stats.used;
+            return p;
+        }
+    }
+    void *q = arena_alloc(a, len);
+    if (q && p)
+        memcpy(q, p, old_len < len ? old_len : len);
+    return q;
+}
+
+static inline void arena_destroy(struct arena *a)
+{
+    while (a->chunk) {
+        struct arena_chunk *c = a->chunk;
+        a->chunk = c->next;
+        free(c);
+    }
+    size_t chunk_len = a->chunk_len;
+    memset(a, 0, sizeof(*a));
+    a->chunk_len = chunk_len;
+}
+
+/**
+ * Releases all allocations. Chained chunks are merged, so that the next
+ * cycle fits into a single chunk.
+ */
+static inline void arena_reset(struct arena *a)
+{
+    if (a->chunk && a->chunk->next) {
+        size_t capacity = a->stats.capacity;
+        struct arena_stats stats = a->stats;
+        arena_destroy(a);
+        if (a->chunk_len < capacity)
+            a->chunk_len = capacity;
+        a->stats = stats;
+        a->stats.chunks = 0;
+        a->stats.capacity = 0;
+        /* On failure, the next arena_alloc() retries. */
+        arena_grow(a, capacity);
+    }
+    a->off = 0;
+    a->last = NULL;
+    a->stats.used = 0;
+    a->stats.resets++;
+}
+
+#endif /* ARENA_H */
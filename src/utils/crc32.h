@@ -0,0 +1,14 @@
+/* Copyright (c) 2017-2019 Foudil Brétel.  All rights reserved. */
+#ifndef CRC32_H
+#define CRC32_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * CRC-32 (IEEE 802.3, as zlib). Chain calls by passing the previous result as
+ * @crc, starting with 0.
+ */
+uint32_t crc32(uint32_t crc, const void *buf, size_t len);
+
+#endif /* CRC32_H */
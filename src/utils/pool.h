@@ -0,0 +1,101 @@
+/* Copyright (c) 2017-2019 Foudil Brétel.  All rights reserved. */
+#ifndef POOL_H
+#define POOL_H
+
+/**
+ * A typed object pool, backed by slabs.
+ *
+ * Objects are carved out of slabs of @slab_len objects, allocated on demand
+ * and only released with name##_destroy(). Released objects are kept in a
+ * freelist, so that a pool which reached its working set size does not
+ * allocate anymore. Objects are handed out zeroed.
+ *
+ * Not thread-safe.
+ */
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct pool_stats {
+    size_t   slabs;
+    size_t   capacity;  /* objects in all slabs */
+    size_t   in_use;
+    size_t   hiwat;     /* in_use high-water mark */
+    uint64_t gets;
+};
+
+#define POOL_GENERATE(name, type, slab_len)               \
+    typedef union name##_slot {                           \
+        union name##_slot *next;                          \
+        type               obj;                           \
+    } name##_slot;                                        \
+    typedef struct name##_slab {                          \
+        struct name##_slab *next;                         \
+        name##_slot         slots[slab_len];              \
+    } name##_slab;                                        \
+    typedef struct {                                      \
+        name##_slot       *free;                          \
+        name##_slab       *slabs;                         \
+        struct pool_stats  stats;                         \
+    } name;                                               \
+    POOL_GENERATE_GROW(name, slab_len)                    \
+    POOL_GENERATE_GET(name, type)                         \
+    POOL_GENERATE_PUT(name, type)                         \
+    POOL_GENERATE_DESTROY(name)
+
+#define POOL_GENERATE_GROW(name, slab_len)                          \
+static inline bool name##_grow(name *p)                             \
+{                                                                   \
+    name##_slab *slab = malloc(sizeof(name##_slab));                \
+    if (!slab)                                                      \
+        return false;                                               \
+    for (size_t i = 0; i < (slab_len); i++) {                       \
+        slab->slots[i].next = p->free;                              \
+        p->free = &slab->slots[i];                                  \
+    }                                                               \
+    slab->next = p->slabs;                                          \
+    p->slabs = slab;                                                \
+    p->stats.slabs++;                                               \
+    p->stats.capacity += (slab_len);                                \
+    return true;                                                    \
+}
+
+#define POOL_GENERATE_GET(name, type)                               \
+static inline type *name##_get(name *p)                             \
+{                                                                   \
+    if (!p->free && !name##_grow(p))                                \
+        return NULL;                                                \
+    name##_slot *slot = p->free;                                    \
+    p->free = slot->next;                                           \
+    memset(slot, 0, sizeof(*slot));                                 \
+    p->stats.gets++;                                                \
+    if (++p->stats.in_use > p->stats.hiwat)                         \
+        p->stats.hiwat = p->stats.in_use;                           \
+    return &slot->obj;                                              \
+}
+
+#define POOL_GENERATE_PUT(name, type)                               \
+static inline void name##_put(name *p, type *obj)                   \
+{                                                                   \
+    if (!obj)                                                       \
+        return;                                                     \
+    name##_slot *slot = (name##_slot *)obj;                         \
+    slot->next = p->free;                                           \
+    p->free = slot;                                                 \
+    p->stats.in_use--;                                              \
+}
+
+#define POOL_GENERATE_DESTROY(name)                                 \
+static inline void name##_destroy(name *p)                          \
+{                                                                   \
+    while (p->slabs) {                                              \
+        name##_slab *slab = p->slabs;                               \
+        p->slabs = slab->next;                                      \
+        free(slab);                                                 \
+    }                                                               \
+    memset(p, 0, sizeof(*p));                                       \
+}
+
+#endif /* POOL_H */
@@ -7,9 +7,14 @@
  *
  * Inspired from https://stackoverflow.com/a/13888143/421846.
  * Another cool implementation: http://www.martinbroadhurst.com/cirque-in-c.html.
+ *
+ * QUEUE_GROW_GENERATE() generates a variant whose heap-allocated ring doubles
+ * on demand, from 2^min_len up to 2^max_len entries. It also tracks its
+ * high-water mark. Such queues must be released with name##_free().
  */
 #include <stdbool.h>
 #include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
 
 enum queue_state {
@@ -30,7 +35,8 @@ enum queue_state {
     QUEUE_GENERATE_INIT(name)                             \
     QUEUE_GENERATE_PUT(name)                              \
     QUEUE_GENERATE_GET(name, type)                        \
-    QUEUE_GENERATE_STATUS(name)
+    QUEUE_GENERATE_STATUS(name)                           \
+    QUEUE_GENERATE_LEN(name, len)
 
 #define QUEUE_GENERATE_INIT(name)                                   \
 static inline void name##_init(name *q)                             \
@@ -73,5 +79,92 @@ static inline enum queue_state name##_status(name *q)               \
         return QUEUE_STATE_OK;                                      \
 }
 
+#define QUEUE_GENERATE_LEN(name, len)   \
+static inline size_t name##_len(name *q)                            \
+{                                                                   \
+    if (q->is_full)                                                 \
+        return QUEUE_BIT_LEN(len);                                  \
+    return (uint32_t)(q->tail - q->head) & ((QUEUE_BIT_LEN(len)) - 1); \
+}
+
+#define QUEUE_GROW_GENERATE(name, type, min_len, max_len) \
+    typedef struct {                                      \
+        type     **entries;                               \
+        uint32_t   cap;                                   \
+        uint32_t   head;                                  \
+        uint32_t   len;                                   \
+        uint32_t   hiwat;                                 \
+    } name;                                               \
+    QUEUE_GROW_GENERATE_FREE(name)                        \
+    QUEUE_GROW_GENERATE_GROW(name, type, min_len, max_len) \
+    QUEUE_GROW_GENERATE_PUT(name)                         \
+    QUEUE_GROW_GENERATE_GET(name, type)                   \
+    QUEUE_GROW_GENERATE_STATUS(name, max_len)             \
+    QUEUE_GROW_GENERATE_LEN(name)
+
+#define QUEUE_GROW_GENERATE_FREE(name)                              \
+static inline void name##_free(name *q)                             \
+{                                                                   \
+    free(q->entries);                                               \
+    memset(q, 0, sizeof(*q));                                       \
+}
+
+#define QUEUE_GROW_GENERATE_GROW(name, type, min_len, max_len)      \
+static inline bool name##_grow(name *q)                             \
+{                                                                   \
+    size_t cap = q->cap ? (size_t)q->cap << 1 : QUEUE_BIT_LEN(min_len); \
+    if (cap > QUEUE_BIT_LEN(max_len))                               \
+        return false;                                               \
+    type **entries = malloc(cap * sizeof(type *));                  \
+    if (!entries)                                                   \
+        return false;                                               \
+    for (uint32_t i = 0; i < q->len; i++)                           \
+        entries[i] = q->entries[(q->head + i) & (q->cap - 1)];      \
+    free(q->entries);                                               \
+    q->entries = entries;                                           \
+    q->cap = cap;                                                   \
+    q->head = 0;                                                    \
+    return true;                                                    \
+}
+
+#define QUEUE_GROW_GENERATE_PUT(name)                               \
+static inline bool name##_put(name *q, void *elt)                   \
+{                                                                   \
+    if (q->len == q->cap && !name##_grow(q))                        \
+        return false;                                               \
+    q->entries[(q->head + q->len) & (q->cap - 1)] = elt;            \
+    q->len++;                                                       \
+    if (q->len > q->hiwat)                                          \
+        q->hiwat = q->len;                                          \
+    return true;                                                    \
+}
+
+#define QUEUE_GROW_GENERATE_GET(name, type)                         \
+static inline type *name##_get(name *q)                             \
+{                                                                   \
+    if (q->len == 0)                                                \
+        return NULL;                                                \
+    type *elt = q->entries[q->head];                                \
+    q->head = (q->head + 1) & (q->cap - 1);                         \
+    q->len--;                                                       \
+    return elt;                                                     \
+}
+
+#define QUEUE_GROW_GENERATE_STATUS(name, max_len)                   \
+static inline enum queue_state name##_status(name *q)               \
+{                                                                   \
+    if (q->len == 0)                                                \
+        return QUEUE_STATE_EMPTY;                                   \
+    else if (q->len == QUEUE_BIT_LEN(max_len))                      \
+        return QUEUE_STATE_FULL;                                    \
+    else                                                            \
+        return QUEUE_STATE_OK;                                      \
+}
+
+#define QUEUE_GROW_GENERATE_LEN(name)                               \
+static inline size_t name##_len(name *q)                            \
+{                                                                   \
+    return q->len;                                                  \
+}
 
 #endif /* QUEUE_H */
@@ -0,0 +1,215 @@
+/* Copyright (c) 2017-2019 Foudil Brétel.  All rights reserved. */
+#include <errno.h>
+#include <limits.h>
+#include <semaphore.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <time.h>
+#include "config.h"
+#ifdef HAVE_EXECINFO_H
+#include <execinfo.h>
+#endif
+#include "log.h"
+#include "metrics.h"
+#include "timers.h"
+#include "watchdog.h"
+
+#define WATCHDOG_SIG_WAIT_MS 100
+
+/* Filled by the signal handler, on the loop thread. */
+static const struct watchdog *watchdog_loop = NULL;
+static volatile sig_atomic_t watchdog_sig_event = 0;
+static sem_t watchdog_sig_sem;
+#ifdef HAVE_EXECINFO_H
+static void *watchdog_bt[WATCHDOG_BT_MAX];
+static volatile sig_atomic_t watchdog_bt_len = 0;
+#endif
+
+static void watchdog_sig_handler(int signo)
+{
+    (void)signo;
+    int saved_errno = errno;
+    watchdog_sig_event = watchdog_loop->event;
+#ifdef HAVE_EXECINFO_H
+    watchdog_bt_len = backtrace(watchdog_bt, WATCHDOG_BT_MAX);
+#endif
+    sem_post(&watchdog_sig_sem);
+    errno = saved_errno;
+}
+
+static void timespec_add_millis(struct timespec *ts, const long long ms)
+{
+    ts->tv_sec += ms / 1000;
+    ts->tv_nsec += (ms % 1000) * 1000000;
+    if (ts->tv_nsec >= 1000000000) {
+        ts->tv_sec++;
+        ts->tv_nsec -= 1000000000;
+    }
+}
+
+/* Has the loop thread tell its current event, and its backtrace. */
+static bool watchdog_loop_inspect(struct watchdog *wd)
+{
+    if (pthread_kill(wd->loop_th, WATCHDOG_SIG) != 0) {
+        log_error("Failed to signal event loop thread.");
+        return false;
+    }
+
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    timespec_add_millis(&deadline, WATCHDOG_SIG_WAIT_MS);
+    while (sem_timedwait(&watchdog_sig_sem, &deadline) == -1) {
+        if (errno != EINTR) {
+            log_warning("No answer from event loop thread.");
+            return false;
+        }
+    }
+    return true;
+}
+
+static void watchdog_log_backtrace(void)
+{
+#ifdef HAVE_EXECINFO_H
+    char **symbols = backtrace_symbols(watchdog_bt, watchdog_bt_len);
+    if (!symbols) {
+        log_perror(LOG_ERR, "Failed backtrace_symbols: %s.", errno);
+        return;
+    }
+    for (int i = 0; i < watchdog_bt_len; i++)
+        log_warning("  #%d %s", i, symbols[i]);
+    free(symbols);
+#endif
+}
+
+static void watchdog_report(struct watchdog *wd, const long long stalled_ms)
+{
+    metrics_inc(METRICS_CNT_LOOP_STALLS);
+    bool inspected = watchdog_loop_inspect(wd);
+    wd->stalled_event = inspected ? watchdog_sig_event : 0;
+    const char *name = lookup_by_id(metrics_event_names, wd->stalled_event);
+    log_warning("Event loop stalled for %lld ms, in event '%s'.",
+                stalled_ms, name ? name : inspected ? "other" : "unknown");
+    if (inspected)
+        watchdog_log_backtrace();
+}
+
+static void *watchdog_run(void *data)
+{
+    struct watchdog *wd = data;
+    if (!metrics_thread_register())
+        return NULL;
+
+    long long period = wd->stall_ms / 4 > 0 ? wd->stall_ms / 4 : 1;
+    long long last = 0;
+    bool reported = false;
+
+    pthread_mutex_lock(&wd->lock);
+    while (!wd->stop) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        timespec_add_millis(&deadline, period);
+        int rv = pthread_cond_timedwait(&wd->cond, &wd->lock, &deadline);
+        if (wd->stop)
+            break;
+        if (rv != 0 && rv != ETIMEDOUT) {
+            log_error("Watchdog wait failed (%d).", rv);
+            break;
+        }
+
+        /* The loop is late once past the latest return of poll(2), and stalled
+           when late for longer than stall_ms without polling again. */
+        long long poll_end = atomic_load_explicit(&wd->deadline, memory_order_relaxed);
+        long long now = now_millis();
+        if (poll_end != last) {
+            if (reported)
+                log_info("Event loop recovered after %lld ms.", now - last);
+            last = poll_end;
+            reported = false;
+            continue;
+        }
+        if (!reported && now - poll_end >= wd->stall_ms) {
+            watchdog_report(wd, now - poll_end);
+            reported = true;
+        }
+    }
+    pthread_mutex_unlock(&wd->lock);
+
+    metrics_thread_unregister();
+    return NULL;
+}
+
+/**
+ * Must be called from the event-loop thread.
+ */
+bool watchdog_start(struct watchdog *wd, const long long stall_ms)
+{
+    wd->loop_th = pthread_self();
+    wd->stall_ms = stall_ms;
+    wd->stop = false;
+    wd->event = 0;
+    wd->stalled_event = 0;
+    atomic_init(&wd->deadline, LLONG_MAX);
+
+    watchdog_loop = wd;
+    if (sem_init(&watchdog_sig_sem, 0, 0) == -1) {
+        log_perror(LOG_ERR, "Failed sem_init: %s.", errno);
+        return false;
+    }
+#ifdef HAVE_EXECINFO_H
+    /* backtrace() may allocate on first call, which is not allowed in signal
+       handlers. */
+    watchdog_bt_len = backtrace(watchdog_bt, WATCHDOG_BT_MAX);
+#endif
+    struct sigaction sa = {0};
+    sa.sa_handler = watchdog_sig_handler;
+    sa.sa_flags = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    if (sigaction(WATCHDOG_SIG, &sa, NULL) != 0) {
+        log_perror(LOG_ERR, "Failed sigaction: %s", errno);
+        return false;
+    }
+
+    pthread_condattr_t cattr;
+    if (pthread_condattr_init(&cattr) != 0 ||
+        pthread_condattr_setclock(&cattr, CLOCK_MONOTONIC) != 0 ||
+        pthread_cond_init(&wd->cond, &cattr) != 0) {
+        log_error("Failed to initialize watchdog condition.");
+        return false;
+    }
+    pthread_condattr_destroy(&cattr);
+    if (pthread_mutex_init(&wd->lock, NULL) != 0) {
+        log_error("Failed to initialize watchdog lock.");
+        pthread_cond_destroy(&wd->cond);
+        return false;
+    }
+
+    /* Process signals must keep being delivered to the loop thread, so that
+       they interrupt poll(2). The new thread inherits this mask. */
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    int rv = pthread_create(&wd->th, NULL, watchdog_run, wd);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (rv != 0) {
+        log_error("Failed to create watchdog thread (%d).", rv);
+        pthread_mutex_destroy(&wd->lock);
+        pthread_cond_destroy(&wd->cond);
+        return false;
+    }
+
+    log_info("Event-loop watchdog started (stall=%lld ms).", stall_ms);
+    return true;
+}
+
+void watchdog_stop(struct watchdog *wd)
+{
+    pthread_mutex_lock(&wd->lock);
+    wd->stop = true;
+    pthread_cond_signal(&wd->cond);
+    pthread_mutex_unlock(&wd->lock);
+    pthread_join(wd->th, NULL);
+    pthread_mutex_destroy(&wd->lock);
+    pthread_cond_destroy(&wd->cond);
+    signal(WATCHDOG_SIG, SIG_IGN);
+    sem_destroy(&watchdog_sig_sem);
+}
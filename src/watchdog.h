@@ -0,0 +1,58 @@
+/* Copyright (c) 2017-2019 Foudil Brétel.  All rights reserved. */
+#ifndef WATCHDOG_H
+#define WATCHDOG_H
+
+/**
+ * Event-loop stall watchdog.
+ *
+ * Right before each poll(2), the loop publishes, with a single relaxed atomic
+ * store, the time by which poll(2) returns at the latest. A separate thread
+ * samples it, and reports a stall when the loop is late by more than the
+ * configured delay and has not published since: it logs the current event
+ * and, when available, a backtrace of the loop thread, and increments the
+ * loop_stalls counter. Stalls are thus detected late by at most the poll
+ * timeout, which the periodic timers keep short.
+ *
+ * The current event is a plain variable of the loop thread, read by the
+ * handler of WATCHDOG_SIG, which is raised on the loop thread on stalls and
+ * also captures the backtrace into a static buffer.
+ */
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+
+#define WATCHDOG_SIG    SIGRTMIN
+#define WATCHDOG_BT_MAX 32
+
+struct watchdog {
+    pthread_t             th;
+    pthread_t             loop_th;
+    pthread_mutex_t       lock;
+    pthread_cond_t        cond;
+    bool                  stop;
+    long long             stall_ms;
+    /* Published by the loop: latest return of poll(2), in ms. */
+    atomic_llong          deadline;
+    /* Loop's own: metrics id of the event being dispatched, 0 otherwise. */
+    volatile sig_atomic_t event;
+    /* Event of the last stall reported. */
+    int                   stalled_event;
+};
+
+bool watchdog_start(struct watchdog *wd, const long long stall_ms);
+void watchdog_stop(struct watchdog *wd);
+
+/** Before poll(2), with the time it returns at the latest. */
+static inline void watchdog_poll(struct watchdog *wd, const long long deadline_ms)
+{
+    atomic_store_explicit(&wd->deadline, deadline_ms, memory_order_relaxed);
+}
+
+/** Not shared with the watchdog thread: a plain store. */
+static inline void watchdog_event(struct watchdog *wd, const int event)
+{
+    wd->event = event;
+}
+
+#endif /* WATCHDOG_H */
@@ -0,0 +1,82 @@
+/* Copyright (c) 2017-2019 Foudil Brétel.  All rights reserved. */
+#include <assert.h>
+#include <stdio.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include "admin.h"
+#include "log.h"
+#include "net/socket.h"
+#include "timers.h"
+#include "utils/cont.h"
+
+int main()
+{
+    assert(log_init(LOG_TYPE_STDOUT, LOG_UPTO(LOG_CRIT)));
+
+    char path[64];
+    snprintf(path, sizeof(path), "/tmp/ptp-admin-%d.sock", getpid());
+    struct admin_ctx actx = {.sock=-1};
+    assert(admin_init(&actx, path));
+
+    // only the owner may connect
+    struct stat st;
+    assert(stat(path, &st) == 0);
+    assert((st.st_mode & 0777) == 0600);
+
+    struct sockaddr_un addr = {.sun_family=AF_UNIX};
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path);
+    int cli = socket(AF_UNIX, SOCK_STREAM, 0);
+    assert(cli >= 0);
+    assert(connect(cli, (struct sockaddr *)&addr, sizeof(addr)) == 0);
+    assert(admin_conn_accept_all(&actx));
+    assert(actx.nclients == 1);
+
+    // idle clients are closed once past their deadline
+    long long now = now_millis();
+    assert(admin_expire(&actx, now));
+    assert(actx.nclients == 1);
+    assert(admin_expire(&actx, now + ADMIN_CLIENT_TIMEOUT_MS));
+    assert(actx.nclients == 0);
+    char buf[8];
+    assert(recv(cli, buf, sizeof(buf), 0) == 0);
+    close(cli);
+
+    // clients that do not read their response do not block
+    struct kad_ctx kctx = {0};
+    kctx.dht = dht_create();
+    assert(kctx.dht);
+    list_init(&kctx.queries);
+    actx.kctx = &kctx;
+    for (int i = 0; i < KAD_GUID_SPACE_IN_BITS; i++) {
+        struct kad_node_info info = {0};
+        info.id = kctx.dht->self_id;
+        info.id.bytes[i / 8] ^= 0x80 >> (i % 8);
+        info.addr.ss_family = AF_INET;
+        for (int j = 0; j < KAD_K_CONST; j++) {
+            info.id.bytes[KAD_GUID_SPACE_IN_BYTES-1] ^= j;
+            dht_insert(kctx.dht, &info);
+            info.id.bytes[KAD_GUID_SPACE_IN_BYTES-1] ^= j;
+        }
+    }
+    cli = socket(AF_UNIX, SOCK_STREAM, 0);
+    assert(cli >= 0);
+    assert(connect(cli, (struct sockaddr *)&addr, sizeof(addr)) == 0);
+    assert(admin_conn_accept_all(&actx));
+    struct admin_client *c = cont(actx.clients.next, struct admin_client, item);
+    int sndbuf = 4096;
+    assert(setsockopt(c->fd, SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf)) == 0);
+    assert(send(cli, "dht\n", 4, 0) == 4);
+    assert(admin_conn_handle(&actx, c->fd, POLLIN));
+    assert(actx.nclients == 1);
+    assert(c->rsp.pos > 64 * 1024 && c->rsp_off < c->rsp.pos);
+    assert(admin_expire(&actx, now_millis() + ADMIN_CLIENT_TIMEOUT_MS));
+    assert(actx.nclients == 0);
+    close(cli);
+    dht_destroy(kctx.dht);
+
+    admin_shutdown(&actx, path);
+    log_shutdown(LOG_TYPE_STDOUT);
+    return 0;
+}
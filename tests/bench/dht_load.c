@@ -0,0 +1,113 @@
+/* Copyright (c) 2017-2019 Foudil Brétel.  All rights reserved. */
+/**
+ * Load time of the routing table state file, for a full table in the binary
+ * format, and for the largest bencoded table the parser accepts.
+ */
+#include <assert.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "file.h"
+#include "log.h"
+#include "timers.h"
+#include "net/kad/bencode/dht.h"
+#include "net/kad/dht.h"
+
+#define LOADS       200
+#define BENC_NODES  200  /* below BENC_NODE_CHILDREN_MAX */
+
+/* A node id falling into bucket @bkt of @self. */
+static void node_id_for_bucket(kad_guid *id, const kad_guid *self, size_t bkt)
+{
+    unsigned char bytes[KAD_GUID_SPACE_IN_BYTES];
+    size_t bit = KAD_GUID_SPACE_IN_BITS - 1 - bkt;
+    for (size_t i = 0; i < KAD_GUID_SPACE_IN_BYTES; i++) {
+        if (i < bit / 8)
+            bytes[i] = self->bytes[i];
+        else
+            bytes[i] = (unsigned char)random();
+    }
+    unsigned char mask = 0x80 >> (bit % 8);
+    unsigned char keep = (unsigned char)~(0xff >> (bit % 8));
+    bytes[bit / 8] = (self->bytes[bit / 8] & keep) |
+        ((self->bytes[bit / 8] ^ mask) & mask) | (bytes[bit / 8] & (mask - 1));
+    kad_guid_set(id, bytes);
+}
+
+static void fill_table(struct kad_dht *dht)
+{
+    for (size_t bkt = 0; bkt < KAD_GUID_SPACE_IN_BITS; bkt++) {
+        for (size_t k = 0; k < KAD_K_CONST; k++) {
+            struct kad_node_info info = {0};
+            node_id_for_bucket(&info.id, &dht->self_id, bkt);
+            if (k % 2) {
+                struct sockaddr_in6 *sa = (struct sockaddr_in6 *)&info.addr;
+                sa->sin6_family = AF_INET6;
+                sa->sin6_addr.s6_addr[0] = 0x20;
+                sa->sin6_addr.s6_addr[15] = (unsigned char)bkt;
+                sa->sin6_port = htons(22000 + k);
+            }
+            else {
+                struct sockaddr_in *sa = (struct sockaddr_in *)&info.addr;
+                sa->sin_family = AF_INET;
+                sa->sin_addr.s_addr = htonl(0x0a000000 | (bkt << 8) | k);
+                sa->sin_port = htons(22000 + k);
+            }
+            assert(dht_insert(dht, &info));
+        }
+    }
+}
+
+static void bench_load(const char label[], const char path[], int expected)
+{
+    long long start = now_micros();
+    for (int i = 0; i < LOADS; i++) {
+        struct kad_dht *dht = NULL;
+        assert(dht_read(&dht, path) == expected);
+        dht_destroy(dht);
+    }
+    long long elapsed = now_micros() - start;
+    printf("%-8s %5d nodes: %8.1f us/load, %6.1f ns/node\n", label, expected,
+           (double)elapsed / LOADS, 1000.0 * elapsed / LOADS / expected);
+}
+
+int main()
+{
+    assert(log_init(LOG_TYPE_STDOUT, LOG_UPTO(LOG_CRIT)));
+
+    char dir[] = "/tmp/ptp-bench-XXXXXX";
+    assert(mkdtemp(dir));
+    char bin[PATH_MAX], benc[PATH_MAX];
+    snprintf(bin, sizeof(bin), "%s/dht.dat", dir);
+    snprintf(benc, sizeof(benc), "%s/dht.benc", dir);
+
+    struct kad_dht *dht = dht_create();
+    assert(dht);
+    fill_table(dht);
+    uint64_t fill[KAD_GUID_SPACE_IN_BITS];
+    int nodes = dht_bucket_fill(dht, fill);
+    assert(nodes == KAD_GUID_SPACE_IN_BITS * KAD_K_CONST);
+
+    assert(dht_write(dht, bin));
+    bench_load("binary", bin, nodes);
+
+    struct kad_dht_encoded *encoded = calloc(1, sizeof(struct kad_dht_encoded));
+    assert(encoded);
+    dht_snapshot(dht, encoded);
+    encoded->nodes_len = BENC_NODES;
+    struct iobuf buf = {0};
+    assert(benc_encode_dht(&buf, encoded));
+    assert(file_write_atomic(benc, buf.buf, buf.pos));
+    iobuf_reset(&buf);
+    free(encoded);
+    bench_load("bencode", benc, BENC_NODES);
+
+    dht_destroy(dht);
+    assert(unlink(bin) == 0);
+    assert(unlink(benc) == 0);
+    assert(rmdir(dir) == 0);
+    kad_node_pool_destroy(&pool_kad_nodes);
+    log_shutdown(LOG_TYPE_STDOUT);
+    return 0;
+}
@@ -0,0 +1,161 @@
+/* Copyright (c) 2017-2019 Foudil Brétel.  All rights reserved. */
+#include <assert.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "log.h"
+#include "net/actions.h"
+#include "net/socket.h"
+#include "options.h"
+
+#define CONTENT_LEN (3 * 1024 * 1024 + 123)
+#define SEG_OFF     1000
+#define MSG_BUF_MAX (64 * 1024)
+
+struct got {
+    int       count;
+    size_t    recv;
+    union u64 off;
+    bool      same;
+    const char *content;
+};
+
+static bool on_chunk(struct proto_msg_parser *parser,
+                     const char buf[], size_t len, void *data)
+{
+    struct got *got = data;
+    for (size_t i = 0; i < len; i++, got->recv++) {
+        if (got->recv < PROTO_MSG_BULK_OFFSET_LEN)
+            got->off.db[got->recv] = buf[i];
+        else if (buf[i] != got->content[SEG_OFF + got->recv -
+                                        PROTO_MSG_BULK_OFFSET_LEN])
+            got->same = false;
+    }
+    (void)parser;
+    return true;
+}
+
+static bool on_msg(struct proto_msg_parser *parser, void *data)
+{
+    struct got *got = data;
+    assert(parser->msg_type == PROTO_MSG_TYPE_BULK);
+    assert(parser->streaming);
+    got->count++;
+    return true;
+}
+
+int main()
+{
+    assert(log_init(LOG_TYPE_STDOUT, LOG_UPTO(LOG_CRIT)));
+
+    char *content = malloc(CONTENT_LEN);
+    assert(content);
+    for (size_t i = 0; i < CONTENT_LEN; i++)
+        content[i] = (char)(i * 7 + i / 251);
+    char dir[] = "/tmp/ptp-bulk-XXXXXX";
+    assert(mkdtemp(dir));
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/content", dir);
+    int fd = open(path, O_RDWR | O_CREAT | O_EXCL, 0600);
+    assert(fd >= 0);
+    assert(unlink(path) == 0);
+    assert(write(fd, content, CONTENT_LEN) == CONTENT_LEN);
+
+    // a real accepted peer, and a client
+    struct config conf = CONFIG_DEFAULT;
+    strcpy(conf.conf_dir, dir);
+    conf.msg_buf_max = MSG_BUF_MAX;
+    peers_msg_budget.max = conf.msg_buf_total;
+    int sock = socket_init(SOCK_STREAM, "::1", "0");
+    assert(sock >= 0);
+    struct sockaddr_in6 addr;
+    socklen_t addr_len = sizeof(addr);
+    assert(getsockname(sock, (struct sockaddr *)&addr, &addr_len) == 0);
+    int cli = socket(AF_INET6, SOCK_STREAM, 0);
+    assert(cli >= 0);
+    assert(connect(cli, (struct sockaddr *)&addr, addr_len) == 0);
+    assert(sock_setnonblock(cli) == 0);
+    struct list_item peers = LIST_ITEM_INIT(peers);
+    assert(peer_conn_accept_all(sock, &peers, 0, &conf) == 0);
+    assert(list_count(&peers) == 1);
+    struct peer *peer = cont(peers.next, struct peer, item);
+
+    // sending: flushes do not wait for the reader
+    size_t seg_len = CONTENT_LEN - SEG_OFF;
+    int src = dup(fd);
+    assert(peer_bulk_send(peer, src, SEG_OFF, seg_len));
+    assert(peer->bulk.left == seg_len);
+    assert(!peer_bulk_send(peer, fd, 0, 1));
+    assert(peer_conn_flush(peer) == CONN_OK);
+    assert(peer->bulk.left > 0);
+
+    struct proto_msg_parser parser;
+    proto_msg_parser_init(&parser);
+    parser.buf_max = 0;
+    struct got got = {.same = true, .content = content};
+    parser.on_msg = on_msg;
+    parser.on_chunk = on_chunk;
+    parser.on_msg_data = &got;
+
+    char buf[65536];
+    int flushes = 0;
+    while (got.count == 0) {
+        assert(peer_conn_flush(peer) == CONN_OK);
+        flushes++;
+        ssize_t n;
+        while ((n = recv(cli, buf, sizeof(buf), 0)) > 0)
+            assert(proto_msg_parse(&parser, buf, n));
+        assert(flushes < 100000);
+    }
+    assert(peer->bulk.left == 0);
+    assert(peer_outq_len(peer) == 0);
+    assert(got.recv == PROTO_MSG_BULK_OFFSET_LEN + seg_len);
+    assert(u64_ntoh(got.off).dd == SEG_OFF);
+    assert(got.same);
+    // content fd closed once sent
+    assert(fcntl(src, F_GETFD) == -1);
+    proto_msg_parser_terminate(&parser);
+
+    // receiving: content longer than msg_buf_max goes to the sink, at its
+    // offset
+    struct peer sender = {0};
+    sender.fd = cli;
+    assert(peer_bulk_send(&sender, fd, SEG_OFF, seg_len));
+    snprintf(path, sizeof(path), "%s/"PEER_BULK_SINK_PREFIX"%.*s", dir,
+             (int)strcspn(peer->addr_str, ":"), peer->addr_str);
+    struct stat st = {0};
+    int reads = 0;
+    while (sender.bulk.left > 0 || (size_t)st.st_size < CONTENT_LEN) {
+        if (sender.bulk.left > 0)
+            assert(peer_conn_flush(&sender) == CONN_OK);
+        assert(peer_conn_handle_data(peer, NULL) == CONN_OK);
+        if (stat(path, &st) == -1)
+            st.st_size = 0;
+        assert(++reads < 100000);
+    }
+    assert(st.st_size == CONTENT_LEN);
+    int sink = open(path, O_RDONLY);
+    assert(sink >= 0);
+    char *received = malloc(seg_len);
+    assert(received);
+    assert(pread(sink, received, seg_len, SEG_OFF) == (ssize_t)seg_len);
+    assert(memcmp(received, content + SEG_OFF, seg_len) == 0);
+    close(sink);
+    free(received);
+
+    assert(peer_conn_close_all(&peers) == 0);
+    assert(unlink(path) == 0);
+    assert(rmdir(dir) == 0);
+    iobuf_reset(&sender.outq);
+    close(cli);
+    close(sock);
+    peer_pool_destroy(&pool_peers);
+    free(content);
+    log_shutdown(LOG_TYPE_STDOUT);
+    return 0;
+}
@@ -0,0 +1,88 @@
+/* Copyright (c) 2017-2019 Foudil Brétel.  All rights reserved. */
+#include <assert.h>
+#include <string.h>
+#include <unistd.h>
+#include "log.h"
+#include "net/iobuf.h"
+
+int main()
+{
+    assert(log_init(LOG_TYPE_STDOUT, LOG_UPTO(LOG_CRIT)));
+
+    // heap
+    struct iobuf b = {0};
+    assert(iobuf_append(&b, "abc", 3));
+    assert(b.pos == 3 && b.capa == IOBUF_SIZE_INITIAL);
+    char *p = b.buf;
+    iobuf_clear(&b);
+    assert(b.pos == 0 && b.buf == p && b.capa == IOBUF_SIZE_INITIAL);
+    assert(iobuf_reserve(&b, 2000));
+    assert(b.capa == 4 * IOBUF_SIZE_INITIAL);
+    iobuf_reset(&b);
+    assert(!b.buf && b.capa == 0);
+
+    // inline, spilling to the heap
+    char s_inline[8];
+    struct iobuf s;
+    iobuf_init_inline(&s, s_inline, sizeof(s_inline));
+    assert(iobuf_append(&s, "0123456", 7));
+    assert(s.buf == s_inline);
+    assert(iobuf_appendf(&s, "%d", 78));
+    assert(s.buf != s_inline);
+    assert(s.pos == 9 && memcmp(s.buf, "012345678", 9) == 0);
+    iobuf_reset(&s);
+    assert(s.buf == s_inline && s.capa == 8 && s.pos == 0);
+    assert(iobuf_append(&s, "x", 1));
+    assert(s.buf == s_inline);
+    iobuf_reset(&s);
+
+    // chain: small fragments coalesced, others referenced
+    struct iochain ch;
+    iochain_clear(&ch);
+    const char big[] = "0123456789abcdefghij";
+    assert(iochain_append(&ch, "ab", 2));
+    assert(iochain_appendf(&ch, "%d:", 20));
+    assert(iochain_append(&ch, big, 20));
+    assert(iochain_copy(&ch, "e", 1));
+    assert(ch.iovcnt == 3);
+    assert(ch.iov[0].iov_len == 5);
+    assert(ch.iov[1].iov_base == big);
+    assert(ch.len == 26);
+
+    struct iobuf flat = {0};
+    assert(iochain_flatten(&ch, &flat));
+    assert(flat.pos == 26 && memcmp(flat.buf, "ab20:0123456789abcdefghije", 26) == 0);
+    iobuf_reset(&flat);
+
+    int fds[2];
+    assert(pipe(fds) == 0);
+    assert(iochain_writev(fds[1], &ch) == 26);
+    char out[32];
+    assert(read(fds[0], out, sizeof(out)) == 26);
+    assert(memcmp(out, "ab20:0123456789abcdefghije", 26) == 0);
+    close(fds[0]); close(fds[1]);
+
+    iochain_consume(&ch, 7);
+    assert(ch.len == 19 && ch.iovcnt == 2);
+    assert(ch.iov[0].iov_base == big + 2 && ch.iov[0].iov_len == 18);
+    iochain_consume(&ch, 18);
+    assert(ch.len == 1 && ch.iovcnt == 1);
+    assert(*(char *)ch.iov[0].iov_base == 'e');
+    iochain_consume(&ch, 5);
+    assert(ch.len == 0 && ch.iovcnt == 0);
+
+    // limits
+    iochain_clear(&ch);
+    assert(ch.len == 0 && ch.iovcnt == 0);
+    for (int i = 0; i < IOCHAIN_IOV_MAX; i++)
+        assert(iochain_ref(&ch, big, 1));
+    assert(!iochain_ref(&ch, big, 1));
+    assert(!iochain_copy(&ch, "x", 1));
+    iochain_clear(&ch);
+    char blob[IOCHAIN_SCRATCH_LEN + 1] = {0};
+    assert(!iochain_copy(&ch, blob, sizeof(blob)));
+    assert(iochain_append(&ch, blob, sizeof(blob)));  // referenced
+
+    log_shutdown(LOG_TYPE_STDOUT);
+    return 0;
+}
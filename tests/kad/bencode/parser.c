@@ -1,6 +1,8 @@
 /* Copyright (c) 2017-2019 Foudil Brétel.  All rights reserved. */
 #include <assert.h>
 #include <stdio.h>
+#include <sys/mman.h>
+#include <unistd.h>
 #include "net/kad/bencode/parser.c"        // testing static functions
 
 #define BENC_PARSER_BUF_MAX 1400
@@ -132,6 +134,28 @@ int main ()
     repr.lit_off=0; repr.n_off=0;
     assert(!benc_parse(&repr, buf, strlen(buf)));
 
+    // truncated input is not read past its end: it is placed right before an
+    // inaccessible page
+    long page = sysconf(_SC_PAGESIZE);
+    char *pages = mmap(NULL, 2 * page, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    assert(pages != MAP_FAILED);
+    assert(mprotect(pages + page, page, PROT_NONE) == 0);
+    const char *truncated[] = {"i", "i-", "i12", "4", "42", "4:sp", "d2:id20:ab"};
+    for (size_t i = 0; i < sizeof(truncated) / sizeof(truncated[0]); i++) {
+        size_t len = strlen(truncated[i]);
+        char *end = pages + page;
+        memcpy(end - len, truncated[i], len);
+        benc_parser_init(&parser, end - len, len);
+        if (truncated[i][0] == 'i')
+            assert(!benc_extract_int(&parser, &lit));
+        else if (truncated[i][0] != 'd')
+            assert(!benc_extract_str(&parser, &lit));
+        repr.lit_off=0; repr.n_off=0;
+        assert(!benc_parse(&repr, end - len, len));
+    }
+    munmap(pages, 2 * page);
+
     // FIXME to be continued...
 
 
@@ -8,10 +8,16 @@
 
 #define BENC_PARSER_BUF_MAX 1400
 
+static struct arena arena = ARENA_INIT(0);
+
 bool check_encoded_msg(const struct kad_rpc_msg *msg, struct iobuf *msgbuf,
                        const char str[], const size_t str_len)
 {
-    return benc_encode_rpc_msg(msgbuf, msg)
+    struct iochain ch;
+    iochain_clear(&ch);
+    return benc_encode_rpc_msg(&ch, msg)
+        && (ch.len == str_len)
+        && iochain_flatten(&ch, msgbuf)
         && (msgbuf->pos == str_len)
         && (strncmp(msgbuf->buf, str, msgbuf->pos) == 0);
 }
@@ -19,8 +25,9 @@ bool check_encoded_msg(const struct kad_rpc_msg *msg, struct iobuf *msgbuf,
 bool check_msg_decode_and_reset(struct kad_rpc_msg *msg, struct iobuf *msgbuf)
 {
     memset(msg, 0, sizeof(*msg));
-    bool ret = benc_decode_rpc_msg(msg, msgbuf->buf, msgbuf->pos);
+    bool ret = benc_decode_rpc_msg(msg, msgbuf->buf, msgbuf->pos, &arena);
     iobuf_reset(msgbuf);
+    arena_reset(&arena);
     return ret;
 }
 
@@ -42,7 +49,7 @@ int main ()
 
     strcpy(buf, KAD_TEST_ERROR);
     memset(&msg, 0, sizeof(msg));
-    assert(benc_decode_rpc_msg(&msg, buf, strlen(buf)));
+    assert(benc_decode_rpc_msg(&msg, buf, strlen(buf), &arena));
     assert(kad_rpc_msg_tx_id_eq(&msg.tx_id, &TX_ID_CONST));
     assert(msg.type == KAD_RPC_TYPE_ERROR);
     assert(msg.err_code == 201);
@@ -50,7 +57,7 @@ int main ()
 
     strcpy(buf, KAD_TEST_PING_QUERY);
     memset(&msg, 0, sizeof(msg));
-    assert(benc_decode_rpc_msg(&msg, buf, strlen(buf)));
+    assert(benc_decode_rpc_msg(&msg, buf, strlen(buf), &arena));
     assert(kad_rpc_msg_tx_id_eq(&msg.tx_id, &TX_ID_CONST));
     assert(msg.type == KAD_RPC_TYPE_QUERY);
     assert(msg.meth == KAD_RPC_METH_PING);
@@ -58,7 +65,7 @@ int main ()
 
     strcpy(buf, KAD_TEST_PING_RESPONSE);
     memset(&msg, 0, sizeof(msg));
-    assert(benc_decode_rpc_msg(&msg, buf, strlen(buf)));
+    assert(benc_decode_rpc_msg(&msg, buf, strlen(buf), &arena));
     assert(kad_rpc_msg_tx_id_eq(&msg.tx_id, &TX_ID_CONST));
     assert(msg.type == KAD_RPC_TYPE_RESPONSE);
     assert(msg.meth == KAD_RPC_METH_NONE);
@@ -66,18 +73,18 @@ int main ()
 
     strcpy(buf, KAD_TEST_PING_RESPONSE_BIN_ID);
     memset(&msg, 0, sizeof(msg));
-    assert(benc_decode_rpc_msg(&msg, buf, strlen(buf)));
+    assert(benc_decode_rpc_msg(&msg, buf, strlen(buf), &arena));
     assert(kad_guid_eq(&msg.node_id, &(kad_guid){.bytes = "\x17\x45\xc4\xed" \
                     "\xca\x16\x33\xf0\x51\x8e\x1f\x36\x0a\xc7\xe1\xad" \
                     "\x27\x41\x86\x33", .is_set = true}));
 
     strcpy(buf, KAD_TEST_FIND_NODE_QUERY_BOGUS);
     memset(&msg, 0, sizeof(msg));
-    assert(!benc_decode_rpc_msg(&msg, buf, strlen(buf)));
+    assert(!benc_decode_rpc_msg(&msg, buf, strlen(buf), &arena));
 
     strcpy(buf, KAD_TEST_FIND_NODE_QUERY);
     memset(&msg, 0, sizeof(msg));
-    assert(benc_decode_rpc_msg(&msg, buf, strlen(buf)));
+    assert(benc_decode_rpc_msg(&msg, buf, strlen(buf), &arena));
     assert(kad_rpc_msg_tx_id_eq(&msg.tx_id, &TX_ID_CONST));
     assert(msg.type == KAD_RPC_TYPE_QUERY);
     assert(msg.meth == KAD_RPC_METH_FIND_NODE);
@@ -86,7 +93,7 @@ int main ()
 
     strcpy(buf, KAD_TEST_FIND_NODE_RESPONSE);
     memset(&msg, 0, sizeof(msg));
-    assert(benc_decode_rpc_msg(&msg, buf, strlen(buf)));
+    assert(benc_decode_rpc_msg(&msg, buf, strlen(buf), &arena));
     assert(kad_rpc_msg_tx_id_eq(&msg.tx_id, &TX_ID_CONST));
     assert(msg.type == KAD_RPC_TYPE_RESPONSE);
     assert(msg.meth == KAD_RPC_METH_NONE);
@@ -104,7 +111,7 @@ int main ()
 
     strcpy(buf, KAD_TEST_FIND_NODE_RESPONSE_IP6);
     memset(&msg, 0, sizeof(msg));
-    assert(benc_decode_rpc_msg(&msg, buf, strlen(buf)));
+    assert(benc_decode_rpc_msg(&msg, buf, strlen(buf), &arena));
     assert(kad_rpc_msg_tx_id_eq(&msg.tx_id, &TX_ID_CONST));
     assert(msg.type == KAD_RPC_TYPE_RESPONSE);
     assert(msg.meth == KAD_RPC_METH_NONE);
@@ -124,7 +131,7 @@ int main ()
 
     strcpy(buf, KAD_TEST_FIND_NODE_RESPONSE_BOGUS);
     memset(&msg, 0, sizeof(msg));
-    assert(benc_decode_rpc_msg(&msg, buf, strlen(buf)));
+    assert(benc_decode_rpc_msg(&msg, buf, strlen(buf), &arena));
     assert(msg.nodes_len == 0);
     assert(kad_guid_eq(&msg.nodes[0].id, &(kad_guid){0}));
 
@@ -204,6 +211,7 @@ int main ()
                              114));
     assert(check_msg_decode_and_reset(&msg, &msgbuf));
 
+    arena_destroy(&arena);
     log_shutdown(LOG_TYPE_STDOUT);
 
 
@@ -0,0 +1,237 @@
+/* Copyright (c) 2017-2019 Foudil Brétel.  All rights reserved. */
+#include <arpa/inet.h>
+#include <assert.h>
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include "log.h"
+#include "utils/array.h"
+#include "net/kad/bootstrap.h"
+
+static bool has_addr4(const struct sockaddr_storage nodes[], int len,
+                      const char addr[], uint16_t port)
+{
+    for (int i = 0; i < len; i++) {
+        const struct sockaddr_in *sa = (const struct sockaddr_in *)&nodes[i];
+        char str[INET_ADDRSTRLEN];
+        if (sa->sin_family == AF_INET && ntohs(sa->sin_port) == port &&
+            inet_ntop(AF_INET, &sa->sin_addr, str, sizeof(str)) &&
+            strcmp(str, addr) == 0)
+            return true;
+    }
+    return false;
+}
+
+static bool has_addr6(const struct sockaddr_storage nodes[], int len,
+                      const char addr[], uint16_t port)
+{
+    for (int i = 0; i < len; i++) {
+        const struct sockaddr_in6 *sa = (const struct sockaddr_in6 *)&nodes[i];
+        char str[INET6_ADDRSTRLEN];
+        if (sa->sin6_family == AF_INET6 && ntohs(sa->sin6_port) == port &&
+            inet_ntop(AF_INET6, &sa->sin6_addr, str, sizeof(str)) &&
+            strcmp(str, addr) == 0)
+            return true;
+    }
+    return false;
+}
+
+/* Feeds @data to a reader byte by byte, to cover chunk boundaries. */
+static int read_bytewise(struct sockaddr_storage nodes[], size_t nodes_len,
+                         const char data[], size_t len)
+{
+    struct kad_bootstrap_reader reader;
+    assert(kad_bootstrap_reader_init(&reader, nodes, nodes_len, 42));
+    int nnodes = -1;
+    for (size_t i = 0; i < len; i++)
+        if (!kad_bootstrap_read(&reader, data + i, 1))
+            goto end;
+    if (kad_bootstrap_read_end(&reader))
+        nnodes = reader.sample.len;
+  end:
+    kad_bootstrap_reader_terminate(&reader);
+    return nnodes;
+}
+
+static void test_sched(void)
+{
+    struct sockaddr_storage seeds[6] = {0};
+    for (int i = 0; i < 6; i++) {
+        struct sockaddr_in *sa = (struct sockaddr_in *)&seeds[i];
+        sa->sin_family = AF_INET;
+        sa->sin_addr.s_addr = htonl(0xc0000201 + i);
+        sa->sin_port = htons(22000);
+    }
+
+    // paced at 10/s, 2 in flight at most
+    struct kad_bootstrap_sched sched;
+    long long now = 1000;
+    assert(kad_bootstrap_sched_init(&sched, seeds, 6, 10, 2, false, now));
+    assert(kad_bootstrap_sched_update(&sched, 0, now));
+    const struct sockaddr_storage *a = kad_bootstrap_sched_next(&sched, now);
+    assert(a == &sched.seeds[0].addr);
+    assert(!kad_bootstrap_sched_next(&sched, now));     // pacing
+    now += 100;
+    assert(kad_bootstrap_sched_next(&sched, now) == &sched.seeds[1].addr);
+    now += 100;
+    assert(!kad_bootstrap_sched_next(&sched, now));     // in flight cap
+    assert(sched.inflight == 2);
+
+    // an answer frees a slot
+    kad_bootstrap_sched_answered(&sched, &seeds[0], 1, now);
+    assert(sched.inflight == 1);
+    assert(sched.seeds[0].state == KAD_BOOTSTRAP_SEED_ANSWERED);
+    assert(kad_bootstrap_sched_next(&sched, now) == &sched.seeds[2].addr);
+
+    // timeouts are retried after backoff, then given up
+    now += KAD_BOOTSTRAP_TIMEOUT_MS;
+    assert(kad_bootstrap_sched_update(&sched, 1, now));
+    assert(sched.inflight == 0);
+    assert(sched.seeds[1].state == KAD_BOOTSTRAP_SEED_NONE);
+    assert(sched.seeds[1].due_ms == now + KAD_BOOTSTRAP_BACKOFF_MS);
+    for (int tries = 1; tries < KAD_BOOTSTRAP_TRIES; tries++) {
+        now = sched.seeds[1].due_ms;
+        // others answer meanwhile
+        while ((a = kad_bootstrap_sched_next(&sched, now)) != &sched.seeds[1].addr) {
+            if (a)
+                kad_bootstrap_sched_answered(&sched, a, 1, now);
+            now += 100;
+        }
+        now += KAD_BOOTSTRAP_TIMEOUT_MS;
+        assert(kad_bootstrap_sched_update(&sched, 1, now) ||
+               tries == KAD_BOOTSTRAP_TRIES - 1);
+    }
+    assert(sched.seeds[1].state == KAD_BOOTSTRAP_SEED_FAILED);
+    assert(sched.seeds[1].tries == KAD_BOOTSTRAP_TRIES);
+    assert(sched.ready_ms == -1);
+    // all answered or given up: done
+    assert(sched.pending == 0);
+    assert(!sched.active);
+    kad_bootstrap_sched_terminate(&sched);
+
+    // ready with KAD_K_CONST nodes, done at the target
+    now = 0;
+    assert(kad_bootstrap_sched_init(&sched, seeds, 6, 1000, 6, false, now));
+    assert(kad_bootstrap_sched_next(&sched, now));
+    now = 42;
+    kad_bootstrap_sched_answered(&sched, &seeds[0], KAD_K_CONST, now);
+    assert(sched.ready_ms == 42);
+    assert(kad_bootstrap_sched_update(&sched, KAD_K_CONST, now));
+    assert(!kad_bootstrap_sched_update(&sched, KAD_BOOTSTRAP_TARGET, now));
+    assert(!kad_bootstrap_sched_next(&sched, now));
+    kad_bootstrap_sched_terminate(&sched);
+
+    // warm start: all validated whatever the fill, no readiness
+    assert(kad_bootstrap_sched_init(&sched, seeds, 2, 1000, 2, true, now));
+    assert(kad_bootstrap_sched_update(&sched, KAD_BOOTSTRAP_TARGET, now));
+    assert(kad_bootstrap_sched_next(&sched, now) == &sched.seeds[0].addr);
+    now += 1;
+    assert(kad_bootstrap_sched_next(&sched, now) == &sched.seeds[1].addr);
+    kad_bootstrap_sched_answered(&sched, &seeds[0], KAD_BOOTSTRAP_TARGET, now);
+    assert(sched.ready_ms == -1);
+    assert(kad_bootstrap_sched_update(&sched, KAD_BOOTSTRAP_TARGET, now));
+    kad_bootstrap_sched_answered(&sched, &seeds[1], KAD_BOOTSTRAP_TARGET, now);
+    assert(!kad_bootstrap_sched_update(&sched, KAD_BOOTSTRAP_TARGET, now));
+    kad_bootstrap_sched_terminate(&sched);
+
+    // no seeds
+    assert(kad_bootstrap_sched_init(&sched, seeds, 0, 10, 2, false, now));
+    assert(!kad_bootstrap_sched_update(&sched, 0, now));
+    kad_bootstrap_sched_terminate(&sched);
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 2) {
+        fprintf(stdout, "Missing SOURCE_DIR argument\n");
+        return 1;
+    }
+    assert(log_init(LOG_TYPE_STDOUT, LOG_UPTO(LOG_CRIT)));
+
+    struct sockaddr_storage nodes[64];
+
+    // bencode, as shipped
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%s", argv[1], "tests/kad/data/nodes.dat");
+    int n = kad_read_bootstrap_nodes(nodes, ARRAY_LEN(nodes), path);
+    assert(n == 4);
+    assert(has_addr4(nodes, n, "192.168.168.15", 0x2f58));
+    assert(has_addr4(nodes, n, "192.168.168.25", 0x2f59));
+    assert(has_addr6(nodes, n, "101:101:101:101:101:101:101:101", 0x0203));
+    assert(has_addr6(nodes, n, "101:101:101:101:101:101:101:1aa", 0x0304));
+
+    // text, with duplicates, comments and invalid lines
+    const char text[] =
+        "# seeds\n"
+        "192.0.2.1 22000\n"
+        "\n"
+        "  192.0.2.2:22001  \r\n"
+        "[2001:db8::1]:22002\n"
+        "2001:db8::2 22003\n"
+        "192.0.2.1:22000\n"
+        "2001:db8::3\n"
+        "192.0.2.3:0\n"
+        "not-an-address 22000\n"
+        "192.0.2.4 22004";
+    n = read_bytewise(nodes, ARRAY_LEN(nodes), text, strlen(text));
+    assert(n == 5);
+    assert(has_addr4(nodes, n, "192.0.2.1", 22000));
+    assert(has_addr4(nodes, n, "192.0.2.2", 22001));
+    assert(has_addr6(nodes, n, "2001:db8::1", 22002));
+    assert(has_addr6(nodes, n, "2001:db8::2", 22003));
+    assert(has_addr4(nodes, n, "192.0.2.4", 22004));
+
+    // bencode fed bytewise, with a duplicate and an invalid entry
+    const char benc[] = "l6:\xc0\x00\x02\x01\x55\xf0" "3:abc"
+        "6:\xc0\x00\x02\x01\x55\xf0" "6:\xc0\x00\x02\x02\x55\xf0" "e\n";
+    n = read_bytewise(nodes, ARRAY_LEN(nodes), benc, sizeof(benc) - 1);
+    assert(n == 2);
+    assert(has_addr4(nodes, n, "192.0.2.1", 22000));
+    assert(has_addr4(nodes, n, "192.0.2.2", 22000));
+    assert(read_bytewise(nodes, ARRAY_LEN(nodes), benc, 10) == -1);
+    assert(read_bytewise(nodes, ARRAY_LEN(nodes), "l6x", 3) == -1);
+    assert(read_bytewise(nodes, ARRAY_LEN(nodes), "", 0) == 0);
+
+    // a large list, beyond any buffer, is sampled without duplicates
+    char dir[] = "/tmp/ptp-bootstrap-XXXXXX";
+    assert(mkdtemp(dir));
+    snprintf(path, sizeof(path), "%s/nodes.dat", dir);
+    FILE *fp = fopen(path, "w");
+    assert(fp);
+    for (int rep = 0; rep < 2; rep++)
+        for (int i = 0; i < 20000; i++)
+            fprintf(fp, "10.%d.%d.%d:%d\n", i >> 16, (i >> 8) & 0xff, i & 0xff,
+                    1024 + i % 100);
+    fclose(fp);
+    n = kad_read_bootstrap_nodes(nodes, ARRAY_LEN(nodes), path);
+    assert(n == ARRAY_LEN(nodes));
+    for (int i = 0; i < n; i++) {
+        const struct sockaddr_in *a = (const struct sockaddr_in *)&nodes[i];
+        assert(a->sin_family == AF_INET);
+        for (int j = i + 1; j < n; j++) {
+            const struct sockaddr_in *b = (const struct sockaddr_in *)&nodes[j];
+            assert(a->sin_addr.s_addr != b->sin_addr.s_addr ||
+                   a->sin_port != b->sin_port);
+        }
+    }
+    // not simply the head of the list
+    int head = 0;
+    for (int i = 0; i < n; i++) {
+        const struct sockaddr_in *a = (const struct sockaddr_in *)&nodes[i];
+        if ((ntohl(a->sin_addr.s_addr) & 0xffffff) < 1000)
+            head++;
+    }
+    assert(head < n / 2);
+
+    // a sample smaller than the list
+    n = kad_read_bootstrap_nodes(nodes, 1, path);
+    assert(n == 1);
+
+    assert(unlink(path) == 0);
+    assert(rmdir(dir) == 0);
+
+    test_sched();
+    log_shutdown(LOG_TYPE_STDOUT);
+    return 0;
+}
@@ -0,0 +1,82 @@
+/* Copyright (c) 2017-2019 Foudil Brétel.  All rights reserved. */
+#include <assert.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "log.h"
+#include "kad/test_util.h"
+#include "net/kad/checkpoint.h"
+
+KAD_TEST_NODES_DECL;
+
+int main()
+{
+    assert(log_init(LOG_TYPE_STDOUT, LOG_UPTO(LOG_CRIT)));
+
+    char dir[] = "/tmp/ptp-ckpt-XXXXXX";
+    assert(mkdtemp(dir));
+    char state[PATH_MAX], journal[PATH_MAX];
+    snprintf(state, sizeof(state), "%s/dht.dat", dir);
+    snprintf(journal, sizeof(journal), "%s/dht.journal", dir);
+
+    struct kad_node_info info[4];
+    for (size_t i = 0; i < 4; i++)
+        kad_node_info_set(&info[i], &kad_test_nodes[i]);
+
+    struct kad_dht *dht = dht_create();
+    assert(dht);
+    assert(dht_insert(dht, &info[0]));
+    assert(dht_insert(dht, &info[1]));
+
+    struct kad_checkpoint ckpt;
+    assert(kad_checkpoint_start(&ckpt, state, journal, true));
+    dht->journal = kad_checkpoint_journal;
+    dht->journal_data = &ckpt;
+
+    // snapshot holds 0 and 1, journal the later changes
+    assert(kad_checkpoint_submit(&ckpt, dht));
+    assert(dht_insert(dht, &info[2]));
+    assert(dht_delete(dht, &info[0].id));
+    kad_checkpoint_stop(&ckpt);
+    assert(access(state, R_OK) == 0);
+    assert(access(journal, R_OK) == 0);
+
+    struct kad_dht *loaded = NULL;
+    assert(dht_read(&loaded, state) == 2);
+    assert(kad_guid_eq(&loaded->self_id, &dht->self_id));
+    assert(dht_find(loaded, &info[0].id));
+    assert(!dht_find(loaded, &info[2].id));
+    assert(kad_journal_replay(loaded, journal) == 2);
+    assert(!dht_find(loaded, &info[0].id));
+    assert(dht_find(loaded, &info[1].id));
+    const struct kad_node *node = dht_find(loaded, &info[2].id);
+    assert(node);
+    assert(kad_node_info_equals(&node->info, &kad_test_nodes[2]));
+
+    // idempotent, and a torn last record is ignored
+    FILE *fp = fopen(journal, "ab");
+    assert(fp);
+    assert(fwrite("I\x06" "abc", 5, 1, fp) == 1);
+    fclose(fp);
+    assert(kad_journal_replay(loaded, journal) == 2);
+    uint64_t fill[KAD_GUID_SPACE_IN_BITS];
+    assert(dht_bucket_fill(loaded, fill) == 2);
+    dht_destroy(loaded);
+
+    // a checkpoint supersedes the journal
+    assert(kad_checkpoint_start(&ckpt, state, journal, false));
+    assert(kad_checkpoint_submit(&ckpt, dht));
+    kad_checkpoint_stop(&ckpt);
+    assert(access(journal, F_OK) == -1);
+    assert(dht_read(&loaded, state) == 2);
+    assert(dht_find(loaded, &info[2].id));
+    dht_destroy(loaded);
+
+    dht_destroy(dht);
+    assert(unlink(state) == 0);
+    // no temporary file left behind
+    assert(rmdir(dir) == 0);
+    kad_node_pool_destroy(&pool_kad_nodes);
+    log_shutdown(LOG_TYPE_STDOUT);
+    return 0;
+}
@@ -1,5 +1,6 @@
 /* Copyright (c) 2017-2019 Foudil Brétel.  All rights reserved. */
 #include <assert.h>
+#include <sys/stat.h>
 #include "file.h"
 #include "net/socket.h"
 #include "utils/array.h"
@@ -9,14 +10,23 @@
 
 KAD_TEST_NODES_DECL;
 
-bool files_eq(const char f1[], const char f2[]) {
-    char buf1[256];
-    size_t buf1_len = 0;
-    if (!file_read(buf1, &buf1_len, f1)) return false;
-    char buf2[256];
-    size_t buf2_len = 0;
-    if (!file_read(buf2, &buf2_len, f2)) return false;
-    return buf1_len == buf2_len && memcmp(buf1, buf2, buf1_len) == 0;
+bool file_eq_buf(const char path[], const char buf[], size_t buf_len) {
+    char fbuf[256];
+    size_t fbuf_len = 0;
+    if (!file_read(fbuf, &fbuf_len, path)) return false;
+    return fbuf_len == buf_len && memcmp(fbuf, buf, buf_len) == 0;
+}
+
+static void file_flip_byte(const char path[], long off)
+{
+    FILE *fp = fopen(path, "r+b");
+    assert(fp);
+    assert(fseek(fp, off, SEEK_SET) == 0);
+    int c = fgetc(fp);
+    assert(c != EOF);
+    assert(fseek(fp, off, SEEK_SET) == 0);
+    assert(fputc(c ^ 0xff, fp) != EOF);
+    fclose(fp);
 }
 
 int main(int argc, char *argv[])
@@ -90,6 +100,55 @@ int main(int argc, char *argv[])
         opp.id.bytes[KAD_GUID_SPACE_IN_BYTES-1] += 1;
     }
     assert(!list_is_empty(&dht->replacement));
+    // seen again, but the bucket is still full
+    opp.id.bytes[KAD_GUID_SPACE_IN_BYTES-1] -= 1;
+    assert(dht_update(dht, &opp) == 0);
+    assert(!dht_find(dht, &opp.id));
+    assert(kad_bucket_count(&dht->buckets[KAD_GUID_SPACE_IN_BITS-1]) == KAD_K_CONST);
+
+    // liveness
+    struct kad_node *lrs = cont(dht->buckets[KAD_GUID_SPACE_IN_BITS-1].next,
+                                struct kad_node, item);
+    time_t now = lrs->last_seen;
+    assert(kad_node_state(lrs, now) == KAD_NODE_STATE_GOOD);
+    assert(!dht_evict_candidate(dht, &opp.id, now));
+    assert(kad_node_state(lrs, now + KAD_NODE_GOOD_S) == KAD_NODE_STATE_QUESTIONABLE);
+    assert(dht_evict_candidate(dht, &opp.id, now + KAD_NODE_GOOD_S) == lrs);
+    assert(dht_timeout(dht, &lrs->info.id));
+    assert(kad_node_state(lrs, now) == KAD_NODE_STATE_QUESTIONABLE);
+    assert(dht_timeout(dht, &lrs->info.id));
+    assert(kad_node_state(lrs, now) == KAD_NODE_STATE_BAD);
+    kad_guid evicted = lrs->info.id;
+    assert(dht_evict(dht, &evicted));
+    assert(!dht_find(dht, &evicted));
+    assert(dht_find(dht, &opp.id));  // promoted
+
+    // round-trip times, and the fastest of equally distant nodes first
+    const struct list_item *top = &dht->buckets[KAD_GUID_SPACE_IN_BITS-1];
+    struct kad_node *slow = cont(top->next, struct kad_node, item);
+    struct kad_node *fast = cont(top->prev, struct kad_node, item);
+    assert(!dht_rtt_sample(dht, &evicted, 100));
+    assert(dht_rtt_sample(dht, &slow->info.id, 100));
+    assert(slow->srtt_ms8 == 100 << 3 && slow->rttvar_ms4 == 50 << 2);
+    assert(kad_node_rto_ms(slow) == 300);
+    assert(dht_rtt_sample(dht, &slow->info.id, 200));
+    assert(slow->srtt_ms8 == 900 && slow->rttvar_ms4 == 250);  // 112.5, 62.5
+    // errors under 8 ms still move the estimates
+    assert(dht_rtt_sample(dht, &slow->info.id, 115));
+    assert(slow->srtt_ms8 == 903 && slow->rttvar_ms4 == 191);
+    assert(dht_rtt_sample(dht, &fast->info.id, 0));
+    assert(fast->srtt_ms8 == 8);
+    struct kad_node_info closest[KAD_K_CONST];
+    assert(dht_find_closest(dht, &opp.id, closest, NULL) == KAD_K_CONST);
+    assert(kad_guid_eq(&closest[0].id, &fast->info.id));
+    assert(kad_guid_eq(&closest[1].id, &slow->info.id));
+
+    // random ids for refreshes fall into their bucket
+    for (size_t i = 0; i < KAD_GUID_SPACE_IN_BITS; i++) {
+        kad_guid id;
+        dht_bucket_random_id(dht, i, &id);
+        assert(kad_bucket_hash(&dht->self_id, &id) == i);
+    }
 
     dht_destroy(dht);
 
@@ -109,16 +168,64 @@ int main(int argc, char *argv[])
         assert(kad_node_info_equals(&knode->info, &kad_test_nodes[i]));
     }
 
+    // the bencode format is still produced as before
+    struct kad_dht_encoded encoded = {0};
+    dht_snapshot(dht, &encoded);
+    struct iobuf benc = {0};
+    assert(benc_encode_dht(&benc, &encoded));
+    char ref[256];
+    snprintf(ref, 255, "%s/%s", source_dir, "tests/kad/data/dht_sorted.dat");
+    assert(file_eq_buf(ref, benc.buf, benc.pos));
+    iobuf_reset(&benc);
+
+    // binary state file
     char tpl[] = "/tmp/tmpXXXXXX";
     assert(mkdtemp(tpl));
     snprintf(path, 255, "%s/%s", tpl, "dht.dat");
     assert(dht_write(dht, path));
-    char ref[256];
-    snprintf(ref, 255, "%s/%s", source_dir, "tests/kad/data/dht_sorted.dat");
-    assert(files_eq(path, ref));
+    struct stat st;
+    assert(stat(path, &st) == 0);
+    assert(st.st_size == DHT_STATE_HDR_LEN +
+           (off_t)ARRAY_LEN(kad_test_nodes) * DHT_STATE_REC_LEN);
+
+    struct kad_dht *loaded = NULL;
+    assert(dht_read(&loaded, path) == ARRAY_LEN(kad_test_nodes));
+    assert(kad_guid_eq(&loaded->self_id, &dht->self_id));
+    for (size_t i=0; i<ARRAY_LEN(kad_test_nodes); i++) {
+        const struct kad_node *knode = dht_find(loaded, &kad_test_nodes[i].id);
+        assert(knode);
+        assert(kad_node_info_equals(&knode->info, &kad_test_nodes[i]));
+        assert(strcmp(knode->info.addr_str,
+                      dht_find(dht, &kad_test_nodes[i].id)->info.addr_str) == 0);
+    }
+    dht_destroy(loaded);
+
+    // corruption is detected
+    file_flip_byte(path, st.st_size - 1);
+    assert(dht_read(&loaded, path) == -1);
+    assert(!loaded);
+    assert(truncate(path, st.st_size - 1) == 0);
+    assert(dht_read(&loaded, path) == -1);
+    assert(dht_write(dht, path));
+    file_flip_byte(path, DHT_STATE_OFF_VERSION + 1);
+    assert(dht_read(&loaded, path) == -1);
     assert(!remove(path));
     assert(!remove(tpl));
 
+    // warm start: nodes not heard from again are purged
+    size_t nnodes = ARRAY_LEN(kad_test_nodes);
+    assert(dht_mark_stale(dht) == nnodes);
+    struct kad_node_info alive;
+    kad_node_info_set(&alive, &kad_test_nodes[0]);
+    assert(dht_update(dht, &alive) == 0);
+    assert(dht_find(dht, &kad_test_nodes[0].id)->stale == 0);
+    assert(dht_find(dht, &kad_test_nodes[1].id)->stale == 1);
+    assert(dht_purge_stale(dht) == nnodes - 1);
+    assert(dht_find(dht, &kad_test_nodes[0].id));
+    assert(!dht_find(dht, &kad_test_nodes[1].id));
+    uint64_t fill[KAD_GUID_SPACE_IN_BITS];
+    assert(dht_bucket_fill(dht, fill) == 1);
+    assert(dht_purge_stale(dht) == 0);
 
     dht_destroy(dht);
 
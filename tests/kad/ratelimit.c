@@ -0,0 +1,71 @@
+/* Copyright (c) 2017-2019 Foudil Brétel.  All rights reserved. */
+#include <assert.h>
+#include <arpa/inet.h>
+#include <string.h>
+#include "log.h"
+#include "net/kad/ratelimit.h"
+
+static struct sockaddr_storage addr4(const uint32_t ip)
+{
+    struct sockaddr_storage ss = {0};
+    struct sockaddr_in *sa = (struct sockaddr_in*)&ss;
+    sa->sin_family = AF_INET;
+    sa->sin_addr.s_addr = htonl(ip);
+    return ss;
+}
+
+static struct sockaddr_storage addr6(const char str[])
+{
+    struct sockaddr_storage ss = {0};
+    struct sockaddr_in6 *sa = (struct sockaddr_in6*)&ss;
+    sa->sin6_family = AF_INET6;
+    assert(inet_pton(AF_INET6, str, &sa->sin6_addr) == 1);
+    return ss;
+}
+
+int main()
+{
+    assert(log_init(LOG_TYPE_STDOUT, LOG_UPTO(LOG_CRIT)));
+
+    static struct kad_ratelimit rl;
+    long long now = 1000000;
+    kad_ratelimit_init(&rl, now);
+
+    // a burst, then the rate
+    struct sockaddr_storage a = addr4(0x01020304), b = addr4(0x01020305);
+    for (int i = 0; i < KAD_RATELIMIT_BURST; i++)
+        assert(kad_ratelimit_allow(&rl, &a, now));
+    assert(!kad_ratelimit_allow(&rl, &a, now));
+    assert(kad_ratelimit_allow(&rl, &b, now));  // per source
+    assert(!kad_ratelimit_allow(&rl, &a, now + 1000 / KAD_RATELIMIT_RATE - 1));
+    assert(kad_ratelimit_allow(&rl, &a, now + 1000 / KAD_RATELIMIT_RATE));
+    assert(!kad_ratelimit_allow(&rl, &a, now + 1000 / KAD_RATELIMIT_RATE));
+
+    // ipv6 sources are /64 prefixes, and v4-mapped ones ipv4 addresses
+    struct sockaddr_storage c = addr6("2001:db8::1"), d = addr6("2001:db8::2");
+    struct sockaddr_storage m = addr6("::ffff:1.2.3.4");
+    for (int i = 0; i < KAD_RATELIMIT_BURST; i++)
+        assert(kad_ratelimit_allow(&rl, &c, now));
+    assert(!kad_ratelimit_allow(&rl, &d, now));
+    assert(!kad_ratelimit_allow(&rl, &m, now + 1000 / KAD_RATELIMIT_RATE));
+    struct sockaddr_storage unix_addr = {.ss_family = AF_UNIX};
+    assert(!kad_ratelimit_allow(&rl, &unix_addr, now));
+
+    // bounded memory: the least recently seen sources are forgotten
+    assert(rl.entries_len == 3);
+    for (uint32_t i = 0; i < KAD_RATELIMIT_LEN; i++) {
+        struct sockaddr_storage x = addr4(0x0a000000 + i);
+        assert(kad_ratelimit_allow(&rl, &x, now));
+    }
+    assert(rl.entries_len == KAD_RATELIMIT_LEN);
+    assert(kad_ratelimit_allow(&rl, &a, now));  // afresh
+
+    // error replies share one budget
+    for (int i = 0; i < KAD_RATELIMIT_ERR_BURST; i++)
+        assert(kad_ratelimit_error_allow(&rl, now));
+    assert(!kad_ratelimit_error_allow(&rl, now));
+    assert(kad_ratelimit_error_allow(&rl, now + 1000 / KAD_RATELIMIT_ERR_RATE));
+
+    log_shutdown(LOG_TYPE_STDOUT);
+    return 0;
+}
@@ -0,0 +1,65 @@
+/* Copyright (c) 2017-2019 Foudil Brétel.  All rights reserved. */
+#include <assert.h>
+#include "log.h"
+#include "net/kad/refresh.h"
+
+#define IDLE (KAD_REFRESH_INTERVAL_S + KAD_REFRESH_JITTER_S)
+
+static void insert_into_bucket(struct kad_dht *dht, size_t bkt_idx)
+{
+    struct kad_node_info info = {0};
+    dht_bucket_random_id(dht, bkt_idx, &info.id);
+    info.addr.ss_family = AF_INET;
+    assert(dht_insert(dht, &info));
+}
+
+int main()
+{
+    assert(log_init(LOG_TYPE_STDOUT, LOG_UPTO(LOG_CRIT)));
+
+    struct kad_dht *dht = dht_create();
+    assert(dht);
+    insert_into_bucket(dht, 100);
+    insert_into_bucket(dht, 120);
+    uint64_t fill[KAD_GUID_SPACE_IN_BITS];
+    assert(dht_bucket_fill(dht, fill) == 2);
+    assert(fill[100] == 1 && fill[120] == 1);
+
+    // freshly changed buckets are not due, and empty ones never
+    time_t now = time(NULL);
+    struct kad_refresh_sched sched;
+    kad_refresh_sched_init(&sched, 6, now);
+    assert(kad_refresh_sched_next(&sched, dht, now) == -1);
+    assert(kad_refresh_sched_next(&sched, dht, now + KAD_REFRESH_INTERVAL_S - 1) == -1);
+    assert(sched.backlog == 0);
+
+    // activity postpones a refresh
+    dht->bucket_active[100] = now - IDLE;
+    insert_into_bucket(dht, 100);
+    assert(kad_refresh_sched_next(&sched, dht, now) == -1);
+    assert(sched.backlog == 0);
+
+    // longest idle first, then paced at 6 per minute
+    sched.jitter[100] = sched.jitter[120] = 0;
+    dht->bucket_active[100] = now - IDLE - 10;
+    dht->bucket_active[120] = now - IDLE;
+    assert(kad_refresh_sched_next(&sched, dht, now) == 100);
+    assert(dht->bucket_active[100] == now);
+    assert(kad_refresh_sched_next(&sched, dht, now) == -1);
+    assert(sched.backlog == 1);
+    assert(kad_refresh_sched_next(&sched, dht, now + 9) == -1);
+    assert(kad_refresh_sched_next(&sched, dht, now + 10) == 120);
+    assert(sched.backlog == 0);
+    assert(kad_refresh_sched_next(&sched, dht, now + 20) == -1);
+
+    // due again after the interval and its jitter
+    assert(kad_refresh_sched_next(&sched, dht, now + KAD_REFRESH_INTERVAL_S - 1) == -1);
+    int first = kad_refresh_sched_next(&sched, dht, now + IDLE + 10);
+    assert(first == 100 || first == 120);
+    assert(sched.backlog == 1);
+
+    dht_destroy(dht);
+    kad_node_pool_destroy(&pool_kad_nodes);
+    log_shutdown(LOG_TYPE_STDOUT);
+    return 0;
+}
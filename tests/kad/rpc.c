@@ -2,29 +2,278 @@
 #include <assert.h>
 #include <netinet/in.h>
 #include "log.h"
+#include "timers.h"
+#include "net/actions.h"
+#include "net/kad/bencode/rpc_msg.h"
 #include "net/kad/rpc.h"
 
+#define BUCKET 150
+
+static bool handle_msg(struct kad_ctx *ctx, const struct sockaddr_storage *ss,
+                       const struct kad_rpc_msg *msg)
+{
+    struct iochain ch;
+    iochain_clear(&ch);
+    assert(benc_encode_rpc_msg(&ch, msg));
+    struct iobuf buf = {0};
+    assert(iochain_flatten(&ch, &buf));
+    struct iochain rsp;
+    iochain_clear(&rsp);
+    bool ret = kad_rpc_handle(ctx, ss, buf.buf, buf.pos, &rsp);
+    arena_reset(&ctx->arena);
+    iobuf_reset(&buf);
+    return ret;
+}
+
+static void ping_from(struct kad_ctx *ctx, const struct sockaddr_storage *ss,
+                      const kad_guid *id)
+{
+    struct kad_rpc_msg msg = {0};
+    kad_rpc_msg_tx_id_set(&msg.tx_id, (unsigned char *)"qq");
+    msg.node_id = *id;
+    msg.type = KAD_RPC_TYPE_QUERY;
+    msg.meth = KAD_RPC_METH_PING;
+    assert(handle_msg(ctx, ss, &msg));
+}
+
+/* What node_ping() does, short of sending. */
+static struct kad_rpc_query *probe_send(struct kad_ctx *ctx)
+{
+    assert(ctx->probes_len == 1 && !ctx->probes[0].sent);
+    struct kad_rpc_query *query = kad_rpc_query_pool_get(&pool_kad_queries);
+    assert(query);
+    query->node = ctx->probes[0].node;
+    struct iochain ch;
+    iochain_clear(&ch);
+    assert(kad_rpc_query_ping(ctx, &ch, query));
+    kad_rpc_query_add(ctx, query);
+    ctx->probes[0].sent = true;
+    return query;
+}
+
+static void test_evict(struct kad_ctx *ctx, const struct sockaddr_storage *ss)
+{
+    ctx->query_retries = 0;
+    kad_guid ids[KAD_K_CONST], newcomer;
+    for (size_t i = 0; i < KAD_K_CONST; i++) {
+        struct kad_node_info info = {0};
+        dht_bucket_random_id(ctx->dht, BUCKET, &info.id);
+        info.addr = *ss;
+        assert(dht_insert(ctx->dht, &info));
+        ids[i] = info.id;
+    }
+
+    // good nodes are kept, and the newcomer waits
+    dht_bucket_random_id(ctx->dht, BUCKET, &newcomer);
+    ping_from(ctx, ss, &newcomer);
+    assert(!dht_find(ctx->dht, &newcomer));
+    assert(ctx->probes_len == 0);
+
+    // a questionable least-recently seen node is probed, evicted on timeout
+    struct kad_node *lrs = (struct kad_node *)dht_find(ctx->dht, &ids[0]);
+    lrs->last_seen -= KAD_NODE_GOOD_S;
+    ping_from(ctx, ss, &newcomer);
+    assert(ctx->probes_len == 1);
+
+    // probes that cannot be sent are given up, and the candidate kept
+    for (size_t i = 0; i < KAD_RPC_PROBE_TRIES - 1; i++) {
+        kad_probes_send(ctx, -1);
+        assert(ctx->probes_len == 1 && !ctx->probes[0].sent);
+    }
+    kad_probes_send(ctx, -1);
+    assert(ctx->probes_len == 0);
+    assert(dht_find(ctx->dht, &ids[0]));
+    assert(list_is_empty(&ctx->queries));
+
+    ping_from(ctx, ss, &newcomer);
+    assert(kad_guid_eq(&ctx->probes[0].node.id, &ids[0]));
+    struct kad_rpc_query *query = probe_send(ctx);
+    ping_from(ctx, ss, &newcomer);  // probed once
+    assert(ctx->probes_len == 1);
+    assert(kad_rpc_expire(ctx, query->ts_ms + KAD_RPC_QUERY_TIMEOUT_MS - 1) == 0);
+    assert(kad_rpc_expire(ctx, query->ts_ms + KAD_RPC_QUERY_TIMEOUT_MS) == 1);
+    assert(ctx->probes_len == 0);
+    assert(!dht_find(ctx->dht, &ids[0]));
+    assert(dht_find(ctx->dht, &newcomer));
+
+    // kept if it responds
+    lrs = (struct kad_node *)dht_find(ctx->dht, &ids[1]);
+    lrs->last_seen -= KAD_NODE_GOOD_S;
+    dht_bucket_random_id(ctx->dht, BUCKET, &newcomer);
+    ping_from(ctx, ss, &newcomer);
+    query = probe_send(ctx);
+    struct kad_rpc_msg msg = {0};
+    msg.tx_id = query->msg.tx_id;
+    msg.node_id = ids[1];
+    msg.type = KAD_RPC_TYPE_RESPONSE;
+    msg.meth = KAD_RPC_METH_PING;
+    assert(handle_msg(ctx, ss, &msg));
+    assert(ctx->probes_len == 0);
+    assert(kad_node_state(dht_find(ctx->dht, &ids[1]), time(NULL)) ==
+           KAD_NODE_STATE_GOOD);
+    assert(!dht_find(ctx->dht, &newcomer));
+
+    // bad nodes are replaced right away
+    lrs = (struct kad_node *)dht_find(ctx->dht, &ids[2]);
+    lrs->stale = KAD_NODE_BAD_TIMEOUTS;
+    dht_bucket_random_id(ctx->dht, BUCKET, &newcomer);
+    ping_from(ctx, ss, &newcomer);
+    assert(ctx->probes_len == 0);
+    assert(!dht_find(ctx->dht, &ids[2]));
+    assert(dht_find(ctx->dht, &newcomer));
+}
+
+static void test_rtt(struct kad_ctx *ctx, const struct sockaddr_storage *ss)
+{
+    struct kad_node_info info = {0};
+    dht_bucket_random_id(ctx->dht, BUCKET + 1, &info.id);
+    info.addr = *ss;
+    assert(dht_insert(ctx->dht, &info));
+
+    // unknown round-trip time: default timeout
+    struct kad_rpc_query *query = kad_rpc_query_pool_get(&pool_kad_queries);
+    assert(query);
+    query->node = info;
+    struct iochain ch;
+    iochain_clear(&ch);
+    assert(kad_rpc_query_ping(ctx, &ch, query));
+    assert(query->timeout_ms == KAD_RPC_QUERY_TIMEOUT_MS);
+    kad_rpc_query_add(ctx, query);
+
+    // a responder claiming another id is no sample, for either
+    struct kad_rpc_msg msg = {0};
+    msg.tx_id = query->msg.tx_id;
+    dht_bucket_random_id(ctx->dht, BUCKET + 3, &msg.node_id);
+    msg.type = KAD_RPC_TYPE_RESPONSE;
+    msg.meth = KAD_RPC_METH_PING;
+    assert(handle_msg(ctx, ss, &msg));
+    struct kad_node *node = (struct kad_node *)dht_find(ctx->dht, &info.id);
+    assert(node->srtt_ms8 == 0);
+    const struct kad_node *other = dht_find(ctx->dht, &msg.node_id);
+    assert(other && other->srtt_ms8 == 0);
+
+    // a response is a sample
+    query = kad_rpc_query_pool_get(&pool_kad_queries);
+    assert(query);
+    query->node = info;
+    assert(kad_rpc_query_ping(ctx, &ch, query));
+    kad_rpc_query_add(ctx, query);
+    msg.tx_id = query->msg.tx_id;
+    msg.node_id = info.id;
+    assert(handle_msg(ctx, ss, &msg));
+    assert(node->srtt_ms8 > 0);
+
+    // then srtt + 4 * rttvar, within bounds
+    node->srtt_ms8 = 300 << 3;
+    node->rttvar_ms4 = 50 << 2;
+    query = kad_rpc_query_pool_get(&pool_kad_queries);
+    assert(query);
+    query->node = info;
+    assert(kad_rpc_query_ping(ctx, &ch, query));
+    assert(query->timeout_ms == 500);
+    kad_rpc_query_add(ctx, query);
+    assert(kad_rpc_expire(ctx, query->ts_ms + 499) == 0);
+    assert(kad_rpc_expire(ctx, query->ts_ms + 500) == 1);
+    assert(node->stale == 1);
+
+    node->srtt_ms8 = 10 << 3;
+    node->rttvar_ms4 = 1 << 2;
+    query = kad_rpc_query_pool_get(&pool_kad_queries);
+    assert(query);
+    query->node = info;
+    assert(kad_rpc_query_ping(ctx, &ch, query));
+    assert(query->timeout_ms == KAD_RPC_QUERY_TIMEOUT_MIN_MS);
+    kad_rpc_query_pool_put(&pool_kad_queries, query);
+}
+
+static void test_retransmit(struct kad_ctx *ctx, const struct sockaddr_storage *ss)
+{
+    ctx->query_retries = 2;
+    struct kad_node_info info = {0};
+    dht_bucket_random_id(ctx->dht, BUCKET + 2, &info.id);
+    info.addr = *ss;
+    assert(dht_insert(ctx->dht, &info));
+    struct kad_node *node = (struct kad_node *)dht_find(ctx->dht, &info.id);
+    node->srtt_ms8 = 300 << 3;
+    node->rttvar_ms4 = 50 << 2;
+
+    struct kad_rpc_query *query = kad_rpc_query_pool_get(&pool_kad_queries);
+    assert(query);
+    query->node = info;
+    struct iochain ch;
+    iochain_clear(&ch);
+    assert(kad_rpc_query_ping(ctx, &ch, query));
+    assert(query->retries == 2);
+    kad_rpc_query_add(ctx, query);
+    long long ts = query->ts_ms;
+    kad_rpc_msg_tx_id tx_id = query->msg.tx_id;
+
+    // retransmitted with the same tx_id, and a doubled timeout
+    assert(!kad_rpc_query_resend_next(ctx, &ch, ts));
+    assert(kad_rpc_expire(ctx, ts + 500) == 0);
+    assert(kad_rpc_query_resend_next(ctx, &ch, ts + 500) == query);
+    assert(!kad_rpc_query_resend_next(ctx, &ch, ts + 500));
+    assert(kad_rpc_msg_tx_id_eq(&query->msg.tx_id, &tx_id));
+    assert(query->timeout_ms == 1000 && query->retries == 1);
+    assert(kad_rpc_expire(ctx, ts + 1499) == 0);
+    assert(kad_rpc_expire(ctx, ts + 1500) == 0);
+    assert(kad_rpc_query_resend_next(ctx, &ch, ts + 1500) == query);
+    assert(node->stale == 0);
+
+    // a late response still matches, but is no round-trip time sample
+    struct kad_rpc_msg msg = {0};
+    msg.tx_id = tx_id;
+    msg.node_id = info.id;
+    msg.type = KAD_RPC_TYPE_RESPONSE;
+    msg.meth = KAD_RPC_METH_PING;
+    assert(handle_msg(ctx, ss, &msg));
+    assert(node->srtt_ms8 == 300 << 3 && node->rttvar_ms4 == 50 << 2);
+    assert(kad_rpc_expire(ctx, ts + 10000) == 0);
+    assert(!kad_rpc_query_resend_next(ctx, &ch, ts + 10000));
+
+    // out of retries: expired, and the timeout counted once
+    query = kad_rpc_query_pool_get(&pool_kad_queries);
+    assert(query);
+    query->node = info;
+    assert(kad_rpc_query_ping(ctx, &ch, query));
+    kad_rpc_query_add(ctx, query);
+    ts = ctx->wheel_ms;
+    for (long long t = ts; t < ts + 20000; t += KAD_RPC_EXPIRE_TICK_MS) {
+        if (kad_rpc_expire(ctx, t) == 1)
+            break;
+        kad_rpc_query_resend_next(ctx, &ch, t);
+    }
+    assert(list_is_empty(&ctx->queries));
+    assert(node->stale == 1);
+}
+
 int main ()
 {
     assert(log_init(LOG_TYPE_STDOUT, LOG_UPTO(LOG_CRIT)));
     struct kad_ctx ctx = {0};
     assert(kad_rpc_init(&ctx, NULL) == 0);
 
-    struct iobuf rsp = {0};
+    struct iochain rsp;
 
     struct sockaddr_storage ss = {0};
     struct sockaddr_in6 *sa = (struct sockaddr_in6*)&ss;
     sa->sin6_family=AF_INET6; sa->sin6_port=htons(0x88b8);
     memcpy(sa->sin6_addr.s6_addr, (unsigned char[]){0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,1}, sizeof(struct in6_addr));
+    iochain_clear(&rsp);
     assert(!kad_rpc_handle(&ctx, &ss, "", 0, &rsp));
-    assert(rsp.pos != 0);
-    iobuf_reset(&rsp);
+    assert(rsp.len != 0);
+    arena_reset(&ctx.arena);
 
     char buf[] = "d1:t2:aa1:y1:r1:rd2:id20:\x17""E\xc4\xed\xca\x16" \
         "3\xf0Q\x8e\x1f""6\n\xc7\xe1\xad'A\x86""3ee";
+    iochain_clear(&rsp);
     assert(!kad_rpc_handle(&ctx, &ss, buf, 47, &rsp));
-    assert(rsp.pos == 0);
-    iobuf_reset(&rsp);
+    assert(rsp.len == 0);
+    arena_reset(&ctx.arena);
+
+    test_evict(&ctx, &ss);
+    test_rtt(&ctx, &ss);
+    test_retransmit(&ctx, &ss);
 
     kad_rpc_terminate(&ctx, NULL);
     log_shutdown(LOG_TYPE_STDOUT);
@@ -0,0 +1,80 @@
+/* Copyright (c) 2017-2019 Foudil Brétel.  All rights reserved. */
+#include <assert.h>
+#include <pthread.h>
+#include <string.h>
+#include "log.h"
+#include "metrics.h"
+
+static void *record_in_thread(void *data)
+{
+    (void)data;
+    assert(metrics_thread_register());
+    metrics_inc(METRICS_CNT_UDP_PKT_IN);
+    metrics_add(METRICS_CNT_UDP_BYTES_IN, 100);
+    metrics_gauge_set(METRICS_GAUGE_PEERS, 7);
+    metrics_hist_record(METRICS_HIST_KAD_RTT_US, 1000000);
+    metrics_thread_unregister();
+    return NULL;
+}
+
+int main ()
+{
+    assert(log_init(LOG_TYPE_STDOUT, LOG_UPTO(LOG_CRIT)));
+
+    // log-linear buckets
+    for (uint64_t v = 0; v < 2*METRICS_HIST_SUB_LEN; v++)
+        assert(metrics_hist_bucket(v) == v);
+    assert(metrics_hist_bucket(16) == metrics_hist_bucket(17));
+    assert(metrics_hist_bucket(17) + 1 == metrics_hist_bucket(18));
+    assert(metrics_hist_bucket(UINT64_MAX) == METRICS_HIST_BUCKETS - 1);
+    for (unsigned i = 0; i < METRICS_HIST_BUCKETS; i++) {
+        assert(metrics_hist_bucket(metrics_hist_bucket_low(i)) == i);
+        if (i > 0)
+            assert(metrics_hist_bucket(metrics_hist_bucket_low(i) - 1) == i - 1);
+    }
+
+    assert(metrics_thread_register());
+    metrics_inc(METRICS_CNT_UDP_PKT_IN);
+    metrics_inc(METRICS_CNT_KAD_DECODE_FAIL);
+    metrics_gauge_set(METRICS_GAUGE_PEERS, 2);
+    for (uint64_t v = 1; v <= 100; v++)
+        metrics_hist_record(METRICS_HIST_KAD_RTT_US, v);
+    metrics_event_record(lookup_by_name(metrics_event_names, "peer-data", 32), 5, 300);
+
+    pthread_t th;
+    assert(pthread_create(&th, NULL, record_in_thread, NULL) == 0);
+    assert(pthread_join(th, NULL) == 0);
+
+    struct metrics snap;
+    metrics_snapshot(&snap);
+    assert(snap.cnt[METRICS_CNT_UDP_PKT_IN] == 2);
+    assert(snap.cnt[METRICS_CNT_UDP_BYTES_IN] == 100);
+    assert(snap.cnt[METRICS_CNT_KAD_DECODE_FAIL] == 1);
+    assert(snap.gauge[METRICS_GAUGE_PEERS] == 2); // retired thread's gauge dropped
+
+    const struct metrics_histogram *h = &snap.hist[METRICS_HIST_KAD_RTT_US];
+    assert(h->count == 101);
+    assert(h->max == 1000000);
+    uint64_t p50 = metrics_hist_percentile(h, 0.5);
+    assert(p50 >= 50 && p50 < 56); // ~12% relative error
+    assert(metrics_hist_percentile(h, 1) == 1000000);
+
+    assert(snap.ev_run[METRICS_EVENT_PEER_DATA].count == 1);
+    assert(snap.ev_run[METRICS_EVENT_PEER_DATA].max == 300);
+    assert(snap.ev_wait[METRICS_EVENT_PEER_DATA].sum == 5);
+
+    struct iobuf out = {0};
+    assert(metrics_render_prometheus(&snap, &out));
+    assert(iobuf_append(&out, "", 1));
+    assert(strstr(out.buf, "ptp_udp_packets_in_total 2\n"));
+    assert(strstr(out.buf, "ptp_event_run_us_bucket{event=\"peer-data\",le=\"256\"} 0\n"));
+    assert(strstr(out.buf, "ptp_event_run_us_bucket{event=\"peer-data\",le=\"512\"} 1\n"));
+    assert(strstr(out.buf, "ptp_event_run_us_count{event=\"peer-data\"} 1\n"));
+    assert(strstr(out.buf, "ptp_kad_rtt_us_count 101\n"));
+    iobuf_reset(&out);
+
+    metrics_thread_unregister();
+    log_shutdown(LOG_TYPE_STDOUT);
+
+    return 0;
+}
@@ -0,0 +1,138 @@
+/* Copyright (c) 2017-2019 Foudil Brétel.  All rights reserved. */
+#include <assert.h>
+#include <string.h>
+#include "log.h"
+#include "net/msg.h"
+
+struct got {
+    int                 count;
+    enum proto_msg_type type[4];
+    char                data[4][16];
+};
+
+static bool on_msg(struct proto_msg_parser *parser, void *data)
+{
+    struct got *got = data;
+    assert(got->count < 4);
+    got->type[got->count] = parser->msg_type;
+    if (parser->msg_data.pos)
+        memcpy(got->data[got->count], parser->msg_data.buf, parser->msg_data.pos);
+    got->count++;
+    return true;
+}
+
+struct streamed {
+    size_t chunks;
+    size_t len;
+    unsigned sum;
+};
+
+static bool on_chunk(struct proto_msg_parser *parser,
+                     const char buf[], size_t len, void *data)
+{
+    (void)parser;
+    struct streamed *st = data;
+    st->chunks++;
+    st->len += len;
+    for (size_t i = 0; i < len; i++)
+        st->sum += (unsigned char)buf[i];
+    return true;
+}
+
+int main()
+{
+    assert(log_init(LOG_TYPE_STDOUT, LOG_UPTO(LOG_CRIT)));
+
+    const char stream[] =
+        "NAME\0\0\0\x05" "alice"
+        "QERY\0\0\0\0"
+        "ERRO\0\0\0\x03" "bad";
+    const size_t stream_len = sizeof(stream) - 1;
+
+    // every chunk size, including byte by byte and all at once
+    for (size_t chunk = 1; chunk <= stream_len; chunk++) {
+        struct proto_msg_parser parser;
+        proto_msg_parser_init(&parser);
+        struct got got = {0};
+        parser.on_msg = on_msg;
+        parser.on_msg_data = &got;
+
+        for (size_t off = 0; off < stream_len; off += chunk) {
+            size_t len = stream_len - off < chunk ? stream_len - off : chunk;
+            assert(proto_msg_parse(&parser, stream + off, len));
+        }
+        assert(parser.stage == PROTO_MSG_STAGE_NONE);
+        assert(got.count == 3);
+        assert(got.type[0] == PROTO_MSG_TYPE_NAME);
+        assert(strcmp(got.data[0], "alice") == 0);
+        assert(got.type[1] == PROTO_MSG_TYPE_QUERY);
+        assert(got.data[1][0] == '\0');
+        assert(got.type[2] == PROTO_MSG_TYPE_ERROR);
+        assert(strcmp(got.data[2], "bad") == 0);
+        proto_msg_parser_terminate(&parser);
+    }
+
+    // streamed past buf_max, within bounded memory
+    {
+        struct proto_msg_parser parser;
+        proto_msg_parser_init(&parser);
+        parser.buf_max = 4;
+        struct streamed st = {0};
+        parser.on_chunk = on_chunk;
+        parser.on_msg_data = &st;
+        const char big[] = "NAME\0\0\0\x0a" "0123456789";
+        for (size_t off = 0; off < sizeof(big) - 1; off += 3) {
+            size_t len = sizeof(big) - 1 - off < 3 ? sizeof(big) - 1 - off : 3;
+            assert(proto_msg_parse(&parser, big + off, len));
+        }
+        assert(parser.stage == PROTO_MSG_STAGE_NONE);
+        assert(st.len == 10);
+        assert(st.chunks == 4);
+        assert(st.sum == 10 * '0' + 45);
+        assert(parser.msg_data.pos == 0);
+        proto_msg_parser_terminate(&parser);
+    }
+
+    // caps without streaming
+    {
+        struct proto_msg_budget budget = {.max = 8};
+        struct proto_msg_parser p1, p2;
+        proto_msg_parser_init(&p1);
+        proto_msg_parser_init(&p2);
+        p1.budget = p2.budget = &budget;
+        p2.buf_max = 4;
+
+        assert(!proto_msg_parse(&p2, "NAME\0\0\0\x05", 8));
+        assert(p2.capped);
+        assert(budget.used == 0);
+
+        assert(proto_msg_parse(&p1, "NAME\0\0\0\x06" "ab", 10));
+        assert(budget.used == 6);
+        proto_msg_parser_init(&p2);
+        p2.budget = &budget;
+        assert(!proto_msg_parse(&p2, "NAME\0\0\0\x03", 8));
+        assert(p2.capped);
+        assert(proto_msg_parse(&p1, "cdef", 4));
+        assert(budget.used == 0);
+        proto_msg_parser_init(&p2);
+        p2.budget = &budget;
+        assert(proto_msg_parse(&p2, "NAME\0\0\0\x03" "abc", 11));
+
+        assert(proto_msg_parse(&p1, "NAME\0\0\0\x04", 8));
+        assert(budget.used == 4);
+        proto_msg_parser_terminate(&p1);
+        assert(budget.used == 0);
+        proto_msg_parser_terminate(&p2);
+    }
+
+    // unknown type
+    struct proto_msg_parser parser;
+    proto_msg_parser_init(&parser);
+    assert(!proto_msg_parse(&parser, "XXXX", 4));
+    assert(parser.stage == PROTO_MSG_STAGE_ERROR);
+    assert(!proto_msg_parse(&parser, "NAME", 4));
+    proto_msg_parser_terminate(&parser);
+
+    log_shutdown(LOG_TYPE_STDOUT);
+    return 0;
+}
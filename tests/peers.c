@@ -0,0 +1,76 @@
+/* Copyright (c) 2017-2019 Foudil Brétel.  All rights reserved. */
+#include <assert.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include "log.h"
+#include "net/actions.h"
+#include "net/socket.h"
+#include "options.h"
+
+#define CLIENTS 100
+#define BATCH   20  /* within the listen backlog */
+#define MSG_LEN (64 * 1024)
+
+int main()
+{
+    assert(log_init(LOG_TYPE_STDOUT, LOG_UPTO(LOG_CRIT)));
+
+    int sock = socket_init(SOCK_STREAM, "::1", "0");
+    assert(sock >= 0);
+    struct sockaddr_in6 addr;
+    socklen_t addr_len = sizeof(addr);
+    assert(getsockname(sock, (struct sockaddr *)&addr, &addr_len) == 0);
+
+    struct config conf = CONFIG_DEFAULT;
+    struct list_item peers = LIST_ITEM_INIT(peers);
+    int clients[CLIENTS];
+    for (int i = 0; i < CLIENTS; i++) {
+        clients[i] = socket(AF_INET6, SOCK_STREAM, 0);
+        assert(clients[i] >= 0);
+        assert(connect(clients[i], (struct sockaddr *)&addr, addr_len) == 0);
+        if ((i + 1) % BATCH == 0)
+            assert(peer_conn_accept_all(sock, &peers, 0, &conf) == 0);
+    }
+    assert(list_count(&peers) == CLIENTS);
+
+    // every registered peer is found by its fd
+    struct list_item *it = &peers;
+    list_for(it, &peers) {
+        struct peer *p = cont(it, struct peer, item);
+        assert(peer_find_by_fd(p->fd) == p);
+    }
+    assert(!peer_find_by_fd(-1));
+    assert(!peer_find_by_fd(sock));
+    assert(!peer_find_by_fd(1 << 20));
+
+    // accepted sockets are non-blocking: output to a peer that does not read
+    // is queued
+    struct peer *slow = cont(peers.prev, struct peer, item);
+    assert(fcntl(slow->fd, F_GETFL) & O_NONBLOCK);
+    static char msg[MSG_LEN];
+    int sent = 0;
+    while (peer_outq_len(slow) == 0 && sent++ < 1024)
+        assert(peer_msg_send(slow, PROTO_MSG_TYPE_NAME, msg, (union u32){MSG_LEN}));
+    assert(peer_outq_len(slow) > 0);
+    assert(peer_conn_flush(slow) == CONN_OK);
+    assert(peer_outq_len(slow) > 0);
+
+    // closed peers are not
+    struct peer *first = cont(peers.next, struct peer, item);
+    int fd = first->fd;
+    assert(peer_conn_close(first));
+    assert(!peer_find_by_fd(fd));
+    assert(list_count(&peers) == CLIENTS - 1);
+
+    assert(peer_conn_close_all(&peers) == 0);
+    assert(list_is_empty(&peers));
+
+    for (int i = 0; i < CLIENTS; i++)
+        close(clients[i]);
+    close(sock);
+    peer_pool_destroy(&pool_peers);
+    log_shutdown(LOG_TYPE_STDOUT);
+    return 0;
+}
@@ -16,7 +16,7 @@ int main ()
 
     struct list_item timer_list = LIST_ITEM_INIT(timer_list);
 
-    struct timer *t1 = malloc(sizeof(struct timer));
+    struct timer *t1 = timer_pool_get(&pool_timers);
     assert(t1);
     *t1 = (struct timer){
         .name = "t1",
@@ -40,6 +40,9 @@ int main ()
     /* assert(t1 == NULL); */
 
 
+    assert(pool_timers.stats.in_use == 0);
+    event_queue_free(&evq);
+    timer_pool_destroy(&pool_timers);
     log_shutdown(LOG_TYPE_STDOUT);
 
     return 0;
@@ -31,6 +31,7 @@ int main ()
     assert(event_queue_status(&evq) != QUEUE_STATE_EMPTY);
 
 
+    event_queue_free(&evq);
     log_shutdown(LOG_TYPE_STDOUT);
 
     return 0;
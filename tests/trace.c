@@ -0,0 +1,60 @@
+/* Copyright (c) 2017-2019 Foudil Brétel.  All rights reserved. */
+#include <assert.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "log.h"
+#include "trace.h"
+
+static size_t read_dump(const char path[], struct trace_file_header *hdr,
+                        struct trace_record recs[], size_t len)
+{
+    FILE *f = fopen(path, "rb");
+    assert(f);
+    assert(fread(hdr, sizeof(*hdr), 1, f) == 1);
+    assert(fseek(f, hdr->event_names_len * TRACE_NAME_LEN, SEEK_CUR) == 0);
+    size_t n = fread(recs, sizeof(struct trace_record), len, f);
+    fclose(f);
+    return n;
+}
+
+int main ()
+{
+    assert(log_init(LOG_TYPE_STDOUT, LOG_UPTO(LOG_CRIT)));
+
+    char dir[] = "/tmp/ptp-trace-XXXXXX";
+    assert(mkdtemp(dir));
+    assert(trace_init(dir));
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/"TRACE_FILENAME, dir);
+
+    static struct trace_record recs[TRACE_RING_LEN + 1];
+    struct trace_file_header hdr;
+
+    for (int i = 0; i < 3; i++)
+        trace_add(&(struct trace_record){.ts_us=i, .kind=TRACE_KIND_EVENT});
+    assert(trace_dump());
+    assert(read_dump(path, &hdr, recs, TRACE_RING_LEN + 1) == 3);
+    assert(memcmp(hdr.magic, TRACE_MAGIC, sizeof(hdr.magic)) == 0);
+    assert(hdr.record_len == sizeof(struct trace_record));
+    assert(hdr.count == 3);
+    assert(hdr.event_names_len == METRICS_EVENT_LEN);
+    assert(recs[0].ts_us == 0 && recs[2].ts_us == 2);
+
+    // wraps around: oldest first
+    for (int i = 3; i < TRACE_RING_LEN + 10; i++)
+        trace_add(&(struct trace_record){.ts_us=i, .kind=TRACE_KIND_EVENT});
+    assert(trace_dump());
+    assert(read_dump(path, &hdr, recs, TRACE_RING_LEN + 1) == TRACE_RING_LEN);
+    assert(hdr.count == TRACE_RING_LEN);
+    for (int i = 0; i < TRACE_RING_LEN; i++)
+        assert(recs[i].ts_us == i + 10);
+
+    assert(unlink(path) == 0);
+    assert(rmdir(dir) == 0);
+    log_shutdown(LOG_TYPE_STDOUT);
+
+    return 0;
+}
@@ -0,0 +1,64 @@
+/* Copyright (c) 2017-2019 Foudil Brétel.  All rights reserved. */
+#include <assert.h>
+#include "utils/arena.h"
+
+int main()
+{
+    struct arena a = ARENA_INIT(256);
+
+    char *p1 = arena_alloc(&a, 10);
+    assert(p1);
+    assert((uintptr_t)p1 % ARENA_ALIGN == 0);
+    assert(a.stats.chunks == 1);
+    assert(a.stats.capacity == 256);
+    assert(a.stats.used == ARENA_ALIGN);
+
+    long long *p2 = arena_alloc(&a, sizeof(long long));
+    assert((char *)p2 == p1 + ARENA_ALIGN);
+    *p2 = 42;
+
+    // last allocation extended in place
+    char *p3 = arena_alloc(&a, 8);
+    memcpy(p3, "abcdefg", 8);
+    assert(arena_realloc(&a, p3, 8, 64) == p3);
+    assert(!strcmp(p3, "abcdefg"));
+
+    // otherwise moved
+    char *p4 = arena_alloc(&a, 8);
+    assert(arena_realloc(&a, p3, 64, 96) != p3);
+    (void)p4;
+    assert(a.stats.chunks == 1);
+
+    // overflow chains a chunk, large allocations get their own
+    assert(arena_alloc(&a, 200));
+    assert(a.stats.chunks == 2);
+    assert(arena_alloc(&a, 1024));
+    assert(a.stats.chunks == 3);
+    assert(a.stats.capacity == 256 + 256 + 1024);
+    size_t hiwat = a.stats.hiwat;
+    assert(hiwat == a.stats.used);
+
+    // reset merges chunks
+    arena_reset(&a);
+    assert(a.stats.chunks == 1);
+    assert(a.stats.capacity == 256 + 256 + 1024);
+    assert(a.stats.used == 0);
+    assert(a.stats.hiwat == hiwat);
+    assert(a.stats.resets == 1);
+
+    // steady state: no more chunks
+    for (int i = 0; i < 100; i++) {
+        assert(arena_alloc(&a, 200));
+        assert(arena_alloc(&a, 1024));
+        arena_reset(&a);
+    }
+    assert(a.stats.chunks == 1);
+    assert(a.stats.resets == 101);
+
+    arena_destroy(&a);
+    assert(!a.chunk);
+    assert(a.stats.capacity == 0);
+    assert(a.chunk_len == 256 + 256 + 1024);
+
+    return 0;
+}
@@ -0,0 +1,17 @@
+/* Copyright (c) 2017-2019 Foudil Brétel.  All rights reserved. */
+#include <assert.h>
+#include <string.h>
+#include "utils/crc32.h"
+
+int main ()
+{
+    assert(crc32(0, "", 0) == 0);
+    assert(crc32(0, "123456789", 9) == 0xcbf43926);
+    assert(crc32(0, "The quick brown fox jumps over the lazy dog", 43) == 0x414fa339);
+
+    // chained
+    uint32_t crc = crc32(0, "1234", 4);
+    assert(crc32(crc, "56789", 5) == 0xcbf43926);
+
+    return 0;
+}
@@ -0,0 +1,59 @@
+/* Copyright (c) 2017-2019 Foudil Brétel.  All rights reserved. */
+#include <assert.h>
+#include "utils/pool.h"
+
+struct obj {
+    int  a;
+    char b[13];
+};
+
+POOL_GENERATE(obj_pool, struct obj, 4)
+
+int main()
+{
+    obj_pool p = {0};
+    struct obj *objs[9];
+
+    objs[0] = obj_pool_get(&p);
+    assert(objs[0]);
+    assert(p.stats.slabs == 1);
+    assert(p.stats.capacity == 4);
+    assert(p.stats.in_use == 1);
+
+    // released objects are reused, and zeroed
+    objs[0]->a = 42;
+    struct obj *first = objs[0];
+    obj_pool_put(&p, objs[0]);
+    assert(p.stats.in_use == 0);
+    objs[0] = obj_pool_get(&p);
+    assert(objs[0] == first);
+    assert(objs[0]->a == 0);
+
+    for (int i = 1; i < 9; i++) {
+        objs[i] = obj_pool_get(&p);
+        assert(objs[i]);
+        for (int j = 0; j < i; j++)
+            assert(objs[i] != objs[j]);
+    }
+    assert(p.stats.slabs == 3);
+    assert(p.stats.capacity == 12);
+    assert(p.stats.in_use == 9);
+
+    for (int i = 0; i < 9; i++)
+        obj_pool_put(&p, objs[i]);
+    obj_pool_put(&p, NULL);
+    assert(p.stats.in_use == 0);
+    assert(p.stats.hiwat == 9);
+    assert(p.stats.gets == 10);
+
+    // steady state: no more slabs
+    for (int i = 0; i < 100; i++)
+        obj_pool_put(&p, obj_pool_get(&p));
+    assert(p.stats.slabs == 3);
+
+    obj_pool_destroy(&p);
+    assert(!p.slabs && !p.free);
+    assert(p.stats.capacity == 0);
+
+    return 0;
+}
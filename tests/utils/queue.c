@@ -4,6 +4,7 @@
 
 #define QUEUE4_BIT_LEN 2
 QUEUE_GENERATE(queue4, int, QUEUE4_BIT_LEN)
+QUEUE_GROW_GENERATE(gqueue, int, 1, 3)
 
 int main()    {
     int elt[QUEUE_BIT_LEN(2)] = {1,2,3,4};
@@ -27,12 +28,42 @@ int main()    {
 
     assert(!queue4_put(&q1, &elt[0]));
     assert(queue4_status(&q1) == QUEUE_STATE_FULL);
+    assert(queue4_len(&q1) == 4);
 
     assert(*queue4_get(&q1) == 1);
+    assert(queue4_len(&q1) == 3);
     assert(*queue4_get(&q1) == 2);
     assert(*queue4_get(&q1) == 3);
     assert(*queue4_get(&q1) == 4);
 
     queue4_init(&q1);
     assert(queue4_status(&q1) == QUEUE_STATE_EMPTY);
+
+    int gelt[10] = {0,1,2,3,4,5,6,7,8,9};
+    gqueue q2 = {0};
+    assert(gqueue_status(&q2) == QUEUE_STATE_EMPTY);
+    assert(!gqueue_get(&q2));
+
+    // wrap around before growing, to check order is kept
+    assert(gqueue_put(&q2, &gelt[0]));
+    assert(gqueue_put(&q2, &gelt[1]));
+    assert(q2.cap == 2);
+    assert(*gqueue_get(&q2) == 0);
+    assert(gqueue_put(&q2, &gelt[2]));
+    assert(gqueue_put(&q2, &gelt[3]));
+    assert(q2.cap == 4);
+    for (int i = 4; i < 9; i++)
+        assert(gqueue_put(&q2, &gelt[i]));
+    assert(q2.cap == 8);
+    assert(gqueue_status(&q2) == QUEUE_STATE_FULL);
+    assert(!gqueue_put(&q2, &gelt[9]));
+    assert(gqueue_len(&q2) == 8);
+    assert(q2.hiwat == 8);
+    for (int i = 1; i < 9; i++)
+        assert(*gqueue_get(&q2) == i);
+    assert(gqueue_status(&q2) == QUEUE_STATE_EMPTY);
+    assert(q2.hiwat == 8);
+
+    gqueue_free(&q2);
+    assert(q2.cap == 0 && !q2.entries);
 }
@@ -0,0 +1,56 @@
+/* Copyright (c) 2017-2019 Foudil Brétel.  All rights reserved. */
+#include <assert.h>
+#include "kad/test_util.c"
+#include "log.h"
+#include "metrics.h"
+#include "timers.h"
+#include "watchdog.h"
+
+static uint64_t stalls(void)
+{
+    struct metrics snap;
+    metrics_snapshot(&snap);
+    return snap.cnt[METRICS_CNT_LOOP_STALLS];
+}
+
+int main ()
+{
+    assert(log_init(LOG_TYPE_STDOUT, LOG_UPTO(LOG_CRIT)));
+    assert(metrics_thread_register());
+
+    struct watchdog wd = {0};
+    assert(watchdog_start(&wd, 50));
+
+    // waiting in poll is not a stall
+    watchdog_poll(&wd, now_millis() + 150);
+    assert(msleep(150) == 0);
+    assert(stalls() == 0);
+
+    // busy iterations keeping up are not stalls
+    for (int i = 0; i < 10; i++) {
+        watchdog_poll(&wd, now_millis() + 10);
+        assert(msleep(10) == 0);
+    }
+    assert(stalls() == 0);
+
+    // reported once per stall, with the event dispatched
+    watchdog_poll(&wd, now_millis());
+    watchdog_event(&wd, METRICS_EVENT_PEER_DATA);
+    assert(msleep(300) == 0);
+    assert(stalls() == 1);
+    assert(wd.stalled_event == METRICS_EVENT_PEER_DATA);
+
+    // the event is reset after dispatch
+    watchdog_event(&wd, 0);
+    watchdog_poll(&wd, now_millis());
+    assert(msleep(300) == 0);
+    assert(stalls() == 2);
+    assert(wd.stalled_event == 0);
+
+    watchdog_stop(&wd);
+
+    metrics_thread_unregister();
+    log_shutdown(LOG_TYPE_STDOUT);
+
+    return 0;
+}